@@ -0,0 +1,362 @@
+#include "iso14443a.h"
+#include "picc.h"
+
+#include <string.h>
+
+// Lookup table for the reflected CRC-CCITT polynomial (x^16 + x^12 + x^5 + 1 -> 0x8408) used
+// by the CRC_A. It trades 512 bytes of flash for doing 8 shift/xor steps per byte.
+static const uint16_t crc_a_table[256] = {
+  0x0000, 0x1189, 0x2312, 0x329B, 0x4624, 0x57AD, 0x6536, 0x74BF,
+  0x8C48, 0x9DC1, 0xAF5A, 0xBED3, 0xCA6C, 0xDBE5, 0xE97E, 0xF8F7,
+  0x1081, 0x0108, 0x3393, 0x221A, 0x56A5, 0x472C, 0x75B7, 0x643E,
+  0x9CC9, 0x8D40, 0xBFDB, 0xAE52, 0xDAED, 0xCB64, 0xF9FF, 0xE876,
+  0x2102, 0x308B, 0x0210, 0x1399, 0x6726, 0x76AF, 0x4434, 0x55BD,
+  0xAD4A, 0xBCC3, 0x8E58, 0x9FD1, 0xEB6E, 0xFAE7, 0xC87C, 0xD9F5,
+  0x3183, 0x200A, 0x1291, 0x0318, 0x77A7, 0x662E, 0x54B5, 0x453C,
+  0xBDCB, 0xAC42, 0x9ED9, 0x8F50, 0xFBEF, 0xEA66, 0xD8FD, 0xC974,
+  0x4204, 0x538D, 0x6116, 0x709F, 0x0420, 0x15A9, 0x2732, 0x36BB,
+  0xCE4C, 0xDFC5, 0xED5E, 0xFCD7, 0x8868, 0x99E1, 0xAB7A, 0xBAF3,
+  0x5285, 0x430C, 0x7197, 0x601E, 0x14A1, 0x0528, 0x37B3, 0x263A,
+  0xDECD, 0xCF44, 0xFDDF, 0xEC56, 0x98E9, 0x8960, 0xBBFB, 0xAA72,
+  0x6306, 0x728F, 0x4014, 0x519D, 0x2522, 0x34AB, 0x0630, 0x17B9,
+  0xEF4E, 0xFEC7, 0xCC5C, 0xDDD5, 0xA96A, 0xB8E3, 0x8A78, 0x9BF1,
+  0x7387, 0x620E, 0x5095, 0x411C, 0x35A3, 0x242A, 0x16B1, 0x0738,
+  0xFFCF, 0xEE46, 0xDCDD, 0xCD54, 0xB9EB, 0xA862, 0x9AF9, 0x8B70,
+  0x8408, 0x9581, 0xA71A, 0xB693, 0xC22C, 0xD3A5, 0xE13E, 0xF0B7,
+  0x0840, 0x19C9, 0x2B52, 0x3ADB, 0x4E64, 0x5FED, 0x6D76, 0x7CFF,
+  0x9489, 0x8500, 0xB79B, 0xA612, 0xD2AD, 0xC324, 0xF1BF, 0xE036,
+  0x18C1, 0x0948, 0x3BD3, 0x2A5A, 0x5EE5, 0x4F6C, 0x7DF7, 0x6C7E,
+  0xA50A, 0xB483, 0x8618, 0x9791, 0xE32E, 0xF2A7, 0xC03C, 0xD1B5,
+  0x2942, 0x38CB, 0x0A50, 0x1BD9, 0x6F66, 0x7EEF, 0x4C74, 0x5DFD,
+  0xB58B, 0xA402, 0x9699, 0x8710, 0xF3AF, 0xE226, 0xD0BD, 0xC134,
+  0x39C3, 0x284A, 0x1AD1, 0x0B58, 0x7FE7, 0x6E6E, 0x5CF5, 0x4D7C,
+  0xC60C, 0xD785, 0xE51E, 0xF497, 0x8028, 0x91A1, 0xA33A, 0xB2B3,
+  0x4A44, 0x5BCD, 0x6956, 0x78DF, 0x0C60, 0x1DE9, 0x2F72, 0x3EFB,
+  0xD68D, 0xC704, 0xF59F, 0xE416, 0x90A9, 0x8120, 0xB3BB, 0xA232,
+  0x5AC5, 0x4B4C, 0x79D7, 0x685E, 0x1CE1, 0x0D68, 0x3FF3, 0x2E7A,
+  0xE70E, 0xF687, 0xC41C, 0xD595, 0xA12A, 0xB0A3, 0x8238, 0x93B1,
+  0x6B46, 0x7ACF, 0x4854, 0x59DD, 0x2D62, 0x3CEB, 0x0E70, 0x1FF9,
+  0xF78F, 0xE606, 0xD49D, 0xC514, 0xB1AB, 0xA022, 0x92B9, 0x8330,
+  0x7BC7, 0x6A4E, 0x58D5, 0x495C, 0x3DE3, 0x2C6A, 0x1EF1, 0x0F78,
+};
+
+
+void
+iso14443a_crc_a(const uint8_t* data, uint32_t data_size, uint8_t crc_buf[2])
+{
+  uint16_t crc = ISO14443A_CRC_A_PRESET;
+
+  for (uint32_t i = 0; i < data_size; i++)
+  {
+    crc = (crc >> 8) ^ crc_a_table[(crc ^ data[i]) & 0xFF];
+  }
+
+  crc_buf[0] = crc & 0xFF;
+  crc_buf[1] = crc >> 8;
+}
+
+bool
+iso14443a_crc_a_check(const uint8_t* frame, uint32_t frame_size)
+{
+  if (frame_size < 3)
+  {
+    return false;
+  }
+
+  uint8_t crc[2];
+  iso14443a_crc_a(frame, frame_size - 2, crc);
+
+  return (crc[0] == frame[frame_size - 2]) && (crc[1] == frame[frame_size - 1]);
+}
+
+iso14443a_result_e
+iso14443a_request(iso14443a_transceive_t transceive, void* ctx, uint8_t command, uint8_t atqa[2])
+{
+  const uint8_t tx[] = {command};
+  uint8_t rx[2] = {};
+  iso14443a_frame_t frame = {
+    .tx = tx,
+    .tx_bits = 7,
+    .rx = rx,
+    .rx_size = sizeof(rx),
+  };
+
+  const iso14443a_result_e result = transceive(ctx, &frame);
+  if (result == ISO14443A_OK && frame.rx_bits != 16)
+  {
+    return ISO14443A_ERROR;
+  }
+
+  memcpy(atqa, rx, sizeof(rx));
+  return result;
+}
+
+static const uint8_t iso14443a_sel[] = {
+  PICC_CMD_SELECT_CL_1,
+  PICC_CMD_SELECT_CL_2,
+  PICC_CMD_SELECT_CL_3,
+};
+
+/*
+ * The SELECT of a cascade level whose 40 bits are in level[2..6]. level[] has room for the CRC_A.
+ */
+static iso14443a_result_e
+iso14443a_select_cl(iso14443a_transceive_t transceive, void* ctx, uint8_t level[9], uint8_t* sak)
+{
+  // SELECT: all the bits and the CRC_A. The SAK comes with a CRC_A too.
+  level[1] = 0x70;
+  iso14443a_crc_a(level, 7, &level[7]);
+
+  uint8_t rx[3] = {};
+  iso14443a_frame_t frame = {
+    .tx = level,
+    .tx_bits = 9 * 8,
+    .rx = rx,
+    .rx_size = sizeof(rx),
+  };
+  const iso14443a_result_e result = transceive(ctx, &frame);
+  if (result != ISO14443A_OK)
+  {
+    return result;
+  }
+  if (frame.rx_bits != 24 || !iso14443a_crc_a_check(rx, sizeof(rx)))
+  {
+    return ISO14443A_ERROR;
+  }
+
+  *sak = rx[0];
+  return ISO14443A_OK;
+}
+
+/*
+ * One cascade level: the anticollision rounds until all the 40 bits (CT or UID, and BCC) are
+ * known and then the SELECT. The level's bytes end up in level[2..6] and the SAK in sak.
+ */
+static iso14443a_result_e
+iso14443a_select_level(iso14443a_transceive_t transceive, void* ctx, uint8_t sel,
+                       uint8_t level[9], uint8_t* sak)
+{
+  memset(level, 0, 9);
+  level[0] = sel;
+  uint8_t known = 0;
+
+  // Every collision adds at least one bit, so there are at most 32 of them.
+  for (uint8_t round = 0; known < 40; round++)
+  {
+    if (round > 32)
+    {
+      return ISO14443A_ERROR;
+    }
+
+    // NVB: the bytes sent, SEL and NVB included, and the bits of the split byte.
+    level[1] = ((2 + known / 8) << 4) | (known % 8);
+
+    uint8_t rx[6] = {};
+    iso14443a_frame_t frame = {
+      .tx = level,
+      .tx_bits = 16 + known,
+      .rx_align = known % 8,
+      .rx = rx,
+      .rx_size = sizeof(rx),
+    };
+    const iso14443a_result_e result = transceive(ctx, &frame);
+
+    uint16_t received = frame.rx_bits;
+    if (result == ISO14443A_COLLISION)
+    {
+      received = frame.collision_bit;
+    }
+    else if (result != ISO14443A_OK)
+    {
+      return result;
+    }
+
+    if (known + received > 40 || (result == ISO14443A_OK && known + received != 40))
+    {
+      return ISO14443A_ERROR;
+    }
+
+    // The split byte keeps its known bits, the PICC's come after them.
+    const uint8_t split = 2 + known / 8;
+    const uint8_t known_mask = (1U << (known % 8)) - 1;
+    level[split] = (level[split] & known_mask) | (rx[0] & ~known_mask);
+    for (uint8_t i = 1; split + i < 7 && i < sizeof(rx); i++)
+    {
+      level[split + i] = rx[i];
+    }
+
+    if (result == ISO14443A_OK)
+    {
+      known = 40;
+      break;
+    }
+
+    // Take the collided bit as 1 and drop whatever came after it.
+    const uint8_t collided = known + received;
+    if (collided >= 32)
+    {
+      // The BCC follows from the UID bits, it can't be the first to collide.
+      return ISO14443A_ERROR;
+    }
+    const uint8_t byte = 2 + collided / 8;
+    level[byte] = (level[byte] & ((1U << (collided % 8)) - 1)) | (1U << (collided % 8));
+    memset(&level[byte + 1], 0, 7 - (byte + 1));
+    known = collided + 1;
+  }
+
+  if (level[6] != (level[2] ^ level[3] ^ level[4] ^ level[5]))
+  {
+    return ISO14443A_ERROR;
+  }
+
+  return iso14443a_select_cl(transceive, ctx, level, sak);
+}
+
+iso14443a_result_e
+iso14443a_select(iso14443a_transceive_t transceive, void* ctx, iso14443a_picc_t* picc)
+{
+  picc->uid_size = 0;
+
+  for (uint8_t cascade = 0; cascade < sizeof(iso14443a_sel); cascade++)
+  {
+    uint8_t level[9];
+    uint8_t sak = 0;
+    const iso14443a_result_e result =
+      iso14443a_select_level(transceive, ctx, iso14443a_sel[cascade], level, &sak);
+    if (result != ISO14443A_OK)
+    {
+      return result;
+    }
+
+    if (!(sak & ISO14443A_SAK_CASCADE))
+    {
+      memcpy(&picc->uid[picc->uid_size], &level[2], 4);
+      picc->uid_size += 4;
+      picc->sak = sak;
+      return ISO14443A_OK;
+    }
+
+    // Not the last level, the cascade tag comes first.
+    if (level[2] != PICC_CASCADE_TAG)
+    {
+      return ISO14443A_ERROR;
+    }
+    memcpy(&picc->uid[picc->uid_size], &level[3], 3);
+    picc->uid_size += 3;
+  }
+
+  // A fourth cascade level doesn't exist.
+  return ISO14443A_ERROR;
+}
+
+iso14443a_result_e
+iso14443a_reselect(iso14443a_transceive_t transceive, void* ctx, iso14443a_picc_t* picc)
+{
+  const uint8_t levels = picc->uid_size == 4 ? 1 : (picc->uid_size == 7 ? 2 : 3);
+  if (picc->uid_size != 4 && picc->uid_size != 7 && picc->uid_size != 10)
+  {
+    return ISO14443A_ERROR;
+  }
+
+  // Other PICCs can answer the WUPA too, the SELECTs leave only this one.
+  const iso14443a_result_e requested =
+    iso14443a_request(transceive, ctx, PICC_CMD_WUPA, picc->atqa);
+  if (requested != ISO14443A_OK && requested != ISO14443A_COLLISION)
+  {
+    return requested;
+  }
+
+  for (uint8_t cascade = 0; cascade < levels; cascade++)
+  {
+    const bool last = cascade + 1 == levels;
+    uint8_t level[9] = {iso14443a_sel[cascade]};
+    if (last)
+    {
+      memcpy(&level[2], &picc->uid[3 * cascade], 4);
+    }
+    else
+    {
+      level[2] = PICC_CASCADE_TAG;
+      memcpy(&level[3], &picc->uid[3 * cascade], 3);
+    }
+    level[6] = level[2] ^ level[3] ^ level[4] ^ level[5];
+
+    uint8_t sak = 0;
+    const iso14443a_result_e result = iso14443a_select_cl(transceive, ctx, level, &sak);
+    if (result != ISO14443A_OK)
+    {
+      return result;
+    }
+    // The cascade bit has to agree with the UID's size.
+    if (((sak & ISO14443A_SAK_CASCADE) != 0) == last)
+    {
+      return ISO14443A_ERROR;
+    }
+    picc->sak = sak;
+  }
+
+  return ISO14443A_OK;
+}
+
+void
+iso14443a_halt(iso14443a_transceive_t transceive, void* ctx)
+{
+  uint8_t tx[4] = {PICC_CMD_HALTA, 0x00};
+  iso14443a_crc_a(tx, 2, &tx[2]);
+
+  uint8_t rx[1];
+  iso14443a_frame_t frame = {
+    .tx = tx,
+    .tx_bits = sizeof(tx) * 8,
+    .rx = rx,
+    .rx_size = sizeof(rx),
+  };
+  (void)transceive(ctx, &frame);
+}
+
+uint8_t
+iso14443a_inventory(iso14443a_transceive_t transceive, void* ctx, iso14443a_inventory_e mode,
+                    iso14443a_picc_t* piccs, uint8_t max)
+{
+  uint8_t count = 0;
+  // A PICC which was READY goes back to IDLE on the request instead of answering it, the next
+  // request gets it. So the field is quiet after two requests without an answer.
+  uint8_t quiet = 0;
+  uint8_t failures = 0;
+  // A request would send the READY PICCs back to IDLE, for nothing but a timeout.
+  bool ready = mode == ISO14443A_INVENTORY_READY;
+
+  while (count < max && quiet < 2 && failures < 2)
+  {
+    iso14443a_picc_t* picc = &piccs[count];
+
+    if (!ready)
+    {
+      // WUPA until the first PICC of a rescan, so the PICCs halted before it are in too.
+      const uint8_t command =
+        count == 0 && mode == ISO14443A_INVENTORY_ALL ? PICC_CMD_WUPA : PICC_CMD_REQA;
+      const iso14443a_result_e requested =
+        iso14443a_request(transceive, ctx, command, picc->atqa);
+      if (requested == ISO14443A_TIMEOUT)
+      {
+        quiet++;
+        continue;
+      }
+      quiet = 0;
+    }
+    ready = false;
+
+    if (iso14443a_select(transceive, ctx, picc) != ISO14443A_OK)
+    {
+      // Whatever is READY goes back to IDLE on the next request.
+      failures++;
+      continue;
+    }
+    failures = 0;
+
+    iso14443a_halt(transceive, ctx);
+    count++;
+  }
+
+  return count;
+}
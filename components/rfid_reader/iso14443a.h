@@ -0,0 +1,133 @@
+/*
+ * Parts of the ISO/IEC 14443-3 Type A protocol which don't need the reader's hardware. Those are
+ * shared by the reader drivers.
+ */
+
+#ifndef ISO14443A_H
+#define ISO14443A_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// ISO 14443-3 part 6.2.4. The CRC_A register gets preset to this value.
+#define ISO14443A_CRC_A_PRESET  (0x6363)
+
+#define ISO14443A_UID_MAX_SIZE  (10)
+// The SAK's bit saying the UID isn't complete, there is another cascade level.
+#define ISO14443A_SAK_CASCADE   (0x04)
+
+typedef enum
+{
+  ISO14443A_OK,
+  // More than one PICC responded and their bits differ, see iso14443a_frame_t.collision_bit.
+  ISO14443A_COLLISION,
+  // No response, or one which didn't make sense.
+  ISO14443A_TIMEOUT,
+  ISO14443A_ERROR,
+} iso14443a_result_e;
+
+/*
+ * A frame to transmit and its response. The bits go LSB first, a partial last byte is sent with
+ * its LSBs (ISO 14443-3 part 6.4.3.2).
+ */
+typedef struct iso14443a_frame_t
+{
+  const uint8_t* tx;
+  // 7 for the short frames (REQA, WUPA), 16 + the known UID bits for the anticollision.
+  uint16_t tx_bits;
+  // The first received bit lands at this bit of rx[0]. The anticollision's split byte is
+  // completed by the PICC, so it's the same as tx_bits % 8 there.
+  uint8_t rx_align;
+  uint8_t* rx;
+  uint8_t rx_size;
+  // Set by the transceive. The received bits, without the rx_align.
+  uint16_t rx_bits;
+  // Set by the transceive with ISO14443A_COLLISION. The first bit which collided, counting from
+  // the first received bit. The bits from there on are zeros.
+  uint16_t collision_bit;
+} iso14443a_frame_t;
+
+/*
+ * What a reader implements for this module: transmit the frame and receive the response. The CRC_A
+ * is in the frames already, the reader passes it through both ways.
+ */
+typedef iso14443a_result_e (*iso14443a_transceive_t)(void* ctx, iso14443a_frame_t* frame);
+
+typedef struct iso14443a_picc_t
+{
+  uint8_t uid[ISO14443A_UID_MAX_SIZE];
+  // 4, 7 or 10.
+  uint8_t uid_size;
+  uint8_t atqa[2];
+  // The last cascade level's SAK.
+  uint8_t sak;
+} iso14443a_picc_t;
+
+/*
+ * Calculate the CRC_A (ISO 14443-3 Annex B) over data_size bytes of data. The CRC's LSB lands in
+ * crc_buf[0] and the MSB in crc_buf[1]. That's the order of transmission, so the crc_buf can point
+ * right behind the data in a frame buffer.
+ */
+void iso14443a_crc_a(const uint8_t* data, uint32_t data_size, uint8_t crc_buf[2]);
+
+/*
+ * Check a received frame which ends with two CRC_A bytes. frame_size includes the CRC bytes.
+ *
+ * Return true if the CRC_A matches.
+ */
+bool iso14443a_crc_a_check(const uint8_t* frame, uint32_t frame_size);
+
+/*
+ * REQA or WUPA, the ATQA goes to atqa. A collision in the ATQA means there are PICCs with
+ * different ATQAs in the field, that's ISO14443A_COLLISION.
+ */
+iso14443a_result_e iso14443a_request(iso14443a_transceive_t transceive, void* ctx, uint8_t command,
+                                     uint8_t atqa[2]);
+
+/*
+ * The anticollision and the SELECT of every cascade level (ISO 14443-3 part 6.4.3) for a PICC which
+ * answered the REQA or the WUPA. It's bit oriented: on a collision the known bits end at the
+ * collided one, which is taken as 1, and the next round asks for the rest of the bits of only the
+ * PICCs which match. With several PICCs in the field the one with the 1s at the collisions gets
+ * selected, the others go back to IDLE.
+ *
+ * Fills in the picc's UID and SAK, the ATQA is left alone.
+ */
+iso14443a_result_e iso14443a_select(iso14443a_transceive_t transceive, void* ctx,
+                                    iso14443a_picc_t* picc);
+
+/*
+ * Wake up and select a PICC whose UID is known, without the anticollision: WUPA and a SELECT per
+ * cascade level with the UID's bytes, 1 + levels frames instead of 1 + 2 * levels or more. The
+ * PICC can be halted or idle, even under a stack of others.
+ *
+ * Anything but ISO14443A_OK means the PICC with that UID didn't get selected. It might have been
+ * replaced with another one, the full anticollision tells.
+ */
+iso14443a_result_e iso14443a_reselect(iso14443a_transceive_t transceive, void* ctx,
+                                      iso14443a_picc_t* picc);
+
+// HLTA. The PICC doesn't answer it, so there is nothing to return.
+void iso14443a_halt(iso14443a_transceive_t transceive, void* ctx);
+
+typedef enum
+{
+  // The PICCs answered a REQA just now, e.g. the reader's detection, and are READY. The first
+  // round goes straight to their anticollision, and the PICCs halted before are left out. The
+  // first PICC's ATQA is left as it is, the detection's REQA got it.
+  ISO14443A_INVENTORY_READY,
+  // WUPA first, so the PICCs halted before are in too. A rescan of everything in the field.
+  ISO14443A_INVENTORY_ALL,
+} iso14443a_inventory_e;
+
+/*
+ * Every PICC in the field, up to max of them: select one PICC, HLTA it, REQA and so on until the
+ * field is quiet. A halted PICC doesn't answer the REQA, so each round finds a new one. The PICCs
+ * are left halted, WUPA wakes them up.
+ *
+ * Return how many PICCs went to piccs.
+ */
+uint8_t iso14443a_inventory(iso14443a_transceive_t transceive, void* ctx,
+                            iso14443a_inventory_e mode, iso14443a_picc_t* piccs, uint8_t max);
+
+#endif // ISO14443A_H
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -16,6 +17,11 @@
 static spi_device_handle_t pn532_spi;
 static esp_timer_handle_t pn532_timer;
 
+// A PICC answers InListPassiveTarget within this, otherwise the field is empty.
+#define PN532_INLIST_TIMEOUT_US  (100 * 1000)
+// InListPassiveTarget doesn't take more.
+#define PN532_INLIST_MAX_TARGETS (2)
+
 
 static bool
 pn532_read_ack()
@@ -184,3 +190,125 @@ pn532_anti_collision(uint8_t cascade_level)
 {
   return false;
 }
+
+static bool
+pn532_wait_ready(int64_t timeout_us)
+{
+  const int64_t deadline = esp_timer_get_time() + timeout_us;
+  while (!_pn532_is_ready())
+  {
+    if (esp_timer_get_time() > deadline)
+    {
+      return false;
+    }
+    vTaskDelay(1);
+  }
+  return true;
+}
+
+// An ACK frame from the host aborts the command the PN532 is working on.
+static void
+pn532_write_ack(void)
+{
+  uint8_t ack[] = {PN532_SPI_DATA_WRITE, 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00};
+  spi_transaction_t t = {};
+
+  // Yes, the length is in bits.
+  t.length = 8 * sizeof(ack);
+  t.tx_buffer = ack;
+
+  (void)spi_device_transmit(pn532_spi, &t);
+}
+
+uint8_t
+_pn532_parse_inlist_response(const uint8_t* response, size_t size, iso14443a_picc_t* piccs,
+                             uint8_t max)
+{
+  // 00 00 FF LEN LCS D5 4B NbTg, LEN counts from the D5 on.
+  if (size < 8 || response[5] != PN532_PN532_TO_HOST ||
+      response[6] != PN532_RESPONSE_INLISTPASSIVETARGET)
+  {
+    return 0;
+  }
+  const size_t end = MIN(size, 5 + (size_t)response[3]);
+
+  // Every target: Tg, SENS_RES (the ATQA, 2 bytes), SEL_RES (the SAK), NFCIDLength, NFCID1 and,
+  // for the ISO14443-4 PICCs, the ATS which starts with its length.
+  uint8_t count = 0;
+  size_t i = 8;
+  for (uint8_t target = 0; target < response[7] && count < max; target++)
+  {
+    if (i + 5 > end)
+    {
+      break;
+    }
+    iso14443a_picc_t* picc = &piccs[count];
+    const uint8_t uid_size = response[i + 4];
+    if (uid_size > ISO14443A_UID_MAX_SIZE || i + 5 + uid_size > end)
+    {
+      break;
+    }
+    // The PN532 sends the SENS_RES MSB first, the ATQA goes LSB first.
+    picc->atqa[0] = response[i + 2];
+    picc->atqa[1] = response[i + 1];
+    picc->sak = response[i + 3];
+    picc->uid_size = uid_size;
+    memcpy(picc->uid, &response[i + 5], uid_size);
+    count++;
+
+    i += 5 + uid_size;
+    if (picc->sak & 0x20)
+    {
+      if (i >= end)
+      {
+        break;
+      }
+      i += response[i];
+    }
+  }
+
+  return count;
+}
+
+uint8_t
+pn532_inventory(iso14443a_picc_t* piccs, uint8_t max)
+{
+  // Only the 106 kbps type A PICCs.
+  uint8_t cmd[] = {PN532_COMMAND_INLISTPASSIVETARGET, MIN(max, PN532_INLIST_MAX_TARGETS), 0x00};
+  if (max == 0 || pn532_write_command(cmd, sizeof(cmd)) != ESP_OK)
+  {
+    return 0;
+  }
+  if (!pn532_wait_ready(PN532_INLIST_TIMEOUT_US) || !pn532_read_ack())
+  {
+    return 0;
+  }
+  if (!pn532_wait_ready(PN532_INLIST_TIMEOUT_US))
+  {
+    // Nothing answered, the PN532 would keep looking.
+    pn532_write_ack();
+    return 0;
+  }
+
+  uint8_t response[64] = {};
+  if (pn532_read_n(response, sizeof(response)) != ESP_OK)
+  {
+    return 0;
+  }
+  const uint8_t count = _pn532_parse_inlist_response(response, sizeof(response), piccs, max);
+
+  // InRelease halts the listed PICCs, like the other readers' inventories leave them.
+  if (count > 0)
+  {
+    uint8_t release[] = {PN532_COMMAND_INRELEASE, 0x00};
+    if (pn532_write_command(release, sizeof(release)) == ESP_OK &&
+        pn532_wait_ready(PN532_INLIST_TIMEOUT_US) && pn532_read_ack() &&
+        pn532_wait_ready(PN532_INLIST_TIMEOUT_US))
+    {
+      uint8_t status[10];
+      (void)pn532_read_n(status, sizeof(status));
+    }
+  }
+
+  return count;
+}
@@ -78,9 +78,19 @@ bool pn532_read_fw_version(void);
 
 bool pn532_say_hello(void);
 
+/*
+ * The PICCs in the field with InListPassiveTarget, which lists two of them at most. They are left
+ * halted, with InRelease.
+ *
+ * Return how many PICCs went to piccs.
+ */
+uint8_t pn532_inventory(iso14443a_picc_t* piccs, uint8_t max);
+
 
 // PRIVATE BUT EXPOSED BECAUSE TESTED
 bool _pn532_is_ready();
 void _pn532_build_information_frame(uint8_t*buf, uint8_t* cmd, uint8_t cmdlen);
+uint8_t _pn532_parse_inlist_response(const uint8_t* response, size_t size, iso14443a_picc_t* piccs,
+                                     uint8_t max);
 
 #endif // PN532_H
@@ -1,4 +1,5 @@
 #include "rc522.h"
+#include "iso14443a.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,113 +7,259 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_attr.h"
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_timer.h"
+#include "esp_heap_caps.h"
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
 #include "soc/gpio_struct.h"
 
 static char* TAG = "rc522";
 
-static spi_device_handle_t rc522_spi;
 static esp_timer_handle_t rc522_timer;
 
-// Creating 3 slots.
-#define SCRATCH_MEM_SIZE  (48 * 3)
-static uint8_t* scratch_mem = NULL;
-
-static picc_t picc;
+// Creating 3 slots: outgoing data, outgoing read addresses and incoming data. A slot has to fit
+// the entire FIFO and the address byte. The memory is DMA capable since the transfers can be
+// longer than what the SPI peripheral's buffer can hold.
+#define SCRATCH_SLOT_SIZE (RC522_FIFO_SIZE + 8)
+#define SCRATCH_MEM_SIZE  (SCRATCH_SLOT_SIZE * 3)
+
+// Registers which only the driver writes to. Their contents are mirrored on the ESP32 side (write
+// through) so flipping bits in them doesn't need a readback and rewriting the same value can be
+// skipped. The IRQ, FIFO, status, error and command registers change on their own, so they are
+// never shadowed.
+#define RC522_REG_BIT(addr)  (1ULL << (addr))
+#define RC522_SHADOWED_REGS  (RC522_REG_BIT(RC522_REG_COM_IRQ_EN_DI)   | \
+                              RC522_REG_BIT(RC522_REG_DIV_IRQ_EN_DI)   | \
+                              RC522_REG_BIT(RC522_REG_WATER_LEVEL)     | \
+                              RC522_REG_BIT(RC522_REG_BIT_FRAMING)     | \
+                              RC522_REG_BIT(RC522_REG_MODE)            | \
+                              RC522_REG_BIT(RC522_REG_TX_MODE)         | \
+                              RC522_REG_BIT(RC522_REG_RX_MODE)         | \
+                              RC522_REG_BIT(RC522_REG_TX_CONTROL_REG)  | \
+                              RC522_REG_BIT(RC522_REG_TX_ASK)          | \
+                              RC522_REG_BIT(RC522_REG_MOD_WIDTH)       | \
+                              RC522_REG_BIT(RC522_REG_RF_CFG)          | \
+                              RC522_REG_BIT(RC522_REG_TIMER_MODE)      | \
+                              RC522_REG_BIT(RC522_REG_TIMER_PRESCALER) | \
+                              RC522_REG_BIT(RC522_REG_TIMER_RELOAD_1)  | \
+                              RC522_REG_BIT(RC522_REG_TIMER_RELOAD_2))
+
+// The RC522's timer runs at 13.56 MHz / (2 * TPrescaler + 1). 0x0A9 gives 40 kHz, so one tick
+// is 25 us and the longest timeout is ~1.6 s.
+#define RC522_TIMER_PRESCALER  (0x0A9)
+#define RC522_TIMER_TICK_US    (25)
+
+// Frame waiting time per PICC command. The RC522's timer starts when the transmission ends
+// (TAuto) and raises the TimerIRq when the time is up. REQA/anticollision/SELECT responses come
+// after ~90 us (ISO 14443-3), the rest depends on the PICC. The values cover MIFARE Classic and
+// NTAG21x with some margin. HALTA is successful when there is no response, so it always waits
+// the full time.
+static const uint32_t fwt_us[RC522_FWT_COUNT] = {
+  [RC522_FWT_REQA]        = 1000,
+  [RC522_FWT_SELECT]      = 1000,
+  [RC522_FWT_HALTA]       = 1000,
+  [RC522_FWT_GET_VERSION] = 5000,
+  [RC522_FWT_READ]        = 5000,
+  [RC522_FWT_AUTH]        = 10000,
+  [RC522_FWT_WRITE]       = 10000,
+};
+
+// The host side gives the RC522 this much on top of the FWT before it stops waiting for it.
+// Covers the SPI transactions around the command.
+#define RC522_FWT_MARGIN_US  (5000)
+
+#if defined (CONFIG_RC522_WAIT_IRQ)
+// How long to wait for the IRQ pin signalling end of CRC calculation.
+#define RC522_IRQ_WAIT_MS  (25)
+#endif // CONFIG_RC522_WAIT_IRQ
+
+struct rc522_t {
+  spi_device_handle_t spi;
+  // Guards the reader for the duration of a session with a PICC, see rc522_lock.
+  SemaphoreHandle_t lock;
+  // The scratch memory, SCRATCH_MEM_SIZE bytes. DMA capable.
+  uint8_t* scratch_mem;
+  picc_t picc;
+  rc522_stats_t stats;
+  // Shadow copy of the RC522_SHADOWED_REGS. A bit set in shadow_valid means the register's copy
+  // can be trusted.
+  uint8_t shadow[64];
+  uint64_t shadow_valid;
+  // The FWT used by the next rc522_picc_write.
+  rc522_fwt_e fwt_current;
+#if defined (CONFIG_RC522_WAIT_IRQ)
+  // The task currently waiting for the IRQ pin. NULL when nobody is waiting.
+  volatile TaskHandle_t irq_waiting_task;
+#endif // CONFIG_RC522_WAIT_IRQ
+};
 
 //
 // Functions that communicate with RC522.
 //
 
 /*
- * Calculate CRC for data on the RC522 side.
+ * Calculate CRC_A for data. It's done in software unless CONFIG_RC522_CRC_COPROCESSOR is set, in
+ * which case the RC522's CRC coprocessor is used (and a dozen of SPI transactions per call).
  */
-static void rc522_calculate_crc(uint8_t *data, uint8_t data_size, uint8_t* crc_buf);
+static void rc522_calculate_crc(rc522_handle_t rc522, uint8_t *data, uint8_t data_size, uint8_t* crc_buf);
+
+static esp_err_t rc522_antenna_on(rc522_handle_t rc522);
+static esp_err_t rc522_set_bitmask(rc522_handle_t rc522, uint8_t addr, uint8_t mask);
+static void rc522_soft_reset(rc522_handle_t rc522);
 
-static esp_err_t rc522_antenna_on();
-static esp_err_t rc522_set_bitmask(uint8_t addr, uint8_t mask);
+/*
+ * Get a register's value from the shadow copy. Falls back to reading the register if it isn't
+ * shadowed or the shadow copy isn't populated yet.
+ */
+static uint8_t rc522_read_shadowed(rc522_handle_t rc522, uint8_t addr);
 
-typedef void(*rc522_tag_callback_t)(uint8_t*);
+typedef void(*rc522_tag_callback_t)(rc522_handle_t, uint8_t*);
 
 
 /*
  * Return picc by copy since the caller shouldn't be able to modify the internal structure.
  */
 picc_t
-rc522_get_last_picc(void)
+rc522_get_last_picc(rc522_handle_t rc522)
+{
+  return rc522->picc;
+}
+
+rc522_stats_t
+rc522_get_stats(rc522_handle_t rc522)
 {
-  return picc;
+  return rc522->stats;
+}
+
+void
+rc522_reset_stats(rc522_handle_t rc522)
+{
+  memset(&rc522->stats, 0, sizeof(rc522->stats));
 }
 
 esp_err_t
-rc522_init(spi_device_handle_t spi)
+rc522_init(spi_device_handle_t spi, rc522_handle_t* out)
 {
-  if (scratch_mem == NULL)
+  if (spi == NULL || out == NULL)
   {
-    scratch_mem = (uint8_t*)malloc(SCRATCH_MEM_SIZE);
+    return ESP_FAIL;
   }
 
-  if (spi != NULL)
+  rc522_handle_t rc522 = (rc522_handle_t)calloc(1, sizeof(struct rc522_t));
+  if (rc522 == NULL)
   {
-    rc522_spi = spi;
-    return ESP_OK;
+    return ESP_ERR_NO_MEM;
+  }
+
+  rc522->scratch_mem = (uint8_t*)heap_caps_malloc(SCRATCH_MEM_SIZE, MALLOC_CAP_DMA);
+  rc522->lock = xSemaphoreCreateMutex();
+  if (rc522->scratch_mem == NULL || rc522->lock == NULL)
+  {
+    rc522_deinit(rc522);
+    return ESP_ERR_NO_MEM;
+  }
+
+  rc522->spi = spi;
+  rc522->fwt_current = RC522_FWT_REQA;
+  // Nothing is known about the registers yet.
+  rc522->shadow_valid = 0;
+
+  *out = rc522;
+  return ESP_OK;
+}
+
+void
+rc522_deinit(rc522_handle_t rc522)
+{
+  if (rc522 == NULL)
+  {
+    return;
+  }
+
+  if (rc522->lock != NULL)
+  {
+    vSemaphoreDelete(rc522->lock);
   }
-  return ESP_FAIL;
+  heap_caps_free(rc522->scratch_mem);
+  free(rc522);
 }
 
 bool
-rc522_say_hello()
+rc522_lock(rc522_handle_t rc522, TickType_t timeout)
+{
+  return xSemaphoreTake(rc522->lock, timeout) == pdTRUE;
+}
+
+void
+rc522_unlock(rc522_handle_t rc522)
+{
+  xSemaphoreGive(rc522->lock);
+}
+
+bool
+rc522_say_hello(rc522_handle_t rc522)
 {
   bool ret = true;
 
+  // Someone could've messed with the RC522 in the meantime.
+  rc522->shadow_valid = 0;
+
   // RW test
-  rc522_write(RC522_REG_MOD_WIDTH, 0x25);
-  if (rc522_read(RC522_REG_MOD_WIDTH) != 0x25)
+  rc522_write(rc522, RC522_REG_MOD_WIDTH, 0x25);
+  if (rc522_read(rc522, RC522_REG_MOD_WIDTH) != 0x25)
   {
     ret = false;
   }
 
-  rc522_write(RC522_REG_MOD_WIDTH, 0x26);
-  if (rc522_read(RC522_REG_MOD_WIDTH) != 0x26)
+  rc522_write(rc522, RC522_REG_MOD_WIDTH, 0x26);
+  if (rc522_read(rc522, RC522_REG_MOD_WIDTH) != 0x26)
   {
     ret = false;
   }
   // End of RW test
 
-  rc522_write(RC522_REG_COMMAND, 0x0F);
-  // 0x0D part is high part of the timer prescaler.
-  rc522_write(RC522_REG_TIMER_MODE, 0x8D);
-  // Timer is used for timing out when talking to PICC.
-  // 0x3E part is the low part of the timer prescaler.
-  // Using the 0x0D3E for prescaler value gives timer frequency of ~2kHz
-  // Using 0x0D3D would give exactly 2kHz...
-  rc522_write(RC522_REG_TIMER_PRESCALER, 0x3E);
-  // 0x1E00 is 7680 in dec - that's the 16 bit reload value.
-  rc522_write(RC522_REG_TIMER_RELOAD_2, 0x1E);
-  rc522_write(RC522_REG_TIMER_RELOAD_1, 0x00);
+  rc522_soft_reset(rc522);
+#if defined (CONFIG_RC522_WAIT_IRQ)
+  // Make the IRQ pin push-pull. Together with IRqInv bit in the ComIEnReg the pin is active low.
+  rc522_write(rc522, RC522_REG_DIV_IRQ_EN_DI, 0x80);
+#endif // CONFIG_RC522_WAIT_IRQ
+  // Timer is used for timing out when talking to PICC. 0x80 is the TAuto bit - the timer starts
+  // when the transmission ends. The lower nibble is the high part of the timer prescaler.
+  rc522_write(rc522, RC522_REG_TIMER_MODE, 0x80 | ((RC522_TIMER_PRESCALER >> 8) & 0x0F));
+  rc522_write(rc522, RC522_REG_TIMER_PRESCALER, RC522_TIMER_PRESCALER & 0xFF);
+  // The reload value is set per command, see rc522_set_fwt.
+  rc522_set_fwt(rc522, RC522_FWT_REQA);
   // Transmission modulation. There is only one bit to set in this register. That's the
   // Force100ASK bit. ASK = Amplitude Shift Keying.
   // TODO(michalc): I don't know why we do this.
-  rc522_write(RC522_REG_TX_ASK, 0x40);
+  rc522_write(rc522, RC522_REG_TX_ASK, 0x40);
   // Default 0x3F. Set the preset value for the CRC coprocessor for the CalcCRC command to 0x6363 (ISO 14443-3 part 6.2.4)
-  rc522_write(RC522_REG_MODE, 0x3D);
+  rc522_write(rc522, RC522_REG_MODE, 0x3D);
+  // ValuesAfterColl off, the bits received after a collision are cleared. The anticollision counts
+  // on it.
+  rc522_write(rc522, RC522_REG_COLL, 0x00);
 
-  rc522_antenna_on();
+  rc522_antenna_on(rc522);
 
-  ESP_LOGW(TAG, "RC522 firmware 0x%x", rc522_fw_version());
+  ESP_LOGW(TAG, "RC522 firmware 0x%x", rc522_fw_version(rc522));
 
   return ret;
 }
 
 esp_err_t
-rc522_write_n(uint8_t addr, uint8_t data_size, const uint8_t* const data)
+rc522_write_n(rc522_handle_t rc522, uint8_t addr, uint8_t data_size, const uint8_t* const data)
 {
+  assert(data_size < SCRATCH_SLOT_SIZE);
+
+  // The shadow copy gets updated by rc522_write, if it's the one calling.
+  rc522->shadow_valid &= ~RC522_REG_BIT(addr);
+
   // The address gets concatenated with the data here.
-  uint8_t* buffer = scratch_mem;
+  uint8_t* buffer = rc522->scratch_mem;
   // MFRC522 documentation says that bit 0 should be 0, bits 1-6 is the address, bit 7
   // is 1 for read and 0 for write.
   buffer[0] = (addr << 1) & 0x7E;
@@ -126,47 +273,97 @@ rc522_write_n(uint8_t addr, uint8_t data_size, const uint8_t* const data)
   t.length = 8 * (data_size + 1);
   t.tx_buffer = buffer;
 
-  esp_err_t ret = spi_device_transmit(rc522_spi, &t);
+  esp_err_t ret = spi_device_transmit(rc522->spi, &t);
+  rc522->stats.spi_transactions++;
+
+  return ret;
+}
+
+esp_err_t rc522_write(rc522_handle_t rc522, uint8_t addr, uint8_t val)
+{
+  const uint64_t reg_bit = RC522_REG_BIT(addr);
+
+  if ((rc522->shadow_valid & reg_bit) && rc522->shadow[addr] == val)
+  {
+    // The register already holds that value.
+    rc522->stats.shadow_hits++;
+    return ESP_OK;
+  }
+
+  esp_err_t ret = rc522_write_n(rc522, addr, 1, &val);
+
+  if ((ret == ESP_OK) && (RC522_SHADOWED_REGS & reg_bit))
+  {
+    rc522->shadow[addr] = val;
+    rc522->shadow_valid |= reg_bit;
+  }
 
   return ret;
 }
 
-esp_err_t rc522_write(uint8_t addr, uint8_t val)
+esp_err_t rc522_write_fifo(rc522_handle_t rc522, uint8_t data_size, const uint8_t* const data)
 {
-  return rc522_write_n(addr, 1, &val);
+  // The RC522 keeps writing into the same register for as long as the CS is held. That's
+  // how the entire FIFO gets filled in a single transaction.
+  return rc522_write_n(rc522, RC522_REG_FIFO_DATA, data_size, data);
 }
 
 /*
- * Returns pointer to dynamically allocated array of N places.
+ * Read the register n times in a single transaction. The MFRC522 wants the address byte for every
+ * byte it clocks out and a 0x00 at the end. The data is delayed by one byte, so the first
+ * received byte is garbage.
+ *
+ * Returns pointer to the scratch memory holding n bytes. It's valid until the next read of more
+ * than one byte.
  */
-uint8_t* rc522_read_n(uint8_t addr, uint8_t n)
+uint8_t* rc522_read_n(rc522_handle_t rc522, uint8_t addr, uint8_t n)
 {
   if (n <= 0) return NULL;
+  assert(n < SCRATCH_SLOT_SIZE);
 
-  spi_transaction_t t;
-  memset(&t, 0, sizeof(t));
-
-  // Using the second half of the scratch_mem for incoming data.
-  uint8_t* buffer = (scratch_mem + SCRATCH_MEM_SIZE / 3);
-  
-  t.flags = SPI_TRANS_USE_TXDATA;
-  t.length = 8;
+  spi_transaction_t t = {};
   // MFRC522 documentation says that bit 0 should be 0, bits 1-6 is the address, bit 7
   // is 1 for read and 0 for write.
+  const uint8_t addr_byte = ((addr << 1) & 0x7E) | 0x80;
+
+  // Using the second slot of the scratch memory for the addresses and the third for incoming data.
+  uint8_t* tx = rc522->scratch_mem + SCRATCH_SLOT_SIZE;
+  uint8_t* rx = rc522->scratch_mem + 2 * SCRATCH_SLOT_SIZE;
+  memset(tx, addr_byte, n);
+  tx[n] = 0x00;
+
+  // Yes, the length is in bits. It's full duplex so the rxlength is the same.
+  t.length = 8 * (n + 1);
+  t.tx_buffer = tx;
+  t.rx_buffer = rx;
+
+  esp_err_t ret = spi_device_transmit(rc522->spi, &t);
+  assert(ret == ESP_OK);
+  rc522->stats.spi_transactions++;
+
+  return rx + 1;
+}
+
+uint8_t rc522_read(rc522_handle_t rc522, uint8_t addr)
+{
+  // Single register reads fit in the transaction itself and don't touch the scratch memory.
+  spi_transaction_t t = {};
+
+  t.flags = SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA;
+  t.length = 8 * 2;
   t.tx_data[0] = ((addr << 1) & 0x7E) | 0x80;
-  t.rxlength = 8 * n;
-  t.rx_buffer = buffer;
+  t.tx_data[1] = 0x00;
 
-  esp_err_t ret = spi_device_transmit(rc522_spi, &t);
+  esp_err_t ret = spi_device_transmit(rc522->spi, &t);
   assert(ret == ESP_OK);
+  rc522->stats.spi_transactions++;
 
-  return buffer;
+  return t.rx_data[1];
 }
 
-uint8_t rc522_read(uint8_t addr)
+uint8_t* rc522_read_fifo(rc522_handle_t rc522, uint8_t n)
 {
-  uint8_t* buffer = rc522_read_n(addr, 1);
-  return buffer[0];
+  return rc522_read_n(rc522, RC522_REG_FIFO_DATA, n);
 }
 
 
@@ -174,23 +371,123 @@ uint8_t rc522_read(uint8_t addr)
 // SPECIFIC FUNCTIONALITY
 // 
 
-static esp_err_t rc522_set_bitmask(uint8_t addr, uint8_t mask)
+static uint8_t rc522_read_shadowed(rc522_handle_t rc522, uint8_t addr)
+{
+  const uint64_t reg_bit = RC522_REG_BIT(addr);
+
+  if (rc522->shadow_valid & reg_bit)
+  {
+    rc522->stats.shadow_hits++;
+    return rc522->shadow[addr];
+  }
+
+  const uint8_t val = rc522_read(rc522, addr);
+
+  if (RC522_SHADOWED_REGS & reg_bit)
+  {
+    rc522->shadow[addr] = val;
+    rc522->shadow_valid |= reg_bit;
+  }
+
+  return val;
+}
+
+#if defined (CONFIG_RC522_WAIT_IRQ)
+void IRAM_ATTR rc522_irq_handler(void* arg)
 {
-  return rc522_write(addr, rc522_read(addr) | mask);
+  rc522_handle_t rc522 = (rc522_handle_t)arg;
+  BaseType_t higher_priority_task_woken = pdFALSE;
+  TaskHandle_t task = rc522->irq_waiting_task;
+
+  if (task != NULL)
+  {
+    vTaskNotifyGiveFromISR(task, &higher_priority_task_woken);
+  }
+
+  if (higher_priority_task_woken)
+  {
+    portYIELD_FROM_ISR();
+  }
 }
 
-esp_err_t rc522_clear_bitmask(uint8_t addr, uint8_t mask)
+void rc522_irq_arm(rc522_handle_t rc522)
 {
-  return rc522_write(addr, rc522_read(addr) & ~mask);
+  rc522->irq_waiting_task = xTaskGetCurrentTaskHandle();
+  // Drop a notification left from an IRQ nobody waited for.
+  (void)ulTaskNotifyTake(pdTRUE, 0);
+}
+
+bool rc522_irq_wait(rc522_handle_t rc522, TickType_t timeout)
+{
+  const bool irq = ulTaskNotifyTake(pdTRUE, timeout) != 0;
+  rc522->irq_waiting_task = NULL;
+  return irq;
+}
+#endif // CONFIG_RC522_WAIT_IRQ
+
+void rc522_set_fwt(rc522_handle_t rc522, rc522_fwt_e fwt)
+{
+  assert(fwt < RC522_FWT_COUNT);
+  rc522->fwt_current = fwt;
+
+  const uint16_t reload = fwt_us[fwt] / RC522_TIMER_TICK_US;
+  // The shadow registers make this free when the command's FWT doesn't change.
+  rc522_write(rc522, RC522_REG_TIMER_RELOAD_2, reload >> 8);
+  rc522_write(rc522, RC522_REG_TIMER_RELOAD_1, reload & 0xFF);
 }
 
-static esp_err_t rc522_antenna_on()
+void rc522_log_stats(rc522_handle_t rc522)
+{
+  static const char* const fwt_names[RC522_FWT_COUNT] = {
+    [RC522_FWT_REQA]        = "REQA",
+    [RC522_FWT_SELECT]      = "SELECT",
+    [RC522_FWT_HALTA]       = "HALTA",
+    [RC522_FWT_GET_VERSION] = "GET_VERSION",
+    [RC522_FWT_READ]        = "READ",
+    [RC522_FWT_AUTH]        = "AUTH",
+    [RC522_FWT_WRITE]       = "WRITE",
+  };
+
+  ESP_LOGI(TAG, "SPI transactions %lu, avoided %lu", rc522->stats.spi_transactions, rc522->stats.shadow_hits);
+  for (uint32_t i = 0; i < RC522_FWT_COUNT; i++)
+  {
+    const rc522_fwt_stats_t* fs = &rc522->stats.fwt[i];
+    ESP_LOGI(TAG, "%-12s FWT %5lu us: issued %lu, timed out %lu, waited %llu us (%llu us on timeouts)",
+             fwt_names[i], fwt_us[i], fs->issued, fs->timed_out, fs->wait_us, fs->timed_out_wait_us);
+  }
+
+  const rc522_reselect_stats_t* rs = &rc522->stats.reselect;
+  const uint32_t fast = rs->fast > 0 ? rs->fast : 1;
+  const uint32_t fallbacks = rs->fallbacks > 0 ? rs->fallbacks : 1;
+  ESP_LOGI(TAG, "Reselect: fast %lu (%lu frames, %llu us each), fallback %lu (%lu frames, %llu us each), failed %lu",
+           rs->fast, rs->fast_frames / fast, rs->fast_us / fast, rs->fallbacks,
+           rs->fallback_frames / fallbacks, rs->fallback_us / fallbacks, rs->failed);
+}
+
+static void rc522_soft_reset(rc522_handle_t rc522)
+{
+  rc522_write(rc522, RC522_REG_COMMAND, RC522_CMD_SOFT_RESET);
+  // All the registers go back to their reset values.
+  rc522->shadow_valid = 0;
+}
+
+static esp_err_t rc522_set_bitmask(rc522_handle_t rc522, uint8_t addr, uint8_t mask)
+{
+  return rc522_write(rc522, addr, rc522_read_shadowed(rc522, addr) | mask);
+}
+
+esp_err_t rc522_clear_bitmask(rc522_handle_t rc522, uint8_t addr, uint8_t mask)
+{
+  return rc522_write(rc522, addr, rc522_read_shadowed(rc522, addr) & ~mask);
+}
+
+static esp_err_t rc522_antenna_on(rc522_handle_t rc522)
 {
   esp_err_t ret;
 
-  if(~(rc522_read(RC522_REG_TX_CONTROL_REG) & 0x03))
+  if((rc522_read_shadowed(rc522, RC522_REG_TX_CONTROL_REG) & 0x03) != 0x03)
   {
-    ret = rc522_set_bitmask(RC522_REG_TX_CONTROL_REG, 0x03);
+    ret = rc522_set_bitmask(rc522, RC522_REG_TX_CONTROL_REG, 0x03);
 
     if(ret != ESP_OK)
     {
@@ -198,20 +495,39 @@ static esp_err_t rc522_antenna_on()
     }
   }
 
-  return rc522_write(RC522_REG_RF_CFG, RC522_RF_GAIN_33dB);
+  return rc522_write(rc522, RC522_REG_RF_CFG, RC522_RF_GAIN_33dB);
 }
 
-/* Returns pointer to dynamically allocated array of two element */
-static void rc522_calculate_crc(uint8_t *data, uint8_t data_size, uint8_t* crc_buf)
+static void rc522_calculate_crc(rc522_handle_t rc522, uint8_t *data, uint8_t data_size, uint8_t* crc_buf)
 {
-  // 0x04 = CalcCRC command is active and all data is processed.
-  rc522_clear_bitmask(RC522_REG_DIV_IRQ, 0x04);
-  // 0x08 = flush FIFO buffer.
-  rc522_set_bitmask(RC522_REG_FIFO_LEVEL, 0x80);
+#if defined (CONFIG_RC522_CRC_COPROCESSOR)
+  // 0x04 = CalcCRC command is active and all data is processed. Writing it with the Set2 bit
+  // (0x80) cleared clears the CRCIRq.
+  rc522_write(rc522, RC522_REG_DIV_IRQ, 0x04);
+  // 0x80 = flush FIFO buffer. The rest of the register is read only, no need to read it first.
+  rc522_write(rc522, RC522_REG_FIFO_LEVEL, 0x80);
+
+  rc522_write_fifo(rc522, data_size, data);
+
+#if defined (CONFIG_RC522_WAIT_IRQ)
+  // Pending ComIrq requests would keep the IRQ pin asserted and there would be no edge.
+  rc522_write(rc522, RC522_REG_COM_IRQ, 0x7F);
+  // Pass the CRCIRq to the IRQ pin (0x80 keeps it push-pull).
+  rc522_write(rc522, RC522_REG_DIV_IRQ_EN_DI, 0x80 | 0x04);
+  rc522_irq_arm(rc522);
 
-  rc522_write_n(RC522_REG_FIFO_DATA, data_size, data);
+  rc522_write(rc522, RC522_REG_COMMAND, RC522_CMD_CALC_CRC);
 
-  rc522_write(RC522_REG_COMMAND, RC522_CMD_CALC_CRC);
+  rc522_irq_wait(rc522, pdMS_TO_TICKS(RC522_IRQ_WAIT_MS));
+
+  crc_buf[0] = rc522_read(rc522, RC522_REG_CRC_RESULT_2);
+  crc_buf[1] = rc522_read(rc522, RC522_REG_CRC_RESULT_1);
+
+  // Don't let the CRCIRq hold the IRQ pin during the following transceive.
+  rc522_write(rc522, RC522_REG_DIV_IRQ, 0x04);
+  rc522_write(rc522, RC522_REG_DIV_IRQ_EN_DI, 0x80);
+#else
+  rc522_write(rc522, RC522_REG_COMMAND, RC522_CMD_CALC_CRC);
 
   uint8_t i = 255;
   uint8_t nn = 0;
@@ -219,7 +535,7 @@ static void rc522_calculate_crc(uint8_t *data, uint8_t data_size, uint8_t* crc_b
   // Wait for the CRC computation to be done.
   while (1)
   {
-    nn = rc522_read(RC522_REG_DIV_IRQ);
+    nn = rc522_read(rc522, RC522_REG_DIV_IRQ);
     i--;
 
     if (i == 0)
@@ -234,16 +550,22 @@ static void rc522_calculate_crc(uint8_t *data, uint8_t data_size, uint8_t* crc_b
     }
   }
 
-  crc_buf[0] = rc522_read(RC522_REG_CRC_RESULT_2);
-  crc_buf[1] = rc522_read(RC522_REG_CRC_RESULT_1);
+  crc_buf[0] = rc522_read(rc522, RC522_REG_CRC_RESULT_2);
+  crc_buf[1] = rc522_read(rc522, RC522_REG_CRC_RESULT_1);
+#endif // CONFIG_RC522_WAIT_IRQ
+#else
+  iso14443a_crc_a(data, data_size, crc_buf);
+#endif // CONFIG_RC522_CRC_COPROCESSOR
 }
 
-void rc522_picc_write(rc522_commands_e cmd,
+void rc522_picc_write(rc522_handle_t rc522, rc522_commands_e cmd,
                       const uint8_t* const data, const uint8_t data_size,
                       response_t* const response)
 {
   uint8_t irq = 0;
   uint8_t irq_wait = 0;
+  // The callers reuse the response between frames, a collision is only this frame's.
+  response->collision_pos = 0;
   
   if (cmd == RC522_CMD_MF_AUTH)
   {
@@ -256,32 +578,56 @@ void rc522_picc_write(rc522_commands_e cmd,
     irq_wait = 0x30; // RxIRq | IdleIRq
   }
 
+#if defined (CONFIG_RC522_WAIT_IRQ)
+  // Only the requests that end the wait get passed to the IRQ pin: the expected ones, ErrIRq
+  // and TimerIRq. 0x80 is the IRqInv bit - the IRQ pin is active low.
+  (void)irq;
+  rc522_write(rc522, RC522_REG_COM_IRQ_EN_DI, 0x80 | irq_wait | 0x02 | 0x01);
+#else
   // Enable passing the interrupt requests. 0x80 turns on the HiAlert which
   // triggers when the FIFO is almost full (WaterLevel is the limit).
   // The WaterLevel isn't set anywhere here.
-  rc522_write(RC522_REG_COM_IRQ_EN_DI, irq | 0x80);
-  // Clear the HiAlert.
-  rc522_clear_bitmask(RC522_REG_COM_IRQ, 0x80);
-  // 0x80 = flush the FIFO buffer.
-  rc522_set_bitmask(RC522_REG_FIFO_LEVEL, 0x80);
+  rc522_write(rc522, RC522_REG_COM_IRQ_EN_DI, irq | 0x80);
+#endif // CONFIG_RC522_WAIT_IRQ
+  // Clear all the interrupt request bits. Bits written as 1 get cleared when the Set1 bit (0x80)
+  // is 0. That's what reading the register and clearing the Set1 bit did, minus the readback.
+  rc522_write(rc522, RC522_REG_COM_IRQ, 0x7F);
+  // 0x80 = flush the FIFO buffer. The rest of the register is read only, no need to read it first.
+  rc522_write(rc522, RC522_REG_FIFO_LEVEL, 0x80);
   // Change to IDLE mode to cancel any command.
-  rc522_write(RC522_REG_COMMAND, RC522_CMD_IDLE);
+  rc522_write(rc522, RC522_REG_COMMAND, RC522_CMD_IDLE);
   // Write the data into FIFO buffer.
-  rc522_write_n(RC522_REG_FIFO_DATA, data_size, data);
+  rc522_write_fifo(rc522, data_size, data);
+
+#if defined (CONFIG_RC522_WAIT_IRQ)
+  rc522_irq_arm(rc522);
+#endif // CONFIG_RC522_WAIT_IRQ
 
-  rc522_write(RC522_REG_COMMAND, cmd);
+  rc522_write(rc522, RC522_REG_COMMAND, cmd);
 
   if(cmd == RC522_CMD_TRANSCEIVE)
   {
     // SEND THE DATA!!!
-    rc522_set_bitmask(RC522_REG_BIT_FRAMING, 0x80);
+    rc522_set_bitmask(rc522, RC522_REG_BIT_FRAMING, 0x80);
   }
 
-  uint16_t dont_lock = 1000;
-
+  bool gave_up = false;
+  uint8_t nn = 0;
+  const int64_t wait_start = esp_timer_get_time();
+  // The RC522's timer should fire way before that. This is in case it doesn't.
+  const uint32_t wait_limit_us = fwt_us[rc522->fwt_current] + RC522_FWT_MARGIN_US;
+
+#if defined (CONFIG_RC522_WAIT_IRQ)
+  // Sleep until the RC522 pulls the IRQ pin. There is no SPI traffic while waiting.
+  rc522_irq_wait(rc522, pdMS_TO_TICKS(wait_limit_us / 1000) + 1);
+
+  // Check what woke us up. 0x01 is the TimerIRq - the PICC didn't respond in time.
+  nn = rc522_read(rc522, RC522_REG_COM_IRQ);
+  gave_up = !(nn & (irq_wait | 0x01));
+#else
   while (1)
   {
-    uint8_t nn = rc522_read(RC522_REG_COM_IRQ);
+    nn = rc522_read(rc522, RC522_REG_COM_IRQ);
 
     // Check for possible interrupts.
     if (nn & irq_wait)
@@ -295,25 +641,53 @@ void rc522_picc_write(rc522_commands_e cmd,
       break;
     }
 
-    if (--dont_lock == 0) break;
+    if ((esp_timer_get_time() - wait_start) > wait_limit_us)
+    {
+      gave_up = true;
+      break;
+    }
+  }
+#endif // CONFIG_RC522_WAIT_IRQ
+
+  const uint32_t waited_us = esp_timer_get_time() - wait_start;
+  rc522_fwt_stats_t* fs = &rc522->stats.fwt[rc522->fwt_current];
+  fs->issued++;
+  fs->wait_us += waited_us;
+  if (gave_up || !(nn & irq_wait))
+  {
+    fs->timed_out++;
+    fs->timed_out_wait_us += waited_us;
   }
 
   // Stop the transmission to PICC.
-  rc522_clear_bitmask(RC522_REG_BIT_FRAMING, 0x80);
+  rc522_clear_bitmask(rc522, RC522_REG_BIT_FRAMING, 0x80);
 
-  if (dont_lock != 0)
+  if (!gave_up)
   {
-    // Check for 0b11011 error bits.
-    if((rc522_read(RC522_REG_ERROR) & 0x1B) == 0x00)
+    const uint8_t error = rc522_read(rc522, RC522_REG_ERROR);
+    // CollErr. The bits before the collision are in the FIFO, CollPos says where it was. 0 is the
+    // 32nd bit, CollPosNotValid (0x20) means it was past those.
+    if (error & 0x08)
+    {
+      const uint8_t coll = rc522_read(rc522, RC522_REG_COLL);
+      if (!(coll & 0x20))
+      {
+        response->collision_pos = (coll & 0x1F) == 0 ? 32 : (coll & 0x1F);
+      }
+    }
+
+    // Check for the BufferOvfl and ProtocolErr bits. The CollErr and ParityErr are fine as long
+    // as it's known where the collision was, the colliding bits come with parity errors.
+    if((error & 0x11) == 0x00 && ((error & 0x0A) == 0x00 || response->collision_pos != 0))
     {
       // The RC522_CMD_MF_AUTH doesn't get a response.
       if(cmd == RC522_CMD_TRANSCEIVE)
       {
         // Check how many bytes are in the FIFO buffer. The last one might be an incomplete byte.
-        response->size_bytes = rc522_read(RC522_REG_FIFO_LEVEL);
+        response->size_bytes = rc522_read(rc522, RC522_REG_FIFO_LEVEL);
         // Returns the number of valid bits in the last received byte. The response might have been
         // smaller than 1 byte.
-        const uint8_t last_bits = rc522_read(RC522_REG_CONTROL) & 0x07;
+        const uint8_t last_bits = rc522_read(rc522, RC522_REG_CONTROL) & 0x07;
         if (last_bits == 0)
         {
           response->size_bits = response->size_bytes * 8U;
@@ -325,13 +699,8 @@ void rc522_picc_write(rc522_commands_e cmd,
 
         if (response->size_bytes)
         {
-          // Using the second half of the scratch_mem for incoming data.
-          response->data = (scratch_mem + 2 * (SCRATCH_MEM_SIZE / 3));
-          // Read the data into scratch memory.
-          for(uint32_t j = 0; j < response->size_bytes; j++)
-          {
-            response->data[j] = rc522_read(RC522_REG_FIFO_DATA);
-          }
+          // Drain the entire FIFO in one go. The data lands in the scratch memory.
+          response->data = rc522_read_fifo(rc522, response->size_bytes);
         }
         else
         {
@@ -344,18 +713,19 @@ void rc522_picc_write(rc522_commands_e cmd,
   return;
 }
 
-status_e rc522_picc_reqa_or_wupa(uint8_t reqa_or_wupa)
+status_e rc522_picc_reqa_or_wupa(rc522_handle_t rc522, uint8_t reqa_or_wupa)
 {
   status_e status = FAILURE;
   // Set a short frame format of 7 bits. That means that only 7 bits of the last byte,
   // in this case the only byte will be transmitted to the PICC.
-  rc522_write(RC522_REG_BIT_FRAMING, 0x07);
+  rc522_write(rc522, RC522_REG_BIT_FRAMING, 0x07);
 
   uint8_t picc_cmd_buffer[] = {reqa_or_wupa};
   response_t resp = {};
+  rc522_set_fwt(rc522, RC522_FWT_REQA);
   // Result is so called ATQA. If we get an ATQA this means there is one or more PICC present.
   // ATQA is exactly 2 bytes.
-  rc522_picc_write(RC522_CMD_TRANSCEIVE, picc_cmd_buffer, 1, &resp);
+  rc522_picc_write(rc522, RC522_CMD_TRANSCEIVE, picc_cmd_buffer, 1, &resp);
 
   if(resp.size_bytes == 2 && resp.size_bits == 16)
   {
@@ -367,11 +737,11 @@ status_e rc522_picc_reqa_or_wupa(uint8_t reqa_or_wupa)
     uint8_t atqa_1 = resp.data[0];
     if (atqa_1 == 0x44)
     {
-      picc.type = PICC_SUPPORTED_NTAG213;
+      rc522->picc.type = PICC_SUPPORTED_NTAG213;
     }
     else if (atqa_1 == 0x04)
     {
-      picc.type = PICC_SUPPORTED_MIFARE_1K;
+      rc522->picc.type = PICC_SUPPORTED_MIFARE_1K;
     }
 
     status = SUCCESS;
@@ -381,28 +751,30 @@ status_e rc522_picc_reqa_or_wupa(uint8_t reqa_or_wupa)
 }
 
 // TODO(michalc): this doesn't need an argument. It's always the same halta.
-status_e rc522_picc_halta(uint8_t halta)
+status_e rc522_picc_halta(rc522_handle_t rc522, uint8_t halta)
 {
   response_t resp = {};
 
   // Halting and clearing the MFCrypto1On bit should be done after readings data.
   // After halting it needs to be WUPA (waken up).
   uint8_t picc_cmd_buffer[] = {halta, 0x00, 0x00, 0x00 };
-  rc522_calculate_crc(picc_cmd_buffer, 2, &picc_cmd_buffer[2]);
+  rc522_calculate_crc(rc522, picc_cmd_buffer, 2, &picc_cmd_buffer[2]);
 
-  rc522_picc_write(RC522_CMD_TRANSCEIVE, picc_cmd_buffer, 4, &resp);
+  rc522_set_fwt(rc522, RC522_FWT_HALTA);
+  rc522_picc_write(rc522, RC522_CMD_TRANSCEIVE, picc_cmd_buffer, 4, &resp);
 
   return SUCCESS;
 }
 
-status_e rc522_picc_get_version(void)
+status_e rc522_picc_get_version(rc522_handle_t rc522)
 {
   response_t resp = {};
 
   uint8_t picc_cmd_buffer[] = {PICC_CMD_NTAG_GET_VERSION, 0x00, 0x00};
-  rc522_calculate_crc(picc_cmd_buffer, 1, &picc_cmd_buffer[1]);
+  rc522_calculate_crc(rc522, picc_cmd_buffer, 1, &picc_cmd_buffer[1]);
 
-  rc522_picc_write(RC522_CMD_TRANSCEIVE, picc_cmd_buffer, 3, &resp);
+  rc522_set_fwt(rc522, RC522_FWT_GET_VERSION);
+  rc522_picc_write(rc522, RC522_CMD_TRANSCEIVE, picc_cmd_buffer, 3, &resp);
 
   // Check for NAK.
   if (resp.data == NULL)
@@ -412,157 +784,198 @@ status_e rc522_picc_get_version(void)
 
   if (resp.size_bytes == 10)
   {
-    picc.ver.fixed_header = resp.data[0];
-    picc.ver.vendor_id = resp.data[1];
-    picc.ver.product_type = resp.data[2];
-    picc.ver.product_subtype = resp.data[3];
-    picc.ver.maj_product_ver = resp.data[4];
-    picc.ver.min_product_ver = resp.data[5];
-    picc.ver.storage_size = resp.data[6];
-    picc.ver.protocol_type = resp.data[7];
-
-    if (picc.ver.storage_size == 0x0F)
+    rc522->picc.ver.fixed_header = resp.data[0];
+    rc522->picc.ver.vendor_id = resp.data[1];
+    rc522->picc.ver.product_type = resp.data[2];
+    rc522->picc.ver.product_subtype = resp.data[3];
+    rc522->picc.ver.maj_product_ver = resp.data[4];
+    rc522->picc.ver.min_product_ver = resp.data[5];
+    rc522->picc.ver.storage_size = resp.data[6];
+    rc522->picc.ver.protocol_type = resp.data[7];
+
+    if (rc522->picc.ver.storage_size == 0x0F)
     {
-      picc.type = PICC_SUPPORTED_NTAG213;
+      rc522->picc.type = PICC_SUPPORTED_NTAG213;
     }
   }
 
   return SUCCESS;
 }
 
-// TODO(michalc): return value should reflect success which depends on the cascade_level.
-bool
-rc522_anti_collision(uint8_t cascade_level)
+/*
+ * The iso14443a_transceive_t for the anticollision. The command in the frame's first byte picks
+ * the FWT.
+ */
+static iso14443a_result_e
+rc522_transceive(void* ctx, iso14443a_frame_t* frame)
 {
-  assert(cascade_level > 0);
-  assert(cascade_level <= 3);
-
-  ESP_LOGD(TAG, "Anticollision with cascade level %d\n", cascade_level);
-
-  response_t resp = {};
+  rc522_handle_t rc522 = (rc522_handle_t)ctx;
 
-  // 1. Build an a ANTI COLLISION command.
-
-  // Anti collision commands always have [1] == 0x20.
-  // Set NVB. First anti collision round sets the NVB to 0x20.
-  // After that NVB should be increased by UID bits count that were already
-  // fetched. Those become a search criteria for fetching the rest of the UID.
-  // After all the anticollision steps the select step needs to be performed.
-  uint8_t anticollision[9];
-  uint8_t anticollision_size = 2;
-  anticollision[1] = 0x20;
-
-  if (cascade_level == 1)
-  {
-    anticollision[0] = PICC_CMD_SELECT_CL_1;
-  }
-  else if (cascade_level == 2)
+  const uint8_t command = frame->tx[0];
+  if (command == PICC_CMD_REQA || command == PICC_CMD_WUPA)
   {
-    // TODO(michalc): for now I just assume that we've received full bytes of UID. No trailing bits.
-    anticollision[0] = PICC_CMD_SELECT_CL_2;
+    rc522_set_fwt(rc522, RC522_FWT_REQA);
   }
-  else if (cascade_level == 3)
+  else if (command == PICC_CMD_HALTA)
   {
-    anticollision[0] = PICC_CMD_SELECT_CL_3;
+    rc522_set_fwt(rc522, RC522_FWT_HALTA);
   }
   else
   {
-    // TODO(michalc): should never happen.
+    rc522_set_fwt(rc522, RC522_FWT_SELECT);
   }
 
-  // 2. Send the ANTI COLLISION command.
+  // RxAlign and TxLastBits. The StartSend bit is set by rc522_picc_write.
+  rc522_write(rc522, RC522_REG_BIT_FRAMING, (frame->rx_align << 4) | (frame->tx_bits % 8));
 
-  // Sets StartSend bit to 0, all bits are valid.
-  rc522_write(RC522_REG_BIT_FRAMING, 0x00);
+  response_t resp = {};
+  rc522_picc_write(rc522, RC522_CMD_TRANSCEIVE, frame->tx, (frame->tx_bits + 7) / 8, &resp);
 
-  rc522_picc_write(RC522_CMD_TRANSCEIVE, anticollision, anticollision_size, &resp);
+  frame->rx_bits = 0;
+  if (resp.data == NULL || resp.size_bits <= frame->rx_align)
+  {
+    return ISO14443A_TIMEOUT;
+  }
 
-  if (resp.data == NULL)
+  memcpy(frame->rx, resp.data, resp.size_bytes < frame->rx_size ? resp.size_bytes : frame->rx_size);
+  frame->rx_bits = resp.size_bits - frame->rx_align;
+
+  if (resp.collision_pos != 0)
   {
-    return false;
+    // The CollPos counts the bits in the FIFO, the ones skipped by the RxAlign too.
+    if (resp.collision_pos <= frame->rx_align)
+    {
+      return ISO14443A_ERROR;
+    }
+    frame->collision_bit = resp.collision_pos - 1 - frame->rx_align;
+    return ISO14443A_COLLISION;
   }
 
-  // 3. Handle the ANTI COLLISION command response.
+  return ISO14443A_OK;
+}
 
-  // Check the BCC byte (XORed UID bytes).
-  if (resp.size_bytes != 5)
+static void
+rc522_set_picc(rc522_handle_t rc522, const iso14443a_picc_t* picc)
+{
+  memcpy(rc522->picc.uid, picc->uid, picc->uid_size);
+  rc522->picc.uid_bits = picc->uid_size * 8;
+  rc522->picc.uid_full = true;
+  rc522->picc.uid_hot = 1;
+
+  // The SAK tells the type better than the ATQA. The NTAGs share theirs with the other
+  // Ultralights, GET_VERSION tells them apart.
+  if (picc->sak == 0x08)
   {
-    // TODO(michalc): error out
+    rc522->picc.type = PICC_SUPPORTED_MIFARE_1K;
   }
-  if (resp.data[4] != (resp.data[0] ^ resp.data[1] ^ resp.data[2] ^ resp.data[3]))
+  else if (picc->sak == 0x00)
   {
-    // TODO(michalc): handle incorrect BCC byte value.
+    rc522->picc.type = PICC_SUPPORTED_NTAG213;
   }
+}
 
-  // 4. Extract the UID bytes.
+bool
+rc522_anti_collision(rc522_handle_t rc522)
+{
+  iso14443a_picc_t picc = {};
+  const iso14443a_result_e result = iso14443a_select(rc522_transceive, rc522, &picc);
 
-  // Check the condition for having full UID.
-  if (resp.data[0] != PICC_CASCADE_TAG)
-  {
-    // Here we skip copying of the BCC byte.
-    picc.uid_full = true;
-    memcpy(picc.uid, resp.data, resp.size_bytes - 1);
-    // TODO(michalc): fix this - it should add more bits, not set.
-    picc.uid_bits = 4 * 8;
-    picc.uid_hot = 1;
-  }
-  else
+  // The PICC commands which follow send whole bytes.
+  rc522_write(rc522, RC522_REG_BIT_FRAMING, 0x00);
+
+  if (result != ISO14443A_OK)
   {
-    // Here we skip copying both CT byte and the BCC byte.
-    picc.uid_full = false;
-    memcpy(picc.uid, resp.data + 1, resp.size_bytes - 2);
-    // TODO(michalc): fix this - it should add more bits, not set.
-    picc.uid_bits = 3 * 8;
-    picc.uid_hot = 1;
+    ESP_LOGD(TAG, "Anticollision failed (%d)", result);
+    rc522->picc.uid_full = false;
+    return false;
   }
 
-  // 5. Send a SELECT command.
+  rc522_set_picc(rc522, &picc);
+  return true;
+}
 
-  if ((cascade_level == 1) || (cascade_level == 2) || (cascade_level == 3))
+// Every frame gets its FWT, so that's all the frames sent.
+static uint32_t
+rc522_frames(rc522_handle_t rc522)
+{
+  uint32_t frames = 0;
+  for (uint32_t i = 0; i < RC522_FWT_COUNT; i++)
   {
-    anticollision[1] = 0x20 + 0x50;
-    memcpy(&anticollision[2], resp.data, 5);
-    // BCC and the CRC is transmitted only if we know all the UID bits of the current cascade level.
-    anticollision[6] = anticollision[2] ^ anticollision[3] ^ anticollision[4] ^ anticollision[5];
-    anticollision_size = 7;
-    rc522_calculate_crc(anticollision, 7, &anticollision[7]);
-    anticollision_size = 9;
+    frames += rc522->stats.fwt[i].issued;
+  }
+  return frames;
+}
+
+bool
+rc522_reselect(rc522_handle_t rc522, const uint8_t* uid, uint8_t uid_size)
+{
+  assert(uid_size <= ISO14443A_UID_MAX_SIZE);
 
-    // Sets StartSend bit to 0, all bits are valid.
-    rc522_write(RC522_REG_BIT_FRAMING, 0x00);
+  const int64_t start = esp_timer_get_time();
+  const uint32_t frames = rc522_frames(rc522);
 
-    rc522_picc_write(RC522_CMD_TRANSCEIVE, anticollision, anticollision_size, &resp);
+  iso14443a_picc_t picc = { .uid_size = uid_size };
+  memcpy(picc.uid, uid, uid_size);
+  const bool fast = iso14443a_reselect(rc522_transceive, rc522, &picc) == ISO14443A_OK;
 
-    // Need to verify 1 byte (actually 24 bits) SAK response. Check for size and cascade bit.
-    if (resp.data != NULL)
+  bool selected = fast;
+  if (!fast)
+  {
+    // The failed SELECT sent the PICCs back to IDLE, the WUPA gets them again.
+    memset(&picc, 0, sizeof(picc));
+    const iso14443a_result_e requested =
+      iso14443a_request(rc522_transceive, rc522, PICC_CMD_WUPA, picc.atqa);
+    if ((requested == ISO14443A_OK || requested == ISO14443A_COLLISION) &&
+        iso14443a_select(rc522_transceive, rc522, &picc) == ISO14443A_OK)
     {
-      if (!(resp.data[0] & 0x04))
-      {
-        picc.uid_full = true;
-        // TODO(michalc): here we should establish the type of PICC based on the contents of SAK.
-        // picc.type = resp.data[0] & 0x7F;
-      }
+      selected = picc.uid_size == uid_size && memcmp(picc.uid, uid, uid_size) == 0;
     }
   }
-  else
+
+  rc522_write(rc522, RC522_REG_BIT_FRAMING, 0x00);
+  if (selected)
   {
-    // TODO(michalc): should never happen.
+    rc522_set_picc(rc522, &picc);
   }
 
-  bool status = 0;
-  if (picc.uid_full == true)
+  rc522_reselect_stats_t* rs = &rc522->stats.reselect;
+  const uint32_t elapsed_us = esp_timer_get_time() - start;
+  if (fast)
   {
-    status = true;
+    rs->fast++;
+    rs->fast_frames += rc522_frames(rc522) - frames;
+    rs->fast_us += elapsed_us;
+  }
+  else if (selected)
+  {
+    rs->fallbacks++;
+    rs->fallback_frames += rc522_frames(rc522) - frames;
+    rs->fallback_us += elapsed_us;
   }
   else
   {
-    status = rc522_anti_collision(cascade_level + 1);
+    rs->failed++;
   }
 
-  return status;
+  return selected;
 }
 
-bool rc522_test_picc_presence()
+uint8_t
+rc522_inventory(rc522_handle_t rc522, iso14443a_inventory_e mode, iso14443a_picc_t* piccs,
+                uint8_t max)
+{
+  const uint8_t count = iso14443a_inventory(rc522_transceive, rc522, mode, piccs, max);
+
+  rc522_write(rc522, RC522_REG_BIT_FRAMING, 0x00);
+
+  if (count > 0)
+  {
+    rc522_set_picc(rc522, &piccs[count - 1]);
+  }
+  return count;
+}
+
+bool rc522_test_picc_presence(rc522_handle_t rc522)
 {
   // An example sequence of establishing the full UID.
   //
@@ -589,12 +1002,12 @@ bool rc522_test_picc_presence()
   // move it close to reader again.
   // If you use WUPA you'll be able to wake up the PICC every time. That means the entire process
   // below will succeed every time.
-  status_e picc_present = rc522_picc_reqa_or_wupa(PICC_CMD_REQA);
+  status_e picc_present = rc522_picc_reqa_or_wupa(rc522, PICC_CMD_REQA);
 
   return picc_present == SUCCESS ? true : false;
 }
 
-status_e rc522_read_picc_data(uint8_t block_address, uint8_t buffer[16])
+status_e rc522_read_picc_data(rc522_handle_t rc522, uint8_t block_address, uint8_t buffer[16])
 {
   response_t resp = {};
 
@@ -602,11 +1015,11 @@ status_e rc522_read_picc_data(uint8_t block_address, uint8_t buffer[16])
   uint8_t picc_cmd_buffer[18];
   picc_cmd_buffer[0] = PICC_CMD_MIFARE_READ;
   picc_cmd_buffer[1] = block_address;
-  // Calculate the CRC on the RC522 side.
-  rc522_calculate_crc(picc_cmd_buffer, 2, &picc_cmd_buffer[2]);
+  rc522_calculate_crc(rc522, picc_cmd_buffer, 2, &picc_cmd_buffer[2]);
 
   // Send the command to PICC.
-  rc522_picc_write(RC522_CMD_TRANSCEIVE, picc_cmd_buffer, 4, &resp);
+  rc522_set_fwt(rc522, RC522_FWT_READ);
+  rc522_picc_write(rc522, RC522_CMD_TRANSCEIVE, picc_cmd_buffer, 4, &resp);
 
   if (resp.data != NULL)
   {
@@ -635,13 +1048,56 @@ status_e rc522_read_picc_data(uint8_t block_address, uint8_t buffer[16])
   return SUCCESS;
 }
 
-void rc522_write_picc_data(const uint8_t block_address, uint8_t* data, const uint32_t data_len)
+status_e rc522_ntag_fast_read(rc522_handle_t rc522, uint8_t start_page, uint8_t end_page,
+                              uint8_t* buffer)
+{
+  response_t resp = {};
+  const uint32_t data_size = (end_page - start_page + 1) * 4U;
+
+  assert(end_page >= start_page);
+  assert(data_size + 2 <= RC522_FIFO_SIZE);
+
+  uint8_t picc_cmd_buffer[5];
+  picc_cmd_buffer[0] = PICC_CMD_NTAG_FAST_READ;
+  picc_cmd_buffer[1] = start_page;
+  picc_cmd_buffer[2] = end_page;
+  rc522_calculate_crc(rc522, picc_cmd_buffer, 3, &picc_cmd_buffer[3]);
+
+  // The same FWT as the READ, the NTAG answers as soon as it has the pages.
+  rc522_set_fwt(rc522, RC522_FWT_READ);
+  rc522_picc_write(rc522, RC522_CMD_TRANSCEIVE, picc_cmd_buffer, 5, &resp);
+
+  if (resp.data == NULL)
+  {
+    ESP_LOGW(TAG, "No data returned when fast reading PICC.\n");
+    return FAILURE;
+  }
+
+  if (resp.size_bits == 4)
+  {
+    ESP_LOGD(TAG, "PICC responded with NAK (%x) when trying to fast read data!\n", resp.data[0]);
+    return FAILURE;
+  }
+
+  if (resp.size_bytes != data_size + 2 || !iso14443a_crc_a_check(resp.data, resp.size_bytes))
+  {
+    ESP_LOGD(TAG, "Bad FAST_READ response, %lu bytes\n", resp.size_bytes);
+    return FAILURE;
+  }
+
+  memcpy(buffer, resp.data, data_size);
+  return SUCCESS;
+}
+
+void rc522_write_picc_data(rc522_handle_t rc522, const uint8_t block_address, uint8_t* data, const uint32_t data_len)
 {
   response_t resp = {};
 
   // The compatibility WRITE is supported by NTAG but we're using the native version here.
   // I had some problems with compatibility WRITE with data being corrupted when written.
-  if (picc.type == PICC_SUPPORTED_NTAG213)
+  rc522_set_fwt(rc522, RC522_FWT_WRITE);
+
+  if (rc522->picc.type == PICC_SUPPORTED_NTAG213)
   {
     // TODO(michalc): More robust? Not writing entire blocks?
     assert(data_len % 4 == 0);
@@ -654,9 +1110,9 @@ void rc522_write_picc_data(const uint8_t block_address, uint8_t* data, const uin
       picc_write_buffer[0] = PICC_CMD_NTAG_WRITE;
       picc_write_buffer[1] = block_address + i;
       memcpy(picc_write_buffer + 2, data + i * 4, 4);
-      rc522_calculate_crc(picc_write_buffer, 6, &picc_write_buffer[6]);
+      rc522_calculate_crc(rc522, picc_write_buffer, 6, &picc_write_buffer[6]);
 
-      rc522_picc_write(RC522_CMD_TRANSCEIVE, picc_write_buffer, 8, &resp);
+      rc522_picc_write(rc522, RC522_CMD_TRANSCEIVE, picc_write_buffer, 8, &resp);
 
       if (resp.data != NULL)
       {
@@ -675,7 +1131,7 @@ void rc522_write_picc_data(const uint8_t block_address, uint8_t* data, const uin
       }
     }  // for write_operations
   }
-  else if(picc.type == PICC_SUPPORTED_MIFARE_1K)
+  else if(rc522->picc.type == PICC_SUPPORTED_MIFARE_1K)
   {
     // TODO(michalc): More robust? Not writing entire blocks?
     assert(data_len % 16 == 0);
@@ -688,11 +1144,10 @@ void rc522_write_picc_data(const uint8_t block_address, uint8_t* data, const uin
       memset(picc_write_buffer, 0, 18);
       picc_write_buffer[0] = PICC_CMD_MIFARE_WRITE;
       picc_write_buffer[1] = block_address + i;
-      // Calculate the CRC on the RC522 side.
-      rc522_calculate_crc(picc_write_buffer, 2, &picc_write_buffer[2]);
+      rc522_calculate_crc(rc522, picc_write_buffer, 2, &picc_write_buffer[2]);
 
       // Send the command to PICC.
-      rc522_picc_write(RC522_CMD_TRANSCEIVE, picc_write_buffer, 4, &resp);
+      rc522_picc_write(rc522, RC522_CMD_TRANSCEIVE, picc_write_buffer, 4, &resp);
 
       if (resp.data != NULL)
       {
@@ -712,8 +1167,8 @@ void rc522_write_picc_data(const uint8_t block_address, uint8_t* data, const uin
 
       // We always write 16 data + 2 CRC bytes. No other way to do a write.
       memcpy(picc_write_buffer, data + 16 * i, 16);
-      rc522_calculate_crc(picc_write_buffer, 16, &picc_write_buffer[16]);
-      rc522_picc_write(RC522_CMD_TRANSCEIVE, picc_write_buffer, 18, &resp);
+      rc522_calculate_crc(rc522, picc_write_buffer, 16, &picc_write_buffer[16]);
+      rc522_picc_write(rc522, RC522_CMD_TRANSCEIVE, picc_write_buffer, 18, &resp);
 
       if (resp.data != NULL)
       {
@@ -741,22 +1196,22 @@ void rc522_write_picc_data(const uint8_t block_address, uint8_t* data, const uin
 }
 
 
-void tag_handler(uint8_t* serial_no)
+void tag_handler(rc522_handle_t rc522, uint8_t* serial_no)
 {
-  if (picc.uid_hot)
+  if (rc522->picc.uid_hot)
   {
-    printf("type: 0x%x, %s : ", picc.type, picc.uid_full ? "full" : "not full");
+    printf("type: 0x%x, %s : ", rc522->picc.type, rc522->picc.uid_full ? "full" : "not full");
     for (int i = 0; i < 10; i++)
     {
       printf("%x ", serial_no[i]);
     }
     printf("\n");
-    picc.uid_hot = false;
+    rc522->picc.uid_hot = false;
   }
 }
 
 void
-rc522_authenticate(uint8_t cmd_auth_key_a_or_b,
+rc522_authenticate(rc522_handle_t rc522, uint8_t cmd_auth_key_a_or_b,
                    uint8_t block_address,
                    const uint8_t key[MIFARE_KEY_SIZE])
 {
@@ -774,10 +1229,11 @@ rc522_authenticate(uint8_t cmd_auth_key_a_or_b,
   for (uint8_t i = 0; i < 4; i++)
   {
     // Use the last 4 bytes.
-    picc_cmd_buffer[8 + i] = *((picc.uid + (picc.uid_bits / 8) - 4) + i);
+    picc_cmd_buffer[8 + i] = *((rc522->picc.uid + (rc522->picc.uid_bits / 8) - 4) + i);
   }
 
-  rc522_picc_write(RC522_CMD_MF_AUTH, picc_cmd_buffer, 12, &resp);
+  rc522_set_fwt(rc522, RC522_FWT_AUTH);
+  rc522_picc_write(rc522, RC522_CMD_MF_AUTH, picc_cmd_buffer, 12, &resp);
   // Authentication gets no response.
   assert(resp.data == NULL);
 }
@@ -788,22 +1244,22 @@ rc522_authenticate(uint8_t cmd_auth_key_a_or_b,
  * Currently the actual processing is in the tasks.c.
 static void rc522_timer_callback(void* arg)
 {
-  status_e picc_present = rc522_test_picc_presence();
+  rc522_handle_t rc522 = (rc522_handle_t)arg;
+  status_e picc_present = rc522_test_picc_presence(rc522);
 
   const uint8_t sector = 2;
   static uint8_t block = 4 * sector - 4;
 
   if (picc_present == SUCCESS)
   {
-    // The rc522_anti_collision is a recursive function. It stores the full UID in the global
-    // picc variable.
-    bool status = rc522_anti_collision(1);
+    // The rc522_anti_collision stores the full UID in the picc of the handle.
+    bool status = rc522_anti_collision(rc522);
 
     if (status)
     {
       uint8_t key[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
       // Authenticate sector access.
-      rc522_authenticate(PICC_CMD_MIFARE_AUTH_KEY_A, block, key);
+      rc522_authenticate(rc522, PICC_CMD_MIFARE_AUTH_KEY_A, block, key);
 
       uint8_t data[18] = {
         0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7,
@@ -812,7 +1268,7 @@ static void rc522_timer_callback(void* arg)
 
       {
         printf("READING %d\n", block);
-        rc522_read_picc_data(block, data);
+        rc522_read_picc_data(rc522, block, data);
         printf("BLOCK %d DATA: %x %x %x %x %x %x %x %x %x %x %x %x %x %x %x %x\n", block,
           data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7],
           data[8], data[9], data[10], data[11], data[12], data[13], data[14], data[15]
@@ -823,24 +1279,24 @@ static void rc522_timer_callback(void* arg)
     }
     else
     {
-      memset((void*)&picc, 0, sizeof(picc));
+      memset((void*)&rc522->picc, 0, sizeof(rc522->picc));
       printf("FAILED TO GET A FULL UID...\n");
     }
 
-    rc522_picc_halta(PICC_CMD_HALTA);
+    rc522_picc_halta(rc522, PICC_CMD_HALTA);
     // Clear the MFCrypto1On bit.
-    rc522_clear_bitmask(RC522_REG_STATUS_2, 0x08);
+    rc522_clear_bitmask(rc522, RC522_REG_STATUS_2, 0x08);
   }
 
-  rc522_tag_callback_t cb = (rc522_tag_callback_t) arg;
-  cb(picc.uid);
+  rc522_tag_callback_t cb = tag_handler;
+  cb(rc522, rc522->picc.uid);
 }
 
-esp_err_t rc522_start_scanning()
+esp_err_t rc522_start_scanning(rc522_handle_t rc522)
 {
   const esp_timer_create_args_t timer_args = {
     .callback = &rc522_timer_callback,
-    .arg = (void*)tag_handler,
+    .arg = (void*)rc522,
     .name = "timer_picc_reqa",
   };
 
@@ -14,6 +14,7 @@
 
 #include "rfid_reader.h"
 #include "picc.h"
+#include "iso14443a.h"
 
 #define RC522_REG_COMMAND         0x01
 #define RC522_REG_COM_IRQ_EN_DI   0x02
@@ -28,6 +29,7 @@
 #define RC522_REG_WATER_LEVEL     0x0B
 #define RC522_REG_CONTROL         0x0C
 #define RC522_REG_BIT_FRAMING     0x0D
+#define RC522_REG_COLL            0x0E
 #define RC522_REG_MODE            0x11
 #define RC522_REG_TX_MODE         0x12
 #define RC522_REG_RX_MODE         0x13
@@ -45,6 +47,8 @@
 #define RC522_REG_TIMER_COUNTER_2 0x2F
 #define RC522_REG_FW_VERSION      0x37
 
+#define RC522_FIFO_SIZE          (64)
+
 #define RC522_RF_GAIN_18dB       (010)
 #define RC522_RF_GAIN_23dB       (011)
 #define RC522_RF_GAIN_33dB       (100)
@@ -52,6 +56,13 @@
 #define RC522_RF_GAIN_43dB       (110)
 #define RC522_RF_GAIN_48dB       (111)
 
+/*
+ * A single RC522 reader. Everything the driver knows about the reader (SPI device, scratch memory,
+ * shadow registers, last PICC) lives behind the handle, so several readers can be driven at once,
+ * each from its own task. A handle itself isn't safe to use from two tasks at the same time, use
+ * rc522_lock/rc522_unlock around a session with a PICC.
+ */
+typedef struct rc522_t* rc522_handle_t;
 
 typedef enum {
   RC522_CMD_IDLE          = (0b0000),
@@ -96,36 +107,122 @@ typedef struct response_t {
   uint8_t* data;
   uint32_t size_bytes;
   uint32_t size_bits;
+  // The RC522's CollPos of a collision, 1 for the first bit in the FIFO. 0 without a collision.
+  uint8_t collision_pos;
 } response_t;
 
+/*
+ * PICC commands grouped by how long the PICC might take to respond (frame waiting time).
+ */
+typedef enum {
+  RC522_FWT_REQA,          // REQA and WUPA
+  RC522_FWT_SELECT,        // Anticollision and SELECT
+  RC522_FWT_HALTA,
+  RC522_FWT_GET_VERSION,
+  RC522_FWT_READ,
+  RC522_FWT_AUTH,
+  RC522_FWT_WRITE,
+  RC522_FWT_COUNT
+} rc522_fwt_e;
+
+typedef struct rc522_fwt_stats_t {
+  uint32_t issued;
+  // The PICC didn't respond before the FWT passed.
+  uint32_t timed_out;
+  uint64_t wait_us;
+  uint64_t timed_out_wait_us;
+} rc522_fwt_stats_t;
+
+/*
+ * How the rc522_reselect calls went. The frames and the time are per path, so the two can be
+ * compared.
+ */
+typedef struct rc522_reselect_stats_t {
+  // Selected with the known UID right away.
+  uint32_t fast;
+  uint32_t fast_frames;
+  uint64_t fast_us;
+  // The fast way failed, the full anticollision found the same PICC.
+  uint32_t fallbacks;
+  uint32_t fallback_frames;
+  uint64_t fallback_us;
+  // The PICC wasn't there anymore.
+  uint32_t failed;
+} rc522_reselect_stats_t;
+
+/*
+ * Bus usage counters. Handy for checking how chatty a given PICC operation is.
+ */
+typedef struct rc522_stats_t {
+  uint32_t spi_transactions;
+  // SPI transactions avoided thanks to the shadow copy of the configuration registers.
+  uint32_t shadow_hits;
+  rc522_fwt_stats_t fwt[RC522_FWT_COUNT];
+  rc522_reselect_stats_t reselect;
+} rc522_stats_t;
+
 // A example callback that the user can register.
-void tag_handler(uint8_t* serial_no);
+void tag_handler(rc522_handle_t rc522, uint8_t* serial_no);
+
+esp_err_t rc522_write_n(rc522_handle_t rc522, uint8_t addr, uint8_t data_size, const uint8_t* const data);
+esp_err_t rc522_write(rc522_handle_t rc522, uint8_t addr , uint8_t val);
+uint8_t* rc522_read_n(rc522_handle_t rc522, uint8_t addr, uint8_t n) ;
+uint8_t rc522_read(rc522_handle_t rc522, uint8_t addr);
 
-esp_err_t rc522_write_n(uint8_t addr, uint8_t data_size, const uint8_t* const data);
-esp_err_t rc522_write(uint8_t addr , uint8_t val);
-uint8_t* rc522_read_n(uint8_t addr, uint8_t n) ;
-uint8_t rc522_read(uint8_t addr);
-esp_err_t rc522_clear_bitmask(uint8_t addr, uint8_t mask);
-status_e rc522_picc_halta(uint8_t halta);
-status_e rc522_picc_get_version(void);
+/*
+ * Move n bytes into/out of the RC522's FIFO using a single SPI transaction.
+ * The pointer returned by rc522_read_fifo is valid until the next read of more than 1 byte.
+ */
+esp_err_t rc522_write_fifo(rc522_handle_t rc522, uint8_t data_size, const uint8_t* const data);
+uint8_t* rc522_read_fifo(rc522_handle_t rc522, uint8_t n);
+esp_err_t rc522_clear_bitmask(rc522_handle_t rc522, uint8_t addr, uint8_t mask);
+status_e rc522_picc_halta(rc522_handle_t rc522, uint8_t halta);
+status_e rc522_picc_get_version(rc522_handle_t rc522);
 
 /*
  * EXPOSED BECAUSE OF TESTING!!!
  * This function is for waking up a PICC. It transmits the REQA or WUPA command.
  * If the PICC responds then the anticollision procedure can be performed.
  */
-status_e rc522_picc_reqa_or_wupa(uint8_t reqa_or_wupa);
+status_e rc522_picc_reqa_or_wupa(rc522_handle_t rc522, uint8_t reqa_or_wupa);
 
+#if defined (CONFIG_RC522_WAIT_IRQ)
+/*
+ * ISR for the RC522's IRQ pin. It's meant to be registered with the GPIO ISR service, which
+ * is the periph module's job. The arg is the reader's handle. It wakes up the task waiting in
+ * rc522_irq_wait.
+ */
+void rc522_irq_handler(void* arg);
 
-#define rc522_fw_version() rc522_read(RC522_REG_FW_VERSION)
+/*
+ * EXPOSED BECAUSE OF TESTING!!!
+ * The calling task becomes the one woken up by the IRQ pin. Call it before starting the RC522
+ * command, otherwise the IRQ might come before anyone waits for it. rc522_irq_wait blocks
+ * until the IRQ comes or the timeout passes. Returns true if it was the IRQ.
+ */
+void rc522_irq_arm(rc522_handle_t rc522);
+bool rc522_irq_wait(rc522_handle_t rc522, TickType_t timeout);
+#endif // CONFIG_RC522_WAIT_IRQ
+
+#define rc522_fw_version(rc522) rc522_read((rc522), RC522_REG_FW_VERSION)
 
 
 /*
- * Init the rc522 module. No device communication is performed at this step.
+ * Create a reader on the given SPI device. No device communication is performed at this step.
+ * Each reader needs its own SPI device (chip select).
  *
- * Return ESP_OK if the initialization succeeded, ESP_FAIL if it didn't.
+ * Return ESP_OK if the initialization succeeded and the handle got saved in rc522, ESP_FAIL if
+ * the arguments are wrong, ESP_ERR_NO_MEM if there isn't enough (DMA capable) memory.
+ */
+esp_err_t rc522_init(spi_device_handle_t spi, rc522_handle_t* rc522);
+void rc522_deinit(rc522_handle_t rc522);
+
+/*
+ * Take the reader for a session with a PICC, e.g. REQA -> anticollision -> read -> HALTA.
+ * Return false if the reader is still taken after timeout.
  */
-esp_err_t rc522_init(spi_device_handle_t spi);
+bool rc522_lock(rc522_handle_t rc522, TickType_t timeout);
+void rc522_unlock(rc522_handle_t rc522);
 
 /*
  * Test communication with the RC522 reader. This also turn on the antenna and
@@ -133,7 +230,7 @@ esp_err_t rc522_init(spi_device_handle_t spi);
  *
  * Return true if the communication succeeded.
  */
-bool rc522_say_hello(void);
+bool rc522_say_hello(rc522_handle_t rc522);
 
 /*
  * Send a command to PICC (saved in data buffer). The cmd is usually RC522_CMD_TRANSCEIVE.
@@ -141,44 +238,74 @@ bool rc522_say_hello(void);
  * This function returns both: response's size in bytes and in bits. That's because it's possible
  * to receive a partial byte. It's important during anti collision stage.
  */
-void rc522_picc_write(rc522_commands_e cmd, const uint8_t* const data, const uint8_t data_size, response_t* const response);
+void rc522_picc_write(rc522_handle_t rc522, rc522_commands_e cmd, const uint8_t* const data, const uint8_t data_size, response_t* const response);
 
 /*
  * Sends a PICC_CMD_REQA to move the PICC from IDLE state into Ready 1 state.
  *
  * Return true when PICC responds with ATQA.
  */
-bool rc522_test_picc_presence(void);
+bool rc522_test_picc_presence(rc522_handle_t rc522);
 
 /*
  * Copy the last detected PICC's UID into buf. The UID's size in bytes gets saved
  * in the size argument.
  */
-picc_t rc522_get_last_picc(void);
+picc_t rc522_get_last_picc(rc522_handle_t rc522);
+
+rc522_stats_t rc522_get_stats(rc522_handle_t rc522);
+void rc522_reset_stats(rc522_handle_t rc522);
+void rc522_log_stats(rc522_handle_t rc522);
+
+/*
+ * Set the timeout of the next rc522_picc_write to the frame waiting time of the given command
+ * type. The PICC command functions in this module do it themselves.
+ */
+void rc522_set_fwt(rc522_handle_t rc522, rc522_fwt_e fwt);
 
 /*
- * This function tries to read the entire UID from the PICC. This is way more complicated than
- * one might expect, mostly because of different UID lengths (4, 7, 10 bytes) and a possiblity of
- * receiving partial byte. First be sure to set the PICC into Ready 1 state with the rc522_test_picc_presence().
+ * Read the entire UID from the PICC and select it, see iso14443a_select. All the cascade levels
+ * (4, 7 and 10 byte UIDs) and the collisions between several PICCs are handled, one of the PICCs
+ * gets selected. First be sure to set the PICC into Ready 1 state with the rc522_test_picc_presence().
  *
- * This function is a recursive function which tries to handle all the cascading levels of reading
- * UID into a global variable.
+ * Returns true if a full UID has been read into the handle's last PICC record.
+ */
+bool rc522_anti_collision(rc522_handle_t rc522);
+
+/*
+ * Select the PICC with the given UID again, e.g. after HALTA or after a failed command sent it back
+ * to IDLE. It's WUPA and the SELECTs with the UID (iso14443a_reselect), without the anticollision.
+ * If that doesn't work out it falls back to WUPA and the full anticollision.
  *
- * cascade_level - should be set to 1 when calling explicitly. It will internally call itself with
- *                 increasing cascade_level, to fetch the entire UID.
+ * Return true if that PICC is selected. Only then the handle's last PICC record is updated, a
+ * different PICC found by the fallback doesn't replace it.
+ */
+bool rc522_reselect(rc522_handle_t rc522, const uint8_t* uid, uint8_t uid_size);
+
+/*
+ * Every PICC in the field, see iso14443a_inventory. They are left halted. The handle's last PICC
+ * record is the last one found.
  *
- * Returns true if a full UID has been read.
+ * Return how many PICCs went to piccs.
  */
-bool rc522_anti_collision(uint8_t cascade_level);
+uint8_t rc522_inventory(rc522_handle_t rc522, iso14443a_inventory_e mode, iso14443a_picc_t* piccs,
+                        uint8_t max);
+
+status_e rc522_read_picc_data(rc522_handle_t rc522, uint8_t block_adress, uint8_t buffer[16]);
 
-status_e rc522_read_picc_data(uint8_t block_adress, uint8_t buffer[16]);
-void rc522_write_picc_data(const uint8_t block_address, uint8_t* data, const uint32_t data_len);
+/*
+ * NTAG's FAST_READ: the pages from start_page to end_page (inclusive) in one command. The buffer
+ * gets 4 bytes per page, the response has to fit in the FIFO with its CRC_A.
+ */
+status_e rc522_ntag_fast_read(rc522_handle_t rc522, uint8_t start_page, uint8_t end_page,
+                              uint8_t* buffer);
+void rc522_write_picc_data(rc522_handle_t rc522, const uint8_t block_address, uint8_t* data, const uint32_t data_len);
 
 
 /*
  * Authenticate a sector access. A sector can be protected with a key A or key B.
  * A proper key needs to be used. Default factory key is {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}.
  */
-void rc522_authenticate(uint8_t cmd, uint8_t block_address, const uint8_t key[MIFARE_KEY_SIZE]);
+void rc522_authenticate(rc522_handle_t rc522, uint8_t cmd, uint8_t block_address, const uint8_t key[MIFARE_KEY_SIZE]);
 
 #endif // RC522_H
@@ -4,57 +4,191 @@
 #include "pn532.h"
 
 
-typedef esp_err_t (*rfid_impl_init)(spi_device_handle_t spi);
-typedef bool (*rfid_impl_say_hello)(void);
-typedef bool (*rfid_impl_test_picc_presence)(void);
-typedef bool (*rfid_impl_anti_collision)(uint8_t cascade_level);
+typedef esp_err_t (*rfid_impl_init)(spi_device_handle_t spi, rfid_handle_t* rfid);
+typedef bool (*rfid_impl_say_hello)(rfid_handle_t rfid);
+typedef bool (*rfid_impl_test_picc_presence)(rfid_handle_t rfid);
+typedef bool (*rfid_impl_anti_collision)(rfid_handle_t rfid);
+typedef uint8_t (*rfid_impl_inventory)(rfid_handle_t rfid, iso14443a_inventory_e mode,
+                                       iso14443a_picc_t* piccs, uint8_t max);
+typedef bool (*rfid_impl_lock)(rfid_handle_t rfid, TickType_t timeout);
+typedef void (*rfid_impl_unlock)(rfid_handle_t rfid);
 
 typedef struct rfid_impl_t {
   rfid_impl_init init;
   rfid_impl_say_hello say_hello;
   rfid_impl_test_picc_presence test_picc_presence;
   rfid_impl_anti_collision anti_collision;
+  rfid_impl_inventory inventory;
+  rfid_impl_lock lock;
+  rfid_impl_unlock unlock;
 } rfid_impl_t;
 
 static rfid_impl_t rfid;
 
 
+#if defined (CONFIG_RC522)
+static esp_err_t
+rfid_rc522_init(spi_device_handle_t spi, rfid_handle_t* out)
+{
+  rc522_handle_t rc522 = NULL;
+  esp_err_t ret = rc522_init(spi, &rc522);
+  *out = rc522;
+  return ret;
+}
+
+static bool
+rfid_rc522_say_hello(rfid_handle_t h)
+{
+  return rc522_say_hello((rc522_handle_t)h);
+}
+
+static bool
+rfid_rc522_test_picc_presence(rfid_handle_t h)
+{
+  return rc522_test_picc_presence((rc522_handle_t)h);
+}
+
+static bool
+rfid_rc522_anti_collision(rfid_handle_t h)
+{
+  return rc522_anti_collision((rc522_handle_t)h);
+}
+
+static uint8_t
+rfid_rc522_inventory(rfid_handle_t h, iso14443a_inventory_e mode, iso14443a_picc_t* piccs,
+                     uint8_t max)
+{
+  return rc522_inventory((rc522_handle_t)h, mode, piccs, max);
+}
+
+static bool
+rfid_rc522_lock(rfid_handle_t h, TickType_t timeout)
+{
+  return rc522_lock((rc522_handle_t)h, timeout);
+}
+
+static void
+rfid_rc522_unlock(rfid_handle_t h)
+{
+  rc522_unlock((rc522_handle_t)h);
+}
+#elif defined (CONFIG_PN532)
+// NOTE(michalc): the PN532 driver still keeps its state in globals. There can be only one and
+// the handle is a dummy.
+static esp_err_t
+rfid_pn532_init(spi_device_handle_t spi, rfid_handle_t* out)
+{
+  *out = NULL;
+  return pn532_init(spi);
+}
+
+static bool
+rfid_pn532_say_hello(rfid_handle_t h)
+{
+  (void)h;
+  return pn532_say_hello();
+}
+
+static bool
+rfid_pn532_test_picc_presence(rfid_handle_t h)
+{
+  (void)h;
+  return pn532_test_picc_presence();
+}
+
+static bool
+rfid_pn532_anti_collision(rfid_handle_t h)
+{
+  (void)h;
+  return pn532_anti_collision(1);
+}
+
+static uint8_t
+rfid_pn532_inventory(rfid_handle_t h, iso14443a_inventory_e mode, iso14443a_picc_t* piccs,
+                     uint8_t max)
+{
+  (void)h;
+  // InListPassiveTarget does its own requests.
+  (void)mode;
+  return pn532_inventory(piccs, max);
+}
+
+static bool
+rfid_pn532_lock(rfid_handle_t h, TickType_t timeout)
+{
+  (void)h;
+  (void)timeout;
+  return true;
+}
+
+static void
+rfid_pn532_unlock(rfid_handle_t h)
+{
+  (void)h;
+}
+#endif
+
 void
 rfid_implement(void)
 {
 #if defined (CONFIG_RC522)
-  rfid.init = rc522_init;
-  rfid.say_hello = rc522_say_hello;
-  rfid.test_picc_presence = rc522_test_picc_presence;
-  rfid.anti_collision = rc522_anti_collision;
+  rfid.init = rfid_rc522_init;
+  rfid.say_hello = rfid_rc522_say_hello;
+  rfid.test_picc_presence = rfid_rc522_test_picc_presence;
+  rfid.anti_collision = rfid_rc522_anti_collision;
+  rfid.inventory = rfid_rc522_inventory;
+  rfid.lock = rfid_rc522_lock;
+  rfid.unlock = rfid_rc522_unlock;
 #elif defined (CONFIG_PN532)
-  rfid.init = pn532_init;
-  rfid.say_hello = pn532_say_hello;
-  rfid.test_picc_presence = pn532_test_picc_presence;
-  rfid.anti_collision = pn532_anti_collision;
+  rfid.init = rfid_pn532_init;
+  rfid.say_hello = rfid_pn532_say_hello;
+  rfid.test_picc_presence = rfid_pn532_test_picc_presence;
+  rfid.anti_collision = rfid_pn532_anti_collision;
+  rfid.inventory = rfid_pn532_inventory;
+  rfid.lock = rfid_pn532_lock;
+  rfid.unlock = rfid_pn532_unlock;
 #endif
 }
 
 esp_err_t
-rfid_init(spi_device_handle_t spi)
+rfid_init(spi_device_handle_t spi, rfid_handle_t* h)
 {
-  return rfid.init(spi);
+  return rfid.init(spi, h);
 }
 
 bool
-rfid_say_hello()
+rfid_say_hello(rfid_handle_t h)
 {
-  return rfid.say_hello();
+  return rfid.say_hello(h);
 }
 
 bool
-rfid_test_picc_presence(void)
+rfid_test_picc_presence(rfid_handle_t h)
 {
-  return rfid.test_picc_presence();
+  return rfid.test_picc_presence(h);
 }
 
 bool
-rfid_anti_collision(uint8_t cascade_level)
+rfid_anti_collision(rfid_handle_t h)
+{
+  return rfid.anti_collision(h);
+}
+
+uint8_t
+rfid_inventory(rfid_handle_t h, iso14443a_inventory_e mode, iso14443a_picc_t* piccs,
+               uint8_t max)
+{
+  return rfid.inventory(h, mode, piccs, max);
+}
+
+bool
+rfid_lock(rfid_handle_t h, TickType_t timeout)
+{
+  return rfid.lock(h, timeout);
+}
+
+void
+rfid_unlock(rfid_handle_t h)
 {
-  return rfid.anti_collision(cascade_level);
+  rfid.unlock(h);
 }
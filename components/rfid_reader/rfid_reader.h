@@ -11,33 +11,53 @@
 #define RFID_READER_H
 
 #include "driver/spi_master.h"
+#include "freertos/FreeRTOS.h"
+
+#include "iso14443a.h"
 
 typedef enum {
   FAILURE,
   SUCCESS,
 } status_e;
 
+// One reader. What's behind it depends on the implementation (e.g. rc522_handle_t).
+typedef void* rfid_handle_t;
+
 
 void
 rfid_implement(void);
 
 esp_err_t
-rfid_init(spi_device_handle_t spi);
+rfid_init(spi_device_handle_t spi, rfid_handle_t* rfid);
 
 // Return true if the RFID reader is present.
 bool
-rfid_say_hello(void);
+rfid_say_hello(rfid_handle_t rfid);
 
 // TODO(michalc): not implemented yet
 bool
-rfid_test_picc_presence(void);
+rfid_test_picc_presence(rfid_handle_t rfid);
 
 // TODO(michalc): not implemented yet
 void
 rfid_get_picc_id(void);
 
-// TODO(michalc): not implemented yet
+// Read the UID of a PICC which answered the REQA and select it. Return true if it's selected.
+bool
+rfid_anti_collision(rfid_handle_t rfid);
+
+// Every PICC in the field, e.g. a stack of cards, in one pass. After a detection the mode is
+// ISO14443A_INVENTORY_READY, so the PICCs halted before stay out of it. The PICCs are left halted.
+// The PN532 lists two of them at most. Return how many went to piccs.
+uint8_t
+rfid_inventory(rfid_handle_t rfid, iso14443a_inventory_e mode, iso14443a_picc_t* piccs,
+               uint8_t max);
+
+// Take the reader for a session with a PICC. Return false if it's still taken after timeout.
 bool
-rfid_anti_collision(uint8_t cascade_level);
+rfid_lock(rfid_handle_t rfid, TickType_t timeout);
+
+void
+rfid_unlock(rfid_handle_t rfid);
 
 #endif // RFID_READER_H
@@ -0,0 +1,519 @@
+#include "unity.h"
+
+#include "esp_timer.h"
+
+#include "iso14443a.h"
+#include "picc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// Test vectors from the ISO/IEC 14443-3 Annex B.
+TEST_CASE("iso14443a CRC_A annex B vectors", "[iso14443a]")
+{
+  uint8_t crc[2] = {};
+
+  const uint8_t zeros[] = {0x00, 0x00};
+  iso14443a_crc_a(zeros, sizeof(zeros), crc);
+  TEST_ASSERT_EQUAL_HEX8(0xA0, crc[0]);
+  TEST_ASSERT_EQUAL_HEX8(0x1E, crc[1]);
+
+  const uint8_t data[] = {0x12, 0x34};
+  iso14443a_crc_a(data, sizeof(data), crc);
+  TEST_ASSERT_EQUAL_HEX8(0x26, crc[0]);
+  TEST_ASSERT_EQUAL_HEX8(0xCF, crc[1]);
+}
+
+TEST_CASE("iso14443a CRC_A of PICC commands", "[iso14443a]")
+{
+  uint8_t crc[2] = {};
+
+  // HLTA is the textbook example - 50 00 57 CD.
+  const uint8_t halta[] = {0x50, 0x00};
+  iso14443a_crc_a(halta, sizeof(halta), crc);
+  TEST_ASSERT_EQUAL_HEX8(0x57, crc[0]);
+  TEST_ASSERT_EQUAL_HEX8(0xCD, crc[1]);
+
+  // SELECT CL1 for the UID from the rc522_test_picc_presence comment.
+  const uint8_t select[] = {0x93, 0x70, 0x88, 0x04, 0xF2, 0x52, 0x2C};
+  iso14443a_crc_a(select, sizeof(select), crc);
+  TEST_ASSERT_EQUAL_HEX8(0xA0, crc[0]);
+  TEST_ASSERT_EQUAL_HEX8(0x49, crc[1]);
+}
+
+TEST_CASE("iso14443a CRC_A check", "[iso14443a]")
+{
+  uint8_t frame[] = {0x30, 0x04, 0x26, 0xEE};
+  TEST_ASSERT_TRUE(iso14443a_crc_a_check(frame, sizeof(frame)));
+
+  frame[1] = 0x05;
+  TEST_ASSERT_FALSE(iso14443a_crc_a_check(frame, sizeof(frame)));
+
+  TEST_ASSERT_FALSE(iso14443a_crc_a_check(frame, 2));
+}
+
+// A field of simulated PICCs behind an iso14443a_transceive_t. They follow the ISO 14443-3 state
+// machine closely enough for the anticollision: the bits of all the PICCs which respond get
+// combined and the first one which differs is a collision.
+typedef enum
+{
+  SIM_IDLE,
+  SIM_READY,
+  SIM_ACTIVE,
+  SIM_HALT,
+} sim_state_e;
+
+typedef struct sim_picc_t
+{
+  uint8_t uid[ISO14443A_UID_MAX_SIZE];
+  uint8_t uid_size;
+  sim_state_e state;
+  uint8_t cascade;
+} sim_picc_t;
+
+typedef struct sim_field_t
+{
+  sim_picc_t piccs[32];
+  uint8_t count;
+  uint32_t frames;
+  // The time on air at 106 kbit/s, with the parity bits, the frame delay and the FWT of the
+  // frames nobody answered.
+  uint32_t air_us;
+} sim_field_t;
+
+static void
+sim_add(sim_field_t* field, const uint8_t* uid, uint8_t uid_size)
+{
+  sim_picc_t* picc = &field->piccs[field->count++];
+  memset(picc, 0, sizeof(*picc));
+  memcpy(picc->uid, uid, uid_size);
+  picc->uid_size = uid_size;
+}
+
+// The 4 bytes and the BCC the PICC sends at a cascade level.
+static void
+sim_level(const sim_picc_t* picc, uint8_t cascade, uint8_t out[5])
+{
+  const uint8_t levels = picc->uid_size == 4 ? 1 : (picc->uid_size == 7 ? 2 : 3);
+  if (cascade + 1 < levels)
+  {
+    out[0] = PICC_CASCADE_TAG;
+    memcpy(&out[1], &picc->uid[3 * cascade], 3);
+  }
+  else
+  {
+    memcpy(out, &picc->uid[3 * cascade], 4);
+  }
+  out[4] = out[0] ^ out[1] ^ out[2] ^ out[3];
+}
+
+static uint8_t
+sim_bit(const uint8_t* bytes, uint16_t bit)
+{
+  return (bytes[bit / 8] >> (bit % 8)) & 1U;
+}
+
+// Combine the responders' bits from..to into the frame's rx.
+static iso14443a_result_e
+sim_respond(iso14443a_frame_t* frame, uint8_t responses[][5], uint8_t responders, uint16_t from,
+            uint16_t to)
+{
+  if (responders == 0)
+  {
+    return ISO14443A_TIMEOUT;
+  }
+
+  memset(frame->rx, 0, frame->rx_size);
+  for (uint16_t bit = from; bit < to; bit++)
+  {
+    const uint8_t value = sim_bit(responses[0], bit);
+    for (uint8_t r = 1; r < responders; r++)
+    {
+      if (sim_bit(responses[r], bit) != value)
+      {
+        frame->rx_bits = bit - from;
+        frame->collision_bit = bit - from;
+        return ISO14443A_COLLISION;
+      }
+    }
+    const uint16_t at = frame->rx_align + bit - from;
+    frame->rx[at / 8] |= value << (at % 8);
+  }
+
+  frame->rx_bits = to - from;
+  return ISO14443A_OK;
+}
+
+static iso14443a_result_e
+sim_transceive(void* ctx, iso14443a_frame_t* frame)
+{
+  sim_field_t* field = (sim_field_t*)ctx;
+  const uint8_t command = frame->tx[0];
+  uint8_t responses[32][5];
+  uint8_t responders = 0;
+  iso14443a_result_e result = ISO14443A_TIMEOUT;
+
+  field->frames++;
+  frame->rx_bits = 0;
+
+  if ((command == PICC_CMD_REQA || command == PICC_CMD_WUPA) && frame->tx_bits == 7)
+  {
+    for (uint8_t i = 0; i < field->count; i++)
+    {
+      sim_picc_t* picc = &field->piccs[i];
+      if (picc->state == SIM_IDLE || (picc->state == SIM_HALT && command == PICC_CMD_WUPA))
+      {
+        picc->state = SIM_READY;
+        picc->cascade = 0;
+        // The ATQA's bits 7 and 8 are the UID's size.
+        responses[responders][0] = picc->uid_size == 4 ? 0x04 : (picc->uid_size == 7 ? 0x44 : 0x84);
+        responses[responders++][1] = 0x00;
+      }
+      else if (picc->state != SIM_HALT)
+      {
+        // Not expected in READY or ACTIVE.
+        picc->state = SIM_IDLE;
+      }
+    }
+    result = sim_respond(frame, responses, responders, 0, 16);
+  }
+  else if (command == PICC_CMD_HALTA)
+  {
+    for (uint8_t i = 0; i < field->count; i++)
+    {
+      if (field->piccs[i].state == SIM_ACTIVE)
+      {
+        field->piccs[i].state = SIM_HALT;
+      }
+    }
+  }
+  else if (command == PICC_CMD_SELECT_CL_1 || command == PICC_CMD_SELECT_CL_2 ||
+           command == PICC_CMD_SELECT_CL_3)
+  {
+    const uint8_t cascade = (command - PICC_CMD_SELECT_CL_1) / 2;
+    const uint16_t known = frame->tx_bits - 16;
+    const bool select = frame->tx[1] == 0x70 && frame->tx_bits == 72;
+
+    for (uint8_t i = 0; i < field->count; i++)
+    {
+      sim_picc_t* picc = &field->piccs[i];
+      if (picc->state != SIM_READY || picc->cascade != cascade)
+      {
+        continue;
+      }
+
+      uint8_t level[5];
+      sim_level(picc, cascade, level);
+
+      bool match = true;
+      for (uint16_t bit = 0; bit < (select ? 40 : known); bit++)
+      {
+        match = match && sim_bit(level, bit) == sim_bit(&frame->tx[2], bit);
+      }
+
+      if (!select)
+      {
+        // The ones which don't match stay READY, quietly.
+        if (match)
+        {
+          memcpy(responses[responders++], level, 5);
+        }
+      }
+      else if (match && iso14443a_crc_a_check(frame->tx, 9))
+      {
+        const bool last = cascade + 1 == (picc->uid_size == 4 ? 1 : (picc->uid_size == 7 ? 2 : 3));
+        picc->state = last ? SIM_ACTIVE : SIM_READY;
+        picc->cascade++;
+        responses[responders][0] = last ? 0x08 : ISO14443A_SAK_CASCADE;
+        iso14443a_crc_a(responses[responders], 1, &responses[responders][1]);
+        responders++;
+      }
+      else
+      {
+        picc->state = SIM_IDLE;
+      }
+    }
+
+    if (select)
+    {
+      result = sim_respond(frame, responses, responders, 0, 24);
+    }
+    else
+    {
+      result = sim_respond(frame, responses, responders, known, 40);
+    }
+  }
+
+  const uint32_t bits = frame->tx_bits + frame->rx_bits;
+  field->air_us += bits * 9 / 8 * 944 / 100 + (responders > 0 ? 86 : 1000);
+
+  return result;
+}
+
+static void
+sim_random_uid(uint8_t* uid, uint8_t uid_size)
+{
+  for (uint8_t i = 0; i < uid_size; i++)
+  {
+    uid[i] = rand();
+  }
+  // NXP's UIDs start with the manufacturer, so they share the first byte.
+  if (uid_size != 4)
+  {
+    uid[0] = 0x04;
+  }
+  // Not a cascade tag where one would be expected.
+  if (uid_size == 4 && uid[0] == PICC_CASCADE_TAG)
+  {
+    uid[0] = 0x08;
+  }
+}
+
+static bool
+sim_found(const iso14443a_picc_t* piccs, uint8_t count, const sim_picc_t* picc)
+{
+  uint8_t found = 0;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (piccs[i].uid_size == picc->uid_size &&
+        memcmp(piccs[i].uid, picc->uid, picc->uid_size) == 0)
+    {
+      found++;
+    }
+  }
+  return found == 1;
+}
+
+TEST_CASE("iso14443a select 4, 7 and 10 byte UIDs", "[iso14443a]")
+{
+  const uint8_t uids[3][10] = {
+    {0x5A, 0x17, 0xC3, 0x9E},
+    {0x04, 0xF2, 0x52, 0xB1, 0xEC, 0x02, 0x80},
+    {0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99},
+  };
+  const uint8_t sizes[3] = {4, 7, 10};
+
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    sim_field_t field = {};
+    sim_add(&field, uids[i], sizes[i]);
+
+    iso14443a_picc_t picc = {};
+    TEST_ASSERT_EQUAL(ISO14443A_OK,
+                      iso14443a_request(sim_transceive, &field, PICC_CMD_REQA, picc.atqa));
+    TEST_ASSERT_EQUAL(ISO14443A_OK, iso14443a_select(sim_transceive, &field, &picc));
+    TEST_ASSERT_EQUAL(sizes[i], picc.uid_size);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(uids[i], picc.uid, sizes[i]);
+    TEST_ASSERT_EQUAL_HEX8(0x08, picc.sak);
+    // A request, then an anticollision and a SELECT per cascade level.
+    TEST_ASSERT_EQUAL(1 + 2 * (i + 1), field.frames);
+  }
+}
+
+TEST_CASE("iso14443a select one of colliding PICCs", "[iso14443a]")
+{
+  // The same first cascade level, they differ in the middle of the second one's 2nd byte.
+  const uint8_t a[] = {0x04, 0xF2, 0x52, 0xB1, 0xEC, 0x02, 0x80};
+  const uint8_t b[] = {0x04, 0xF2, 0x52, 0xB1, 0xE4, 0x02, 0x80};
+  sim_field_t field = {};
+  sim_add(&field, a, sizeof(a));
+  sim_add(&field, b, sizeof(b));
+
+  iso14443a_picc_t picc = {};
+  TEST_ASSERT_EQUAL(ISO14443A_OK,
+                    iso14443a_request(sim_transceive, &field, PICC_CMD_REQA, picc.atqa));
+  TEST_ASSERT_EQUAL(ISO14443A_OK, iso14443a_select(sim_transceive, &field, &picc));
+
+  // The collided bit is taken as 1: 0xEC has it, 0xE4 doesn't.
+  TEST_ASSERT_EQUAL(7, picc.uid_size);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(a, picc.uid, sizeof(a));
+  TEST_ASSERT_EQUAL(SIM_ACTIVE, field.piccs[0].state);
+  TEST_ASSERT_EQUAL(SIM_IDLE, field.piccs[1].state);
+}
+
+TEST_CASE("iso14443a inventory", "[iso14443a]")
+{
+  srand(14443);
+
+  const uint8_t sizes[] = {4, 7, 10};
+  sim_field_t field = {};
+  for (uint8_t i = 0; i < 12; i++)
+  {
+    uint8_t uid[ISO14443A_UID_MAX_SIZE];
+    sim_random_uid(uid, sizes[i % 3]);
+    sim_add(&field, uid, sizes[i % 3]);
+  }
+  // Halted before the inventory, the WUPA gets it too.
+  field.piccs[5].state = SIM_HALT;
+
+  iso14443a_picc_t piccs[16] = {};
+  TEST_ASSERT_EQUAL(12, iso14443a_inventory(sim_transceive, &field, ISO14443A_INVENTORY_ALL, piccs, 16));
+  for (uint8_t i = 0; i < field.count; i++)
+  {
+    TEST_ASSERT_TRUE(sim_found(piccs, 12, &field.piccs[i]));
+    TEST_ASSERT_EQUAL(SIM_HALT, field.piccs[i].state);
+  }
+
+  // No more than max.
+  for (uint8_t i = 0; i < field.count; i++)
+  {
+    field.piccs[i].state = SIM_IDLE;
+  }
+  TEST_ASSERT_EQUAL(5, iso14443a_inventory(sim_transceive, &field, ISO14443A_INVENTORY_ALL, piccs, 5));
+
+  // An empty field.
+  sim_field_t empty = {};
+  TEST_ASSERT_EQUAL(0, iso14443a_inventory(sim_transceive, &empty, ISO14443A_INVENTORY_ALL, piccs, 16));
+  TEST_ASSERT_EQUAL(2, empty.frames);
+}
+
+// A card put on a stack which was inventoried before, the detection's REQA got only the new one.
+TEST_CASE("iso14443a inventory after a detection", "[iso14443a]")
+{
+  srand(3);
+
+  sim_field_t field = {};
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    uint8_t uid[7];
+    sim_random_uid(uid, sizeof(uid));
+    sim_add(&field, uid, sizeof(uid));
+  }
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    field.piccs[i].state = SIM_HALT;
+  }
+
+  uint8_t atqa[2];
+  TEST_ASSERT_EQUAL(ISO14443A_OK, iso14443a_request(sim_transceive, &field, PICC_CMD_REQA, atqa));
+  TEST_ASSERT_EQUAL(SIM_READY, field.piccs[3].state);
+
+  // No request before the READY PICC's anticollision: 2 levels of 2 frames, the HLTA and the two
+  // REQAs nobody answered.
+  field.frames = 0;
+  iso14443a_picc_t piccs[4] = {};
+  TEST_ASSERT_EQUAL(1, iso14443a_inventory(sim_transceive, &field, ISO14443A_INVENTORY_READY,
+                                           piccs, 4));
+  TEST_ASSERT_TRUE(sim_found(piccs, 1, &field.piccs[3]));
+  TEST_ASSERT_EQUAL(7, field.frames);
+  for (uint8_t i = 0; i < field.count; i++)
+  {
+    TEST_ASSERT_EQUAL(SIM_HALT, field.piccs[i].state);
+  }
+
+  // Two new ones at once, both READY after the detection.
+  sim_field_t pair = {};
+  for (uint8_t i = 0; i < 2; i++)
+  {
+    uint8_t uid[4];
+    sim_random_uid(uid, sizeof(uid));
+    sim_add(&pair, uid, sizeof(uid));
+  }
+  TEST_ASSERT_NOT_EQUAL(ISO14443A_TIMEOUT,
+                        iso14443a_request(sim_transceive, &pair, PICC_CMD_REQA, atqa));
+  TEST_ASSERT_EQUAL(2, iso14443a_inventory(sim_transceive, &pair, ISO14443A_INVENTORY_READY,
+                                           piccs, 4));
+}
+
+TEST_CASE("iso14443a inventory benchmark", "[iso14443a][benchmark]")
+{
+  srand(1);
+
+  const uint8_t counts[] = {1, 2, 4, 8, 16, 32};
+  for (uint8_t c = 0; c < sizeof(counts); c++)
+  {
+    // NTAG21x, 7 byte UIDs, the usual stack of cards.
+    sim_field_t field = {};
+    for (uint8_t i = 0; i < counts[c]; i++)
+    {
+      uint8_t uid[7];
+      sim_random_uid(uid, sizeof(uid));
+      sim_add(&field, uid, sizeof(uid));
+    }
+
+    iso14443a_picc_t piccs[32];
+    const int64_t start = esp_timer_get_time();
+    const uint8_t found = iso14443a_inventory(sim_transceive, &field, ISO14443A_INVENTORY_ALL, piccs, 32);
+    const int64_t cpu_us = esp_timer_get_time() - start;
+
+    TEST_ASSERT_EQUAL(counts[c], found);
+    printf("%2u tags: %4lu frames, %6lu us on air, %5lld us of CPU\n", counts[c], field.frames,
+           field.air_us, cpu_us);
+  }
+}
+
+TEST_CASE("iso14443a reselect", "[iso14443a]")
+{
+  srand(22);
+
+  // A stack of halted PICCs, each one can be picked out of it.
+  sim_field_t field = {};
+  for (uint8_t i = 0; i < 8; i++)
+  {
+    const uint8_t size = i % 2 ? 7 : 4;
+    uint8_t uid[ISO14443A_UID_MAX_SIZE];
+    sim_random_uid(uid, size);
+    sim_add(&field, uid, size);
+  }
+  iso14443a_picc_t piccs[8] = {};
+  TEST_ASSERT_EQUAL(8, iso14443a_inventory(sim_transceive, &field, ISO14443A_INVENTORY_ALL, piccs, 8));
+
+  for (uint8_t i = 0; i < 8; i++)
+  {
+    field.frames = 0;
+    TEST_ASSERT_EQUAL(ISO14443A_OK, iso14443a_reselect(sim_transceive, &field, &piccs[i]));
+    TEST_ASSERT_EQUAL(piccs[i].uid_size == 4 ? 2 : 3, field.frames);
+    TEST_ASSERT_EQUAL_HEX8(0x08, piccs[i].sak);
+
+    for (uint8_t p = 0; p < field.count; p++)
+    {
+      const bool selected = sim_found(&piccs[i], 1, &field.piccs[p]);
+      TEST_ASSERT_EQUAL(selected ? SIM_ACTIVE : SIM_IDLE, field.piccs[p].state);
+    }
+    iso14443a_halt(sim_transceive, &field);
+  }
+
+  // A PICC which isn't in the field anymore, another one took its place.
+  sim_field_t swapped = {};
+  const uint8_t other[] = {0x04, 0xF2, 0x52, 0xB1, 0xE4, 0x02, 0x80};
+  sim_add(&swapped, other, sizeof(other));
+  iso14443a_picc_t gone = {.uid = {0x04, 0xF2, 0x52, 0xB1, 0xEC, 0x02, 0x80}, .uid_size = 7};
+  TEST_ASSERT_NOT_EQUAL(ISO14443A_OK, iso14443a_reselect(sim_transceive, &swapped, &gone));
+  TEST_ASSERT_EQUAL(SIM_IDLE, swapped.piccs[0].state);
+
+  // Not a UID's size.
+  gone.uid_size = 5;
+  TEST_ASSERT_EQUAL(ISO14443A_ERROR, iso14443a_reselect(sim_transceive, &swapped, &gone));
+}
+
+TEST_CASE("iso14443a reselect benchmark", "[iso14443a][benchmark]")
+{
+  const uint8_t uid[ISO14443A_UID_MAX_SIZE] = {0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+                                               0x88, 0x99};
+  const uint8_t sizes[] = {4, 7, 10};
+
+  for (uint8_t i = 0; i < sizeof(sizes); i++)
+  {
+    sim_field_t field = {};
+    sim_add(&field, uid, sizes[i]);
+    iso14443a_picc_t picc = {};
+
+    // The full way, like after HLTA without a known UID.
+    field.piccs[0].state = SIM_HALT;
+    TEST_ASSERT_EQUAL(ISO14443A_OK,
+                      iso14443a_request(sim_transceive, &field, PICC_CMD_WUPA, picc.atqa));
+    TEST_ASSERT_EQUAL(ISO14443A_OK, iso14443a_select(sim_transceive, &field, &picc));
+    const uint32_t full_frames = field.frames;
+    const uint32_t full_us = field.air_us;
+
+    iso14443a_halt(sim_transceive, &field);
+    field.frames = 0;
+    field.air_us = 0;
+    TEST_ASSERT_EQUAL(ISO14443A_OK, iso14443a_reselect(sim_transceive, &field, &picc));
+    TEST_ASSERT_LESS_THAN(full_frames, field.frames);
+
+    printf("%2u byte UID: anticollision %lu frames %4lu us, reselect %lu frames %4lu us\n",
+           sizes[i], full_frames, full_us, field.frames, field.air_us);
+  }
+}
@@ -88,3 +88,30 @@ TEST_CASE("pn532 firmware version", "[pn532]")
   TEST_ASSERT_EQUAL(true, pn532_read_fw_version());
 }
 
+
+TEST_CASE("pn532 inventory response", "[pn532]")
+{
+  // Two targets: an NTAG213 and a MIFARE Classic 1K.
+  const uint8_t response[] = {0x00, 0x00, 0xFF, 0x18, 0xE8, 0xD5, 0x4B, 0x02,
+                              0x01, 0x00, 0x44, 0x00, 0x07, 0x04, 0xA2, 0x2B, 0x1A, 0xF3, 0x5C, 0x80,
+                              0x02, 0x00, 0x04, 0x08, 0x04, 0x8A, 0x1B, 0x2C, 0x3D,
+                              0x00, 0x00};
+  const uint8_t ntag_uid[] = {0x04, 0xA2, 0x2B, 0x1A, 0xF3, 0x5C, 0x80};
+  const uint8_t mifare_uid[] = {0x8A, 0x1B, 0x2C, 0x3D};
+  iso14443a_picc_t piccs[2] = {};
+
+  TEST_ASSERT_EQUAL(2, _pn532_parse_inlist_response(response, sizeof(response), piccs, 2));
+
+  TEST_ASSERT_EQUAL(7, piccs[0].uid_size);
+  TEST_ASSERT_EQUAL(0, memcmp(piccs[0].uid, ntag_uid, sizeof(ntag_uid)));
+  TEST_ASSERT_EQUAL(0x44, piccs[0].atqa[0]);
+  TEST_ASSERT_EQUAL(0x00, piccs[0].sak);
+
+  TEST_ASSERT_EQUAL(4, piccs[1].uid_size);
+  TEST_ASSERT_EQUAL(0, memcmp(piccs[1].uid, mifare_uid, sizeof(mifare_uid)));
+  TEST_ASSERT_EQUAL(0x08, piccs[1].sak);
+
+  // Only as many as asked for, and none from a frame cut short.
+  TEST_ASSERT_EQUAL(1, _pn532_parse_inlist_response(response, sizeof(response), piccs, 1));
+  TEST_ASSERT_EQUAL(0, _pn532_parse_inlist_response(response, 12, piccs, 2));
+}
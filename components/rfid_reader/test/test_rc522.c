@@ -2,6 +2,7 @@
 
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
+#include "esp_timer.h"
 
 #include "rc522.h"
 #include "periph.h"
@@ -13,41 +14,79 @@ TEST_CASE("rc522 init", "[rc522]")
 { 
   spi_device_handle_t spi = periph_get_spi_handle();
 
-  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi));
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+
+  rc522_deinit(rc522);
 }
 
 TEST_CASE("rc522 init NULL", "[rc522]")
 {
-  TEST_ASSERT_EQUAL(ESP_FAIL, rc522_init(NULL));
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_FAIL, rc522_init(NULL, &rc522));
+  TEST_ASSERT_NULL(rc522);
 }
 
 TEST_CASE("rc522 hello", "[rc522]")
 {
   spi_device_handle_t spi = periph_get_spi_handle();
 
-  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi));
-  TEST_ASSERT_EQUAL(true, rc522_say_hello());
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(true, rc522_say_hello(rc522));
+
+  rc522_deinit(rc522);
+}
+
+// Run it without a PICC in the field. That's what the idle scanning does all the time.
+TEST_CASE("rc522 REQA timeout without PICC", "[rc522]")
+{
+  spi_device_handle_t spi = periph_get_spi_handle();
+
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(true, rc522_say_hello(rc522));
+
+  const uint32_t rounds = 32;
+
+  rc522_reset_stats(rc522);
+  for (uint32_t i = 0; i < rounds; i++)
+  {
+    TEST_ASSERT_EQUAL(FAILURE, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_REQA));
+  }
+  rc522_log_stats(rc522);
+
+  const rc522_fwt_stats_t reqa = rc522_get_stats(rc522).fwt[RC522_FWT_REQA];
+  TEST_ASSERT_EQUAL(rounds, reqa.timed_out);
+  // 1 ms FWT plus the SPI transactions around it.
+  TEST_ASSERT_LESS_THAN(rounds * 5000, reqa.timed_out_wait_us);
+
+  rc522_deinit(rc522);
 }
 
 TEST_CASE("rc522 picc presence", "[rc522][picc_present]")
 {
   spi_device_handle_t spi = periph_get_spi_handle();
 
-  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi));
-  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(PICC_CMD_WUPA));
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_WUPA));
+
+  rc522_picc_halta(rc522, PICC_CMD_HALTA);
 
-  rc522_picc_halta(PICC_CMD_HALTA);
+  rc522_deinit(rc522);
 }
 
 TEST_CASE("rc522 anti collision", "[rc522][picc_present]")
 {
   spi_device_handle_t spi = periph_get_spi_handle();
 
-  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi));
-  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(PICC_CMD_WUPA));
-  TEST_ASSERT_EQUAL(true, rc522_anti_collision(1));
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_WUPA));
+  TEST_ASSERT_EQUAL(true, rc522_anti_collision(rc522));
 
-  picc_t picc = rc522_get_last_picc();
+  picc_t picc = rc522_get_last_picc(rc522);
   printf("Detected PICC with UID: ");
   for (int i = 0; i < (picc.uid_bits / 8); i++)
   {
@@ -55,20 +94,85 @@ TEST_CASE("rc522 anti collision", "[rc522][picc_present]")
   }
   printf("\n");
 
-  rc522_picc_halta(PICC_CMD_HALTA);
+  rc522_picc_halta(rc522, PICC_CMD_HALTA);
+
+  rc522_deinit(rc522);
+}
+
+// Put a stack of PICCs on the reader.
+TEST_CASE("rc522 inventory", "[rc522][picc_present]")
+{
+  spi_device_handle_t spi = periph_get_spi_handle();
+
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(true, rc522_say_hello(rc522));
+
+  iso14443a_picc_t piccs[8];
+  rc522_reset_stats(rc522);
+  const int64_t start = esp_timer_get_time();
+  const uint8_t count = rc522_inventory(rc522, ISO14443A_INVENTORY_ALL, piccs, 8);
+  const int64_t elapsed_us = esp_timer_get_time() - start;
+  TEST_ASSERT_GREATER_THAN(0, count);
+
+  printf("%u PICCs in %lld us, %lu SPI transactions\n", count, elapsed_us,
+         rc522_get_stats(rc522).spi_transactions);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    printf("  SAK %02x UID ", piccs[i].sak);
+    for (uint8_t b = 0; b < piccs[i].uid_size; b++)
+    {
+      printf("%02x ", piccs[i].uid[b]);
+    }
+    printf("\n");
+  }
+  rc522_log_stats(rc522);
+
+  rc522_deinit(rc522);
+}
+
+TEST_CASE("rc522 reselect", "[rc522][picc_present]")
+{
+  spi_device_handle_t spi = periph_get_spi_handle();
+
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(true, rc522_say_hello(rc522));
+
+  iso14443a_picc_t piccs[8];
+  const uint8_t count = rc522_inventory(rc522, ISO14443A_INVENTORY_ALL, piccs, 8);
+  TEST_ASSERT_GREATER_THAN(0, count);
+
+  // The inventory left them all halted, each one is picked straight out of the field.
+  rc522_reset_stats(rc522);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    TEST_ASSERT_EQUAL(true, rc522_reselect(rc522, piccs[i].uid, piccs[i].uid_size));
+    rc522_picc_halta(rc522, PICC_CMD_HALTA);
+  }
+  TEST_ASSERT_EQUAL(count, rc522_get_stats(rc522).reselect.fast);
+
+  // Not in the field, after the fast path and the full anticollision.
+  const uint8_t missing[4] = {0x01, 0x02, 0x03, 0x04};
+  TEST_ASSERT_EQUAL(false, rc522_reselect(rc522, missing, sizeof(missing)));
+  TEST_ASSERT_EQUAL(1, rc522_get_stats(rc522).reselect.failed);
+  rc522_log_stats(rc522);
+
+  rc522_deinit(rc522);
 }
 
 TEST_CASE("rc522 try GET VERSION command", "[rc522][picc_present]")
 {
   spi_device_handle_t spi = periph_get_spi_handle();
 
-  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi));
-  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(PICC_CMD_WUPA));
-  TEST_ASSERT_EQUAL(true, rc522_anti_collision(1));
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_WUPA));
+  TEST_ASSERT_EQUAL(true, rc522_anti_collision(rc522));
 
-  TEST_ASSERT_EQUAL(SUCCESS, rc522_picc_get_version());
+  TEST_ASSERT_EQUAL(SUCCESS, rc522_picc_get_version(rc522));
 
-  picc_t picc = rc522_get_last_picc();
+  picc_t picc = rc522_get_last_picc(rc522);
 
   printf("Detected PICC with UID: ");
   for (int i = 0; i < (picc.uid_bits / 8); i++)
@@ -86,18 +190,21 @@ TEST_CASE("rc522 try GET VERSION command", "[rc522][picc_present]")
   printf("  %-24s : 0x%02x\n", "storage_size", picc.ver.storage_size);
   printf("  %-24s : 0x%02x\n", "protocol_type", picc.ver.protocol_type);
 
-  rc522_picc_halta(PICC_CMD_HALTA);
+  rc522_picc_halta(rc522, PICC_CMD_HALTA);
+
+  rc522_deinit(rc522);
 }
 
 TEST_CASE("rc522 read NTAG213 data", "[rc522][picc_present]")
 {
   spi_device_handle_t spi = periph_get_spi_handle();
 
-  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi));
-  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(PICC_CMD_WUPA));
-  TEST_ASSERT_EQUAL(true, rc522_anti_collision(1));
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_WUPA));
+  TEST_ASSERT_EQUAL(true, rc522_anti_collision(rc522));
 
-  TEST_ASSERT_EQUAL(SUCCESS, rc522_picc_get_version());
+  TEST_ASSERT_EQUAL(SUCCESS, rc522_picc_get_version(rc522));
 
   // 0x2C + 4 is the entire space of the NTAG213.
   for (uint32_t i = 0; i < 0x2C; i += 4)
@@ -105,7 +212,7 @@ TEST_CASE("rc522 read NTAG213 data", "[rc522][picc_present]")
     uint8_t picc_data[16] = {};
     const uint8_t page = i;
 
-    rc522_read_picc_data(page, picc_data);
+    rc522_read_picc_data(rc522, page, picc_data);
 
     printf("%02d: ", i);
     for (uint8_t j = 0; j < 16; j++)
@@ -115,18 +222,21 @@ TEST_CASE("rc522 read NTAG213 data", "[rc522][picc_present]")
     printf("\n");
   }
 
-  rc522_picc_halta(PICC_CMD_HALTA);
+  rc522_picc_halta(rc522, PICC_CMD_HALTA);
+
+  rc522_deinit(rc522);
 }
 
 TEST_CASE("rc522 write NTAG213 data", "[rc522][picc_present]")
 {
   spi_device_handle_t spi = periph_get_spi_handle();
 
-  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi));
-  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(PICC_CMD_WUPA));
-  TEST_ASSERT_EQUAL(true, rc522_anti_collision(1));
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_WUPA));
+  TEST_ASSERT_EQUAL(true, rc522_anti_collision(rc522));
 
-  TEST_ASSERT_EQUAL(SUCCESS, rc522_picc_get_version());
+  TEST_ASSERT_EQUAL(SUCCESS, rc522_picc_get_version(rc522));
 
   const uint8_t page = 16;
 
@@ -134,12 +244,12 @@ TEST_CASE("rc522 write NTAG213 data", "[rc522][picc_present]")
   // Example data (32_bytes; the hex ID is 22 bytes): "sp_song...7LPRP2wOvP4DAMFBdf4uDZ"
   uint8_t write_picc_data[32] = "sp_song...7LPRP2wOvP4DAMFBdf4uDZ";
 
-  rc522_write_picc_data(page, write_picc_data, 32);
+  rc522_write_picc_data(rc522, page, write_picc_data, 32);
 
   // Read data back. No need to reactivate the NTAG.
   uint8_t read_picc_data[32] = {};
 
-  rc522_read_picc_data(page, read_picc_data);
+  rc522_read_picc_data(rc522, page, read_picc_data);
   printf("%02d: ", page);
   for (uint8_t i = 0; i < 16; i++)
   {
@@ -147,7 +257,7 @@ TEST_CASE("rc522 write NTAG213 data", "[rc522][picc_present]")
   }
   printf("\n");
 
-  rc522_read_picc_data(page + 4, read_picc_data + 16);
+  rc522_read_picc_data(rc522, page + 4, read_picc_data + 16);
   printf("%02d: ", page + 4);
   for (uint8_t i = 0; i < 16; i++)
   {
@@ -155,19 +265,22 @@ TEST_CASE("rc522 write NTAG213 data", "[rc522][picc_present]")
   }
   printf("\n");
 
-  rc522_picc_halta(PICC_CMD_HALTA);
+  rc522_picc_halta(rc522, PICC_CMD_HALTA);
 
   if (0 != memcmp(read_picc_data, write_picc_data, 32))
   {
     TEST_FAIL_MESSAGE("Data read back from the PICC isn't correct!");
   }
+
+  rc522_deinit(rc522);
 }
 
 TEST_CASE("rc522 read PICC's data", "[rc522][picc_present]")
 {
   spi_device_handle_t spi = periph_get_spi_handle();
 
-  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi));
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
 
   uint8_t picc_data[16] = {};
   const uint8_t key[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
@@ -176,12 +289,12 @@ TEST_CASE("rc522 read PICC's data", "[rc522][picc_present]")
   {
     {
       uint8_t block = 0 + sector * 4;
-      TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(PICC_CMD_WUPA));
-      TEST_ASSERT_EQUAL(true, rc522_anti_collision(1));
+      TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_WUPA));
+      TEST_ASSERT_EQUAL(true, rc522_anti_collision(rc522));
 
-      rc522_authenticate(PICC_CMD_MIFARE_AUTH_KEY_A, block, key);
+      rc522_authenticate(rc522, PICC_CMD_MIFARE_AUTH_KEY_A, block, key);
 
-      rc522_read_picc_data(block, picc_data);
+      rc522_read_picc_data(rc522, block, picc_data);
       printf("%02d: ", block);
       for (uint8_t i = 0; i < 16; i++)
       {
@@ -189,18 +302,18 @@ TEST_CASE("rc522 read PICC's data", "[rc522][picc_present]")
       }
       printf("\n");
 
-      rc522_picc_halta(PICC_CMD_HALTA);
+      rc522_picc_halta(rc522, PICC_CMD_HALTA);
       // Clear the MFCrypto1On bit.
-      rc522_clear_bitmask(RC522_REG_STATUS_2, 0x08);
+      rc522_clear_bitmask(rc522, RC522_REG_STATUS_2, 0x08);
     }
     {
       uint8_t block = 1 + sector * 4;
-      TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(PICC_CMD_WUPA));
-      TEST_ASSERT_EQUAL(true, rc522_anti_collision(1));
+      TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_WUPA));
+      TEST_ASSERT_EQUAL(true, rc522_anti_collision(rc522));
 
-      rc522_authenticate(PICC_CMD_MIFARE_AUTH_KEY_A, block, key);
+      rc522_authenticate(rc522, PICC_CMD_MIFARE_AUTH_KEY_A, block, key);
 
-      rc522_read_picc_data(block, picc_data);
+      rc522_read_picc_data(rc522, block, picc_data);
       printf("%02d: ", block);
       for (uint8_t i = 0; i < 16; i++)
       {
@@ -208,18 +321,18 @@ TEST_CASE("rc522 read PICC's data", "[rc522][picc_present]")
       }
       printf("\n");
 
-      rc522_picc_halta(PICC_CMD_HALTA);
+      rc522_picc_halta(rc522, PICC_CMD_HALTA);
       // Clear the MFCrypto1On bit.
-      rc522_clear_bitmask(RC522_REG_STATUS_2, 0x08);
+      rc522_clear_bitmask(rc522, RC522_REG_STATUS_2, 0x08);
     }
     {
       uint8_t block = 2 + sector * 4;
-      TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(PICC_CMD_WUPA));
-      TEST_ASSERT_EQUAL(true, rc522_anti_collision(1));
+      TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_WUPA));
+      TEST_ASSERT_EQUAL(true, rc522_anti_collision(rc522));
 
-      rc522_authenticate(PICC_CMD_MIFARE_AUTH_KEY_A, block, key);
+      rc522_authenticate(rc522, PICC_CMD_MIFARE_AUTH_KEY_A, block, key);
 
-      rc522_read_picc_data(block, picc_data);
+      rc522_read_picc_data(rc522, block, picc_data);
       printf("%02d: ", block);
       for (uint8_t i = 0; i < 16; i++)
       {
@@ -227,18 +340,18 @@ TEST_CASE("rc522 read PICC's data", "[rc522][picc_present]")
       }
       printf("\n");
 
-      rc522_picc_halta(PICC_CMD_HALTA);
+      rc522_picc_halta(rc522, PICC_CMD_HALTA);
       // Clear the MFCrypto1On bit.
-      rc522_clear_bitmask(RC522_REG_STATUS_2, 0x08);
+      rc522_clear_bitmask(rc522, RC522_REG_STATUS_2, 0x08);
     }
     {
       uint8_t block = 3 + sector * 4;
-      TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(PICC_CMD_WUPA));
-      TEST_ASSERT_EQUAL(true, rc522_anti_collision(1));
+      TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_WUPA));
+      TEST_ASSERT_EQUAL(true, rc522_anti_collision(rc522));
 
-      rc522_authenticate(PICC_CMD_MIFARE_AUTH_KEY_A, block, key);
+      rc522_authenticate(rc522, PICC_CMD_MIFARE_AUTH_KEY_A, block, key);
 
-      rc522_read_picc_data(block, picc_data);
+      rc522_read_picc_data(rc522, block, picc_data);
       printf("%02d: ", block);
       for (uint8_t i = 0; i < 16; i++)
       {
@@ -246,9 +359,186 @@ TEST_CASE("rc522 read PICC's data", "[rc522][picc_present]")
       }
       printf("\n");
 
-      rc522_picc_halta(PICC_CMD_HALTA);
+      rc522_picc_halta(rc522, PICC_CMD_HALTA);
       // Clear the MFCrypto1On bit.
-      rc522_clear_bitmask(RC522_REG_STATUS_2, 0x08);
+      rc522_clear_bitmask(rc522, RC522_REG_STATUS_2, 0x08);
     }
   }
+
+  rc522_deinit(rc522);
+}
+
+TEST_CASE("rc522 SPI transactions per 32 byte read", "[rc522][picc_present]")
+{
+  spi_device_handle_t spi = periph_get_spi_handle();
+
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_WUPA));
+  TEST_ASSERT_EQUAL(true, rc522_anti_collision(rc522));
+
+  const uint8_t page = 16;
+  uint8_t picc_data[32] = {};
+
+  // Two READ commands - each returns 16 bytes (4 NTAG pages or 1 MIFARE block).
+  rc522_reset_stats(rc522);
+  TEST_ASSERT_EQUAL(SUCCESS, rc522_read_picc_data(rc522, page, picc_data));
+  TEST_ASSERT_EQUAL(SUCCESS, rc522_read_picc_data(rc522, page + 4, picc_data + 16));
+  rc522_stats_t stats = rc522_get_stats(rc522);
+
+  printf("SPI transactions for 32 bytes: %lu\n", stats.spi_transactions);
+
+  rc522_picc_halta(rc522, PICC_CMD_HALTA);
+
+  rc522_deinit(rc522);
+}
+
+TEST_CASE("rc522 read PICC data cost", "[rc522][picc_present]")
+{
+  spi_device_handle_t spi = periph_get_spi_handle();
+
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_WUPA));
+  TEST_ASSERT_EQUAL(true, rc522_anti_collision(rc522));
+
+  const uint32_t reads = 16;
+  uint8_t picc_data[16] = {};
+
+  rc522_reset_stats(rc522);
+  const int64_t start = esp_timer_get_time();
+  for (uint32_t i = 0; i < reads; i++)
+  {
+    TEST_ASSERT_EQUAL(SUCCESS, rc522_read_picc_data(rc522, 4, picc_data));
+  }
+  const int64_t elapsed = esp_timer_get_time() - start;
+  rc522_stats_t stats = rc522_get_stats(rc522);
+
+  printf("rc522_read_picc_data: %lu SPI transactions, %lld us\n",
+         stats.spi_transactions / reads, elapsed / reads);
+
+  rc522_picc_halta(rc522, PICC_CMD_HALTA);
+
+  rc522_deinit(rc522);
+}
+
+TEST_CASE("rc522 SPI transactions per REQA, anticollision, read session", "[rc522][picc_present]")
+{
+  spi_device_handle_t spi = periph_get_spi_handle();
+
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(true, rc522_say_hello(rc522));
+
+  uint8_t picc_data[16] = {};
+
+  rc522_reset_stats(rc522);
+  TEST_ASSERT_EQUAL(true, rc522_picc_reqa_or_wupa(rc522, PICC_CMD_WUPA));
+  TEST_ASSERT_EQUAL(true, rc522_anti_collision(rc522));
+  TEST_ASSERT_EQUAL(SUCCESS, rc522_read_picc_data(rc522, 4, picc_data));
+  rc522_stats_t stats = rc522_get_stats(rc522);
+
+  printf("Session: %lu SPI transactions, %lu avoided by the shadow registers\n",
+         stats.spi_transactions, stats.shadow_hits);
+
+  rc522_picc_halta(rc522, PICC_CMD_HALTA);
+
+  rc522_deinit(rc522);
+}
+
+// Two handles on the same RC522. Whatever one of them does doesn't show up in the other one.
+TEST_CASE("rc522 handles don't share state", "[rc522]")
+{
+  spi_device_handle_t spi = periph_get_spi_handle();
+
+  rc522_handle_t a = NULL;
+  rc522_handle_t b = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &a));
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &b));
+  TEST_ASSERT_NOT_EQUAL(a, b);
+
+  TEST_ASSERT_EQUAL(true, rc522_say_hello(a));
+  rc522_reset_stats(a);
+  rc522_reset_stats(b);
+
+  TEST_ASSERT_EQUAL(FAILURE, rc522_picc_reqa_or_wupa(a, PICC_CMD_REQA));
+  TEST_ASSERT_NOT_EQUAL(0, rc522_get_stats(a).spi_transactions);
+  TEST_ASSERT_EQUAL(0, rc522_get_stats(b).spi_transactions);
+
+  // A session on a blocks it for everyone else.
+  TEST_ASSERT_EQUAL(true, rc522_lock(a, 0));
+  TEST_ASSERT_EQUAL(false, rc522_lock(a, 0));
+  TEST_ASSERT_EQUAL(true, rc522_lock(b, 0));
+  rc522_unlock(b);
+  rc522_unlock(a);
+
+  rc522_deinit(a);
+  rc522_deinit(b);
+}
+
+#if defined (CONFIG_RC522_WAIT_IRQ)
+static int64_t irq_line_pulled_at = 0;
+
+static void
+simulate_irq_line(void* arg)
+{
+  (void)arg;
+  irq_line_pulled_at = esp_timer_get_time();
+  gpio_set_level(CONFIG_RC522_IRQ_PIN, 0);
+}
+
+// Simulates the RC522 pulling its IRQ line. The pin is switched to input/output so driving it
+// triggers the GPIO ISR attached through the periph module. No RC522 needed.
+TEST_CASE("rc522 IRQ line wakeup latency", "[rc522]")
+{
+  spi_device_handle_t spi = periph_get_spi_handle();
+
+  rc522_handle_t rc522 = NULL;
+  TEST_ASSERT_EQUAL(ESP_OK, rc522_init(spi, &rc522));
+  TEST_ASSERT_EQUAL(ESP_OK, periph_attach_irq(CONFIG_RC522_IRQ_PIN, rc522_irq_handler, rc522));
+
+  esp_timer_handle_t timer;
+  const esp_timer_create_args_t timer_args = {
+    .callback = &simulate_irq_line,
+    .name = "simulate_irq_line",
+  };
+  TEST_ASSERT_EQUAL(ESP_OK, esp_timer_create(&timer_args, &timer));
+  TEST_ASSERT_EQUAL(ESP_OK, gpio_set_direction(CONFIG_RC522_IRQ_PIN, GPIO_MODE_INPUT_OUTPUT));
+
+  const uint32_t rounds = 50;
+  int64_t latency_max = 0;
+  int64_t latency_sum = 0;
+
+  rc522_reset_stats(rc522);
+  for (uint32_t i = 0; i < rounds; i++)
+  {
+    gpio_set_level(CONFIG_RC522_IRQ_PIN, 1);
+
+    rc522_irq_arm(rc522);
+    esp_timer_start_once(timer, 2000);
+    TEST_ASSERT_EQUAL(true, rc522_irq_wait(rc522, pdMS_TO_TICKS(100)));
+
+    const int64_t latency = esp_timer_get_time() - irq_line_pulled_at;
+    latency_sum += latency;
+    if (latency > latency_max)
+    {
+      latency_max = latency;
+    }
+  }
+
+  // Nothing pulls the line now - the wait has to time out.
+  gpio_set_level(CONFIG_RC522_IRQ_PIN, 1);
+  rc522_irq_arm(rc522);
+  TEST_ASSERT_EQUAL(false, rc522_irq_wait(rc522, 2));
+
+  printf("IRQ wakeup latency: avg %lld us, max %lld us\n", latency_sum / rounds, latency_max);
+
+  // Waiting must not touch the bus.
+  TEST_ASSERT_EQUAL(0, rc522_get_stats(rc522).spi_transactions);
+  TEST_ASSERT_LESS_THAN(1000, latency_max);
+
+  esp_timer_delete(timer);
+  gpio_set_direction(CONFIG_RC522_IRQ_PIN, GPIO_MODE_INPUT);
+  rc522_deinit(rc522);
 }
+#endif // CONFIG_RC522_WAIT_IRQ
@@ -0,0 +1,549 @@
+#include "json_stream.h"
+
+#include <string.h>
+
+typedef enum {
+  JS_VALUE,
+  // Right after '[', so the array might be empty.
+  JS_VALUE_OR_END,
+  // Right after '{', so the object might be empty.
+  JS_KEY_OR_END,
+  JS_KEY,
+  JS_KEY_STRING,
+  JS_COLON,
+  JS_STRING,
+  JS_LITERAL,
+  JS_AFTER_VALUE,
+  JS_DONE,
+} json_stream_state_e;
+
+static inline bool json_stream_is_ws(const char c)
+{
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static inline bool json_stream_is_literal_char(const char c)
+{
+  // Literals aren't validated beyond their characters. A "tru" passes as a literal.
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-' || c == '+' || c == '.' ||
+         c == 'E';
+}
+
+static int8_t json_stream_hex(const char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/*
+ * Match the path of the value about to be parsed, which is the keys and indices on the stack,
+ * against a field's path.
+ */
+static bool json_stream_path_matches(const json_stream_t* js, const char* path, uint32_t* index)
+{
+  const char* p = path;
+  bool wildcard_seen = false;
+  *index = 0;
+
+  for (uint8_t i = 0; i < js->depth; i++)
+  {
+    const json_stream_level_t* level = &js->levels[i];
+
+    if (level->is_array)
+    {
+      if (*p++ != '[')
+      {
+        return false;
+      }
+
+      if (*p == '*')
+      {
+        p++;
+        if (!wildcard_seen)
+        {
+          *index = level->index;
+          wildcard_seen = true;
+        }
+      }
+      else
+      {
+        if (*p < '0' || *p > '9')
+        {
+          return false;
+        }
+
+        uint32_t n = 0;
+        while (*p >= '0' && *p <= '9')
+        {
+          n = n * 10 + (*p++ - '0');
+        }
+
+        if (n != level->index)
+        {
+          return false;
+        }
+      }
+
+      if (*p++ != ']')
+      {
+        return false;
+      }
+    }
+    else
+    {
+      // Every member but the root's follows a dot.
+      if (i > 0 && *p++ != '.')
+      {
+        return false;
+      }
+
+      const size_t key_length = strcspn(p, ".[");
+      if (level->key_truncated || key_length != level->key_length ||
+          memcmp(p, level->key, key_length) != 0)
+      {
+        return false;
+      }
+      p += key_length;
+    }
+  }
+
+  return *p == '\0';
+}
+
+static void json_stream_value_begin(json_stream_t* js, const bool is_literal)
+{
+  js->field = -1;
+  js->length = 0;
+  js->is_literal = is_literal;
+
+  for (uint8_t i = 0; i < js->fields_count; i++)
+  {
+    uint32_t index = 0;
+    if (json_stream_path_matches(js, js->fields[i].path, &index))
+    {
+      js->field = i;
+      js->index = index;
+      break;
+    }
+  }
+}
+
+static void json_stream_value_end(json_stream_t* js)
+{
+  if (js->field < 0)
+  {
+    return;
+  }
+
+  json_stream_field_t* field = &js->fields[js->field];
+
+  // Strings going to a buffer are already there.
+  if (!js->is_literal && field->dest != NULL)
+  {
+    field->dest[js->length] = '\0';
+    field->matches++;
+    return;
+  }
+
+  js->value[js->length] = '\0';
+
+  if (js->is_literal && strcmp(js->value, "null") == 0)
+  {
+    return;
+  }
+
+  if (field->dest != NULL)
+  {
+    const size_t length = js->length < field->dest_size ? js->length : field->dest_size - 1;
+    memcpy(field->dest, js->value, length);
+    field->dest[length] = '\0';
+  }
+  else if (field->on_value != NULL)
+  {
+    field->on_value(field->user_data, js->index, js->value, js->length);
+  }
+
+  field->matches++;
+}
+
+/*
+ * Append a byte of a key or a value. What doesn't fit is dropped.
+ */
+static void json_stream_put(json_stream_t* js, const char c)
+{
+  if (js->state == JS_KEY_STRING)
+  {
+    json_stream_level_t* level = &js->levels[js->depth - 1];
+    if (level->key_length < JSON_STREAM_KEY_MAX)
+    {
+      level->key[level->key_length++] = c;
+    }
+    else
+    {
+      level->key_truncated = true;
+    }
+    return;
+  }
+
+  if (js->field < 0)
+  {
+    return;
+  }
+
+  const json_stream_field_t* field = &js->fields[js->field];
+  if (!js->is_literal && field->dest != NULL)
+  {
+    if (js->length + 1 < field->dest_size)
+    {
+      field->dest[js->length++] = c;
+    }
+  }
+  else if (js->length + 1 < JSON_STREAM_VALUE_MAX)
+  {
+    js->value[js->length++] = c;
+  }
+}
+
+static void json_stream_put_utf8(json_stream_t* js, const uint32_t code_point)
+{
+  if (code_point < 0x80)
+  {
+    json_stream_put(js, code_point);
+  }
+  else if (code_point < 0x800)
+  {
+    json_stream_put(js, 0xC0 | (code_point >> 6));
+    json_stream_put(js, 0x80 | (code_point & 0x3F));
+  }
+  else if (code_point < 0x10000)
+  {
+    json_stream_put(js, 0xE0 | (code_point >> 12));
+    json_stream_put(js, 0x80 | ((code_point >> 6) & 0x3F));
+    json_stream_put(js, 0x80 | (code_point & 0x3F));
+  }
+  else
+  {
+    json_stream_put(js, 0xF0 | (code_point >> 18));
+    json_stream_put(js, 0x80 | ((code_point >> 12) & 0x3F));
+    json_stream_put(js, 0x80 | ((code_point >> 6) & 0x3F));
+    json_stream_put(js, 0x80 | (code_point & 0x3F));
+  }
+}
+
+/*
+ * A high surrogate which didn't get its low surrogate becomes the replacement character.
+ */
+static void json_stream_flush_surrogate(json_stream_t* js)
+{
+  if (js->high_surrogate != 0)
+  {
+    js->high_surrogate = 0;
+    json_stream_put_utf8(js, 0xFFFD);
+  }
+}
+
+static void json_stream_put_code_unit(json_stream_t* js, const uint16_t code_unit)
+{
+  if (code_unit >= 0xD800 && code_unit <= 0xDBFF)
+  {
+    json_stream_flush_surrogate(js);
+    js->high_surrogate = code_unit;
+  }
+  else if (code_unit >= 0xDC00 && code_unit <= 0xDFFF)
+  {
+    if (js->high_surrogate != 0)
+    {
+      const uint32_t code_point =
+        0x10000 + (((uint32_t)js->high_surrogate - 0xD800) << 10) + (code_unit - 0xDC00);
+      js->high_surrogate = 0;
+      json_stream_put_utf8(js, code_point);
+    }
+    else
+    {
+      json_stream_put_utf8(js, 0xFFFD);
+    }
+  }
+  else
+  {
+    json_stream_flush_surrogate(js);
+    json_stream_put_utf8(js, code_unit);
+  }
+}
+
+static void json_stream_push(json_stream_t* js, const bool is_array)
+{
+  if (js->depth == JSON_STREAM_MAX_DEPTH)
+  {
+    js->error = true;
+    return;
+  }
+
+  json_stream_level_t* level = &js->levels[js->depth++];
+  level->is_array = is_array;
+  level->index = 0;
+  level->key_length = 0;
+  level->key_truncated = false;
+}
+
+static void json_stream_after_value(json_stream_t* js)
+{
+  js->state = js->depth == 0 ? JS_DONE : JS_AFTER_VALUE;
+}
+
+static void json_stream_string_char(json_stream_t* js, const char c)
+{
+  if (js->escape == -1)
+  {
+    js->escape = 0;
+    char unescaped = 0;
+
+    switch (c)
+    {
+      case '"':  unescaped = '"';  break;
+      case '\\': unescaped = '\\'; break;
+      case '/':  unescaped = '/';  break;
+      case 'b':  unescaped = '\b'; break;
+      case 'f':  unescaped = '\f'; break;
+      case 'n':  unescaped = '\n'; break;
+      case 'r':  unescaped = '\r'; break;
+      case 't':  unescaped = '\t'; break;
+      case 'u':
+        js->escape = 4;
+        js->code_unit = 0;
+        return;
+      default:
+        js->error = true;
+        return;
+    }
+
+    json_stream_flush_surrogate(js);
+    json_stream_put(js, unescaped);
+  }
+  else if (js->escape > 0)
+  {
+    const int8_t digit = json_stream_hex(c);
+    if (digit < 0)
+    {
+      js->error = true;
+      return;
+    }
+
+    js->code_unit = (js->code_unit << 4) | digit;
+    if (--js->escape == 0)
+    {
+      json_stream_put_code_unit(js, js->code_unit);
+    }
+  }
+  else if (c == '\\')
+  {
+    js->escape = -1;
+  }
+  else if (c == '"')
+  {
+    json_stream_flush_surrogate(js);
+
+    if (js->state == JS_KEY_STRING)
+    {
+      js->state = JS_COLON;
+    }
+    else
+    {
+      json_stream_value_end(js);
+      json_stream_after_value(js);
+    }
+  }
+  else if ((uint8_t)c < 0x20)
+  {
+    js->error = true;
+  }
+  else
+  {
+    json_stream_flush_surrogate(js);
+    json_stream_put(js, c);
+  }
+}
+
+void json_stream_begin(json_stream_t* js, json_stream_field_t* fields, uint8_t fields_count)
+{
+  memset(js, 0, sizeof(json_stream_t));
+  js->fields = fields;
+  js->fields_count = fields_count;
+  js->state = JS_VALUE;
+  js->field = -1;
+
+  for (uint8_t i = 0; i < fields_count; i++)
+  {
+    fields[i].matches = 0;
+  }
+}
+
+bool json_stream_feed(json_stream_t* js, const char* data, size_t length)
+{
+  size_t i = 0;
+
+  while (i < length && !js->error)
+  {
+    const char c = data[i];
+    bool consumed = true;
+
+    switch (js->state)
+    {
+      case JS_VALUE_OR_END:
+        if (c == ']')
+        {
+          js->depth--;
+          json_stream_after_value(js);
+          break;
+        }
+        // fallthrough
+      case JS_VALUE:
+        if (json_stream_is_ws(c))
+        {
+          break;
+        }
+
+        if (c == '{')
+        {
+          json_stream_push(js, false);
+          js->state = JS_KEY_OR_END;
+        }
+        else if (c == '[')
+        {
+          json_stream_push(js, true);
+          js->state = JS_VALUE_OR_END;
+        }
+        else if (c == '"')
+        {
+          json_stream_value_begin(js, false);
+          js->state = JS_STRING;
+        }
+        else if (c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n')
+        {
+          json_stream_value_begin(js, true);
+          js->state = JS_LITERAL;
+          json_stream_put(js, c);
+        }
+        else
+        {
+          js->error = true;
+        }
+        break;
+
+      case JS_KEY_OR_END:
+        if (c == '}')
+        {
+          js->depth--;
+          json_stream_after_value(js);
+          break;
+        }
+        // fallthrough
+      case JS_KEY:
+        if (json_stream_is_ws(c))
+        {
+          break;
+        }
+
+        if (c == '"')
+        {
+          js->levels[js->depth - 1].key_length = 0;
+          js->levels[js->depth - 1].key_truncated = false;
+          js->state = JS_KEY_STRING;
+        }
+        else
+        {
+          js->error = true;
+        }
+        break;
+
+      case JS_KEY_STRING:
+      case JS_STRING:
+        json_stream_string_char(js, c);
+        break;
+
+      case JS_COLON:
+        if (c == ':')
+        {
+          js->state = JS_VALUE;
+        }
+        else if (!json_stream_is_ws(c))
+        {
+          js->error = true;
+        }
+        break;
+
+      case JS_LITERAL:
+        if (json_stream_is_literal_char(c))
+        {
+          json_stream_put(js, c);
+        }
+        else
+        {
+          // The character after the literal belongs to what follows it.
+          json_stream_value_end(js);
+          json_stream_after_value(js);
+          consumed = false;
+        }
+        break;
+
+      case JS_AFTER_VALUE:
+      {
+        if (json_stream_is_ws(c))
+        {
+          break;
+        }
+
+        json_stream_level_t* level = &js->levels[js->depth - 1];
+        if (c == ',')
+        {
+          if (level->is_array)
+          {
+            level->index++;
+            js->state = JS_VALUE;
+          }
+          else
+          {
+            js->state = JS_KEY;
+          }
+        }
+        else if (c == (level->is_array ? ']' : '}'))
+        {
+          js->depth--;
+          json_stream_after_value(js);
+        }
+        else
+        {
+          js->error = true;
+        }
+        break;
+      }
+
+      case JS_DONE:
+        if (!json_stream_is_ws(c))
+        {
+          js->error = true;
+        }
+        break;
+    }
+
+    if (consumed)
+    {
+      i++;
+    }
+  }
+
+  return !js->error;
+}
+
+bool json_stream_end(json_stream_t* js)
+{
+  // A literal is the only value which doesn't know it ended until something follows it.
+  if (!js->error && js->state == JS_LITERAL && js->depth == 0)
+  {
+    json_stream_value_end(js);
+    js->state = JS_DONE;
+  }
+
+  return !js->error && js->state == JS_DONE;
+}
@@ -0,0 +1,89 @@
+// json_stream.h
+//
+// Streaming JSON field extractor. The document is fed in chunks, as they come from the network,
+// and the values of the requested fields are written straight to their destinations. There is no
+// document tree and no allocation - the parser's memory is the json_stream_t itself, whatever the
+// size of the document.
+//
+// A field is selected with a path relative to the document's root:
+//
+//   access_token            the "access_token" member of the root object
+//   item.artists[0].name    members and array elements can be chained
+//   items[*].track.id       [*] matches every element, the callback gets the element's index
+//
+// Only scalars (strings, numbers, true and false) are extracted. Strings are unescaped, numbers
+// and the literals are passed as they are in the document. A null is treated as a missing field.
+
+#ifndef JSON_STREAM_H
+#define JSON_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JSON_STREAM_MAX_DEPTH  (12U)
+// Longer keys never match.
+#define JSON_STREAM_KEY_MAX    (32U)
+// Longer values passed to the callbacks and all the numbers and literals get truncated.
+#define JSON_STREAM_VALUE_MAX  (64U)
+
+// The index is the one of the element matched by the path's first [*], 0 without a [*].
+typedef void (*json_stream_value_cb_t)(void* user_data, uint32_t index, const char* value,
+                                       size_t length);
+
+typedef struct json_stream_field_t
+{
+  const char* path;
+  // Either a destination buffer, which always ends up NUL terminated (the value gets truncated to
+  // fit), or a callback. With a buffer the last match wins.
+  char* dest;
+  size_t dest_size;
+  json_stream_value_cb_t on_value;
+  void* user_data;
+  // Filled in by the parser.
+  uint32_t matches;
+} json_stream_field_t;
+
+typedef struct json_stream_level_t
+{
+  bool is_array;
+  bool key_truncated;
+  uint8_t key_length;
+  uint32_t index;
+  char key[JSON_STREAM_KEY_MAX];
+} json_stream_level_t;
+
+typedef struct json_stream_t
+{
+  json_stream_field_t* fields;
+  uint8_t fields_count;
+
+  json_stream_level_t levels[JSON_STREAM_MAX_DEPTH];
+  uint8_t depth;
+  uint8_t state;
+  bool error;
+
+  // The value being parsed. field is -1 when the value doesn't match any field.
+  int8_t field;
+  uint32_t index;
+  size_t length;
+  bool is_literal;
+  char value[JSON_STREAM_VALUE_MAX];
+
+  // String escapes. escape is the number of the \uXXXX hex digits left, or -1 right after '\'.
+  int8_t escape;
+  uint16_t code_unit;
+  uint16_t high_surrogate;
+} json_stream_t;
+
+// Start a new document. Resets the fields' matches. The fields have to outlive the parsing.
+void json_stream_begin(json_stream_t* js, json_stream_field_t* fields, uint8_t fields_count);
+
+// Return false once the document turned out to be malformed (or too deep). The rest of it is
+// ignored then.
+bool json_stream_feed(json_stream_t* js, const char* data, size_t length);
+
+// Return true if the document was complete and well formed.
+bool json_stream_end(json_stream_t* js);
+
+#endif // JSON_STREAM_H
@@ -0,0 +1,66 @@
+// seqlock.h
+//
+// A sequence lock, for state which is written rarely and read often. The writer makes the
+// sequence odd before changing the data and even again after. The readers copy the data without
+// taking any lock, then check the sequence: if it was odd or changed meanwhile the copy might be
+// torn and they copy again. The writer never waits for the readers.
+//
+// The writers have to be serialized by the caller. Keep the writes short (in a critical section
+// ideally), a reader spins while a write is in progress.
+//
+//   uint32_t sequence;
+//   do
+//   {
+//     sequence = seqlock_read_begin(&lock);
+//     copy = shared;
+//   } while (seqlock_read_retry(&lock, sequence));
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct seqlock_t
+{
+  _Atomic uint32_t sequence;
+} seqlock_t;
+
+static inline void seqlock_write_begin(seqlock_t* lock)
+{
+  atomic_fetch_add_explicit(&lock->sequence, 1, memory_order_relaxed);
+  // The odd sequence is visible before any of the data changes.
+  atomic_thread_fence(memory_order_release);
+}
+
+static inline void seqlock_write_end(seqlock_t* lock)
+{
+  atomic_fetch_add_explicit(&lock->sequence, 1, memory_order_release);
+}
+
+// Waits out a write in progress. Returns the sequence to pass to seqlock_read_retry.
+static inline uint32_t seqlock_read_begin(seqlock_t* lock)
+{
+  uint32_t sequence;
+  while ((sequence = atomic_load_explicit(&lock->sequence, memory_order_acquire)) & 1U)
+  {
+  }
+  return sequence;
+}
+
+// Return true if the data copied since seqlock_read_begin might be torn.
+static inline bool seqlock_read_retry(seqlock_t* lock, uint32_t sequence)
+{
+  // The data copy is done before the sequence is read again.
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&lock->sequence, memory_order_relaxed) != sequence;
+}
+
+// The number of the writes completed so far.
+static inline uint32_t seqlock_version(seqlock_t* lock)
+{
+  return atomic_load_explicit(&lock->sequence, memory_order_acquire) / 2;
+}
+
+#endif // SEQLOCK_H
@@ -1,444 +1,1923 @@
 #include "spotify.h"
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "esp_http_client.h"
 #include "esp_log.h"
-#include "cJSON.h"
+#include "esp_timer.h"
+#include "nvs.h"
 
+#include "json_stream.h"
+#include "seqlock.h"
+#include "spotify_tls.h"
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static const char* TAG = "spotify";
 
-// This struct is available through extern in spotify.h.
 spotify_access_t spotify;
-spotify_context_t spotify_context;
 
 /*
- * HTTP event handler for the spotify module. This is where response's are collected in a static
- * buffer and parsed by cJSON.
+ * The state the readers get with spotify_get_state. The writers (the responses' completions and
+ * spotify_set_playlist) are serialized by state_lock, a critical section so a write is never
+ * preempted halfway and the readers never spin for long. The readers take no lock at all.
+ */
+static spotify_state_t state;
+static seqlock_t state_seqlock;
+static portMUX_TYPE state_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/*
+ * HTTP event handler for the spotify module. This is where the response's chunks are fed to the
+ * request's JSON extractor, as they come.
  */
 static esp_err_t spotify_http_event_handler(esp_http_client_event_t *evt);
 
 // Memory used by this component. Trying to avoid sprinkling the code with mallocs and frees.
-#define RESPONSE_BUF_SIZE     (1024 * 8)
 #define SCRATCH_MEM_SIZE      (1024)
-#define MAX_SONGS_IN_QUEUE        (5)
-#define SONGS_QUEUE_MEM_SIZE  (MAX_SONG_ID_LENGTH * MAX_SONGS_IN_QUEUE)
-static char* response_buf = NULL;
-static char* scratch_mem = NULL;
-static char* songs_queue = NULL;
-static uint32_t songs_queue_write_counter = 0;
+// The fields a request extracts from its response. The error fields come on top of those.
+#define MAX_RESPONSE_FIELDS       (6)
+#define ERROR_FIELDS_COUNT        (2)
+// The asynchronous requests each have their own slot, with its own connection.
+#define MAX_ASYNC_REQUESTS        (4)
+// The request contexts. Each request takes one for its duration, nothing is shared between them.
+// The blocking requests hold one per host at most, so the asynchronous ones never wait for one.
+#define MAX_REQUESTS_IN_FLIGHT    (SPOTIFY_HOST_COUNT + MAX_ASYNC_REQUESTS)
 
+/*
+ * One long lived client per host. The connection is kept open between the requests (HTTP/1.1
+ * keep-alive) so only the first request pays for the DNS lookup, TCP connect and TLS handshake.
+ * The requests to a host are serialized with its lock, which also guards its scratch memory.
+ */
+typedef struct spotify_host_t
+{
+  const char* name;
+  // Scheme and authority, the requests append the path.
+  const char* url;
+  esp_http_client_handle_t client;
+  // Outlives the clients, so a new connection still resumes the TLS session. NULL over plain HTTP.
+  esp_transport_handle_t transport;
+  SemaphoreHandle_t lock;
+  // For building the current request's URL, headers and body.
+  char* scratch_mem;
+  spotify_stats_t stats;
+} spotify_host_t;
+
+static spotify_host_t hosts[SPOTIFY_HOST_COUNT] = {
+  [SPOTIFY_HOST_API] = {
+    .name = "api.spotify.com",
+    .url = CONFIG_SPOTIFY_API_URL,
+  },
+  [SPOTIFY_HOST_ACCOUNTS] = {
+    .name = "accounts.spotify.com",
+    .url = CONFIG_SPOTIFY_ACCOUNTS_URL,
+  },
+};
 
-void spotify_init(void)
+/*
+ * The kinds of the responses. A kind knows which fields to extract, into which output struct and
+ * what to do with the output once the response is complete.
+ */
+typedef enum
 {
-  spotify.fresh = false;
-  memset(spotify.client_id, 0, sizeof(spotify.client_id));
-  memset(spotify.client_secret, 0, sizeof(spotify.client_secret));
-  memset(spotify.refresh_token, 0, sizeof(spotify.refresh_token));
-  memset(spotify.access_token, 0, sizeof(spotify.access_token));
+  SPOTIFY_RESPONSE_NONE,
+  SPOTIFY_RESPONSE_TOKEN,
+  SPOTIFY_RESPONSE_PLAYER,
+  SPOTIFY_RESPONSE_NOW_PLAYING,
+  SPOTIFY_RESPONSE_PLAYLISTS_PAGE,
+  SPOTIFY_RESPONSE_TRACKS_PAGE,
+  SPOTIFY_RESPONSE_KINDS_COUNT,
+} spotify_response_e;
+
+// The output structs, one per kind. The requesters keep them on their stacks.
+typedef struct spotify_token_response_t
+{
+  char access_token[sizeof(spotify.access_token)];
+  char expires_in[12];
+} spotify_token_response_t;
 
-  // Context init.
-  memset(&spotify_context, 0, sizeof(spotify_context_t));
-  // This is used instead of `inited` field. It's used when the code in tasks.c writes using the
-  // current spotify_context.song_id. I don't want it to write crap into PICC.
-  spotify_context.is_playing = 0xFF;
+typedef struct spotify_player_response_t
+{
+  char is_playing[8];
+  char artist[MAX_ARTIST_NAME_LENGTH];
+  char song_title[MAX_SONG_TITLE_LENGTH];
+  char song_id[MAX_SONG_ID_LENGTH + 1];
+} spotify_player_response_t;
 
-  snprintf(spotify.client_id, sizeof(spotify.client_id), "%s", CONFIG_SPOTIFY_CLIENT_ID);
-  snprintf(spotify.client_secret, sizeof(spotify.client_secret), "%s", CONFIG_SPOTIFY_CLIENT_SECRET);
-  snprintf(spotify.refresh_token, sizeof(spotify.refresh_token), "%s", CONFIG_SPOTIFY_REFRESH_TOKEN);
+typedef struct spotify_now_playing_response_t
+{
+  char is_playing[8];
+  char progress_ms[12];
+  char duration_ms[12];
+  char artist[MAX_ARTIST_NAME_LENGTH];
+  char song_title[MAX_SONG_TITLE_LENGTH];
+  char song_id[MAX_SONG_ID_LENGTH + 1];
+  // Filled in by the completion.
+  uint32_t bytes;
+  bool published;
+} spotify_now_playing_response_t;
+
+/*
+ * A page of the user's playlists. The same struct goes through all the pages. A playlist goes to
+ * the sink once the next one starts or the page ends, when it has at least an ID and a name.
+ */
+typedef struct spotify_playlists_page_t
+{
+  spotify_playlist_sink_t sink;
+  void* user_data;
+  uint32_t listed;
+  bool stopped;
+  // The items on the current page.
+  uint32_t items;
+  // The item being put together, its fields can come in any order.
+  uint32_t item_index;
+  bool has_id;
+  bool has_name;
+  spotify_playlist_t item;
+  char next[128];
+  char total[12];
+} spotify_playlists_page_t;
+
+// A page of a playlist's tracks. The same struct goes through all the pages.
+typedef struct spotify_tracks_page_t
+{
+  spotify_track_table_t* table;
+  uint32_t loaded;
+  // Not base62 IDs. The local files and the unavailable tracks have no ID at all, they are missing.
+  uint32_t skipped;
+  bool out_of_memory;
+  char next[256];
+  char total[12];
+} spotify_tracks_page_t;
+
+/*
+ * Everything one request needs, from the moment it starts until its response is handed over. The
+ * HTTP client carries it in its user_data, so the event handler gets straight to the request's
+ * extractor.
+ */
+typedef struct spotify_request_t
+{
+  spotify_response_e kind;
+  void* output;
+  spotify_host_t* host;
+  bool in_use;
+  // When the request started, for timing the connect.
+  int64_t start_us;
+  // The attempt made a new connection, it didn't only reuse the open one.
+  bool connected;
+  // The response goes through the extractor straight to the output. Nothing is buffered, the
+  // memory doesn't depend on the response's size.
+  json_stream_t json;
+  json_stream_field_t fields[MAX_RESPONSE_FIELDS + ERROR_FIELDS_COUNT];
+  uint8_t fields_count;
+  uint32_t response_bytes_count;
+  char error_message[64];
+} spotify_request_t;
+
+/*
+ * A field of a kind's output struct. With on_value set the value goes to the callback, which gets
+ * the output struct as its user_data.
+ */
+typedef struct spotify_field_t
+{
+  const char* path;
+  size_t offset;
+  size_t size;
+  json_stream_value_cb_t on_value;
+} spotify_field_t;
+
+#define SPOTIFY_FIELD(type, member, field_path)                                                   \
+  { .path = field_path, .offset = offsetof(type, member), .size = sizeof(((type*)0)->member) }
+
+typedef struct spotify_response_kind_t
+{
+  const char* name;
+  const spotify_field_t* fields;
+  uint8_t fields_count;
+  // Called when the request succeeded. The fields' matches tell what the response had.
+  void (*on_complete)(spotify_request_t* request);
+} spotify_response_kind_t;
+
+static void spotify_token_complete(spotify_request_t* request);
+static void spotify_token_invalidate(void);
+static void spotify_player_complete(spotify_request_t* request);
+static void spotify_now_playing_complete(spotify_request_t* request);
+static void spotify_page_id(void* user_data, uint32_t index, const char* value, size_t length);
+static void spotify_page_name(void* user_data, uint32_t index, const char* value, size_t length);
+static void spotify_page_snapshot(void* user_data, uint32_t index, const char* value,
+                                  size_t length);
+static void spotify_page_tracks(void* user_data, uint32_t index, const char* value, size_t length);
+static void spotify_page_track(void* user_data, uint32_t index, const char* value, size_t length);
+
+static const spotify_field_t token_fields[] = {
+  SPOTIFY_FIELD(spotify_token_response_t, access_token, "access_token"),
+  SPOTIFY_FIELD(spotify_token_response_t, expires_in, "expires_in"),
+};
+
+// The completion looks at the matches by these indices.
+static const spotify_field_t player_fields[] = {
+  SPOTIFY_FIELD(spotify_player_response_t, is_playing, "is_playing"),
+  SPOTIFY_FIELD(spotify_player_response_t, artist, "item.artists[0].name"),
+  SPOTIFY_FIELD(spotify_player_response_t, song_title, "item.name"),
+  SPOTIFY_FIELD(spotify_player_response_t, song_id, "item.id"),
+};
+
+// The completion looks at the matches by these indices too.
+static const spotify_field_t now_playing_fields[] = {
+  SPOTIFY_FIELD(spotify_now_playing_response_t, is_playing, "is_playing"),
+  SPOTIFY_FIELD(spotify_now_playing_response_t, progress_ms, "progress_ms"),
+  SPOTIFY_FIELD(spotify_now_playing_response_t, duration_ms, "item.duration_ms"),
+  SPOTIFY_FIELD(spotify_now_playing_response_t, song_id, "item.id"),
+  SPOTIFY_FIELD(spotify_now_playing_response_t, song_title, "item.name"),
+  SPOTIFY_FIELD(spotify_now_playing_response_t, artist, "item.artists[0].name"),
+};
+
+static const spotify_field_t playlists_page_fields[] = {
+  { .path = "items[*].id", .on_value = spotify_page_id },
+  { .path = "items[*].name", .on_value = spotify_page_name },
+  { .path = "items[*].snapshot_id", .on_value = spotify_page_snapshot },
+  { .path = "items[*].tracks.total", .on_value = spotify_page_tracks },
+  SPOTIFY_FIELD(spotify_playlists_page_t, next, "next"),
+  SPOTIFY_FIELD(spotify_playlists_page_t, total, "total"),
+};
+
+static const spotify_field_t tracks_page_fields[] = {
+  { .path = "items[*].track.id", .on_value = spotify_page_track },
+  SPOTIFY_FIELD(spotify_tracks_page_t, next, "next"),
+  SPOTIFY_FIELD(spotify_tracks_page_t, total, "total"),
+};
+
+#define KIND_FIELDS(f) .fields = (f), .fields_count = sizeof(f) / sizeof((f)[0])
+
+static const spotify_response_kind_t response_kinds[SPOTIFY_RESPONSE_KINDS_COUNT] = {
+  [SPOTIFY_RESPONSE_NONE] = { .name = "none" },
+  [SPOTIFY_RESPONSE_TOKEN] = {
+    .name = "token", KIND_FIELDS(token_fields), .on_complete = spotify_token_complete,
+  },
+  [SPOTIFY_RESPONSE_PLAYER] = {
+    .name = "player", KIND_FIELDS(player_fields), .on_complete = spotify_player_complete,
+  },
+  [SPOTIFY_RESPONSE_NOW_PLAYING] = {
+    .name = "now playing", KIND_FIELDS(now_playing_fields),
+    .on_complete = spotify_now_playing_complete,
+  },
+  [SPOTIFY_RESPONSE_PLAYLISTS_PAGE] = {
+    .name = "playlists page", KIND_FIELDS(playlists_page_fields),
+  },
+  [SPOTIFY_RESPONSE_TRACKS_PAGE] = {
+    .name = "tracks page", KIND_FIELDS(tracks_page_fields),
+  },
+};
+
+static spotify_request_t requests[MAX_REQUESTS_IN_FLIGHT];
+static portMUX_TYPE requests_lock = portMUX_INITIALIZER_UNLOCKED;
+// Counts the free request contexts.
+static SemaphoreHandle_t requests_free = NULL;
+
+// The hosts' stats are updated by the blocking requests and by the asynchronous engine.
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+typedef enum
+{
+  SLOT_FREE,
+  // Taken by a submitter, which is building the request in the scratch memory.
+  SLOT_RESERVED,
+  SLOT_SUBMITTED,
+  SLOT_RUNNING,
+} spotify_slot_state_e;
+
+// Room for the output of any kind, the asynchronous requesters don't wait around to keep it.
+typedef union spotify_output_u
+{
+  spotify_token_response_t token;
+  spotify_player_response_t player;
+  spotify_now_playing_response_t now_playing;
+  spotify_playlists_page_t playlists_page;
+  spotify_tracks_page_t tracks_page;
+} spotify_output_u;
 
-  // We are assuming the init function is called only once. Otherwise we have a memory leak.
-  response_buf = (char*)malloc(RESPONSE_BUF_SIZE);
-  scratch_mem = (char*)malloc(SCRATCH_MEM_SIZE);
-  songs_queue = (char*)malloc(SONGS_QUEUE_MEM_SIZE);
+/*
+ * An asynchronous request. The slot keeps its client, and the connection, between the requests.
+ * Only the engine's task touches a slot past SLOT_SUBMITTED.
+ */
+typedef struct spotify_slot_t
+{
+  spotify_slot_state_e state;
+  spotify_host_e host_id;
+  spotify_response_e kind;
+  esp_http_client_method_t method;
+  esp_http_client_handle_t client;
+  esp_transport_handle_t transport;
+  // The host the client connected to last.
+  spotify_host_e client_host_id;
+  spotify_request_t* request;
+  spotify_output_u output;
+  // The URL, followed by the authorization header or the body.
+  char* scratch_mem;
+  const char* authorization;
+  const char* post_data;
+  uint8_t attempt;
+  // The attempt went out on the connection the slot had open already.
+  bool reused;
+  int64_t start_us;
+  spotify_done_cb_t done;
+  void* user_data;
+} spotify_slot_t;
+
+static spotify_poll_stats_t poll_stats = {};
+// What the last poll said about the next one.
+static uint32_t poll_next_ms = 0;
+
+// The token manager. TOKEN_FRESH_BIT is set while the access token can be used, TOKEN_FAILED_BIT
+// once a refresh failed, until the next one.
+#define TOKEN_FRESH_BIT         BIT0
+#define TOKEN_FAILED_BIT        BIT1
+// Refresh this long before the expiry, so a request started right before it still gets through.
+#define TOKEN_REFRESH_MARGIN_S  (120)
+#define TOKEN_RETRY_S           (10U)
+#define TOKEN_NVS_NAMESPACE     "spotify"
+#define TOKEN_NVS_KEY           "token"
+#define TOKEN_NVS_VERSION       (1U)
+// Any earlier and the clock wasn't set by SNTP, 2021-01-01.
+#define TOKEN_VALID_TIME        (1609459200)
+
+typedef struct spotify_token_blob_t
+{
+  uint32_t version;
+  uint32_t refresh_hash;
+  int64_t expires_at;
+  char access_token[sizeof(spotify.access_token)];
+} spotify_token_blob_t;
+
+static EventGroupHandle_t token_events = NULL;
+static TaskHandle_t token_task = NULL;
+// Guards the access token, its expiry and the stats. The manager replaces the token while the
+// others build their requests with it.
+static portMUX_TYPE token_lock = portMUX_INITIALIZER_UNLOCKED;
+static spotify_token_stats_t token_stats = {};
+static portMUX_TYPE poll_lock = portMUX_INITIALIZER_UNLOCKED;
+// Wakes the poller up early, after a command which changes the playback.
+static SemaphoreHandle_t poll_kick = NULL;
+
+static spotify_slot_t slots[MAX_ASYNC_REQUESTS];
+static portMUX_TYPE slots_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t async_task = NULL;
+static spotify_async_stats_t async_stats = {};
+
+static spotify_host_t* spotify_host_take(spotify_host_e host_id)
+{
+  spotify_host_t* host = &hosts[host_id];
+  (void)xSemaphoreTake(host->lock, portMAX_DELAY);
+  return host;
 }
 
-uint8_t spotify_is_fresh_access_token(void)
+static void spotify_host_give(spotify_host_t* host)
 {
-  return spotify.fresh;
+  (void)xSemaphoreGive(host->lock);
 }
 
-void spotify_refresh_access_token(void)
+/*
+ * Take a free request context and point the kind's fields at the output. Blocks while all of
+ * them are in flight. The blocking requests take it while holding their host's lock. The output
+ * can be NULL for the kinds without fields.
+ */
+static spotify_request_t* spotify_request_take(spotify_response_e kind, void* output)
 {
-  const char* const _url= "https://accounts.spotify.com/api/token";
+  const spotify_response_kind_t* k = &response_kinds[kind];
+  spotify_request_t* request = NULL;
 
-  esp_http_client_config_t config = {
-    .url = _url,
-    .transport_type = HTTP_TRANSPORT_OVER_SSL,
-    .event_handler = spotify_http_event_handler,
+  assert(k->fields_count <= MAX_RESPONSE_FIELDS);
+  assert(k->fields_count == 0 || output != NULL);
+
+  (void)xSemaphoreTake(requests_free, portMAX_DELAY);
+  portENTER_CRITICAL(&requests_lock);
+  for (uint8_t i = 0; i < MAX_REQUESTS_IN_FLIGHT; i++)
+  {
+    if (!requests[i].in_use)
+    {
+      request = &requests[i];
+      request->in_use = true;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&requests_lock);
+  assert(request != NULL);
+
+  request->kind = kind;
+  request->output = output;
+  request->host = NULL;
+  request->fields_count = k->fields_count;
+  for (uint8_t i = 0; i < k->fields_count; i++)
+  {
+    const spotify_field_t* f = &k->fields[i];
+    request->fields[i] = (json_stream_field_t){
+      .path = f->path,
+      .dest = f->on_value == NULL ? (char*)output + f->offset : NULL,
+      .dest_size = f->size,
+      .on_value = f->on_value,
+      .user_data = output,
+    };
+  }
+  // The Web API's errors and the accounts service's errors.
+  request->fields[k->fields_count] = (json_stream_field_t){
+    .path = "error.message",
+    .dest = request->error_message,
+    .dest_size = sizeof(request->error_message),
+  };
+  request->fields[k->fields_count + 1] = (json_stream_field_t){
+    .path = "error_description",
+    .dest = request->error_message,
+    .dest_size = sizeof(request->error_message),
   };
-  esp_http_client_handle_t client = esp_http_client_init(&config);
-  esp_http_client_set_method(client, HTTP_METHOD_POST);
-  // Build a URL encoded key-value data pairs.
-  snprintf(scratch_mem, SCRATCH_MEM_SIZE, "client_id=%s"
-                                         "&client_secret=%s"
-                                         "&refresh_token=%s"
-                                         "&grant_type=refresh_token",
-           spotify.client_id,
-           spotify.client_secret,
-           spotify.refresh_token);
-  esp_http_client_set_post_field(client, scratch_mem, strlen(scratch_mem));
 
-  esp_err_t err = esp_http_client_perform(client);
+  return request;
+}
 
-  if (err == ESP_OK)
+static void spotify_request_give(spotify_request_t* request)
+{
+  portENTER_CRITICAL(&requests_lock);
+  request->in_use = false;
+  portEXIT_CRITICAL(&requests_lock);
+  (void)xSemaphoreGive(requests_free);
+}
+
+static void spotify_stats_record(spotify_host_t* host, int64_t start, esp_err_t err)
+{
+  const uint32_t latency = esp_timer_get_time() - start;
+
+  portENTER_CRITICAL(&stats_lock);
+  host->stats.requests++;
+  host->stats.latency_sum_us += latency;
+  if (latency > host->stats.latency_max_us)
   {
-    ESP_LOGD(TAG, "Status = %d, content_length = %lld",
-             esp_http_client_get_status_code(client),
-             esp_http_client_get_content_length(client));
+    host->stats.latency_max_us = latency;
   }
-
-  // Closing the connection.
-  esp_http_client_cleanup(client);
+  if (err != ESP_OK)
+  {
+    host->stats.failures++;
+  }
+  portEXIT_CRITICAL(&stats_lock);
 }
 
-void spotify_query(void)
+/*
+ * The response is all in. Check it for the errors and let the request's kind hand its output
+ * over.
+ */
+static void spotify_request_finish(spotify_request_t* request, esp_http_client_handle_t client)
 {
-  const char* const _url = "https://api.spotify.com/v1/me/player";
-  snprintf(scratch_mem, SCRATCH_MEM_SIZE, "Bearer %s", spotify.access_token);
+  spotify_host_t* host = request->host;
 
-  esp_http_client_config_t config = {
-    .url = _url,
-    .transport_type = HTTP_TRANSPORT_OVER_SSL,
-    .event_handler = spotify_http_event_handler,
-  };
-  esp_http_client_handle_t client = esp_http_client_init(&config);
-  esp_http_client_set_method(client, HTTP_METHOD_GET);
-  esp_http_client_set_header(client, "Authorization", scratch_mem);
+  ESP_LOGD(TAG, "Status = %d, content_length = %lld",
+           esp_http_client_get_status_code(client),
+           esp_http_client_get_content_length(client));
 
-  esp_err_t err = esp_http_client_perform(client);
+  // Plenty of the responses have no body.
+  if (request->response_bytes_count > 0 && !json_stream_end(&request->json))
+  {
+    ESP_LOGW(TAG, "Malformed or truncated %s response from %s",
+             response_kinds[request->kind].name, host->name);
+  }
 
-  if (err == ESP_OK)
+  if (request->error_message[0] != '\0')
+  {
+    // It's more common for the token to expired than to mess up the request.
+    if (strcmp(request->error_message, "The access token expired") == 0)
+    {
+      ESP_LOGW(TAG, "The access token expired!");
+      spotify_token_invalidate();
+    }
+    else if (strcmp(request->error_message, "Only valid bearer authentication supported") == 0)
+    {
+      ESP_LOGW(TAG, "The access token is incorrect!");
+      spotify_token_invalidate();
+    }
+    else
+    {
+      ESP_LOGW(TAG, "%s responded with an error: %s", host->name, request->error_message);
+    }
+  }
+  else if (response_kinds[request->kind].on_complete != NULL)
   {
-    ESP_LOGD(TAG, "Status = %d, content_length = %lld",
-             esp_http_client_get_status_code(client),
-             esp_http_client_get_content_length(client));
+    response_kinds[request->kind].on_complete(request);
   }
+}
+
+/*
+ * Point the extractor at the request's fields and reset what the previous attempt left.
+ */
+static void spotify_request_begin(spotify_request_t* request)
+{
+  request->response_bytes_count = 0;
+  request->error_message[0] = '\0';
+  request->connected = false;
+  json_stream_begin(&request->json, request->fields, request->fields_count + ERROR_FIELDS_COUNT);
+  request->start_us = esp_timer_get_time();
+}
 
-  // Closing the connection.
-  esp_http_client_cleanup(client);
+/*
+ * Whether a failed attempt can go again on a new connection. Only if it failed on a connection
+ * which was open already, which the server most likely closed while it was idle. And only if
+ * the request can't have reached the server, or if it doesn't matter when it did: queueing a song
+ * twice does.
+ */
+static bool spotify_request_may_retry(const spotify_request_t* request, bool reused,
+                                      esp_http_client_method_t method, esp_err_t err)
+{
+  if (!reused || request->connected)
+  {
+    return false;
+  }
+  return err == ESP_ERR_HTTP_CONNECT || err == ESP_ERR_HTTP_WRITE_DATA ||
+         method == HTTP_METHOD_GET || request->kind == SPOTIFY_RESPONSE_TOKEN;
 }
 
-void spotify_enqueue_song(const char* const song_id, const uint8_t song_id_len)
+/*
+ * Perform a request on the host's connection. The caller holds the host's lock. The authorization
+ * and the post data can be NULL. On success the request's kind gets to hand its output over.
+ */
+static esp_err_t spotify_perform(spotify_host_t* host, spotify_request_t* request,
+                                 const char* url, esp_http_client_method_t method,
+                                 const char* authorization, const char* post_data)
 {
-  const char* const _url = "https://api.spotify.com/v1/me/player/queue?uri=spotify:track:";
-  const uint32_t _url_len = strlen(_url);
-  // The idea below is to use the scratch buffer for building the URL and the header.
-  char* const spotify_url = scratch_mem;
-  memcpy(spotify_url, _url, _url_len);
-  memcpy(spotify_url + _url_len, song_id, song_id_len);
-  *(spotify_url + _url_len + song_id_len) = 0;
-
-  char* const spotify_header = (scratch_mem + _url_len + song_id_len + 1);
-  memcpy(spotify_header, "Bearer ", 7);
-  memcpy(spotify_header + 7, spotify.access_token, strlen(spotify.access_token));
-  *(spotify_header + 7 + strlen(spotify.access_token)) = 0;
-
-  esp_http_client_config_t config = {
-    .url = spotify_url,
-    .transport_type = HTTP_TRANSPORT_OVER_SSL,
-    .event_handler = spotify_http_event_handler,
-    .is_async = false,
-  };
-  esp_http_client_handle_t client = esp_http_client_init(&config);
-  esp_http_client_set_header(client, "Authorization", spotify_header);
-  esp_http_client_set_method(client, HTTP_METHOD_POST);
+  const int64_t start = esp_timer_get_time();
+  esp_err_t err = ESP_FAIL;
+
+  request->host = host;
+
+  // One more try on a fresh connection, see spotify_request_may_retry.
+  for (uint8_t attempt = 0; attempt < 2 && err != ESP_OK; attempt++)
+  {
+    const bool reused = host->client != NULL;
+
+    if (host->client == NULL)
+    {
+      // The transport follows the URL's scheme, so a plain HTTP stand-in works too.
+      esp_http_client_config_t config = {
+        .url = url,
+        .event_handler = spotify_http_event_handler,
+        .user_data = request,
+        // TCP keep-alive, to notice a dead connection before using it.
+        .keep_alive_enable = true,
+#ifdef CONFIG_SPOTIFY_TLS_SESSIONS
+        .transport = host->transport,
+#endif
+      };
+      host->client = esp_http_client_init(&config);
+
+      if (host->client == NULL)
+      {
+        break;
+      }
+    }
+    else
+    {
+      // Same host, so the client keeps the connection. The events go to this request now.
+      esp_http_client_set_url(host->client, url);
+      esp_http_client_set_user_data(host->client, request);
+    }
+
+    esp_http_client_set_method(host->client, method);
+    if (authorization != NULL)
+    {
+      esp_http_client_set_header(host->client, "Authorization", authorization);
+    }
+    esp_http_client_set_post_field(host->client, post_data, post_data ? strlen(post_data) : 0);
+
+    spotify_request_begin(request);
+    err = esp_http_client_perform(host->client);
+
+    if (err != ESP_OK)
+    {
+      ESP_LOGW(TAG, "Request to %s failed: %s", host->name, esp_err_to_name(err));
+      esp_http_client_cleanup(host->client);
+      host->client = NULL;
+
+      if (!spotify_request_may_retry(request, reused, method, err))
+      {
+        break;
+      }
+    }
+  }
 
-  // NOTE(michalc): _connect part of the _open can be made asynchronous.
-  // Open connection and write header strings.
-  if (esp_http_client_open(client, 0) == ESP_FAIL)
+  spotify_stats_record(host, start, err);
+
+  if (err == ESP_OK)
   {
-    ESP_LOGW(TAG, "Failed to open connection!");
+    spotify_request_finish(request, host->client);
   }
 
-  if (esp_http_client_fetch_headers(client) == ESP_FAIL)
+  return err;
+}
+
+void spotify_init(void)
+{
+  spotify.expires_at = 0;
+  memset(spotify.client_id, 0, sizeof(spotify.client_id));
+  memset(spotify.client_secret, 0, sizeof(spotify.client_secret));
+  memset(spotify.refresh_token, 0, sizeof(spotify.refresh_token));
+  memset(spotify.access_token, 0, sizeof(spotify.access_token));
+
+  // State init.
+  memset(&state, 0, sizeof(spotify_state_t));
+  // This is used instead of `inited` field. It's used when the code in tasks.c writes using the
+  // current state's song_id. I don't want it to write crap into PICC.
+  state.is_playing = 0xFF;
+
+  snprintf(spotify.client_id, sizeof(spotify.client_id), "%s", CONFIG_SPOTIFY_CLIENT_ID);
+  snprintf(spotify.client_secret, sizeof(spotify.client_secret), "%s", CONFIG_SPOTIFY_CLIENT_SECRET);
+  snprintf(spotify.refresh_token, sizeof(spotify.refresh_token), "%s", CONFIG_SPOTIFY_REFRESH_TOKEN);
+
+#ifdef CONFIG_SPOTIFY_TLS_SESSIONS
+  spotify_tls_init();
+#endif
+
+  // The clients connect on their first request. We are assuming the init function is called only
+  // once. Otherwise we have a memory leak.
+  for (uint8_t i = 0; i < SPOTIFY_HOST_COUNT; i++)
   {
-    ESP_LOGW(TAG, "Failed to fetch headers!");
+    hosts[i].lock = xSemaphoreCreateMutex();
+    hosts[i].scratch_mem = (char*)malloc(SCRATCH_MEM_SIZE);
+#ifdef CONFIG_SPOTIFY_TLS_SESSIONS
+    // Without one the client falls back to its own transport, which doesn't resume the sessions.
+    if (hosts[i].transport == NULL && strncmp(hosts[i].url, "https", 5) == 0)
+    {
+      hosts[i].transport = spotify_tls_transport_create();
+    }
+#endif
   }
-  else
+
+  requests_free = xSemaphoreCreateCounting(MAX_REQUESTS_IN_FLIGHT, MAX_REQUESTS_IN_FLIGHT);
+  poll_kick = xSemaphoreCreateBinary();
+  token_events = xEventGroupCreate();
+
+  for (uint8_t i = 0; i < MAX_ASYNC_REQUESTS; i++)
   {
-    ESP_LOGD(TAG, "Status = %d, content_length = %lld",
-             esp_http_client_get_status_code(client),
-             esp_http_client_get_content_length(client));
+    slots[i].scratch_mem = (char*)malloc(SCRATCH_MEM_SIZE);
+#ifdef CONFIG_SPOTIFY_TLS_SESSIONS
+    if (slots[i].transport == NULL)
+    {
+      slots[i].transport = spotify_tls_transport_create();
+    }
+#endif
   }
+}
 
-  // Closing the connection.
-  esp_http_client_cleanup(client);
+static int64_t spotify_token_expires_at(void)
+{
+  portENTER_CRITICAL(&token_lock);
+  const int64_t expires_at = spotify.expires_at;
+  portEXIT_CRITICAL(&token_lock);
+  return expires_at;
 }
 
-void spotify_next_song(void)
+uint8_t spotify_is_fresh_access_token(void)
 {
-  const char* _url = "https://api.spotify.com/v1/me/player/next";
-  snprintf(scratch_mem, SCRATCH_MEM_SIZE, "Bearer %s", spotify.access_token);
+  return (xEventGroupGetBits(token_events) & TOKEN_FRESH_BIT) != 0 &&
+         time(NULL) < spotify_token_expires_at();
+}
 
-  // Modyfing the client here, which we assume is connected to the server.
-  esp_http_client_config_t config = {
-    .url = _url,
-    .transport_type = HTTP_TRANSPORT_OVER_SSL,
-    .event_handler = spotify_http_event_handler,
-  };
-  esp_http_client_handle_t client = esp_http_client_init(&config);
-  esp_http_client_set_header(client, "Authorization", scratch_mem);
-  esp_http_client_set_method(client, HTTP_METHOD_POST);
+// FNV-1a. The stored token is only good for the refresh token it came from.
+static uint32_t spotify_token_hash(const char* s)
+{
+  uint32_t hash = 2166136261U;
+  for (; *s != '\0'; s++)
+  {
+    hash = (hash ^ (uint8_t)*s) * 16777619U;
+  }
+  return hash;
+}
 
-  esp_err_t err = esp_http_client_perform(client);
+static void spotify_token_store(void)
+{
+  // Without the wall clock the expiry means nothing after a reboot.
+  if (time(NULL) < TOKEN_VALID_TIME)
+  {
+    return;
+  }
 
+  spotify_token_blob_t* blob = (spotify_token_blob_t*)malloc(sizeof(spotify_token_blob_t));
+  if (blob == NULL)
+  {
+    return;
+  }
+  blob->version = TOKEN_NVS_VERSION;
+  blob->refresh_hash = spotify_token_hash(spotify.refresh_token);
+  portENTER_CRITICAL(&token_lock);
+  blob->expires_at = spotify.expires_at;
+  memcpy(blob->access_token, spotify.access_token, sizeof(blob->access_token));
+  portEXIT_CRITICAL(&token_lock);
+
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(TOKEN_NVS_NAMESPACE, NVS_READWRITE, &nvs);
   if (err == ESP_OK)
   {
-    ESP_LOGD(TAG, "Status = %d, content_length = %lld",
-             esp_http_client_get_status_code(client),
-             esp_http_client_get_content_length(client));
+    err = nvs_set_blob(nvs, TOKEN_NVS_KEY, blob, sizeof(spotify_token_blob_t));
+    if (err == ESP_OK)
+    {
+      err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+  }
+  if (err != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Failed to store the access token: %s", esp_err_to_name(err));
   }
 
-  // Closing the connection.
-  esp_http_client_cleanup(client);
+  free(blob);
 }
 
-void spotify_get_playlist(const uint32_t playlist_idx)
+/*
+ * Take the access token stored before the reboot, if it's still good for a while.
+ */
+static void spotify_token_load(void)
 {
-  const char* _url = "https://api.spotify.com/v1/me/playlists?limit=1&offset=";
-  // The idea below is to use the scratch buffer for building the URL and the header.
-  char* const spotify_url = scratch_mem;
-  snprintf(spotify_url, SCRATCH_MEM_SIZE, "%s%ld", _url, playlist_idx);
+  const int64_t now = time(NULL);
+  if (now < TOKEN_VALID_TIME)
+  {
+    ESP_LOGI(TAG, "The clock isn't set, not using the stored access token");
+    return;
+  }
 
-  char* const spotify_header = (scratch_mem + strlen(spotify_url) + 1);
-  snprintf(spotify_header, SCRATCH_MEM_SIZE, "Bearer %s", spotify.access_token);
+  nvs_handle_t nvs;
+  if (nvs_open(TOKEN_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+  {
+    return;
+  }
 
-  // TODO(michalc): the response should read the 'total' field
-  // TODO(michalc): the 'next' field is the url to the next playlist
+  spotify_token_blob_t* blob = (spotify_token_blob_t*)malloc(sizeof(spotify_token_blob_t));
+  size_t size = sizeof(spotify_token_blob_t);
+  if (blob != NULL &&
+      nvs_get_blob(nvs, TOKEN_NVS_KEY, blob, &size) == ESP_OK &&
+      size == sizeof(spotify_token_blob_t) &&
+      blob->version == TOKEN_NVS_VERSION &&
+      blob->refresh_hash == spotify_token_hash(spotify.refresh_token) &&
+      now < blob->expires_at)
+  {
+    portENTER_CRITICAL(&token_lock);
+    spotify.expires_at = blob->expires_at;
+    memcpy(spotify.access_token, blob->access_token, sizeof(spotify.access_token));
+    portEXIT_CRITICAL(&token_lock);
+    token_stats.loaded = true;
+    (void)xEventGroupSetBits(token_events, TOKEN_FRESH_BIT);
+    ESP_LOGI(TAG, "Using the stored access token, expires in %lld s", blob->expires_at - now);
+  }
 
-  esp_http_client_config_t config = {
-    .url = spotify_url,
-    .transport_type = HTTP_TRANSPORT_OVER_SSL,
-    .event_handler = spotify_http_event_handler,
-  };
-  esp_http_client_handle_t client = esp_http_client_init(&config);
-  esp_http_client_set_header(client, "Authorization", spotify_header);
-  esp_http_client_set_method(client, HTTP_METHOD_GET);
+  free(blob);
+  nvs_close(nvs);
+}
 
-  esp_err_t err = esp_http_client_perform(client);
+static void spotify_token_complete(spotify_request_t* request)
+{
+  const spotify_token_response_t* token = (const spotify_token_response_t*)request->output;
 
-  if (err == ESP_OK)
+  if (request->fields[0].matches > 0)
   {
-    ESP_LOGD(TAG, "Status = %d, content_length = %lld",
-             esp_http_client_get_status_code(client),
-             esp_http_client_get_content_length(client));
+    // The tokens last an hour, in case the response doesn't say.
+    uint32_t expires_in = 3600;
+    if (request->fields[1].matches > 0)
+    {
+      expires_in = strtoul(token->expires_in, NULL, 10);
+    }
+
+    ESP_LOGI(TAG, "Storing a new access token, expires in %lu s", expires_in);
+    portENTER_CRITICAL(&token_lock);
+    memcpy(spotify.access_token, token->access_token, sizeof(spotify.access_token));
+    spotify.expires_at = time(NULL) + expires_in;
+    portEXIT_CRITICAL(&token_lock);
+
+    spotify_token_store();
+    (void)xEventGroupClearBits(token_events, TOKEN_FAILED_BIT);
+    (void)xEventGroupSetBits(token_events, TOKEN_FRESH_BIT);
+    // The manager schedules the next refresh from the new expiry.
+    if (token_task != NULL)
+    {
+      xTaskNotifyGive(token_task);
+    }
   }
+}
 
-  // Closing the connection.
-  esp_http_client_cleanup(client);
+/*
+ * Build the token request in the scratch memory: the URL at the beginning and the URL encoded
+ * key-value pairs of the body after it. Returns the body.
+ */
+static const char* spotify_build_token_request(char* scratch_mem, const char* url)
+{
+  const int url_len = snprintf(scratch_mem, SCRATCH_MEM_SIZE, "%s/api/token", url);
+  char* const body = scratch_mem + url_len + 1;
+  snprintf(body, SCRATCH_MEM_SIZE - url_len - 1, "client_id=%s"
+                                                 "&client_secret=%s"
+                                                 "&refresh_token=%s"
+                                                 "&grant_type=refresh_token",
+           spotify.client_id,
+           spotify.client_secret,
+           spotify.refresh_token);
+  return body;
 }
 
-void spotify_get_playlist_song(const char* playlist_id, const uint32_t song_idx)
+/*
+ * Return true if the response had a new access token in it.
+ */
+static bool spotify_token_refresh(void)
 {
-  const char* _url = "https://api.spotify.com/v1/playlists/";
-  // The idea below is to use the scratch buffer for building the URL and the header.
-  char* const spotify_url = scratch_mem;
-  snprintf(spotify_url, SCRATCH_MEM_SIZE,
-           "%s%.*s/tracks?%s&%s%ld", _url, MAX_PLAYLIST_ID_LENGTH, playlist_id, "fields=href(),items(track(name,id)),total()", "limit=1&offset=", song_idx);
+  spotify_token_response_t token = {};
+  spotify_host_t* host = spotify_host_take(SPOTIFY_HOST_ACCOUNTS);
+  spotify_request_t* request = spotify_request_take(SPOTIFY_RESPONSE_TOKEN, &token);
 
-  char* const spotify_header = (scratch_mem + strlen(spotify_url) + 1);
-  snprintf(spotify_header, SCRATCH_MEM_SIZE, "Bearer %s", spotify.access_token);
+  char* const spotify_url = host->scratch_mem;
+  const char* const body = spotify_build_token_request(host->scratch_mem, host->url);
 
-  esp_http_client_config_t config = {
-    .url = spotify_url,
-    .transport_type = HTTP_TRANSPORT_OVER_SSL,
-    .event_handler = spotify_http_event_handler,
-  };
-  esp_http_client_handle_t client = esp_http_client_init(&config);
-  esp_http_client_set_header(client, "Authorization", spotify_header);
-  esp_http_client_set_method(client, HTTP_METHOD_GET);
+  const esp_err_t err = spotify_perform(host, request, spotify_url, HTTP_METHOD_POST, NULL, body);
 
-  esp_err_t err = esp_http_client_perform(client);
+  spotify_request_give(request);
+  spotify_host_give(host);
 
-  if (err == ESP_OK)
+  return err == ESP_OK && token.access_token[0] != '\0';
+}
+
+void spotify_refresh_access_token(void)
+{
+  (void)spotify_token_refresh();
+}
+
+// The token requests are in progress or coming, the requests using the old token would fail.
+static void spotify_token_invalidate(void)
+{
+  (void)xEventGroupClearBits(token_events, TOKEN_FRESH_BIT);
+  if (token_task != NULL)
   {
-    ESP_LOGD(TAG, "Status = %d, content_length = %lld",
-             esp_http_client_get_status_code(client),
-             esp_http_client_get_content_length(client));
+    xTaskNotifyGive(token_task);
   }
+}
 
-  // Closing the connection.
-  esp_http_client_cleanup(client);
+// Due once it's stale or close to the expiry.
+static bool spotify_token_due(void)
+{
+  return (xEventGroupGetBits(token_events) & TOKEN_FRESH_BIT) == 0 ||
+         time(NULL) >= spotify_token_expires_at() - TOKEN_REFRESH_MARGIN_S;
 }
 
-static esp_err_t spotify_http_event_handler(esp_http_client_event_t *evt)
+/*
+ * The manager refreshes the token before it expires, so the requests never find it expired. Being
+ * the only one refreshing, it makes every caller wait for the same request.
+ */
+static void spotify_token_task(void* pvParameters)
 {
-  static uint32_t response_bytes_count = 0;
-  ESP_LOGD(TAG, "Handling response for client addr 0x%p", evt->client);
+  (void)pvParameters;
 
-  switch(evt->event_id) {
-    case HTTP_EVENT_ERROR:
-      ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
-      break;
-    case HTTP_EVENT_ON_CONNECTED:
-      ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
-      break;
-    case HTTP_EVENT_HEADER_SENT:
-      ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
-      break;
-    case HTTP_EVENT_REDIRECT:
-      ESP_LOGD(TAG, "HTTP_EVENT_REDIRECT");
-      break;
-    case HTTP_EVENT_ON_HEADER:
-      ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER");
-      ESP_LOGD(TAG, "%s : %s", evt->header_key, evt->header_value);
-      break;
-    case HTTP_EVENT_ON_DATA:
-      ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, chunk size %d", evt->data_len);
-      // Collect the data into a buffer. Remember that a response doesn't have to have
-      // data. It's HTTP so information can be stored in HEADERs.
-      memcpy(&response_buf[response_bytes_count], evt->data, evt->data_len);
-      response_bytes_count += evt->data_len;
+  while (1)
+  {
+    uint32_t wait_s = TOKEN_RETRY_S;
 
-      if (response_bytes_count >= RESPONSE_BUF_SIZE)
+    if (spotify_token_due())
+    {
+      if (spotify_token_refresh())
+      {
+        portENTER_CRITICAL(&token_lock);
+        token_stats.refreshes++;
+        portEXIT_CRITICAL(&token_lock);
+      }
+      else
       {
-        ESP_LOGE(TAG, "Not enough space in the response_buf... that's a yikes!");
-        memset(response_buf, 0, RESPONSE_BUF_SIZE);
-        response_bytes_count = 0;
+        ESP_LOGW(TAG, "Failed to refresh the access token, retrying in %u s", TOKEN_RETRY_S);
+        portENTER_CRITICAL(&token_lock);
+        token_stats.failures++;
+        portEXIT_CRITICAL(&token_lock);
+        // The old token keeps working until it expires.
+        if (time(NULL) >= spotify_token_expires_at())
+        {
+          (void)xEventGroupClearBits(token_events, TOKEN_FRESH_BIT);
+        }
+        (void)xEventGroupSetBits(token_events, TOKEN_FAILED_BIT);
       }
+    }
 
-      // if (!esp_http_client_is_chunked_response(evt->client)) {
-      //     printf("%.*s", evt->data_len, (char*)evt->data);
-      // }
-      break;
-    case HTTP_EVENT_ON_FINISH:
-      ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH, bytes to process %lu", response_bytes_count);
+    if (!spotify_token_due())
+    {
+      wait_s = spotify_token_expires_at() - TOKEN_REFRESH_MARGIN_S - time(NULL);
+    }
 
-      cJSON* response_json = NULL;
+    // Woken up early by a new token, an invalidated one or a waiting caller.
+    (void)ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_s * 1000));
+  }
+}
 
-      // cJSON_Parse mallocs memory! Remember to run cJSON_Delete.
-      response_json = cJSON_Parse(response_buf);
+void spotify_token_start(void)
+{
+  if (token_task != NULL)
+  {
+    return;
+  }
 
-      if (response_json == NULL)
-      {
-        ESP_LOGW(TAG, "cJSON_Parse failed to parse the response_buf");
-        goto bail;
-      }
+  spotify_token_load();
 
-      // First check for a possible failure.
-      cJSON* error = cJSON_GetObjectItem(response_json, "error");
+  // The refreshes are blocking requests, same stack as the tasks making the others.
+  BaseType_t xReturned = xTaskCreate(&spotify_token_task, "spotify_token",
+                                     16 * 1024 / 4,  // Stack size in words, not bytes.
+                                     NULL, 5, &token_task);
+  assert(xReturned == pdPASS);
+  (void)xReturned;
+}
 
-      if (error != NULL)
-      {
-        cJSON* error_message = cJSON_GetObjectItem(response_json, "message");
-        if (error_message != NULL)
-        {
-          char* error_message_value = cJSON_GetStringValue(error_message);
-          // It's more common for the token to expired than to mess up the request.
-          if (strcmp(error_message_value, "The access token expired") == 0)
-          {
-            ESP_LOGW(TAG, "The access token expired!");
-          }
-          else if (strcmp(error_message_value, "Only valid bearer authentication supported") == 0)
-          {
-            ESP_LOGW(TAG, "The access token is incorrect!");
-          }
-          spotify.fresh = false;
-        }
+bool spotify_wait_access_token(uint32_t timeout_ms)
+{
+  if (spotify_is_fresh_access_token())
+  {
+    return true;
+  }
 
-        goto bail;
-      }
+  portENTER_CRITICAL(&token_lock);
+  token_stats.waits++;
+  portEXIT_CRITICAL(&token_lock);
 
-      // The response contains the request that was sent under the href key.
-      cJSON* href = cJSON_GetObjectItem(response_json, "href");
+  // The bits left by the previous failure or by an expired token would end the wait right away.
+  // The manager can publish a new token since the check above, its bit has to stay then.
+  (void)xEventGroupClearBits(token_events, TOKEN_FAILED_BIT);
+  if (time(NULL) >= spotify_token_expires_at())
+  {
+    (void)xEventGroupClearBits(token_events, TOKEN_FRESH_BIT);
+  }
+  if (token_task != NULL)
+  {
+    xTaskNotifyGive(token_task);
+  }
 
-      if (href != NULL)
-      {
-        // TODO(michalc): this is fugly. The second strstr is here because otherwise we enter this
-        // when reading a song from a playlist but since the response isn't the same this crashes.
-        if (strstr(cJSON_GetStringValue(href), "playlists"))
-        {
-          cJSON* item = cJSON_GetArrayItem(cJSON_GetObjectItem(response_json, "items"), 0);
-          // This is where the 'get song from playlist' response goes.
-          if (strstr(cJSON_GetStringValue(href), "tracks"))
-          {
-            cJSON* track = cJSON_GetObjectItem(item, "track");
-            ESP_LOGI(TAG, "Storing a track ID %s in slot %lu",
-                          cJSON_GetStringValue(cJSON_GetObjectItem(track, "id")),
-                          (songs_queue_write_counter % MAX_SONGS_IN_QUEUE));
-            char* const write_to = songs_queue + (songs_queue_write_counter++ % MAX_SONGS_IN_QUEUE) * MAX_SONG_ID_LENGTH;
-            memcpy(write_to, cJSON_GetStringValue(cJSON_GetObjectItem(track, "id")), MAX_SONG_ID_LENGTH);
-          }
-          // This is where the 'get playlist by index' response goes.
-          else
-          {
-            ESP_LOGI(TAG, "Got a response for the playlist %s ID %s",
-                          cJSON_GetStringValue(cJSON_GetObjectItem(item, "name")),
-                          cJSON_GetStringValue(cJSON_GetObjectItem(item, "id")));
-            strncpy(spotify_context.playlist_id,
-                    cJSON_GetStringValue(cJSON_GetObjectItem(item, "id")),
-                    MAX_PLAYLIST_ID_LENGTH);
-            strncpy(spotify_context.playlist_name,
-                    cJSON_GetStringValue(cJSON_GetObjectItem(item, "name")),
-                    MAX_PLAYLIST_NAME_LENGTH);
-          }
-        }
-      }
+  (void)xEventGroupWaitBits(token_events, TOKEN_FRESH_BIT | TOKEN_FAILED_BIT, pdFALSE, pdFALSE,
+                            pdMS_TO_TICKS(timeout_ms));
+  return spotify_is_fresh_access_token();
+}
 
-      cJSON* access_token = cJSON_GetObjectItem(response_json, "access_token");
+spotify_token_stats_t spotify_get_token_stats(void)
+{
+  portENTER_CRITICAL(&token_lock);
+  spotify_token_stats_t stats = token_stats;
+  portEXIT_CRITICAL(&token_lock);
+  stats.expires_in_s = stats.refreshes > 0 || stats.loaded ?
+                       spotify_token_expires_at() - time(NULL) : 0;
+  return stats;
+}
 
-      if (access_token != NULL)
-      {
-        char* access_token_value = cJSON_GetStringValue(access_token);
-        if (access_token_value)
-        {
-          ESP_LOGI(TAG, "Storing a new access token");
-          strncpy(spotify.access_token, access_token_value, strlen(access_token_value));
-          spotify.fresh = true;
-        }
+/*
+ * Build an API request in the scratch memory: the URL at the beginning and the authorization
+ * header after it. Returns the header.
+ */
+static const char* spotify_build_api_request(char* scratch_mem, const char* path_fmt,
+                                             va_list args)
+{
+  int url_len = snprintf(scratch_mem, SCRATCH_MEM_SIZE, "%s", hosts[SPOTIFY_HOST_API].url);
+  url_len += vsnprintf(scratch_mem + url_len, SCRATCH_MEM_SIZE - url_len, path_fmt, args);
+
+  char* const header = scratch_mem + url_len + 1;
+  // The manager can be storing a new token meanwhile.
+  char access_token[sizeof(spotify.access_token)];
+  portENTER_CRITICAL(&token_lock);
+  memcpy(access_token, spotify.access_token, sizeof(access_token));
+  portEXIT_CRITICAL(&token_lock);
+  snprintf(header, SCRATCH_MEM_SIZE - url_len - 1, "Bearer %s", access_token);
+  return header;
+}
 
-        goto bail;
-      }
+/*
+ * The API requests differ only by the path, the method and the kind of the response. Takes
+ * a request context and the API host, builds the authorization header and performs the request.
+ * The path is a printf format.
+ */
+static esp_err_t spotify_api_request(spotify_response_e kind, void* output,
+                                     esp_http_client_method_t method, const char* path_fmt, ...)
+  __attribute__((format(printf, 4, 5)));
 
-      cJSON* is_playing = NULL;
+static esp_err_t spotify_api_request(spotify_response_e kind, void* output,
+                                     esp_http_client_method_t method, const char* path_fmt, ...)
+{
+  spotify_host_t* host = spotify_host_take(SPOTIFY_HOST_API);
+  spotify_request_t* request = spotify_request_take(kind, output);
 
-      is_playing = cJSON_GetObjectItem(response_json, "is_playing");
-      if (is_playing)
-      {
-        if (cJSON_IsBool(is_playing))
-        {
-          if (cJSON_IsTrue(is_playing))
-          {
-            spotify_context.is_playing = 1;
-          }
-          else
-          {
-            spotify_context.is_playing = 0;
-          }
-        }
-      }
+  char* const spotify_url = host->scratch_mem;
+  va_list args;
+  va_start(args, path_fmt);
+  const char* const spotify_header = spotify_build_api_request(host->scratch_mem, path_fmt, args);
+  va_end(args);
 
-      // Print the raw response data.
-      ESP_LOGD(TAG, "\n%.*s\n", (int)response_bytes_count, response_buf);
+  const esp_err_t err =
+    spotify_perform(host, request, spotify_url, method, spotify_header, NULL);
 
-      cJSON* item = cJSON_GetObjectItem(response_json, "item");
-      cJSON* artists = cJSON_GetObjectItem(item, "artists");
-      artists = cJSON_GetArrayItem(artists, 0);
-      cJSON* artist_name = cJSON_GetObjectItem(artists, "name");
-      cJSON* song_title = cJSON_GetObjectItem(item, "name");
-      cJSON* song_id = cJSON_GetObjectItem(item, "id");
+  spotify_request_give(request);
+  spotify_host_give(host);
 
-      // NOTE(michalc): the size of spotify_context.artist buffer is 64.
-      if (cJSON_GetStringValue(artist_name))
-      {
-        strncpy(spotify_context.artist, cJSON_GetStringValue(artist_name), MAX_ARTIST_NAME_LENGTH);
-      }
+  return err;
+}
 
-      if (cJSON_GetStringValue(song_title))
-      {
-        strncpy(spotify_context.song_title, cJSON_GetStringValue(song_title), MAX_SONG_TITLE_LENGTH);
-      }
+/*
+ * The writers take the lock, change a copy of the state and publish it. Publishing a copy which
+ * didn't change leaves the version as it is.
+ */
+static spotify_state_t spotify_state_write_begin(void)
+{
+  portENTER_CRITICAL(&state_lock);
+  return state;
+}
 
-      if (cJSON_GetStringValue(song_id))
-      {
-        strncpy(spotify_context.song_id, cJSON_GetStringValue(song_id), MAX_SONG_ID_LENGTH);
-      }
+static void spotify_state_write_end(const spotify_state_t* next)
+{
+  if (memcmp(next, &state, sizeof(spotify_state_t)) != 0)
+  {
+    seqlock_write_begin(&state_seqlock);
+    memcpy(&state, next, sizeof(spotify_state_t));
+    seqlock_write_end(&state_seqlock);
+  }
+  portEXIT_CRITICAL(&state_lock);
+}
 
-bail:
-      if(response_json) cJSON_Delete(response_json);
-      memset(response_buf, 0, RESPONSE_BUF_SIZE);
-      response_bytes_count = 0;
+void spotify_get_state(spotify_state_t* out)
+{
+  uint32_t sequence;
+
+  do
+  {
+    sequence = seqlock_read_begin(&state_seqlock);
+    memcpy(out, &state, sizeof(spotify_state_t));
+  } while (seqlock_read_retry(&state_seqlock, sequence));
+
+  out->version = sequence / 2;
+}
+
+uint32_t spotify_get_state_version(void)
+{
+  return seqlock_version(&state_seqlock);
+}
+
+void spotify_set_playlist(const char* id, const char* name)
+{
+  spotify_state_t next = spotify_state_write_begin();
+  snprintf(next.playlist_id, sizeof(next.playlist_id), "%s", id);
+  snprintf(next.playlist_name, sizeof(next.playlist_name), "%s", name);
+  spotify_state_write_end(&next);
+}
+
+static void spotify_player_complete(spotify_request_t* request)
+{
+  const spotify_player_response_t* player = (const spotify_player_response_t*)request->output;
+
+  // Nothing is playing when the response has no body.
+  if (request->fields[0].matches == 0)
+  {
+    return;
+  }
+
+  spotify_state_t next = spotify_state_write_begin();
+  next.is_playing = strcmp(player->is_playing, "true") == 0 ? 1 : 0;
+
+  // The item is null during the ads, the last song stays then.
+  if (request->fields[3].matches > 0)
+  {
+    memcpy(next.artist, player->artist, sizeof(next.artist));
+    memcpy(next.song_title, player->song_title, sizeof(next.song_title));
+    memcpy(next.song_id, player->song_id, sizeof(next.song_id));
+  }
+  spotify_state_write_end(&next);
+}
+
+void spotify_query(void)
+{
+  spotify_player_response_t player = {};
+  (void)spotify_api_request(SPOTIFY_RESPONSE_PLAYER, &player, HTTP_METHOD_GET, "/v1/me/player");
+}
+
+void spotify_enqueue_song(const char* const song_id, const uint8_t song_id_len)
+{
+  (void)spotify_api_request(SPOTIFY_RESPONSE_NONE, NULL, HTTP_METHOD_POST,
+                            "/v1/me/player/queue?uri=spotify:track:%.*s", song_id_len, song_id);
+  spotify_poll_kick();
+}
+
+void spotify_next_song(void)
+{
+  (void)spotify_api_request(SPOTIFY_RESPONSE_NONE, NULL, HTTP_METHOD_POST, "/v1/me/player/next");
+  spotify_poll_kick();
+}
+
+// Not playing, or the poll failed.
+#define POLL_IDLE_MS        (15000U)
+// The longest a poll waits in the middle of a track.
+#define POLL_MAX_MS         (30000U)
+// How long before the track's end the poll gets tight, and how long after the end it looks for
+// the next track.
+#define POLL_END_MARGIN_MS  (2000U)
+#define POLL_AFTER_END_MS   (500U)
+
+static void spotify_now_playing_complete(spotify_request_t* request)
+{
+  spotify_now_playing_response_t* response = (spotify_now_playing_response_t*)request->output;
+  bool changed = false;
+  uint32_t progress_ms = 0;
+
+  response->bytes = request->response_bytes_count;
+  response->published = true;
+
+  spotify_state_t next = spotify_state_write_begin();
+  next.fetched_us = esp_timer_get_time();
+  // No body (204) when nothing is playing. The last song stays, like with the ads' null item.
+  next.is_playing = 0;
+  if (request->fields[0].matches > 0)
+  {
+    next.is_playing = strcmp(response->is_playing, "true") == 0 ? 1 : 0;
+    next.progress_ms = progress_ms = strtoul(response->progress_ms, NULL, 10);
+    next.duration_ms = strtoul(response->duration_ms, NULL, 10);
+  }
+  if (request->fields[3].matches > 0)
+  {
+    changed = strcmp(next.song_id, response->song_id) != 0;
+    memcpy(next.song_id, response->song_id, sizeof(next.song_id));
+    memcpy(next.song_title, response->song_title, sizeof(next.song_title));
+    memcpy(next.artist, response->artist, sizeof(next.artist));
+  }
+  spotify_state_write_end(&next);
+
+  if (changed)
+  {
+    // The track started progress_ms ago, that's how late the poll noticed.
+    portENTER_CRITICAL(&poll_lock);
+    poll_stats.changes++;
+    poll_stats.change_lag_sum_ms += progress_ms;
+    if (progress_ms > poll_stats.change_lag_max_ms)
+    {
+      poll_stats.change_lag_max_ms = progress_ms;
+    }
+    portEXIT_CRITICAL(&poll_lock);
+  }
+}
+
+/*
+ * A poll is done, the blocking or the asynchronous one. Work out when to poll next and count the
+ * poll in.
+ */
+static uint32_t spotify_poll_finish(int64_t now_us, esp_err_t err,
+                                    const spotify_now_playing_response_t* response)
+{
+  uint32_t next_ms = POLL_IDLE_MS;
+
+  spotify_state_t now;
+  spotify_get_state(&now);
+
+  if (err == ESP_OK && response->published && now.is_playing == 1 && now.duration_ms > 0)
+  {
+    const uint32_t remaining_ms =
+      now.duration_ms > now.progress_ms ? now.duration_ms - now.progress_ms : 0;
+
+    if (remaining_ms > POLL_END_MARGIN_MS)
+    {
+      // Sparse in the middle of the track, tight towards its end.
+      next_ms = remaining_ms - POLL_END_MARGIN_MS;
+      next_ms = next_ms < POLL_MAX_MS ? next_ms : POLL_MAX_MS;
+    }
+    else
+    {
+      next_ms = remaining_ms + POLL_AFTER_END_MS;
+    }
+  }
+
+  portENTER_CRITICAL(&poll_lock);
+  if (poll_stats.first_poll_us == 0)
+  {
+    poll_stats.first_poll_us = now_us;
+  }
+  poll_stats.polls++;
+  poll_stats.failures += (err == ESP_OK && response->published) ? 0 : 1;
+  poll_stats.bytes += response->bytes;
+  if (next_ms > poll_stats.interval_max_ms)
+  {
+    poll_stats.interval_max_ms = next_ms;
+  }
+  poll_next_ms = next_ms;
+  portEXIT_CRITICAL(&poll_lock);
+
+  return next_ms;
+}
+
+uint32_t spotify_poll_now_playing(void)
+{
+  spotify_now_playing_response_t response = {};
+  const int64_t now_us = esp_timer_get_time();
+
+  const esp_err_t err = spotify_api_request(SPOTIFY_RESPONSE_NOW_PLAYING, &response,
+                                            HTTP_METHOD_GET,
+                                            "/v1/me/player/currently-playing?market=from_token");
+
+  return spotify_poll_finish(now_us, err, &response);
+}
+
+uint32_t spotify_poll_next_ms(void)
+{
+  portENTER_CRITICAL(&poll_lock);
+  const uint32_t next_ms = poll_next_ms > 0 ? poll_next_ms : POLL_IDLE_MS;
+  portEXIT_CRITICAL(&poll_lock);
+  return next_ms;
+}
+
+void spotify_poll_wait(uint32_t timeout_ms)
+{
+  (void)xSemaphoreTake(poll_kick, pdMS_TO_TICKS(timeout_ms));
+}
+
+void spotify_poll_kick(void)
+{
+  (void)xSemaphoreGive(poll_kick);
+}
+
+spotify_poll_stats_t spotify_get_poll_stats(void)
+{
+  portENTER_CRITICAL(&poll_lock);
+  const spotify_poll_stats_t stats = poll_stats;
+  portEXIT_CRITICAL(&poll_lock);
+  return stats;
+}
+
+// The most the API gives in one page of playlists, and of a playlist's tracks.
+#define PLAYLISTS_PAGE_LIMIT  (50)
+#define TRACKS_PAGE_LIMIT     (100)
+
+/*
+ * The pages' next is a full URL. Take its path if it's on the configured host. It isn't when
+ * that's a stand-in, the callers then ask for the same page by its offset.
+ */
+static bool spotify_path_from_next(char* path, size_t path_size, const char* next)
+{
+  const char* const api_url = hosts[SPOTIFY_HOST_API].url;
+  const size_t api_url_len = strlen(api_url);
+
+  if (strncmp(next, api_url, api_url_len) != 0)
+  {
+    return false;
+  }
+
+  snprintf(path, path_size, "%s", next + api_url_len);
+  return true;
+}
+
+static void spotify_page_flush(spotify_playlists_page_t* page)
+{
+  if (page->item_index != UINT32_MAX && page->has_id && page->has_name && !page->stopped)
+  {
+    page->listed++;
+    page->stopped = !page->sink(page->user_data, &page->item);
+  }
+  page->item_index = UINT32_MAX;
+}
+
+static spotify_playlist_t* spotify_page_item(spotify_playlists_page_t* page, uint32_t index)
+{
+  if (index != page->item_index)
+  {
+    spotify_page_flush(page);
+    page->item_index = index;
+    page->has_id = false;
+    page->has_name = false;
+    memset(&page->item, 0, sizeof(page->item));
+  }
+  if (index + 1 > page->items)
+  {
+    page->items = index + 1;
+  }
+  return &page->item;
+}
+
+static void spotify_page_id(void* user_data, uint32_t index, const char* value, size_t length)
+{
+  spotify_playlists_page_t* page = (spotify_playlists_page_t*)user_data;
+  spotify_playlist_t* item = spotify_page_item(page, index);
+
+  snprintf(item->id, sizeof(item->id), "%.*s", (int)length, value);
+  page->has_id = true;
+}
+
+static void spotify_page_name(void* user_data, uint32_t index, const char* value, size_t length)
+{
+  spotify_playlists_page_t* page = (spotify_playlists_page_t*)user_data;
+  spotify_playlist_t* item = spotify_page_item(page, index);
+
+  snprintf(item->name, sizeof(item->name), "%.*s", (int)length, value);
+  page->has_name = true;
+}
+
+static void spotify_page_snapshot(void* user_data, uint32_t index, const char* value,
+                                  size_t length)
+{
+  spotify_playlists_page_t* page = (spotify_playlists_page_t*)user_data;
+  spotify_playlist_t* item = spotify_page_item(page, index);
+
+  snprintf(item->snapshot_id, sizeof(item->snapshot_id), "%.*s", (int)length, value);
+}
+
+static void spotify_page_tracks(void* user_data, uint32_t index, const char* value, size_t length)
+{
+  spotify_playlists_page_t* page = (spotify_playlists_page_t*)user_data;
+  spotify_playlist_t* item = spotify_page_item(page, index);
+  char number[12];
+
+  snprintf(number, sizeof(number), "%.*s", (int)length, value);
+  item->tracks = strtoul(number, NULL, 10);
+}
+
+bool spotify_list_playlists(spotify_playlist_sink_t sink, void* user_data)
+{
+  spotify_playlists_page_t page = { .sink = sink, .user_data = user_data };
+  char path[sizeof(page.next)];
+  uint32_t offset = 0;
+  uint32_t requests = 0;
+  bool complete = false;
+
+  snprintf(path, sizeof(path), "/v1/me/playlists?limit=%d&offset=0", PLAYLISTS_PAGE_LIMIT);
+
+  for (;;)
+  {
+    page.items = 0;
+    page.item_index = UINT32_MAX;
+    page.next[0] = '\0';
+    page.total[0] = '\0';
+
+    const esp_err_t err =
+      spotify_api_request(SPOTIFY_RESPONSE_PLAYLISTS_PAGE, &page, HTTP_METHOD_GET, "%s", path);
+    spotify_page_flush(&page);
+    requests++;
+
+    // Without the total it's an error response, not a page.
+    if (err != ESP_OK || page.total[0] == '\0')
+    {
+      break;
+    }
+
+    if (page.stopped || page.items == 0)
+    {
+      complete = true;
+      break;
+    }
+
+    // The next is null on the last page.
+    offset += page.items;
+    if (page.next[0] == '\0' || offset >= strtoul(page.total, NULL, 10))
+    {
+      complete = true;
+      break;
+    }
+
+    if (!spotify_path_from_next(path, sizeof(path), page.next))
+    {
+      snprintf(path, sizeof(path), "/v1/me/playlists?limit=%d&offset=%lu", PLAYLISTS_PAGE_LIMIT,
+               offset);
+    }
+  }
+
+  ESP_LOGI(TAG, "Listed %lu playlists in %lu requests%s", page.listed, requests,
+           complete ? "" : ", incomplete");
+
+  return complete;
+}
+
+static void spotify_page_track(void* user_data, uint32_t index, const char* value, size_t length)
+{
+  spotify_tracks_page_t* page = (spotify_tracks_page_t*)user_data;
+  spotify_id_t id;
+  (void)index;
+
+  if (page->out_of_memory)
+  {
+    return;
+  }
+
+  if (!spotify_id_from_base62(value, length, &id))
+  {
+    page->skipped++;
+    return;
+  }
+
+  if (!spotify_track_table_append(page->table, &id))
+  {
+    page->out_of_memory = true;
+    return;
+  }
+  page->loaded++;
+}
+
+uint32_t spotify_load_playlist_tracks(const char* playlist_id, spotify_track_table_t* table)
+{
+  // Only what the table needs, the full track objects are a few KB each.
+  static const char* const filter = "fields=items(track(id)),next,total";
+  spotify_tracks_page_t page = { .table = table };
+  char path[sizeof(page.next)];
+  uint32_t offset = 0;
+  uint32_t requests = 0;
+
+  snprintf(path, sizeof(path), "/v1/playlists/%.*s/tracks?%s&limit=%d&offset=0",
+           MAX_PLAYLIST_ID_LENGTH, playlist_id, filter, TRACKS_PAGE_LIMIT);
+
+  for (;;)
+  {
+    page.next[0] = '\0';
+    page.total[0] = '\0';
+
+    const esp_err_t err =
+      spotify_api_request(SPOTIFY_RESPONSE_TRACKS_PAGE, &page, HTTP_METHOD_GET, "%s", path);
+    requests++;
+
+    if (err != ESP_OK || page.out_of_memory)
+    {
+      break;
+    }
+
+    // Only the last page isn't full, its next is null.
+    offset += TRACKS_PAGE_LIMIT;
+    if (page.next[0] == '\0' || offset >= strtoul(page.total, NULL, 10))
+    {
+      break;
+    }
+
+    if (!spotify_path_from_next(path, sizeof(path), page.next))
+    {
+      snprintf(path, sizeof(path), "/v1/playlists/%.*s/tracks?%s&limit=%d&offset=%lu",
+               MAX_PLAYLIST_ID_LENGTH, playlist_id, filter, TRACKS_PAGE_LIMIT, offset);
+    }
+  }
+
+  if (page.out_of_memory)
+  {
+    ESP_LOGW(TAG, "No memory for more than %lu tracks", table->count);
+  }
+  ESP_LOGI(TAG, "Loaded %lu tracks (%lu skipped) in %lu requests, %lu bytes", page.loaded,
+           page.skipped, requests, table->capacity * (uint32_t)sizeof(spotify_id_t));
+
+  return page.loaded;
+}
+
+/*
+ * Reserve a free slot, preferring one whose client is connected to the host already. Never
+ * blocks, returns NULL when all the slots are busy.
+ */
+static spotify_slot_t* spotify_slot_reserve(spotify_host_e host_id)
+{
+  spotify_slot_t* slot = NULL;
+
+  portENTER_CRITICAL(&slots_lock);
+  for (uint8_t i = 0; i < MAX_ASYNC_REQUESTS; i++)
+  {
+    if (slots[i].state == SLOT_FREE &&
+        (slot == NULL || (slots[i].client != NULL && slots[i].client_host_id == host_id)))
+    {
+      slot = &slots[i];
+    }
+  }
+  if (slot != NULL)
+  {
+    slot->state = SLOT_RESERVED;
+    async_stats.submitted++;
+  }
+  else
+  {
+    async_stats.rejected++;
+  }
+  portEXIT_CRITICAL(&slots_lock);
+
+  return slot;
+}
+
+/*
+ * Hand a reserved slot, with its request built in the scratch memory, over to the engine.
+ */
+static void spotify_slot_submit(spotify_slot_t* slot, spotify_host_e host_id,
+                                spotify_response_e kind, esp_http_client_method_t method,
+                                const char* authorization, const char* post_data,
+                                spotify_done_cb_t done, void* user_data)
+{
+  slot->host_id = host_id;
+  slot->kind = kind;
+  slot->method = method;
+  slot->authorization = authorization;
+  slot->post_data = post_data;
+  slot->done = done;
+  slot->user_data = user_data;
+  // The completions count on the output starting out empty, like the blocking requests' do.
+  memset(&slot->output, 0, sizeof(slot->output));
+
+  portENTER_CRITICAL(&slots_lock);
+  slot->state = SLOT_SUBMITTED;
+  portEXIT_CRITICAL(&slots_lock);
+
+  xTaskNotifyGive(async_task);
+}
+
+/*
+ * Set the slot's client up for the (next attempt at the) request. Returns false if there's no
+ * client to run it on.
+ */
+static bool spotify_slot_begin(spotify_slot_t* slot)
+{
+  const char* const url = slot->scratch_mem;
+
+  slot->reused = slot->client != NULL;
+  if (slot->client == NULL)
+  {
+    // The asynchronous mode works only over TLS. Over plain HTTP (a stand-in) the slot's
+    // requests block the engine for their round trips.
+    esp_http_client_config_t config = {
+      .url = url,
+      .event_handler = spotify_http_event_handler,
+      .user_data = slot->request,
+      .keep_alive_enable = true,
+      .is_async = strncmp(url, "https", 5) == 0,
+#ifdef CONFIG_SPOTIFY_TLS_SESSIONS
+      .transport = strncmp(url, "https", 5) == 0 ? slot->transport : NULL,
+#endif
+    };
+    slot->client = esp_http_client_init(&config);
+
+    if (slot->client == NULL)
+    {
+      return false;
+    }
+  }
+  else
+  {
+    // The client reconnects by itself if the slot served another host last time.
+    esp_http_client_set_url(slot->client, url);
+    esp_http_client_set_user_data(slot->client, slot->request);
+  }
+  slot->client_host_id = slot->host_id;
+
+  esp_http_client_set_method(slot->client, slot->method);
+  if (slot->authorization != NULL)
+  {
+    esp_http_client_set_header(slot->client, "Authorization", slot->authorization);
+  }
+  else
+  {
+    esp_http_client_delete_header(slot->client, "Authorization");
+  }
+  // The API takes JSON. Without the header the client makes the accounts service's body a form.
+  if (slot->post_data != NULL && slot->host_id == SPOTIFY_HOST_API)
+  {
+    esp_http_client_set_header(slot->client, "Content-Type", "application/json");
+  }
+  else
+  {
+    esp_http_client_delete_header(slot->client, "Content-Type");
+  }
+  esp_http_client_set_post_field(slot->client, slot->post_data,
+                                 slot->post_data ? strlen(slot->post_data) : 0);
+
+  spotify_request_begin(slot->request);
+  return true;
+}
+
+static void spotify_slot_complete(spotify_slot_t* slot, esp_err_t err)
+{
+  spotify_stats_record(&hosts[slot->host_id], slot->start_us, err);
+
+  if (err == ESP_OK)
+  {
+    spotify_request_finish(slot->request, slot->client);
+  }
+  if (slot->kind == SPOTIFY_RESPONSE_NOW_PLAYING)
+  {
+    (void)spotify_poll_finish(slot->start_us, err, &slot->output.now_playing);
+  }
+
+  if (slot->done != NULL)
+  {
+    slot->done(slot->user_data, err);
+  }
+
+  spotify_request_give(slot->request);
+  slot->request = NULL;
+
+  portENTER_CRITICAL(&slots_lock);
+  slot->state = SLOT_FREE;
+  async_stats.completed++;
+  async_stats.failed += err == ESP_OK ? 0 : 1;
+  portEXIT_CRITICAL(&slots_lock);
+}
+
+/*
+ * Move the slot's request along as far as it goes without blocking. Returns true while the
+ * request is still on the wire.
+ */
+static bool spotify_slot_step(spotify_slot_t* slot)
+{
+  const esp_err_t err = esp_http_client_perform(slot->client);
+
+  if (err == ESP_ERR_HTTP_EAGAIN)
+  {
+    return true;
+  }
+
+  if (err != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Async request to %s failed: %s", hosts[slot->host_id].name,
+             esp_err_to_name(err));
+    esp_http_client_cleanup(slot->client);
+    slot->client = NULL;
+
+    // Like the blocking requests, one more try on a fresh connection.
+    if (slot->attempt++ == 0 &&
+        spotify_request_may_retry(slot->request, slot->reused, slot->method, err) &&
+        spotify_slot_begin(slot))
+    {
+      return true;
+    }
+  }
+
+  spotify_slot_complete(slot, err);
+  return false;
+}
+
+/*
+ * The engine. Starts the submitted requests and keeps polling the running ones. Each one is on its
+ * own connection, so their round trips overlap. Sleeps while there's nothing on the wire.
+ */
+static void spotify_async_task(void* pvParameters)
+{
+  (void)pvParameters;
+
+  for (;;)
+  {
+    uint8_t running = 0;
+
+    for (uint8_t i = 0; i < MAX_ASYNC_REQUESTS; i++)
+    {
+      spotify_slot_t* slot = &slots[i];
+
+      portENTER_CRITICAL(&slots_lock);
+      const spotify_slot_state_e state = slot->state;
+      portEXIT_CRITICAL(&slots_lock);
+
+      if (state == SLOT_SUBMITTED)
+      {
+        // There's always a context left for the slots, see MAX_REQUESTS_IN_FLIGHT.
+        slot->request = spotify_request_take(slot->kind, &slot->output);
+        slot->request->host = &hosts[slot->host_id];
+        slot->attempt = 0;
+        slot->start_us = esp_timer_get_time();
+        slot->state = SLOT_RUNNING;
+
+        if (!spotify_slot_begin(slot))
+        {
+          spotify_slot_complete(slot, ESP_FAIL);
+          continue;
+        }
+      }
+      else if (state != SLOT_RUNNING)
+      {
+        continue;
+      }
+
+      if (spotify_slot_step(slot))
+      {
+        running++;
+      }
+    }
+
+    portENTER_CRITICAL(&slots_lock);
+    if (running > async_stats.in_flight_max)
+    {
+      async_stats.in_flight_max = running;
+    }
+    portEXIT_CRITICAL(&slots_lock);
+
+    // A submission wakes the engine up right away. While waiting for the responses it polls every
+    // tick.
+    (void)ulTaskNotifyTake(pdTRUE, running > 0 ? 1 : portMAX_DELAY);
+  }
+}
+
+void spotify_async_start(void)
+{
+  if (async_task != NULL)
+  {
+    return;
+  }
+
+  // Same stack as the tasks making the blocking requests, it's the TLS which needs it.
+  BaseType_t xReturned = xTaskCreate(&spotify_async_task, "spotify_async",
+                                     16 * 1024 / 4,  // Stack size in words, not bytes.
+                                     NULL, 5, &async_task);
+  assert(xReturned == pdPASS);
+  (void)xReturned;
+}
+
+bool spotify_refresh_access_token_async(spotify_done_cb_t done, void* user_data)
+{
+  spotify_slot_t* slot = spotify_slot_reserve(SPOTIFY_HOST_ACCOUNTS);
+  if (slot == NULL)
+  {
+    return false;
+  }
+
+  const char* const body =
+    spotify_build_token_request(slot->scratch_mem, hosts[SPOTIFY_HOST_ACCOUNTS].url);
+  spotify_slot_submit(slot, SPOTIFY_HOST_ACCOUNTS, SPOTIFY_RESPONSE_TOKEN, HTTP_METHOD_POST, NULL,
+                      body, done, user_data);
+  return true;
+}
+
+/*
+ * The asynchronous counterpart of spotify_api_request. The body is JSON, it can be NULL. Returns
+ * false when all the slots are busy.
+ */
+static bool spotify_api_request_async(spotify_response_e kind, esp_http_client_method_t method,
+                                      const char* body, spotify_done_cb_t done, void* user_data,
+                                      const char* path_fmt, ...)
+  __attribute__((format(printf, 6, 7)));
+
+static bool spotify_api_request_async(spotify_response_e kind, esp_http_client_method_t method,
+                                      const char* body, spotify_done_cb_t done, void* user_data,
+                                      const char* path_fmt, ...)
+{
+  spotify_slot_t* slot = spotify_slot_reserve(SPOTIFY_HOST_API);
+  if (slot == NULL)
+  {
+    return false;
+  }
+
+  va_list args;
+  va_start(args, path_fmt);
+  const char* const header = spotify_build_api_request(slot->scratch_mem, path_fmt, args);
+  va_end(args);
+
+  // The body goes after the header.
+  char* post_data = NULL;
+  if (body != NULL)
+  {
+    post_data = (char*)header + strlen(header) + 1;
+    snprintf(post_data, SCRATCH_MEM_SIZE - (post_data - slot->scratch_mem), "%s", body);
+  }
+
+  spotify_slot_submit(slot, SPOTIFY_HOST_API, kind, method, header, post_data, done, user_data);
+  return true;
+}
+
+bool spotify_query_async(spotify_done_cb_t done, void* user_data)
+{
+  return spotify_api_request_async(SPOTIFY_RESPONSE_PLAYER, HTTP_METHOD_GET, NULL, done,
+                                   user_data, "/v1/me/player");
+}
+
+bool spotify_poll_now_playing_async(spotify_done_cb_t done, void* user_data)
+{
+  return spotify_api_request_async(SPOTIFY_RESPONSE_NOW_PLAYING, HTTP_METHOD_GET, NULL, done,
+                                   user_data, "/v1/me/player/currently-playing?market=from_token");
+}
+
+bool spotify_enqueue_song_async(const char* const song_id, const uint8_t song_id_len,
+                                spotify_done_cb_t done, void* user_data)
+{
+  return spotify_api_request_async(SPOTIFY_RESPONSE_NONE, HTTP_METHOD_POST, NULL, done,
+                                   user_data, "/v1/me/player/queue?uri=spotify:track:%.*s",
+                                   song_id_len, song_id);
+}
+
+bool spotify_play_context_async(const char* type, const char* id, spotify_done_cb_t done,
+                                void* user_data)
+{
+  char body[64];
+  snprintf(body, sizeof(body), "{\"context_uri\":\"spotify:%s:%.*s\"}", type,
+           (int)MAX_PLAYLIST_ID_LENGTH, id);
+  return spotify_api_request_async(SPOTIFY_RESPONSE_NONE, HTTP_METHOD_PUT, body, done, user_data,
+                                   "/v1/me/player/play");
+}
+
+bool spotify_play_pause_async(spotify_done_cb_t done, void* user_data)
+{
+  spotify_state_t now;
+  spotify_get_state(&now);
+
+  // Unknown (0xFF) until the first poll, then it's better to start playing.
+  return spotify_api_request_async(SPOTIFY_RESPONSE_NONE, HTTP_METHOD_PUT, NULL, done, user_data,
+                                   now.is_playing == 1 ? "/v1/me/player/pause"
+                                                       : "/v1/me/player/play");
+}
+
+bool spotify_next_song_async(spotify_done_cb_t done, void* user_data)
+{
+  return spotify_api_request_async(SPOTIFY_RESPONSE_NONE, HTTP_METHOD_POST, NULL, done, user_data,
+                                   "/v1/me/player/next");
+}
+
+bool spotify_previous_song_async(spotify_done_cb_t done, void* user_data)
+{
+  return spotify_api_request_async(SPOTIFY_RESPONSE_NONE, HTTP_METHOD_POST, NULL, done, user_data,
+                                   "/v1/me/player/previous");
+}
+
+spotify_async_stats_t spotify_get_async_stats(void)
+{
+  portENTER_CRITICAL(&slots_lock);
+  const spotify_async_stats_t stats = async_stats;
+  portEXIT_CRITICAL(&slots_lock);
+  return stats;
+}
+
+spotify_stats_t spotify_get_stats(spotify_host_e host)
+{
+  portENTER_CRITICAL(&stats_lock);
+  const spotify_stats_t stats = hosts[host].stats;
+  portEXIT_CRITICAL(&stats_lock);
+  return stats;
+}
+
+void spotify_log_stats(void)
+{
+  for (uint8_t i = 0; i < SPOTIFY_HOST_COUNT; i++)
+  {
+    const spotify_stats_t stats = spotify_get_stats(i);
+    const spotify_stats_t* s = &stats;
+    const uint32_t requests = s->requests > 0 ? s->requests : 1;
+    const uint32_t handshakes = s->handshakes > 0 ? s->handshakes : 1;
+    // Every request which didn't need a handshake used a connection which was open already.
+    const uint32_t reused = s->requests > s->handshakes ? s->requests - s->handshakes : 0;
+
+    ESP_LOGI(TAG, "%s: requests %lu, failed %lu, latency avg %llu us max %lu us",
+             hosts[i].name, s->requests, s->failures, s->latency_sum_us / requests,
+             s->latency_max_us);
+    ESP_LOGI(TAG, "%s: handshakes %lu, connect avg %llu us max %lu us, reused %lu%%",
+             hosts[i].name, s->handshakes, s->connect_sum_us / handshakes, s->connect_max_us,
+             100 * reused / requests);
+  }
+
+  const spotify_async_stats_t a = spotify_get_async_stats();
+  ESP_LOGI(TAG, "async: submitted %lu, rejected %lu, completed %lu, failed %lu, in flight max %lu",
+           a.submitted, a.rejected, a.completed, a.failed, a.in_flight_max);
+
+  const spotify_token_stats_t t = spotify_get_token_stats();
+  ESP_LOGI(TAG, "token: refreshes %lu, failed %lu, callers waited %lu, stored %s, expires in %lld s",
+           t.refreshes, t.failures, t.waits, t.loaded ? "yes" : "no", t.expires_in_s);
+
+  const spotify_poll_stats_t p = spotify_get_poll_stats();
+  spotify_state_t now;
+  spotify_get_state(&now);
+  const int64_t elapsed_us = esp_timer_get_time() - p.first_poll_us;
+  const uint64_t bytes_per_hour =
+    (p.first_poll_us > 0 && elapsed_us > 0) ? p.bytes * 3600000000ULL / elapsed_us : 0;
+  const uint32_t changes = p.changes > 0 ? p.changes : 1;
+  ESP_LOGI(TAG, "poll: polls %lu, failed %lu, %llu bytes/h, interval max %lu ms, state age %lld ms",
+           p.polls, p.failures, bytes_per_hour, p.interval_max_ms,
+           now.fetched_us > 0 ? (esp_timer_get_time() - now.fetched_us) / 1000 : -1);
+  ESP_LOGI(TAG, "poll: track changes %lu, noticed late by avg %lu ms max %lu ms",
+           p.changes, (uint32_t)(p.change_lag_sum_ms / changes), p.change_lag_max_ms);
+
+#ifdef CONFIG_SPOTIFY_TLS_SESSIONS
+  spotify_tls_log_stats();
+#endif
+}
+
+static esp_err_t spotify_http_event_handler(esp_http_client_event_t *evt)
+{
+  spotify_request_t* request = (spotify_request_t*)evt->user_data;
+  spotify_host_t* host = request->host;
+  ESP_LOGD(TAG, "Handling response for client addr 0x%p", evt->client);
+
+  switch(evt->event_id) {
+    case HTTP_EVENT_ERROR:
+      ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
+      break;
+    case HTTP_EVENT_ON_CONNECTED:
+      ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
+      request->connected = true;
+      // A new connection, so a TLS handshake. spotify_tls tells the full ones from the resumed.
+      {
+        const uint32_t connect = esp_timer_get_time() - request->start_us;
+        portENTER_CRITICAL(&stats_lock);
+        host->stats.handshakes++;
+        host->stats.connect_sum_us += connect;
+        if (connect > host->stats.connect_max_us)
+        {
+          host->stats.connect_max_us = connect;
+        }
+        portEXIT_CRITICAL(&stats_lock);
+      }
+      break;
+    case HTTP_EVENT_HEADER_SENT:
+      ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
+      break;
+    case HTTP_EVENT_REDIRECT:
+      ESP_LOGD(TAG, "HTTP_EVENT_REDIRECT");
+      break;
+    case HTTP_EVENT_ON_HEADER:
+      ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER");
+      ESP_LOGD(TAG, "%s : %s", evt->header_key, evt->header_value);
+      break;
+    case HTTP_EVENT_ON_DATA:
+      ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, chunk size %d", evt->data_len);
+      // Remember that a response doesn't have to have data. It's HTTP so information can be
+      // stored in HEADERs.
+      request->response_bytes_count += evt->data_len;
+      // Once the response turns out malformed the extractor ignores the rest of it.
+      (void)json_stream_feed(&request->json, (const char*)evt->data, evt->data_len);
+      break;
+    case HTTP_EVENT_ON_FINISH:
+      ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH, bytes processed %lu", request->response_bytes_count);
       break;
     case HTTP_EVENT_DISCONNECTED:
       ESP_LOGD(TAG, "HTTP_EVENT_DISCONNECTED");
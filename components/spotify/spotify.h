@@ -5,6 +5,10 @@
 #ifndef SPOTIFY_H
 #define SPOTIFY_H
 
+#include "esp_err.h"
+
+#include "spotify_id.h"
+
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -16,26 +20,114 @@
 
 typedef struct spotify_access_t
 {
-  uint8_t fresh;
+  // When the access token expires, in time(NULL) seconds.
+  int64_t expires_at;
   char client_id[128];
   char client_secret[128];
   char refresh_token[256];
   char access_token[256];
 } spotify_access_t;
 
-typedef struct spotify_context_t
+/*
+ * What the module knows about the player and the current playlist. spotify_get_state gives
+ * consistent copies of it: the song ID always goes with its title, never with the previous one's.
+ */
+typedef struct spotify_state_t
 {
+  // Bumped by every change, the polls' progress included. The same version means the same state.
+  uint32_t version;
+  // 0xFF until the first query or poll.
   uint8_t is_playing;
+  uint32_t progress_ms;
+  uint32_t duration_ms;
+  // When the last poll's response came (esp_timer_get_time), 0 before the first one.
+  int64_t fetched_us;
   char artist[MAX_ARTIST_NAME_LENGTH];
   char song_title[MAX_SONG_TITLE_LENGTH];
-  char song_id[MAX_SONG_ID_LENGTH];
-  char playlist_id[MAX_PLAYLIST_ID_LENGTH];
+  // The IDs are NUL terminated.
+  char song_id[MAX_SONG_ID_LENGTH + 1];
+  char playlist_id[MAX_PLAYLIST_ID_LENGTH + 1];
   char playlist_name[MAX_PLAYLIST_ID_LENGTH];
-} spotify_context_t;
+} spotify_state_t;
+
+// The hosts the module talks to. Each one has its own connection.
+typedef enum
+{
+  SPOTIFY_HOST_API,
+  SPOTIFY_HOST_ACCOUNTS,
+  SPOTIFY_HOST_COUNT,
+} spotify_host_e;
+
+typedef struct spotify_stats_t
+{
+  uint32_t requests;
+  uint32_t failures;
+  // New connections. With the connection kept alive it should stay far below requests.
+  uint32_t handshakes;
+  // From starting the request to being connected: DNS lookup, TCP connect and TLS handshake.
+  uint32_t connect_max_us;
+  uint64_t connect_sum_us;
+  // From starting the request to having the whole response, reconnecting included.
+  uint32_t latency_max_us;
+  uint64_t latency_sum_us;
+} spotify_stats_t;
+
+typedef struct spotify_poll_stats_t
+{
+  uint32_t polls;
+  uint32_t failures;
+  // The response bodies, for the bytes per hour.
+  uint64_t bytes;
+  int64_t first_poll_us;
+  uint32_t interval_max_ms;
+  // A new track is noticed by a poll somewhere into it. How far in is how stale the state was.
+  uint32_t changes;
+  uint32_t change_lag_max_ms;
+  uint64_t change_lag_sum_ms;
+} spotify_poll_stats_t;
+
+// A playlist, as the listing has it.
+typedef struct spotify_playlist_t
+{
+  char id[MAX_PLAYLIST_ID_LENGTH + 1];
+  // The extractor truncates the values to 64 bytes.
+  char name[64 + 1];
+  // Changes whenever the playlist does.
+  char snapshot_id[64 + 1];
+  uint32_t tracks;
+} spotify_playlist_t;
+
+/*
+ * Gets the playlists one by one. Return false to stop the listing.
+ */
+typedef bool (*spotify_playlist_sink_t)(void* user_data, const spotify_playlist_t* playlist);
+
+typedef struct spotify_async_stats_t
+{
+  uint32_t submitted;
+  // Submissions which found all the slots busy.
+  uint32_t rejected;
+  uint32_t completed;
+  uint32_t failed;
+  uint32_t in_flight_max;
+} spotify_async_stats_t;
+
+typedef struct spotify_token_stats_t
+{
+  uint32_t refreshes;
+  uint32_t failures;
+  // Callers which found the token stale and had to wait for a refresh.
+  uint32_t waits;
+  // The token came from NVS at the start.
+  bool loaded;
+  int64_t expires_in_s;
+} spotify_token_stats_t;
 
-// TODO(michalc): instead of making it extern and passing it every time it's probably better to
-// just operate on it inside the spotify module and never expose it.
-extern spotify_context_t spotify_context;
+/*
+ * Called from the engine's task once an asynchronous request is done. err is ESP_OK when the
+ * response came, the response's outcome is in the module's state (spotify_get_state, the token).
+ */
+typedef void (*spotify_done_cb_t)(void* user_data, esp_err_t err);
 
 /*
  * Init structures - mostly about setting the access tokens/codes.
@@ -43,19 +135,69 @@ extern spotify_context_t spotify_context;
 void spotify_init(void);
 
 /*
+ * True while the access token is there and not expired.
  */
 uint8_t spotify_is_fresh_access_token(void);
 
 /*
- * Use the refresh token to update the access token. Access token expires after 1 hour.
+ * Use the refresh token to update the access token. Access token expires after 1 hour. Blocks
+ * until the response comes, spotify_wait_access_token is the way for the tasks.
  */
 void spotify_refresh_access_token(void);
 
 /*
- * This updates the spotify_playback_t static structure.
+ * Start the token manager. It takes the token stored in NVS if it's still good (which needs the
+ * clock set) and from then on refreshes the token a couple of minutes before it expires.
+ */
+void spotify_token_start(void);
+
+/*
+ * Return true once there is a fresh access token, false if the refresh failed or took longer than
+ * the timeout. Whoever calls it while a refresh is in progress waits for that same refresh.
+ */
+bool spotify_wait_access_token(uint32_t timeout_ms);
+
+/*
+ * This updates the state's player part, see spotify_get_state.
  */
 void spotify_query(void);
 
+/*
+ * Poll /v1/me/player/currently-playing and publish what's playing. Returns in how many ms to poll
+ * next: sparse in the middle of a track, right after the track's end, rarely when nothing plays.
+ */
+uint32_t spotify_poll_now_playing(void);
+
+/*
+ * Wait for the next poll. The commands which change the playback (enqueue, next) cut the wait
+ * short.
+ */
+void spotify_poll_wait(uint32_t timeout_ms);
+
+/*
+ * In how many ms to poll next, as the last poll (either one) worked it out.
+ */
+uint32_t spotify_poll_next_ms(void);
+
+void spotify_poll_kick(void);
+
+/*
+ * Copy out the current state. Never blocks, not even while a response is being written into it.
+ */
+void spotify_get_state(spotify_state_t* state);
+
+/*
+ * Cheaper than spotify_get_state, to skip the work when nothing changed since the last copy.
+ */
+uint32_t spotify_get_state_version(void);
+
+/*
+ * Make the playlist the current one.
+ */
+void spotify_set_playlist(const char* id, const char* name);
+
+spotify_poll_stats_t spotify_get_poll_stats(void);
+
 /*
  * Push a song to the Spotify's queue.
  */
@@ -66,8 +208,59 @@ void spotify_enqueue_song(const char* const song_id, const uint8_t song_id_len);
  */
 void spotify_next_song(void);
 
-void spotify_get_playlist(const uint32_t playlist_idx);
+/*
+ * Load the playlist's track IDs into the table, after the ones which are in it already, 100 per
+ * request. Returns how many got added.
+ */
+uint32_t spotify_load_playlist_tracks(const char* playlist_id, spotify_track_table_t* table);
+
+/*
+ * List the user's playlists into the sink, a page of 50 per request. Follows the pages' next until
+ * the total or until the sink says stop. Returns false if a request failed before that.
+ */
+bool spotify_list_playlists(spotify_playlist_sink_t sink, void* user_data);
+
+/*
+ * Start the engine which runs the asynchronous requests. Their round trips overlap, each one is on
+ * its own connection. Call after spotify_init.
+ */
+void spotify_async_start(void);
+
+/*
+ * The asynchronous versions of the requests above. They never block, they return false when all
+ * the engine's slots are busy. The callback can be NULL.
+ */
+bool spotify_refresh_access_token_async(spotify_done_cb_t done, void* user_data);
+
+bool spotify_query_async(spotify_done_cb_t done, void* user_data);
+
+bool spotify_poll_now_playing_async(spotify_done_cb_t done, void* user_data);
+
+bool spotify_enqueue_song_async(const char* const song_id, const uint8_t song_id_len,
+                                spotify_done_cb_t done, void* user_data);
+
+/*
+ * Start playing an album or a playlist from its beginning. The type is "album" or "playlist", the
+ * id its base62 ID.
+ */
+bool spotify_play_context_async(const char* type, const char* id, spotify_done_cb_t done,
+                                void* user_data);
+
+/*
+ * Pause the playback if it's playing, resume it otherwise. Goes by the last poll's state.
+ */
+bool spotify_play_pause_async(spotify_done_cb_t done, void* user_data);
+
+bool spotify_next_song_async(spotify_done_cb_t done, void* user_data);
+
+bool spotify_previous_song_async(spotify_done_cb_t done, void* user_data);
+
+spotify_stats_t spotify_get_stats(spotify_host_e host);
+
+spotify_async_stats_t spotify_get_async_stats(void);
+
+spotify_token_stats_t spotify_get_token_stats(void);
 
-void spotify_get_playlist_song(const char* playlist_id, const uint32_t song_idx);
+void spotify_log_stats(void);
 
 #endif // SPOTIFY_H
@@ -0,0 +1,160 @@
+#include "spotify_id.h"
+
+#include "esp_heap_caps.h"
+
+#include <string.h>
+
+// The table's first allocation, in tracks.
+#define TRACK_TABLE_INITIAL_CAPACITY  (64U)
+
+static const char base62_digits[] =
+  "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+static int8_t spotify_base62_value(char c)
+{
+  if (c >= '0' && c <= '9')
+  {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'z')
+  {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'Z')
+  {
+    return c - 'A' + 36;
+  }
+  return -1;
+}
+
+bool spotify_id_from_base62(const char* base62, size_t length, spotify_id_t* id)
+{
+  // The number as 32 bit limbs, the most significant first.
+  uint32_t limbs[4] = {};
+
+  if (length != SPOTIFY_ID_BASE62_LENGTH)
+  {
+    return false;
+  }
+
+  for (size_t i = 0; i < length; i++)
+  {
+    const int8_t digit = spotify_base62_value(base62[i]);
+    if (digit < 0)
+    {
+      return false;
+    }
+
+    // limbs = limbs * 62 + digit
+    uint64_t carry = (uint64_t)digit;
+    for (int8_t l = 3; l >= 0; l--)
+    {
+      const uint64_t v = (uint64_t)limbs[l] * 62U + carry;
+      limbs[l] = (uint32_t)v;
+      carry = v >> 32;
+    }
+    // 22 base62 digits go a bit over 128 bits.
+    if (carry != 0)
+    {
+      return false;
+    }
+  }
+
+  for (uint8_t l = 0; l < 4; l++)
+  {
+    id->bytes[4 * l] = limbs[l] >> 24;
+    id->bytes[4 * l + 1] = limbs[l] >> 16;
+    id->bytes[4 * l + 2] = limbs[l] >> 8;
+    id->bytes[4 * l + 3] = limbs[l];
+  }
+  return true;
+}
+
+void spotify_id_to_base62(const spotify_id_t* id, char base62[SPOTIFY_ID_BASE62_LENGTH + 1])
+{
+  uint32_t limbs[4];
+  for (uint8_t l = 0; l < 4; l++)
+  {
+    limbs[l] = ((uint32_t)id->bytes[4 * l] << 24) | ((uint32_t)id->bytes[4 * l + 1] << 16) |
+               ((uint32_t)id->bytes[4 * l + 2] << 8) | id->bytes[4 * l + 3];
+  }
+
+  // The least significant digit first: limbs = limbs / 62, the remainder is the digit.
+  for (int8_t i = SPOTIFY_ID_BASE62_LENGTH - 1; i >= 0; i--)
+  {
+    uint64_t remainder = 0;
+    for (uint8_t l = 0; l < 4; l++)
+    {
+      const uint64_t v = (remainder << 32) | limbs[l];
+      limbs[l] = (uint32_t)(v / 62U);
+      remainder = v % 62U;
+    }
+    base62[i] = base62_digits[remainder];
+  }
+  base62[SPOTIFY_ID_BASE62_LENGTH] = '\0';
+}
+
+void* spotify_table_realloc(void* ptr, size_t size)
+{
+  // PSRAM if the board has it, the internal RAM otherwise.
+  void* table = heap_caps_realloc(ptr, size, MALLOC_CAP_SPIRAM);
+  if (table == NULL)
+  {
+    table = heap_caps_realloc(ptr, size, MALLOC_CAP_8BIT);
+  }
+  return table;
+}
+
+void spotify_track_table_init(spotify_track_table_t* table)
+{
+  memset(table, 0, sizeof(spotify_track_table_t));
+}
+
+bool spotify_track_table_append(spotify_track_table_t* table, const spotify_id_t* id)
+{
+  if (table->count == table->capacity)
+  {
+    const uint32_t capacity =
+      table->capacity == 0 ? TRACK_TABLE_INITIAL_CAPACITY : 2 * table->capacity;
+    const size_t size = capacity * sizeof(spotify_id_t);
+
+    spotify_id_t* ids = (spotify_id_t*)spotify_table_realloc(table->ids, size);
+    if (ids == NULL)
+    {
+      return false;
+    }
+
+    table->ids = ids;
+    table->capacity = capacity;
+  }
+
+  table->ids[table->count++] = *id;
+  return true;
+}
+
+void spotify_track_table_clear(spotify_track_table_t* table)
+{
+  table->count = 0;
+}
+
+void spotify_track_table_free(spotify_track_table_t* table)
+{
+  heap_caps_free(table->ids);
+  spotify_track_table_init(table);
+}
+
+spotify_track_iter_t spotify_track_table_iter(const spotify_track_table_t* table)
+{
+  return (spotify_track_iter_t){ .table = table, .index = 0 };
+}
+
+bool spotify_track_iter_next(spotify_track_iter_t* iter, spotify_id_t* id)
+{
+  if (iter->index >= iter->table->count)
+  {
+    return false;
+  }
+
+  *id = iter->table->ids[iter->index++];
+  return true;
+}
@@ -0,0 +1,70 @@
+// spotify_id.h
+//
+// Spotify's IDs in binary. The base62 IDs the Web API uses (22 characters, 0-9a-zA-Z) are 128 bit
+// numbers, so a track ID takes 16 bytes instead of 23. The track table keeps a playlist's worth of
+// them, in PSRAM when there is some.
+
+#ifndef SPOTIFY_ID_H
+#define SPOTIFY_ID_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPOTIFY_ID_BASE62_LENGTH  (22U)
+
+// Big endian, like the number the base62 string spells.
+typedef struct spotify_id_t
+{
+  uint8_t bytes[16];
+} spotify_id_t;
+
+typedef struct spotify_track_table_t
+{
+  spotify_id_t* ids;
+  uint32_t count;
+  uint32_t capacity;
+} spotify_track_table_t;
+
+typedef struct spotify_track_iter_t
+{
+  const spotify_track_table_t* table;
+  uint32_t index;
+} spotify_track_iter_t;
+
+/*
+ * Return false if the string isn't 22 base62 characters or if it doesn't fit in 128 bits.
+ */
+bool spotify_id_from_base62(const char* base62, size_t length, spotify_id_t* id);
+
+/*
+ * Write the 22 characters and the NUL.
+ */
+void spotify_id_to_base62(const spotify_id_t* id, char base62[SPOTIFY_ID_BASE62_LENGTH + 1]);
+
+/*
+ * Allocate or grow one of the big tables, the track table or the playlist index. Works like
+ * realloc, free the memory with heap_caps_free.
+ */
+void* spotify_table_realloc(void* ptr, size_t size);
+
+void spotify_track_table_init(spotify_track_table_t* table);
+
+/*
+ * The table grows by doubling. Return false when there is no memory left for it.
+ */
+bool spotify_track_table_append(spotify_track_table_t* table, const spotify_id_t* id);
+
+// Keep the memory for the next playlist.
+void spotify_track_table_clear(spotify_track_table_t* table);
+
+void spotify_track_table_free(spotify_track_table_t* table);
+
+spotify_track_iter_t spotify_track_table_iter(const spotify_track_table_t* table);
+
+/*
+ * Return false past the last track.
+ */
+bool spotify_track_iter_next(spotify_track_iter_t* iter, spotify_id_t* id);
+
+#endif // SPOTIFY_ID_H
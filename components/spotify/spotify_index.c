@@ -0,0 +1,354 @@
+#include "spotify_index.h"
+#include "spotify_id.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* TAG = "spotify_index";
+
+// An open addressing hash table. The slots are a power of two, and at most 3/4 of them are used so
+// the probes stay short.
+#define INDEX_SLOTS          (512U)
+#define INDEX_MAX_PLAYLISTS  (INDEX_SLOTS * 3 / 4)
+#define INDEX_NVS_NAMESPACE  "spotify"
+#define INDEX_NVS_KEY        "playlists"
+// Bump it when the entry changes, the old blob gets ignored then.
+#define INDEX_VERSION        (1U)
+
+/*
+ * The name and the snapshot_id are kept as their hashes. 64 bits make the names' collisions
+ * unlikely enough, the snapshot_id only needs to tell whether it changed.
+ */
+typedef struct spotify_index_entry_t
+{
+  // 0 is an empty slot.
+  uint64_t name_hash;
+  uint32_t snapshot_hash;
+  uint32_t tracks;
+  spotify_id_t id;
+} spotify_index_entry_t;
+
+typedef struct spotify_index_header_t
+{
+  uint32_t version;
+  uint32_t count;
+} spotify_index_header_t;
+
+typedef struct spotify_index_table_t
+{
+  spotify_index_entry_t* slots;
+  uint32_t count;
+} spotify_index_table_t;
+
+// A refresh builds a new table and swaps it in under the lock, the lookups use the old one until
+// then.
+static spotify_index_table_t s_index = {};
+static SemaphoreHandle_t s_lock = NULL;
+
+// FNV-1a.
+static uint64_t spotify_index_hash64(const char* str)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (; *str != '\0'; str++)
+  {
+    hash ^= (uint8_t)*str;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash != 0 ? hash : 1;
+}
+
+static uint32_t spotify_index_hash32(const char* str)
+{
+  uint32_t hash = 0x811c9dc5U;
+  for (; *str != '\0'; str++)
+  {
+    hash ^= (uint8_t)*str;
+    hash *= 0x01000193U;
+  }
+  return hash;
+}
+
+static bool spotify_index_alloc(spotify_index_table_t* table)
+{
+  const size_t size = INDEX_SLOTS * sizeof(spotify_index_entry_t);
+
+  table->slots = (spotify_index_entry_t*)spotify_table_realloc(NULL, size);
+  if (table->slots != NULL)
+  {
+    memset(table->slots, 0, size);
+  }
+  table->count = 0;
+  return table->slots != NULL;
+}
+
+// The slot with the name or the empty slot where it would go.
+static spotify_index_entry_t* spotify_index_slot(const spotify_index_table_t* table,
+                                                 uint64_t name_hash)
+{
+  uint32_t i = (uint32_t)name_hash & (INDEX_SLOTS - 1);
+  while (table->slots[i].name_hash != 0 && table->slots[i].name_hash != name_hash)
+  {
+    i = (i + 1) & (INDEX_SLOTS - 1);
+  }
+  return &table->slots[i];
+}
+
+// Playlists with the same name: the first one listed wins, like it would with a linear search.
+static bool spotify_index_insert(spotify_index_table_t* table, const spotify_index_entry_t* entry)
+{
+  spotify_index_entry_t* slot = spotify_index_slot(table, entry->name_hash);
+
+  if (slot->name_hash != 0)
+  {
+    return true;
+  }
+  if (table->count == INDEX_MAX_PLAYLISTS)
+  {
+    return false;
+  }
+
+  *slot = *entry;
+  table->count++;
+  return true;
+}
+
+static void spotify_index_save(const spotify_index_table_t* table)
+{
+  const size_t size =
+    sizeof(spotify_index_header_t) + table->count * sizeof(spotify_index_entry_t);
+  uint8_t* blob = (uint8_t*)malloc(size);
+  nvs_handle_t nvs;
+
+  if (blob == NULL)
+  {
+    return;
+  }
+
+  // Only the used slots, they get hashed into place again on load.
+  const spotify_index_header_t header = { .version = INDEX_VERSION, .count = table->count };
+  memcpy(blob, &header, sizeof(header));
+  spotify_index_entry_t* entries = (spotify_index_entry_t*)(blob + sizeof(header));
+  for (uint32_t i = 0, n = 0; i < INDEX_SLOTS; i++)
+  {
+    if (table->slots[i].name_hash != 0)
+    {
+      entries[n++] = table->slots[i];
+    }
+  }
+
+  esp_err_t err = nvs_open(INDEX_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err == ESP_OK)
+  {
+    err = nvs_set_blob(nvs, INDEX_NVS_KEY, blob, size);
+    if (err == ESP_OK)
+    {
+      err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+  }
+
+  if (err != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Failed to save the index: %s", esp_err_to_name(err));
+  }
+  free(blob);
+}
+
+void spotify_index_init(void)
+{
+  nvs_handle_t nvs;
+  size_t size = 0;
+
+  s_lock = xSemaphoreCreateMutex();
+  assert(s_lock != NULL);
+
+  if (!spotify_index_alloc(&s_index))
+  {
+    ESP_LOGE(TAG, "No memory for the index");
+    return;
+  }
+
+  if (nvs_open(INDEX_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+  {
+    // Nothing was ever saved.
+    return;
+  }
+
+  if (nvs_get_blob(nvs, INDEX_NVS_KEY, NULL, &size) == ESP_OK &&
+      size >= sizeof(spotify_index_header_t))
+  {
+    uint8_t* blob = (uint8_t*)malloc(size);
+    spotify_index_header_t header;
+
+    if (blob != NULL && nvs_get_blob(nvs, INDEX_NVS_KEY, blob, &size) == ESP_OK)
+    {
+      memcpy(&header, blob, sizeof(header));
+      if (header.version == INDEX_VERSION &&
+          size == sizeof(header) + header.count * sizeof(spotify_index_entry_t))
+      {
+        const spotify_index_entry_t* entries =
+          (const spotify_index_entry_t*)(blob + sizeof(header));
+        for (uint32_t i = 0; i < header.count; i++)
+        {
+          (void)spotify_index_insert(&s_index, &entries[i]);
+        }
+      }
+    }
+    free(blob);
+  }
+  nvs_close(nvs);
+
+  ESP_LOGI(TAG, "Loaded %lu playlists", s_index.count);
+}
+
+bool spotify_index_find(const char* name, char id[MAX_PLAYLIST_ID_LENGTH + 1], uint32_t* tracks)
+{
+  bool found = false;
+
+  (void)xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (s_index.slots != NULL)
+  {
+    const spotify_index_entry_t* slot = spotify_index_slot(&s_index, spotify_index_hash64(name));
+    found = slot->name_hash != 0;
+    if (found && id != NULL)
+    {
+      spotify_id_to_base62(&slot->id, id);
+    }
+    if (found && tracks != NULL)
+    {
+      *tracks = slot->tracks;
+    }
+  }
+  (void)xSemaphoreGive(s_lock);
+
+  return found;
+}
+
+/*
+ * The entry for the same playlist, by its ID. Usually it's under the same name, a renamed playlist
+ * needs the search. NULL if the playlist is new.
+ */
+static const spotify_index_entry_t* spotify_index_find_id(const spotify_index_table_t* table,
+                                                          const spotify_index_entry_t* entry)
+{
+  const spotify_index_entry_t* slot = spotify_index_slot(table, entry->name_hash);
+
+  if (slot->name_hash != 0 && memcmp(&slot->id, &entry->id, sizeof(entry->id)) == 0)
+  {
+    return slot;
+  }
+  for (uint32_t i = 0; i < INDEX_SLOTS; i++)
+  {
+    if (table->slots[i].name_hash != 0 &&
+        memcmp(&table->slots[i].id, &entry->id, sizeof(entry->id)) == 0)
+    {
+      return &table->slots[i];
+    }
+  }
+  return NULL;
+}
+
+typedef struct spotify_index_refresh_t
+{
+  spotify_index_table_t table;
+  spotify_index_changed_cb_t on_changed;
+  void* user_data;
+  uint32_t changed;
+  // Same playlist and contents under another name. Nothing to download, but the index changed.
+  uint32_t renamed;
+  bool full;
+} spotify_index_refresh_t;
+
+static bool spotify_index_add(void* user_data, const spotify_playlist_t* playlist)
+{
+  spotify_index_refresh_t* refresh = (spotify_index_refresh_t*)user_data;
+  spotify_index_entry_t entry = {
+    .name_hash = spotify_index_hash64(playlist->name),
+    .snapshot_hash = spotify_index_hash32(playlist->snapshot_id),
+    .tracks = playlist->tracks,
+  };
+
+  if (!spotify_id_from_base62(playlist->id, strlen(playlist->id), &entry.id))
+  {
+    return true;
+  }
+
+  // A second playlist with a name which is taken doesn't go in, its changes mean nothing here.
+  if (spotify_index_slot(&refresh->table, entry.name_hash)->name_hash != 0)
+  {
+    return true;
+  }
+
+  // Only the refresh writes s_index, reading it here doesn't need the lock.
+  const spotify_index_entry_t* old = spotify_index_find_id(&s_index, &entry);
+  if (old == NULL || old->snapshot_hash != entry.snapshot_hash)
+  {
+    refresh->changed++;
+    if (refresh->on_changed != NULL)
+    {
+      refresh->on_changed(refresh->user_data, playlist);
+    }
+  }
+  else if (old->name_hash != entry.name_hash)
+  {
+    refresh->renamed++;
+  }
+
+  if (!spotify_index_insert(&refresh->table, &entry))
+  {
+    refresh->full = true;
+    return false;
+  }
+  return true;
+}
+
+bool spotify_index_refresh(spotify_index_changed_cb_t on_changed, void* user_data)
+{
+  spotify_index_refresh_t refresh = { .on_changed = on_changed, .user_data = user_data };
+
+  if (s_index.slots == NULL || !spotify_index_alloc(&refresh.table))
+  {
+    return false;
+  }
+
+  if (!spotify_list_playlists(spotify_index_add, &refresh))
+  {
+    heap_caps_free(refresh.table.slots);
+    return false;
+  }
+
+  if (refresh.full)
+  {
+    ESP_LOGW(TAG, "Only the first %u playlists fit in the index", INDEX_MAX_PLAYLISTS);
+  }
+
+  // Same count and nothing new, changed or renamed means nothing was removed either.
+  const bool modified =
+    refresh.changed > 0 || refresh.renamed > 0 || refresh.table.count != s_index.count;
+
+  (void)xSemaphoreTake(s_lock, portMAX_DELAY);
+  spotify_index_table_t old = s_index;
+  s_index = refresh.table;
+  (void)xSemaphoreGive(s_lock);
+  heap_caps_free(old.slots);
+
+  if (modified)
+  {
+    spotify_index_save(&s_index);
+  }
+
+  ESP_LOGI(TAG, "Refreshed %lu playlists, %lu new or changed", s_index.count, refresh.changed);
+  return true;
+}
+
+uint32_t spotify_index_count(void)
+{
+  return s_index.count;
+}
@@ -0,0 +1,37 @@
+// spotify_index.h
+//
+// The user's playlists by name, kept in NVS. Looking a playlist up doesn't touch the network, only
+// refreshing the index does. A refresh lists the playlists (50 per request) and tells which ones
+// changed since the last time by their snapshot_id, so only those need to be downloaded again.
+
+#ifndef SPOTIFY_INDEX_H
+#define SPOTIFY_INDEX_H
+
+#include "spotify.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Gets the playlists which are new or changed since the last refresh.
+typedef void (*spotify_index_changed_cb_t)(void* user_data, const spotify_playlist_t* playlist);
+
+/*
+ * Load the index from NVS. Needs the NVS flash initialized.
+ */
+void spotify_index_init(void);
+
+/*
+ * Return true if there's a playlist with that name. The id gets its ID (NUL terminated) and the
+ * tracks its track count, either can be NULL.
+ */
+bool spotify_index_find(const char* name, char id[MAX_PLAYLIST_ID_LENGTH + 1], uint32_t* tracks);
+
+/*
+ * List the playlists and replace the index with them. The callback can be NULL. Keeps the old index
+ * if the listing fails. Returns false then.
+ */
+bool spotify_index_refresh(spotify_index_changed_cb_t on_changed, void* user_data);
+
+uint32_t spotify_index_count(void);
+
+#endif // SPOTIFY_INDEX_H
@@ -0,0 +1,785 @@
+// The sessions' master secrets are private in mbedTLS 3, telling a resumed handshake from a full
+// one needs them.
+#define MBEDTLS_ALLOW_PRIVATE_ACCESS
+
+#include "spotify_tls.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#ifndef CONFIG_ESP_TLS_SKIP_SERVER_CERT_VERIFY
+#include "esp_crt_bundle.h"
+#endif
+
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ssl.h"
+
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* TAG = "spotify_tls";
+
+// The API, the accounts service and a stand-in or two.
+#define MAX_TLS_HOSTS           (4)
+#define TLS_HOST_NAME_LENGTH    (64)
+#define TLS_NVS_NAMESPACE       "spotify_tls"
+#define TLS_NVS_VERSION         (1U)
+// A saved session is mostly the server's certificate, a ticket is a couple hundred bytes on top.
+#define TLS_SESSION_MAX_SIZE    (4096U)
+
+/*
+ * A host's session. Every connection to the host offers it, and every handshake replaces it with
+ * the one it ended with, so the ticket stays the server's newest.
+ */
+typedef struct spotify_tls_host_t
+{
+  char name[TLS_HOST_NAME_LENGTH];
+  int port;
+  bool has_session;
+  mbedtls_ssl_session session;
+  spotify_tls_stats_t stats;
+} spotify_tls_host_t;
+
+typedef struct spotify_tls_blob_t
+{
+  uint32_t version;
+  int32_t port;
+  char host[TLS_HOST_NAME_LENGTH];
+  uint32_t size;
+  // What mbedtls_ssl_session_save wrote, size bytes.
+  uint8_t data[];
+} spotify_tls_blob_t;
+
+typedef enum
+{
+  TLS_IDLE,
+  TLS_CONNECTING,
+  TLS_HANDSHAKE,
+  TLS_CONNECTED,
+} spotify_tls_state_e;
+
+/*
+ * A transport's connection. The config and the random generator stay for the transport's
+ * lifetime, the SSL context and the socket only for one connection's.
+ */
+typedef struct spotify_tls_t
+{
+  spotify_tls_state_e state;
+  int fd;
+  spotify_tls_host_t* host;
+  int64_t start_us;
+  // The master secret of the session offered to the server. A resumed session keeps it.
+  bool offered;
+  unsigned char offered_master[48];
+  // Something was read since the last write, so the next write starts a new request.
+  bool responded;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_config conf;
+  mbedtls_ctr_drbg_context ctr_drbg;
+  mbedtls_entropy_context entropy;
+} spotify_tls_t;
+
+static spotify_tls_host_t hosts[MAX_TLS_HOSTS];
+static uint8_t hosts_count = 0;
+// Guards the sessions. Copying one in or out allocates, so it's a mutex, not a critical section.
+static SemaphoreHandle_t sessions_lock = NULL;
+// Guards the stats and hosts_count.
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// FNV-1a of host:port, for the NVS key. The blob has the host too, in case two of them collide.
+static void spotify_tls_nvs_key(const spotify_tls_host_t* host, char key[16])
+{
+  char name[TLS_HOST_NAME_LENGTH + 8];
+  uint32_t hash = 2166136261U;
+
+  snprintf(name, sizeof(name), "%s:%d", host->name, host->port);
+  for (const char* s = name; *s != '\0'; s++)
+  {
+    hash = (hash ^ (uint8_t)*s) * 16777619U;
+  }
+  snprintf(key, 16, "s%08lx", (unsigned long)hash);
+}
+
+#ifdef CONFIG_SPOTIFY_TLS_SESSIONS_NVS
+// The caller holds sessions_lock. The host's entry is new, without a session.
+static void spotify_tls_session_load(spotify_tls_host_t* host)
+{
+  nvs_handle_t nvs;
+  char key[16];
+  size_t size = 0;
+
+  if (nvs_open(TLS_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+  {
+    return;
+  }
+
+  spotify_tls_nvs_key(host, key);
+  if (nvs_get_blob(nvs, key, NULL, &size) == ESP_OK && size > sizeof(spotify_tls_blob_t) &&
+      size <= sizeof(spotify_tls_blob_t) + TLS_SESSION_MAX_SIZE)
+  {
+    spotify_tls_blob_t* blob = (spotify_tls_blob_t*)malloc(size);
+
+    if (blob != NULL && nvs_get_blob(nvs, key, blob, &size) == ESP_OK &&
+        blob->version == TLS_NVS_VERSION && blob->port == host->port &&
+        strncmp(blob->host, host->name, sizeof(blob->host)) == 0 &&
+        blob->size == size - sizeof(spotify_tls_blob_t))
+    {
+      // Fails for a session saved by a differently configured mbedTLS, among others.
+      if (mbedtls_ssl_session_load(&host->session, blob->data, blob->size) == 0)
+      {
+        host->has_session = true;
+        ESP_LOGI(TAG, "Loaded the stored session for %s", host->name);
+      }
+      else
+      {
+        mbedtls_ssl_session_free(&host->session);
+        mbedtls_ssl_session_init(&host->session);
+      }
+    }
+    free(blob);
+  }
+
+  nvs_close(nvs);
+}
+
+// The caller holds sessions_lock. Returns NULL if the session doesn't fit.
+static spotify_tls_blob_t* spotify_tls_session_save(const spotify_tls_host_t* host)
+{
+  size_t size = 0;
+
+  // Asking for the size fails with MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL.
+  (void)mbedtls_ssl_session_save(&host->session, NULL, 0, &size);
+  if (size == 0 || size > TLS_SESSION_MAX_SIZE)
+  {
+    return NULL;
+  }
+
+  spotify_tls_blob_t* blob = (spotify_tls_blob_t*)calloc(1, sizeof(spotify_tls_blob_t) + size);
+  if (blob == NULL)
+  {
+    return NULL;
+  }
+  blob->version = TLS_NVS_VERSION;
+  blob->port = host->port;
+  snprintf(blob->host, sizeof(blob->host), "%s", host->name);
+  if (mbedtls_ssl_session_save(&host->session, blob->data, size, &size) != 0)
+  {
+    free(blob);
+    return NULL;
+  }
+  blob->size = size;
+
+  return blob;
+}
+
+static void spotify_tls_session_store(const spotify_tls_host_t* host, spotify_tls_blob_t* blob)
+{
+  nvs_handle_t nvs;
+  char key[16];
+
+  spotify_tls_nvs_key(host, key);
+  esp_err_t err = nvs_open(TLS_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err == ESP_OK)
+  {
+    err = nvs_set_blob(nvs, key, blob, sizeof(spotify_tls_blob_t) + blob->size);
+    if (err == ESP_OK)
+    {
+      err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+  }
+  if (err != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Failed to store the session for %s: %s", host->name, esp_err_to_name(err));
+  }
+}
+#endif
+
+/*
+ * Find the host's entry, or make one. Returns NULL once there's no room for another host, its
+ * connections then always get the full handshake.
+ */
+static spotify_tls_host_t* spotify_tls_host_get(const char* name, int port)
+{
+  spotify_tls_host_t* host = NULL;
+
+  (void)xSemaphoreTake(sessions_lock, portMAX_DELAY);
+  for (uint8_t i = 0; i < hosts_count; i++)
+  {
+    if (hosts[i].port == port && strcmp(hosts[i].name, name) == 0)
+    {
+      host = &hosts[i];
+    }
+  }
+  if (host == NULL && hosts_count < MAX_TLS_HOSTS && strlen(name) < TLS_HOST_NAME_LENGTH)
+  {
+    host = &hosts[hosts_count];
+    snprintf(host->name, sizeof(host->name), "%s", name);
+    host->port = port;
+    host->has_session = false;
+    mbedtls_ssl_session_init(&host->session);
+#ifdef CONFIG_SPOTIFY_TLS_SESSIONS_NVS
+    spotify_tls_session_load(host);
+#endif
+    portENTER_CRITICAL(&stats_lock);
+    hosts_count++;
+    portEXIT_CRITICAL(&stats_lock);
+  }
+  (void)xSemaphoreGive(sessions_lock);
+
+  return host;
+}
+
+static int spotify_tls_send(void* ctx, const unsigned char* buf, size_t len)
+{
+  spotify_tls_t* tls = (spotify_tls_t*)ctx;
+  const int ret = send(tls->fd, buf, len, 0);
+
+  if (ret < 0)
+  {
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? MBEDTLS_ERR_SSL_WANT_WRITE
+                                                     : MBEDTLS_ERR_NET_SEND_FAILED;
+  }
+  return ret;
+}
+
+static int spotify_tls_recv(void* ctx, unsigned char* buf, size_t len)
+{
+  spotify_tls_t* tls = (spotify_tls_t*)ctx;
+  const int ret = recv(tls->fd, buf, len, 0);
+
+  if (ret < 0)
+  {
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? MBEDTLS_ERR_SSL_WANT_READ
+                                                     : MBEDTLS_ERR_NET_RECV_FAILED;
+  }
+  // 0 is the server's FIN, mbedTLS takes it as the end of the connection.
+  return ret;
+}
+
+/*
+ * Wait until the socket can be read (or written). Returns > 0 when it can, 0 on the timeout and
+ * < 0 on an error.
+ */
+static int spotify_tls_wait(spotify_tls_t* tls, bool write, int timeout_ms)
+{
+  fd_set fds;
+  struct timeval tv = {
+    .tv_sec = timeout_ms / 1000,
+    .tv_usec = (timeout_ms % 1000) * 1000,
+  };
+
+  FD_ZERO(&fds);
+  FD_SET(tls->fd, &fds);
+  return select(tls->fd + 1, write ? NULL : &fds, write ? &fds : NULL, NULL,
+                timeout_ms < 0 ? NULL : &tv);
+}
+
+// How much of the timeout, started at start_us, is left.
+static int spotify_tls_remaining_ms(int64_t start_us, int timeout_ms)
+{
+  const int64_t elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+  return elapsed_ms < timeout_ms ? (int)(timeout_ms - elapsed_ms) : 0;
+}
+
+static void spotify_tls_reset(spotify_tls_t* tls)
+{
+  if (tls->state != TLS_IDLE)
+  {
+    mbedtls_ssl_free(&tls->ssl);
+  }
+  if (tls->fd >= 0)
+  {
+    close(tls->fd);
+    tls->fd = -1;
+  }
+  tls->state = TLS_IDLE;
+  tls->offered = false;
+  tls->responded = false;
+}
+
+/*
+ * Resolve the host, start the TCP connect and set the SSL context up, offering the host's session
+ * if there's one. Returns false if any of it fails.
+ */
+static bool spotify_tls_start(spotify_tls_t* tls, const char* host, int port)
+{
+  const struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+  };
+  struct addrinfo* addresses = NULL;
+  char port_str[8];
+
+  tls->start_us = esp_timer_get_time();
+  tls->host = spotify_tls_host_get(host, port);
+
+  snprintf(port_str, sizeof(port_str), "%d", port);
+  if (getaddrinfo(host, port_str, &hints, &addresses) != 0 || addresses == NULL)
+  {
+    ESP_LOGW(TAG, "Couldn't resolve %s", host);
+    return false;
+  }
+
+  tls->fd = socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol);
+  if (tls->fd < 0)
+  {
+    freeaddrinfo(addresses);
+    return false;
+  }
+  (void)fcntl(tls->fd, F_SETFL, fcntl(tls->fd, F_GETFL, 0) | O_NONBLOCK);
+  const int ret = connect(tls->fd, addresses->ai_addr, addresses->ai_addrlen);
+  freeaddrinfo(addresses);
+  if (ret < 0 && errno != EINPROGRESS)
+  {
+    ESP_LOGW(TAG, "Couldn't connect to %s: %d", host, errno);
+    return false;
+  }
+
+  mbedtls_ssl_init(&tls->ssl);
+  tls->state = TLS_CONNECTING;
+  if (mbedtls_ssl_setup(&tls->ssl, &tls->conf) != 0 ||
+      mbedtls_ssl_set_hostname(&tls->ssl, host) != 0)
+  {
+    return false;
+  }
+  mbedtls_ssl_set_bio(&tls->ssl, tls, spotify_tls_send, spotify_tls_recv, NULL);
+
+  if (tls->host != NULL)
+  {
+    (void)xSemaphoreTake(sessions_lock, portMAX_DELAY);
+    if (tls->host->has_session && mbedtls_ssl_set_session(&tls->ssl, &tls->host->session) == 0)
+    {
+      tls->offered = true;
+      memcpy(tls->offered_master, tls->host->session.master, sizeof(tls->offered_master));
+    }
+    (void)xSemaphoreGive(sessions_lock);
+  }
+
+  return true;
+}
+
+/*
+ * The handshake is done. Keep the session it ended with and count the handshake as full or
+ * resumed. A resumed session has the master secret of the one which was offered.
+ */
+static void spotify_tls_finish(spotify_tls_t* tls)
+{
+  spotify_tls_host_t* host = tls->host;
+  const uint32_t handshake_us = esp_timer_get_time() - tls->start_us;
+  mbedtls_ssl_session session;
+  bool resumed = false;
+#ifdef CONFIG_SPOTIFY_TLS_SESSIONS_NVS
+  spotify_tls_blob_t* blob = NULL;
+#endif
+
+  tls->state = TLS_CONNECTED;
+  tls->responded = false;
+  if (host == NULL)
+  {
+    return;
+  }
+
+  mbedtls_ssl_session_init(&session);
+  const bool got = mbedtls_ssl_get_session(&tls->ssl, &session) == 0;
+  resumed = got && tls->offered &&
+            memcmp(session.master, tls->offered_master, sizeof(tls->offered_master)) == 0;
+
+  if (got)
+  {
+    (void)xSemaphoreTake(sessions_lock, portMAX_DELAY);
+    mbedtls_ssl_session_free(&host->session);
+    // The copy owns its allocations, the struct moves over as it is.
+    host->session = session;
+    host->has_session = true;
+#ifdef CONFIG_SPOTIFY_TLS_SESSIONS_NVS
+    // A resumed session is the stored one with a renewed ticket at most, not worth the flash wear.
+    if (!resumed)
+    {
+      blob = spotify_tls_session_save(host);
+    }
+#endif
+    (void)xSemaphoreGive(sessions_lock);
+  }
+
+  portENTER_CRITICAL(&stats_lock);
+  if (resumed)
+  {
+    host->stats.resumed++;
+    host->stats.resumed_sum_us += handshake_us;
+  }
+  else
+  {
+    host->stats.full++;
+    host->stats.full_sum_us += handshake_us;
+    host->stats.rejected += tls->offered ? 1 : 0;
+  }
+  portEXIT_CRITICAL(&stats_lock);
+
+  ESP_LOGD(TAG, "%s handshake with %s in %lu us", resumed ? "Resumed" : "Full", host->name,
+           handshake_us);
+
+#ifdef CONFIG_SPOTIFY_TLS_SESSIONS_NVS
+  if (blob != NULL)
+  {
+    spotify_tls_session_store(host, blob);
+    free(blob);
+  }
+#endif
+}
+
+/*
+ * Move the connection along: TCP connect, then the handshake. With block set it waits for the
+ * socket between the steps, as long as the timeout allows. Returns 1 once connected, 0 while in
+ * progress and -1 on a failure, which leaves the transport idle.
+ */
+static int spotify_tls_step(spotify_tls_t* tls, const char* host, int port, int timeout_ms,
+                            bool block)
+{
+  if (tls->state == TLS_IDLE && !spotify_tls_start(tls, host, port))
+  {
+    spotify_tls_reset(tls);
+    return -1;
+  }
+
+  if (tls->state == TLS_CONNECTED)
+  {
+    return 1;
+  }
+
+  const int remaining_ms = spotify_tls_remaining_ms(tls->start_us, timeout_ms);
+  const int wait_ms = block ? remaining_ms : 0;
+  if (remaining_ms == 0)
+  {
+    ESP_LOGW(TAG, "Connecting to %s timed out", host);
+    spotify_tls_reset(tls);
+    return -1;
+  }
+
+  if (tls->state == TLS_CONNECTING)
+  {
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (spotify_tls_wait(tls, true, wait_ms) <= 0)
+    {
+      return 0;
+    }
+    if (getsockopt(tls->fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)
+    {
+      ESP_LOGW(TAG, "Couldn't connect to %s: %d", host, error);
+      spotify_tls_reset(tls);
+      return -1;
+    }
+    tls->state = TLS_HANDSHAKE;
+  }
+
+  const int ret = mbedtls_ssl_handshake(&tls->ssl);
+  if (ret == 0)
+  {
+    spotify_tls_finish(tls);
+    return 1;
+  }
+  if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+  {
+    ESP_LOGW(TAG, "Handshake with %s failed: -0x%04x", host, -ret);
+    spotify_tls_reset(tls);
+    return -1;
+  }
+
+  (void)spotify_tls_wait(tls, ret == MBEDTLS_ERR_SSL_WANT_WRITE, wait_ms);
+  return 0;
+}
+
+static int spotify_tls_connect_async(esp_transport_handle_t t, const char* host, int port,
+                                     int timeout_ms)
+{
+  spotify_tls_t* tls = (spotify_tls_t*)esp_transport_get_context_data(t);
+  return spotify_tls_step(tls, host, port, timeout_ms, false);
+}
+
+static int spotify_tls_connect(esp_transport_handle_t t, const char* host, int port,
+                               int timeout_ms)
+{
+  spotify_tls_t* tls = (spotify_tls_t*)esp_transport_get_context_data(t);
+  int ret = 0;
+
+  // A leftover from a connection the client didn't close.
+  spotify_tls_reset(tls);
+  while (ret == 0)
+  {
+    ret = spotify_tls_step(tls, host, port, timeout_ms, true);
+  }
+  return ret > 0 ? 0 : -1;
+}
+
+/*
+ * A kept alive connection has nothing to read between the requests. Once the server closed it
+ * there's its close_notify or FIN waiting.
+ */
+static bool spotify_tls_alive(spotify_tls_t* tls)
+{
+  return mbedtls_ssl_get_bytes_avail(&tls->ssl) == 0 && spotify_tls_wait(tls, false, 0) == 0;
+}
+
+static int spotify_tls_read(esp_transport_handle_t t, char* buffer, int len, int timeout_ms)
+{
+  spotify_tls_t* tls = (spotify_tls_t*)esp_transport_get_context_data(t);
+  const int64_t start_us = esp_timer_get_time();
+
+  if (tls->state != TLS_CONNECTED)
+  {
+    return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+  }
+  tls->responded = true;
+
+  for (;;)
+  {
+    const int ret = mbedtls_ssl_read(&tls->ssl, (unsigned char*)buffer, len);
+
+    if (ret > 0)
+    {
+      return ret;
+    }
+    if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+    {
+      return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    }
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      ESP_LOGW(TAG, "Reading from %s failed: -0x%04x", tls->host ? tls->host->name : "?", -ret);
+      return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    const int remaining_ms = spotify_tls_remaining_ms(start_us, timeout_ms);
+    const int ready = remaining_ms > 0
+                        ? spotify_tls_wait(tls, ret == MBEDTLS_ERR_SSL_WANT_WRITE, remaining_ms)
+                        : 0;
+    if (ready == 0)
+    {
+      // The asynchronous client takes it for "come back later".
+      errno = EAGAIN;
+      return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if (ready < 0)
+    {
+      return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+  }
+}
+
+static int spotify_tls_write(esp_transport_handle_t t, const char* buffer, int len,
+                             int timeout_ms)
+{
+  spotify_tls_t* tls = (spotify_tls_t*)esp_transport_get_context_data(t);
+  const int64_t start_us = esp_timer_get_time();
+
+  if (tls->state != TLS_CONNECTED)
+  {
+    return -1;
+  }
+
+  // The first write of the next request on a kept alive connection. Sending it to a server which
+  // closed the connection already gets nothing back, after the request might have gone out. This
+  // way the request fails before any of it was written, and the client reconnects.
+  if (tls->responded)
+  {
+    tls->responded = false;
+    if (!spotify_tls_alive(tls))
+    {
+      if (tls->host != NULL)
+      {
+        portENTER_CRITICAL(&stats_lock);
+        tls->host->stats.stale++;
+        portEXIT_CRITICAL(&stats_lock);
+      }
+      ESP_LOGD(TAG, "The server closed the connection");
+      return -1;
+    }
+  }
+
+  for (;;)
+  {
+    const int ret = mbedtls_ssl_write(&tls->ssl, (const unsigned char*)buffer, len);
+
+    if (ret >= 0)
+    {
+      return ret;
+    }
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      ESP_LOGW(TAG, "Writing to %s failed: -0x%04x", tls->host ? tls->host->name : "?", -ret);
+      return -1;
+    }
+
+    const int remaining_ms = spotify_tls_remaining_ms(start_us, timeout_ms);
+    if (remaining_ms == 0 ||
+        spotify_tls_wait(tls, ret == MBEDTLS_ERR_SSL_WANT_WRITE, remaining_ms) <= 0)
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+}
+
+static int spotify_tls_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+  spotify_tls_t* tls = (spotify_tls_t*)esp_transport_get_context_data(t);
+
+  if (tls->state != TLS_CONNECTED)
+  {
+    return -1;
+  }
+  // Decrypted already, the socket may well have nothing more.
+  if (mbedtls_ssl_get_bytes_avail(&tls->ssl) > 0)
+  {
+    return 1;
+  }
+  return spotify_tls_wait(tls, false, timeout_ms);
+}
+
+static int spotify_tls_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+  spotify_tls_t* tls = (spotify_tls_t*)esp_transport_get_context_data(t);
+
+  if (tls->state != TLS_CONNECTED)
+  {
+    return -1;
+  }
+  return spotify_tls_wait(tls, true, timeout_ms);
+}
+
+static int spotify_tls_close(esp_transport_handle_t t)
+{
+  spotify_tls_t* tls = (spotify_tls_t*)esp_transport_get_context_data(t);
+
+  if (tls->state == TLS_CONNECTED)
+  {
+    (void)mbedtls_ssl_close_notify(&tls->ssl);
+  }
+  spotify_tls_reset(tls);
+  return 0;
+}
+
+static int spotify_tls_destroy(esp_transport_handle_t t)
+{
+  spotify_tls_t* tls = (spotify_tls_t*)esp_transport_get_context_data(t);
+
+  spotify_tls_reset(tls);
+  mbedtls_ssl_config_free(&tls->conf);
+  mbedtls_ctr_drbg_free(&tls->ctr_drbg);
+  mbedtls_entropy_free(&tls->entropy);
+  free(tls);
+  return 0;
+}
+
+void spotify_tls_init(void)
+{
+  if (sessions_lock != NULL)
+  {
+    return;
+  }
+  sessions_lock = xSemaphoreCreateMutex();
+}
+
+esp_transport_handle_t spotify_tls_transport_create(void)
+{
+  spotify_tls_t* tls = (spotify_tls_t*)calloc(1, sizeof(spotify_tls_t));
+  if (tls == NULL)
+  {
+    return NULL;
+  }
+  tls->fd = -1;
+  tls->state = TLS_IDLE;
+  mbedtls_ssl_config_init(&tls->conf);
+  mbedtls_ctr_drbg_init(&tls->ctr_drbg);
+  mbedtls_entropy_init(&tls->entropy);
+
+  bool ok = mbedtls_ctr_drbg_seed(&tls->ctr_drbg, mbedtls_entropy_func, &tls->entropy,
+                                  NULL, 0) == 0 &&
+            mbedtls_ssl_config_defaults(&tls->conf, MBEDTLS_SSL_IS_CLIENT,
+                                        MBEDTLS_SSL_TRANSPORT_STREAM,
+                                        MBEDTLS_SSL_PRESET_DEFAULT) == 0;
+  if (ok)
+  {
+    mbedtls_ssl_conf_rng(&tls->conf, mbedtls_ctr_drbg_random, &tls->ctr_drbg);
+    // The same as the default transport would do with this sdkconfig.
+#ifdef CONFIG_ESP_TLS_SKIP_SERVER_CERT_VERIFY
+    mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_NONE);
+#else
+    mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    ok = esp_crt_bundle_attach(&tls->conf) == ESP_OK;
+#endif
+  }
+
+  esp_transport_handle_t t = ok ? esp_transport_init() : NULL;
+  if (t == NULL)
+  {
+    ESP_LOGW(TAG, "Couldn't set the transport up");
+    mbedtls_ssl_config_free(&tls->conf);
+    mbedtls_ctr_drbg_free(&tls->ctr_drbg);
+    mbedtls_entropy_free(&tls->entropy);
+    free(tls);
+    return NULL;
+  }
+
+  esp_transport_set_context_data(t, tls);
+  esp_transport_set_func(t, spotify_tls_connect, spotify_tls_read, spotify_tls_write,
+                         spotify_tls_close, spotify_tls_poll_read, spotify_tls_poll_write,
+                         spotify_tls_destroy);
+  esp_transport_set_async_connect_func(t, spotify_tls_connect_async);
+  esp_transport_set_default_port(t, 443);
+
+  return t;
+}
+
+spotify_tls_stats_t spotify_tls_get_stats(void)
+{
+  spotify_tls_stats_t total = {};
+
+  portENTER_CRITICAL(&stats_lock);
+  for (uint8_t i = 0; i < hosts_count; i++)
+  {
+    const spotify_tls_stats_t* s = &hosts[i].stats;
+    total.full += s->full;
+    total.resumed += s->resumed;
+    total.full_sum_us += s->full_sum_us;
+    total.resumed_sum_us += s->resumed_sum_us;
+    total.rejected += s->rejected;
+    total.stale += s->stale;
+  }
+  portEXIT_CRITICAL(&stats_lock);
+
+  return total;
+}
+
+void spotify_tls_log_stats(void)
+{
+  portENTER_CRITICAL(&stats_lock);
+  const uint8_t count = hosts_count;
+  portEXIT_CRITICAL(&stats_lock);
+
+  for (uint8_t i = 0; i < count; i++)
+  {
+    portENTER_CRITICAL(&stats_lock);
+    const spotify_tls_stats_t s = hosts[i].stats;
+    portEXIT_CRITICAL(&stats_lock);
+
+    const uint32_t handshakes = s.full + s.resumed > 0 ? s.full + s.resumed : 1;
+    ESP_LOGI(TAG, "%s: full handshakes %lu avg %llu us, resumed %lu avg %llu us (%lu%%)",
+             hosts[i].name, s.full, s.full > 0 ? s.full_sum_us / s.full : 0, s.resumed,
+             s.resumed > 0 ? s.resumed_sum_us / s.resumed : 0, 100 * s.resumed / handshakes);
+    ESP_LOGI(TAG, "%s: sessions rejected %lu, closed connections caught %lu", hosts[i].name,
+             s.rejected, s.stale);
+  }
+}
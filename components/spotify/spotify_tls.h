@@ -0,0 +1,49 @@
+// spotify_tls.h
+//
+// A TLS transport for the HTTP clients which remembers the sessions. The servers close the idle
+// connections after a while, and a new connection on a remembered session skips the certificate
+// chain and the key exchange, the abbreviated handshake is one round trip instead of two. The
+// sessions are kept per host in RAM and, with CONFIG_SPOTIFY_TLS_SESSIONS_NVS, in NVS too, so the
+// first connection after a reboot gets resumed as well.
+
+#ifndef SPOTIFY_TLS_H
+#define SPOTIFY_TLS_H
+
+#include "esp_transport.h"
+
+#include <stdint.h>
+
+typedef struct spotify_tls_stats_t
+{
+  // Handshakes which went all the way, and the ones which resumed a session.
+  uint32_t full;
+  uint32_t resumed;
+  // From starting the TCP connect to the end of the handshake.
+  uint64_t full_sum_us;
+  uint64_t resumed_sum_us;
+  // A session was offered but the server wanted a full handshake.
+  uint32_t rejected;
+  // Kept alive connections the server closed before the next request went out.
+  uint32_t stale;
+} spotify_tls_stats_t;
+
+/*
+ * Set the session cache up. The stored sessions get loaded as their hosts are first connected to,
+ * which needs the NVS flash initialized by then.
+ */
+void spotify_tls_init(void);
+
+/*
+ * A transport for an HTTP client's config. The client doesn't own it: it outlives the clients
+ * which use it, so a client can be cleaned up and made again without losing the transport.
+ */
+esp_transport_handle_t spotify_tls_transport_create(void);
+
+/*
+ * All the hosts' stats added up.
+ */
+spotify_tls_stats_t spotify_tls_get_stats(void);
+
+void spotify_tls_log_stats(void);
+
+#endif // SPOTIFY_TLS_H
@@ -0,0 +1,160 @@
+// Responses as the Spotify's Web API returns them to the requests the spotify module makes, with
+// the IDs and the token made up. The player response is over 8 KB, mostly because of the
+// available_markets arrays.
+
+#ifndef RECORDED_RESPONSES_H
+#define RECORDED_RESPONSES_H
+
+static const char RESPONSE_ME_PLAYER[] =
+  "{\n  \"device\": {\n    \"id\": \"ed01a3ca8def0a1772eab7be6c4b0bb37b06163e\",\n"
+  "    \"is_active\": true,\n    \"is_private_session\": false,\n"
+  "    \"is_restricted\": false,\n    \"name\": \"Living Room\",\n"
+  "    \"type\": \"Speaker\",\n    \"volume_percent\": 58,\n    \"supports_volume\": true\n"
+  "  },\n  \"shuffle_state\": false,\n  \"smart_shuffle\": false,\n"
+  "  \"repeat_state\": \"off\",\n  \"timestamp\": 1697565234123,\n"
+  "  \"context\": {\n    \"external_urls\": {\n      \"spotify\": \"https://open.spotify.com/pl"
+  "aylist/37i9dQZF1DXcBWIGoYBM5M\"\n    },\n    \"href\": \"https://api.spotify.com/v1/playlist"
+  "s/37i9dQZF1DXcBWIGoYBM5M\",\n    \"type\": \"playlist\",\n    \"uri\": \"spotify:playlist:37"
+  "i9dQZF1DXcBWIGoYBM5M\"\n  },\n  \"progress_ms\": 80321,\n  \"item\": {\n"
+  "    \"album\": {\n      \"album_type\": \"album\",\n      \"artists\": [\n"
+  "        {\n          \"external_urls\": {\n            \"spotify\": \"https://open.spotify.c"
+  "om/artist/0oSGxfWSnnOXhD2fKuz2Gy\"\n          },\n          \"href\": \"https://api.spotify."
+  "com/v1/artists/0oSGxfWSnnOXhD2fKuz2Gy\",\n          \"id\": \"0oSGxfWSnnOXhD2fKuz2Gy\",\n"
+  "          \"name\": \"David Bowie\",\n          \"type\": \"artist\",\n"
+  "          \"uri\": \"spotify:artist:0oSGxfWSnnOXhD2fKuz2Gy\"\n"
+  "        }\n      ],\n      \"available_markets\": [\n        \"AD\",\n"
+  "        \"AE\",\n        \"AG\",\n        \"AL\",\n        \"AM\",\n"
+  "        \"AO\",\n        \"AR\",\n        \"AT\",\n        \"AU\",\n"
+  "        \"AZ\",\n        \"BA\",\n        \"BB\",\n        \"BD\",\n"
+  "        \"BE\",\n        \"BF\",\n        \"BG\",\n        \"BH\",\n"
+  "        \"BI\",\n        \"BJ\",\n        \"BN\",\n        \"BO\",\n"
+  "        \"BR\",\n        \"BS\",\n        \"BT\",\n        \"BW\",\n"
+  "        \"BY\",\n        \"BZ\",\n        \"CA\",\n        \"CD\",\n"
+  "        \"CG\",\n        \"CH\",\n        \"CI\",\n        \"CL\",\n"
+  "        \"CM\",\n        \"CO\",\n        \"CR\",\n        \"CV\",\n"
+  "        \"CW\",\n        \"CY\",\n        \"CZ\",\n        \"DE\",\n"
+  "        \"DJ\",\n        \"DK\",\n        \"DM\",\n        \"DO\",\n"
+  "        \"DZ\",\n        \"EC\",\n        \"EE\",\n        \"EG\",\n"
+  "        \"ES\",\n        \"ET\",\n        \"FI\",\n        \"FJ\",\n"
+  "        \"FM\",\n        \"FR\",\n        \"GA\",\n        \"GB\",\n"
+  "        \"GD\",\n        \"GE\",\n        \"GH\",\n        \"GM\",\n"
+  "        \"GN\",\n        \"GQ\",\n        \"GR\",\n        \"GT\",\n"
+  "        \"GW\",\n        \"GY\",\n        \"HK\",\n        \"HN\",\n"
+  "        \"HR\",\n        \"HT\",\n        \"HU\",\n        \"ID\",\n"
+  "        \"IE\",\n        \"IL\",\n        \"IN\",\n        \"IQ\",\n"
+  "        \"IS\",\n        \"IT\",\n        \"JM\",\n        \"JO\",\n"
+  "        \"JP\",\n        \"KE\",\n        \"KG\",\n        \"KH\",\n"
+  "        \"KI\",\n        \"KM\",\n        \"KN\",\n        \"KR\",\n"
+  "        \"KW\",\n        \"KZ\",\n        \"LA\",\n        \"LB\",\n"
+  "        \"LC\",\n        \"LI\",\n        \"LK\",\n        \"LR\",\n"
+  "        \"LS\",\n        \"LT\",\n        \"LU\",\n        \"LV\",\n"
+  "        \"LY\",\n        \"MA\",\n        \"MC\",\n        \"MD\",\n"
+  "        \"ME\",\n        \"MG\",\n        \"MH\",\n        \"MK\",\n"
+  "        \"ML\",\n        \"MN\",\n        \"MO\",\n        \"MR\",\n"
+  "        \"MT\",\n        \"MU\",\n        \"MV\",\n        \"MW\",\n"
+  "        \"MX\",\n        \"MY\",\n        \"MZ\",\n        \"NA\",\n"
+  "        \"NE\",\n        \"NG\",\n        \"NI\",\n        \"NL\",\n"
+  "        \"NO\",\n        \"NP\",\n        \"NR\",\n        \"NZ\",\n"
+  "        \"OM\",\n        \"PA\",\n        \"PE\",\n        \"PG\",\n"
+  "        \"PH\",\n        \"PK\",\n        \"PL\",\n        \"PS\",\n"
+  "        \"PT\",\n        \"PW\",\n        \"PY\",\n        \"QA\",\n"
+  "        \"RO\",\n        \"RS\",\n        \"RW\",\n        \"SA\",\n"
+  "        \"SB\",\n        \"SC\",\n        \"SE\",\n        \"SG\",\n"
+  "        \"SI\",\n        \"SK\",\n        \"SL\",\n        \"SM\",\n"
+  "        \"SN\",\n        \"SR\",\n        \"ST\",\n        \"SV\",\n"
+  "        \"SZ\",\n        \"TD\",\n        \"TG\",\n        \"TH\",\n"
+  "        \"TJ\",\n        \"TL\",\n        \"TN\",\n        \"TO\",\n"
+  "        \"TR\",\n        \"TT\",\n        \"TV\",\n        \"TW\",\n"
+  "        \"TZ\",\n        \"UA\",\n        \"UG\",\n        \"US\",\n"
+  "        \"UY\",\n        \"UZ\",\n        \"VC\",\n        \"VE\",\n"
+  "        \"VN\",\n        \"VU\",\n        \"WS\",\n        \"XK\",\n"
+  "        \"ZA\",\n        \"ZM\",\n        \"ZW\"\n      ],\n      \"external_urls\": {\n"
+  "        \"spotify\": \"https://open.spotify.com/album/6fQElzBNTiEMGdIeY0hy5l\"\n"
+  "      },\n      \"href\": \"https://api.spotify.com/v1/albums/6fQElzBNTiEMGdIeY0hy5l\",\n"
+  "      \"id\": \"6fQElzBNTiEMGdIeY0hy5l\",\n      \"images\": [\n"
+  "        {\n          \"height\": 640,\n          \"url\": \"https://i.scdn.co/image/ab67616d"
+  "0000b273640e8a9f5c1d7c4a1b2c3d4e5f6\",\n          \"width\": 640\n"
+  "        },\n        {\n          \"height\": 300,\n          \"url\": \"https://i.scdn.co/im"
+  "age/ab67616d0000b273300e8a9f5c1d7c4a1b2c3d4e5f6\",\n          \"width\": 300\n"
+  "        },\n        {\n          \"height\": 64,\n          \"url\": \"https://i.scdn.co/ima"
+  "ge/ab67616d0000b27364e8a9f5c1d7c4a1b2c3d4e5f6\",\n          \"width\": 64\n"
+  "        }\n      ],\n      \"name\": \"\\\"Heroes\\\" (2017 Remaster)\",\n"
+  "      \"release_date\": \"1977-10-14\",\n      \"release_date_precision\": \"day\",\n"
+  "      \"total_tracks\": 10,\n      \"type\": \"album\",\n      \"uri\": \"spotify:album:6fQE"
+  "lzBNTiEMGdIeY0hy5l\"\n    },\n    \"artists\": [\n      {\n        \"external_urls\": {\n"
+  "          \"spotify\": \"https://open.spotify.com/artist/0oSGxfWSnnOXhD2fKuz2Gy\"\n"
+  "        },\n        \"href\": \"https://api.spotify.com/v1/artists/0oSGxfWSnnOXhD2fKuz2Gy\","
+  "\n        \"id\": \"0oSGxfWSnnOXhD2fKuz2Gy\",\n        \"name\": \"David Bowie\",\n"
+  "        \"type\": \"artist\",\n        \"uri\": \"spotify:artist:0oSGxfWSnnOXhD2fKuz2Gy\"\n"
+  "      },\n      {\n        \"external_urls\": {\n          \"spotify\": \"https://open.spoti"
+  "fy.com/artist/7Ln80lUS6He07XvHI8qqHH\"\n        },\n        \"href\": \"https://api.spotify."
+  "com/v1/artists/7Ln80lUS6He07XvHI8qqHH\",\n        \"id\": \"7Ln80lUS6He07XvHI8qqHH\",\n"
+  "        \"name\": \"Brian Eno\",\n        \"type\": \"artist\",\n"
+  "        \"uri\": \"spotify:artist:7Ln80lUS6He07XvHI8qqHH\"\n      }\n"
+  "    ],\n    \"available_markets\": [\n      \"AD\",\n      \"AE\",\n"
+  "      \"AG\",\n      \"AL\",\n      \"AM\",\n      \"AO\",\n      \"AR\",\n"
+  "      \"AT\",\n      \"AU\",\n      \"AZ\",\n      \"BA\",\n      \"BB\",\n"
+  "      \"BD\",\n      \"BE\",\n      \"BF\",\n      \"BG\",\n      \"BH\",\n"
+  "      \"BI\",\n      \"BJ\",\n      \"BN\",\n      \"BO\",\n      \"BR\",\n"
+  "      \"BS\",\n      \"BT\",\n      \"BW\",\n      \"BY\",\n      \"BZ\",\n"
+  "      \"CA\",\n      \"CD\",\n      \"CG\",\n      \"CH\",\n      \"CI\",\n"
+  "      \"CL\",\n      \"CM\",\n      \"CO\",\n      \"CR\",\n      \"CV\",\n"
+  "      \"CW\",\n      \"CY\",\n      \"CZ\",\n      \"DE\",\n      \"DJ\",\n"
+  "      \"DK\",\n      \"DM\",\n      \"DO\",\n      \"DZ\",\n      \"EC\",\n"
+  "      \"EE\",\n      \"EG\",\n      \"ES\",\n      \"ET\",\n      \"FI\",\n"
+  "      \"FJ\",\n      \"FM\",\n      \"FR\",\n      \"GA\",\n      \"GB\",\n"
+  "      \"GD\",\n      \"GE\",\n      \"GH\",\n      \"GM\",\n      \"GN\",\n"
+  "      \"GQ\",\n      \"GR\",\n      \"GT\",\n      \"GW\",\n      \"GY\",\n"
+  "      \"HK\",\n      \"HN\",\n      \"HR\",\n      \"HT\",\n      \"HU\",\n"
+  "      \"ID\",\n      \"IE\",\n      \"IL\",\n      \"IN\",\n      \"IQ\",\n"
+  "      \"IS\",\n      \"IT\",\n      \"JM\",\n      \"JO\",\n      \"JP\",\n"
+  "      \"KE\",\n      \"KG\",\n      \"KH\",\n      \"KI\",\n      \"KM\",\n"
+  "      \"KN\",\n      \"KR\",\n      \"KW\",\n      \"KZ\",\n      \"LA\",\n"
+  "      \"LB\",\n      \"LC\",\n      \"LI\",\n      \"LK\",\n      \"LR\",\n"
+  "      \"LS\",\n      \"LT\",\n      \"LU\",\n      \"LV\",\n      \"LY\",\n"
+  "      \"MA\",\n      \"MC\",\n      \"MD\",\n      \"ME\",\n      \"MG\",\n"
+  "      \"MH\",\n      \"MK\",\n      \"ML\",\n      \"MN\",\n      \"MO\",\n"
+  "      \"MR\",\n      \"MT\",\n      \"MU\",\n      \"MV\",\n      \"MW\",\n"
+  "      \"MX\",\n      \"MY\",\n      \"MZ\",\n      \"NA\",\n      \"NE\",\n"
+  "      \"NG\",\n      \"NI\",\n      \"NL\",\n      \"NO\",\n      \"NP\",\n"
+  "      \"NR\",\n      \"NZ\",\n      \"OM\",\n      \"PA\",\n      \"PE\",\n"
+  "      \"PG\",\n      \"PH\",\n      \"PK\",\n      \"PL\",\n      \"PS\",\n"
+  "      \"PT\",\n      \"PW\",\n      \"PY\",\n      \"QA\",\n      \"RO\",\n"
+  "      \"RS\",\n      \"RW\",\n      \"SA\",\n      \"SB\",\n      \"SC\",\n"
+  "      \"SE\",\n      \"SG\",\n      \"SI\",\n      \"SK\",\n      \"SL\",\n"
+  "      \"SM\",\n      \"SN\",\n      \"SR\",\n      \"ST\",\n      \"SV\",\n"
+  "      \"SZ\",\n      \"TD\",\n      \"TG\",\n      \"TH\",\n      \"TJ\",\n"
+  "      \"TL\",\n      \"TN\",\n      \"TO\",\n      \"TR\",\n      \"TT\",\n"
+  "      \"TV\",\n      \"TW\",\n      \"TZ\",\n      \"UA\",\n      \"UG\",\n"
+  "      \"US\",\n      \"UY\",\n      \"UZ\",\n      \"VC\",\n      \"VE\",\n"
+  "      \"VN\",\n      \"VU\",\n      \"WS\",\n      \"XK\",\n      \"ZA\",\n"
+  "      \"ZM\",\n      \"ZW\"\n    ],\n    \"disc_number\": 1,\n"
+  "    \"duration_ms\": 371413,\n    \"explicit\": false,\n    \"external_ids\": {\n"
+  "      \"isrc\": \"DEC761700503\"\n    },\n    \"external_urls\": {\n"
+  "      \"spotify\": \"https://open.spotify.com/track/7Jh1bpe76CNTCgdgAdBw4Z\"\n"
+  "    },\n    \"href\": \"https://api.spotify.com/v1/tracks/7Jh1bpe76CNTCgdgAdBw4Z\",\n"
+  "    \"id\": \"7Jh1bpe76CNTCgdgAdBw4Z\",\n    \"is_local\": false,\n"
+  "    \"name\": \"\\u201cHeroes\\u201d - 2017 Remaster\",\n    \"popularity\": 74,\n"
+  "    \"preview_url\": null,\n    \"track_number\": 3,\n    \"type\": \"track\",\n"
+  "    \"uri\": \"spotify:track:7Jh1bpe76CNTCgdgAdBw4Z\"\n  },\n"
+  "  \"currently_playing_type\": \"track\",\n  \"actions\": {\n    \"disallows\": {\n"
+  "      \"resuming\": true\n    }\n  },\n  \"is_playing\": true\n"
+  "}\n";
+
+static const char RESPONSE_PLAYLIST_TRACKS[] =
+  "{\n  \"href\": \"https://api.spotify.com/v1/playlists/37i9dQZF1DXcBWIGoYBM5M/tracks?offset=0"
+  "&limit=3\",\n  \"items\": [\n    {\n      \"track\": {\n        \"id\": \"7Jh1bpe76CNTCgdgAd"
+  "Bw4Z\",\n        \"name\": \"\\u201cHeroes\\u201d - 2017 Remaster\"\n"
+  "      }\n    },\n    {\n      \"track\": {\n        \"id\": \"3ZE3wv8V3w2T2f7nOCjV0N\",\n"
+  "        \"name\": \"Life on Mars? - 2015 Remaster\"\n      }\n"
+  "    },\n    {\n      \"track\": {\n        \"id\": \"0pQskrTITgmCMyr85tb9qq\",\n"
+  "        \"name\": \"Ashes to Ashes - 2017 Remaster\"\n      }\n"
+  "    }\n  ],\n  \"total\": 42\n}\n";
+
+static const char RESPONSE_TOKEN[] =
+  "{\"access_token\": \"BQDl3Xq9nK2f8dQ1vV0yq3s7l9r0mZ6vQ2N7e5b3WfJ8T1kX4aYzC6uP0oL9hG2sD5fR8tE"
+  "1wQ4yU7iO3pA6sD9fG2hJ5kL8zX1cV4bN7mQ0wE3rT6yU9iO2pA5sD8fG1hJ4kL7zX0cV3bN6mQ9wE2rT5yU8iO1pA4s"
+  "D7fG0hJ3kL6zX9cV2bN5mQ8wE1rT4yU7iO0p\", \"token_type\": \"Bearer\", \"expires_in\": 3600, \""
+  "scope\": \"user-read-playback-state user-modify-playback-state playlist-read-private\"}";
+
+#endif // RECORDED_RESPONSES_H
@@ -0,0 +1,267 @@
+#include "unity.h"
+
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+
+#include "json_stream.h"
+#include "recorded_responses.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+// Feed the document in chunks of the given size, like the HTTP client does.
+static bool feed_in_chunks(json_stream_t* js, const char* json, size_t chunk)
+{
+  const size_t length = strlen(json);
+  for (size_t i = 0; i < length; i += chunk)
+  {
+    const size_t n = (length - i) < chunk ? (length - i) : chunk;
+    if (!json_stream_feed(js, json + i, n))
+    {
+      return false;
+    }
+  }
+  return json_stream_end(js);
+}
+
+TEST_CASE("json_stream player fields", "[json_stream]")
+{
+  const size_t chunks[] = {1, 7, 512, sizeof(RESPONSE_ME_PLAYER)};
+
+  for (uint8_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+  {
+    char is_playing[8] = {};
+    char artist[64] = {};
+    char title[64] = {};
+    char id[23] = {};
+    json_stream_field_t fields[] = {
+      { .path = "is_playing", .dest = is_playing, .dest_size = sizeof(is_playing) },
+      { .path = "item.artists[0].name", .dest = artist, .dest_size = sizeof(artist) },
+      { .path = "item.name", .dest = title, .dest_size = sizeof(title) },
+      { .path = "item.id", .dest = id, .dest_size = sizeof(id) },
+    };
+
+    json_stream_t js;
+    json_stream_begin(&js, fields, 4);
+    TEST_ASSERT_TRUE(feed_in_chunks(&js, RESPONSE_ME_PLAYER, chunks[i]));
+
+    TEST_ASSERT_EQUAL_STRING("true", is_playing);
+    // Not the album's artist, not the second one.
+    TEST_ASSERT_EQUAL_STRING("David Bowie", artist);
+    TEST_ASSERT_EQUAL(1, fields[1].matches);
+    // The quotes are \u201c and \u201d in the document.
+    TEST_ASSERT_EQUAL_STRING("\xE2\x80\x9CHeroes\xE2\x80\x9D - 2017 Remaster", title);
+    TEST_ASSERT_EQUAL_STRING("7Jh1bpe76CNTCgdgAdBw4Z", id);
+  }
+}
+
+typedef struct collected_t
+{
+  uint32_t count;
+  uint32_t indices[4];
+  char ids[4][23];
+} collected_t;
+
+static void collect(void* user_data, uint32_t index, const char* value, size_t length)
+{
+  collected_t* c = (collected_t*)user_data;
+  if (c->count < 4)
+  {
+    c->indices[c->count] = index;
+    snprintf(c->ids[c->count], sizeof(c->ids[0]), "%.*s", (int)length, value);
+  }
+  c->count++;
+}
+
+TEST_CASE("json_stream wildcard paths", "[json_stream]")
+{
+  collected_t collected = {};
+  char total[8] = {};
+  json_stream_field_t fields[] = {
+    { .path = "items[*].track.id", .on_value = collect, .user_data = &collected },
+    { .path = "total", .dest = total, .dest_size = sizeof(total) },
+  };
+
+  json_stream_t js;
+  json_stream_begin(&js, fields, 2);
+  TEST_ASSERT_TRUE(feed_in_chunks(&js, RESPONSE_PLAYLIST_TRACKS, 16));
+
+  TEST_ASSERT_EQUAL(3, collected.count);
+  TEST_ASSERT_EQUAL(3, fields[0].matches);
+  TEST_ASSERT_EQUAL(0, collected.indices[0]);
+  TEST_ASSERT_EQUAL(2, collected.indices[2]);
+  TEST_ASSERT_EQUAL_STRING("7Jh1bpe76CNTCgdgAdBw4Z", collected.ids[0]);
+  TEST_ASSERT_EQUAL_STRING("0pQskrTITgmCMyr85tb9qq", collected.ids[2]);
+  TEST_ASSERT_EQUAL_STRING("42", total);
+}
+
+TEST_CASE("json_stream truncates to the destination", "[json_stream]")
+{
+  char token[8] = {};
+  json_stream_field_t fields[] = {
+    { .path = "access_token", .dest = token, .dest_size = sizeof(token) },
+  };
+
+  json_stream_t js;
+  json_stream_begin(&js, fields, 1);
+  TEST_ASSERT_TRUE(feed_in_chunks(&js, RESPONSE_TOKEN, 3));
+  TEST_ASSERT_EQUAL_STRING("BQDl3Xq", token);
+}
+
+TEST_CASE("json_stream escapes", "[json_stream]")
+{
+  const char json[] = "{\"a\": \"q\\\"b\\\\s\\/n\\n\", "
+                      "\"b\": \"\\ud83c\\udfb5\", "
+                      "\"c\": \"\\udfb5x\", "
+                      "\"d\\u0021\": \"\\u00e9\"}";
+  char a[16] = {};
+  char b[8] = {};
+  char c[8] = {};
+  char d[8] = {};
+  json_stream_field_t fields[] = {
+    { .path = "a", .dest = a, .dest_size = sizeof(a) },
+    { .path = "b", .dest = b, .dest_size = sizeof(b) },
+    { .path = "c", .dest = c, .dest_size = sizeof(c) },
+    // Keys get unescaped too.
+    { .path = "d!", .dest = d, .dest_size = sizeof(d) },
+  };
+
+  json_stream_t js;
+  json_stream_begin(&js, fields, 4);
+  TEST_ASSERT_TRUE(feed_in_chunks(&js, json, 1));
+  TEST_ASSERT_EQUAL_STRING("q\"b\\s/n\n", a);
+  // A surrogate pair.
+  TEST_ASSERT_EQUAL_STRING("\xF0\x9F\x8E\xB5", b);
+  // A lone surrogate.
+  TEST_ASSERT_EQUAL_STRING("\xEF\xBF\xBDx", c);
+  TEST_ASSERT_EQUAL_STRING("\xC3\xA9", d);
+}
+
+TEST_CASE("json_stream literals and nulls", "[json_stream]")
+{
+  const char json[] = "{\"n\": null, \"e\": [], \"o\": {}, \"x\": [[1, 2], {\"y\": -1.5e3}], "
+                      "\"f\": false}";
+  char n[8] = "keep";
+  char y[16] = {};
+  char x[8] = {};
+  char f[8] = {};
+  json_stream_field_t fields[] = {
+    { .path = "n", .dest = n, .dest_size = sizeof(n) },
+    { .path = "x[1].y", .dest = y, .dest_size = sizeof(y) },
+    { .path = "x[0][1]", .dest = x, .dest_size = sizeof(x) },
+    { .path = "f", .dest = f, .dest_size = sizeof(f) },
+  };
+
+  json_stream_t js;
+  json_stream_begin(&js, fields, 4);
+  TEST_ASSERT_TRUE(feed_in_chunks(&js, json, 5));
+  TEST_ASSERT_EQUAL_STRING("keep", n);
+  TEST_ASSERT_EQUAL(0, fields[0].matches);
+  TEST_ASSERT_EQUAL_STRING("-1.5e3", y);
+  TEST_ASSERT_EQUAL_STRING("2", x);
+  TEST_ASSERT_EQUAL_STRING("false", f);
+
+  // A document which is just a literal.
+  json_stream_begin(&js, NULL, 0);
+  TEST_ASSERT_TRUE(feed_in_chunks(&js, "12", 1));
+}
+
+TEST_CASE("json_stream malformed documents", "[json_stream]")
+{
+  const char* malformed[] = {
+    "{\"a\":}",
+    "{\"a\" 1}",
+    "{\"a\": 1,}x",
+    "[1 2]",
+    "{\"a\": \"\\x\"}",
+    "{\"a\": 1} {",
+    "{\"a\": \"\n\"}",
+  };
+
+  json_stream_t js;
+  for (uint8_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++)
+  {
+    json_stream_begin(&js, NULL, 0);
+    TEST_ASSERT_FALSE(feed_in_chunks(&js, malformed[i], 2));
+  }
+
+  // Incomplete.
+  json_stream_begin(&js, NULL, 0);
+  TEST_ASSERT_TRUE(json_stream_feed(&js, "{\"a\": [1", 8));
+  TEST_ASSERT_FALSE(json_stream_end(&js));
+
+  // Too deep.
+  char deep[2 * JSON_STREAM_MAX_DEPTH + 3] = {};
+  memset(deep, '[', JSON_STREAM_MAX_DEPTH + 1);
+  memset(deep + JSON_STREAM_MAX_DEPTH + 1, ']', JSON_STREAM_MAX_DEPTH + 1);
+  json_stream_begin(&js, NULL, 0);
+  TEST_ASSERT_FALSE(feed_in_chunks(&js, deep, 4));
+}
+
+/*
+ * Extract the player fields from the recorded response with cJSON, the way spotify.c used to, and
+ * with json_stream. Prints the time and the heap each one takes.
+ */
+TEST_CASE("json_stream vs cJSON benchmark", "[json_stream][benchmark]")
+{
+  const uint32_t rounds = 20;
+  char artist[64] = {};
+  char title[64] = {};
+  char id[23] = {};
+
+  // cJSON needs the whole document in a buffer before it can parse it.
+  size_t cjson_heap_max = 0;
+  const int64_t cjson_start = esp_timer_get_time();
+  for (uint32_t i = 0; i < rounds; i++)
+  {
+    const size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    cJSON* json = cJSON_Parse(RESPONSE_ME_PLAYER);
+    TEST_ASSERT_NOT_NULL(json);
+    const size_t used = free_before - heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    cjson_heap_max = used > cjson_heap_max ? used : cjson_heap_max;
+
+    cJSON* item = cJSON_GetObjectItem(json, "item");
+    cJSON* artists = cJSON_GetArrayItem(cJSON_GetObjectItem(item, "artists"), 0);
+    strncpy(artist, cJSON_GetStringValue(cJSON_GetObjectItem(artists, "name")), sizeof(artist) - 1);
+    strncpy(title, cJSON_GetStringValue(cJSON_GetObjectItem(item, "name")), sizeof(title) - 1);
+    strncpy(id, cJSON_GetStringValue(cJSON_GetObjectItem(item, "id")), sizeof(id) - 1);
+    cJSON_Delete(json);
+  }
+  const int64_t cjson_us = (esp_timer_get_time() - cjson_start) / rounds;
+
+  char stream_artist[64] = {};
+  char stream_title[64] = {};
+  char stream_id[23] = {};
+  json_stream_field_t fields[] = {
+    { .path = "item.artists[0].name", .dest = stream_artist, .dest_size = sizeof(stream_artist) },
+    { .path = "item.name", .dest = stream_title, .dest_size = sizeof(stream_title) },
+    { .path = "item.id", .dest = stream_id, .dest_size = sizeof(stream_id) },
+  };
+  json_stream_t js;
+
+  size_t stream_heap_max = 0;
+  const int64_t stream_start = esp_timer_get_time();
+  for (uint32_t i = 0; i < rounds; i++)
+  {
+    const size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    json_stream_begin(&js, fields, 3);
+    // The HTTP client's default buffer is 512 bytes.
+    TEST_ASSERT_TRUE(feed_in_chunks(&js, RESPONSE_ME_PLAYER, 512));
+    const size_t used = free_before - heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    stream_heap_max = used > stream_heap_max ? used : stream_heap_max;
+  }
+  const int64_t stream_us = (esp_timer_get_time() - stream_start) / rounds;
+
+  printf("%u byte response: cJSON %lld us, %u bytes of heap (+ the whole response buffered)\n",
+         (unsigned)strlen(RESPONSE_ME_PLAYER), cjson_us, (unsigned)cjson_heap_max);
+  printf("%u byte response: json_stream %lld us, %u bytes of heap, %u bytes of state\n",
+         (unsigned)strlen(RESPONSE_ME_PLAYER), stream_us, (unsigned)stream_heap_max,
+         (unsigned)sizeof(json_stream_t));
+
+  TEST_ASSERT_EQUAL_STRING(artist, stream_artist);
+  TEST_ASSERT_EQUAL_STRING(title, stream_title);
+  TEST_ASSERT_EQUAL_STRING(id, stream_id);
+  TEST_ASSERT_EQUAL(0, stream_heap_max);
+}
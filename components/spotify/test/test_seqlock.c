@@ -0,0 +1,119 @@
+#include "unity.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "seqlock.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+// Bigger than the player state's interesting part, so a copy takes long enough to get torn.
+#define PATTERN_WORDS  (32)
+
+typedef struct shared_t
+{
+  seqlock_t lock;
+  volatile bool stop;
+  SemaphoreHandle_t stopped;
+  uint32_t writes;
+  // Every word holds the number of the write.
+  uint32_t words[PATTERN_WORDS];
+} shared_t;
+
+static bool is_torn(const uint32_t* words)
+{
+  for (uint8_t i = 1; i < PATTERN_WORDS; i++)
+  {
+    if (words[i] != words[0])
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void writer_task(void* pvParameters)
+{
+  shared_t* shared = (shared_t*)pvParameters;
+
+  while (!shared->stop)
+  {
+    seqlock_write_begin(&shared->lock);
+    shared->writes++;
+    for (uint8_t i = 0; i < PATTERN_WORDS; i++)
+    {
+      shared->words[i] = shared->writes;
+    }
+    seqlock_write_end(&shared->lock);
+  }
+
+  (void)xSemaphoreGive(shared->stopped);
+  vTaskDelete(NULL);
+}
+
+/*
+ * A writer on the other core rewrites the pattern as fast as it can, the reader copies it with and
+ * without the seqlock. Prints how many of the unprotected copies got torn and how often the
+ * protected ones had to be retried.
+ */
+TEST_CASE("seqlock copies are never torn", "[seqlock]")
+{
+  static shared_t shared;
+  memset(&shared, 0, sizeof(shared));
+  shared.stopped = xSemaphoreCreateBinary();
+  TEST_ASSERT_NOT_NULL(shared.stopped);
+
+  const BaseType_t other_core = xPortGetCoreID() == 0 ? 1 : 0;
+  TEST_ASSERT_EQUAL(pdPASS, xTaskCreatePinnedToCore(writer_task,
+                                                    "seqlock_writer",
+                                                    4 * 1024 / 4, // Stack size in words, not bytes.
+                                                    &shared,
+                                                    tskIDLE_PRIORITY + 1,
+                                                    NULL,
+                                                    other_core));
+
+  const uint32_t rounds = 200000;
+  uint32_t copy[PATTERN_WORDS];
+  uint32_t torn = 0;
+  uint32_t unprotected_torn = 0;
+  uint32_t retries = 0;
+  uint32_t last_version = 0;
+
+  const int64_t start = esp_timer_get_time();
+  for (uint32_t i = 0; i < rounds; i++)
+  {
+    uint32_t sequence;
+    bool first = true;
+    do
+    {
+      retries += first ? 0 : 1;
+      first = false;
+      sequence = seqlock_read_begin(&shared.lock);
+      memcpy(copy, shared.words, sizeof(copy));
+    } while (seqlock_read_retry(&shared.lock, sequence));
+
+    torn += is_torn(copy) ? 1 : 0;
+    // The versions never go back.
+    TEST_ASSERT_TRUE(sequence / 2 >= last_version);
+    last_version = sequence / 2;
+
+    memcpy(copy, shared.words, sizeof(copy));
+    unprotected_torn += is_torn(copy) ? 1 : 0;
+  }
+  const int64_t elapsed_us = esp_timer_get_time() - start;
+
+  shared.stop = true;
+  TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(shared.stopped, pdMS_TO_TICKS(1000)));
+  vSemaphoreDelete(shared.stopped);
+
+  printf("%lu reads in %lld us against %lu writes: %lu retries, %lu torn with the seqlock, "
+         "%lu torn without\n",
+         rounds, elapsed_us, shared.writes, retries, torn, unprotected_torn);
+
+  TEST_ASSERT_EQUAL(0, torn);
+  TEST_ASSERT_EQUAL(shared.writes, seqlock_version(&shared.lock));
+}
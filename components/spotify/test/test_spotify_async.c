@@ -0,0 +1,80 @@
+#include "unity.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+
+#include "spotify.h"
+
+#include <stdio.h>
+
+
+// As many as the engine has slots.
+#define CONCURRENT_REQUESTS  (4)
+
+typedef struct burst_t
+{
+  SemaphoreHandle_t done;
+  uint32_t failed;
+} burst_t;
+
+static void on_done(void* user_data, esp_err_t err)
+{
+  burst_t* burst = (burst_t*)user_data;
+  burst->failed += err == ESP_OK ? 0 : 1;
+  (void)xSemaphoreGive(burst->done);
+}
+
+// Submit the requests all at once and wait for all of them. Returns how long it took.
+static int64_t run_burst(burst_t* burst)
+{
+  const int64_t start = esp_timer_get_time();
+
+  for (uint8_t i = 0; i < CONCURRENT_REQUESTS; i++)
+  {
+    TEST_ASSERT_TRUE(spotify_query_async(on_done, burst));
+  }
+  for (uint8_t i = 0; i < CONCURRENT_REQUESTS; i++)
+  {
+    TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(burst->done, pdMS_TO_TICKS(10000)));
+  }
+
+  return esp_timer_get_time() - start;
+}
+
+/*
+ * Needs the board on the network and utilities/tls_standin.py serving HTTPS with a delay, e.g.
+ * --delay 300, with the Spotify URLs in menuconfig pointing at it. The test app doesn't join
+ * a network by itself, so run it from a build which does.
+ */
+TEST_CASE("spotify async requests overlap", "[spotify][async][network]")
+{
+  spotify_init();
+  spotify_async_start();
+
+  // One round trip, on a connection which is open already.
+  spotify_query();
+  const int64_t blocking_start = esp_timer_get_time();
+  spotify_query();
+  const int64_t round_trip = esp_timer_get_time() - blocking_start;
+
+  burst_t burst = { .done = xSemaphoreCreateCounting(CONCURRENT_REQUESTS, 0) };
+  TEST_ASSERT_NOT_NULL(burst.done);
+
+  // The first burst opens the slots' connections, the second one reuses them.
+  const int64_t first = run_burst(&burst);
+  const int64_t second = run_burst(&burst);
+
+  TEST_ASSERT_EQUAL(0, burst.failed);
+
+  const spotify_async_stats_t stats = spotify_get_async_stats();
+  printf("%u requests: one blocking %lld us, async burst %lld us (connecting %lld us), "
+         "in flight max %lu\n",
+         CONCURRENT_REQUESTS, round_trip, second, first, stats.in_flight_max);
+
+  TEST_ASSERT_EQUAL(CONCURRENT_REQUESTS, stats.in_flight_max);
+  // Back to back they'd take CONCURRENT_REQUESTS round trips.
+  TEST_ASSERT_LESS_THAN(2 * round_trip, second);
+
+  vSemaphoreDelete(burst.done);
+}
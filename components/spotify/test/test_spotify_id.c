@@ -0,0 +1,82 @@
+#include "unity.h"
+
+#include "spotify_id.h"
+
+#include <string.h>
+
+
+TEST_CASE("spotify_id base62 round trip", "[spotify_id]")
+{
+  const char* ids[] = {
+    "4uLU6hMCjMI75M1A2tKUQC",
+    "7Jh1bpe76CNTCgdgAdBw4Z",
+    "0000000000000000000000",
+    // The largest 128 bit number.
+    "7N42dgm5tFLK9N8MT7fHC7",
+  };
+  const uint8_t first[16] = {
+    0x93, 0xbc, 0x41, 0x4a, 0x60, 0x67, 0x47, 0xb2,
+    0xb6, 0x12, 0x49, 0x1e, 0xf8, 0x3d, 0x5a, 0x3e,
+  };
+
+  for (uint8_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++)
+  {
+    spotify_id_t id;
+    char base62[SPOTIFY_ID_BASE62_LENGTH + 1];
+
+    TEST_ASSERT_TRUE(spotify_id_from_base62(ids[i], strlen(ids[i]), &id));
+    if (i == 0)
+    {
+      TEST_ASSERT_EQUAL_HEX8_ARRAY(first, id.bytes, 16);
+    }
+    spotify_id_to_base62(&id, base62);
+    TEST_ASSERT_EQUAL_STRING(ids[i], base62);
+  }
+}
+
+TEST_CASE("spotify_id rejects invalid IDs", "[spotify_id]")
+{
+  spotify_id_t id;
+
+  // One over 128 bits, and the largest 22 digits.
+  TEST_ASSERT_FALSE(spotify_id_from_base62("7N42dgm5tFLK9N8MT7fHC8", 22, &id));
+  TEST_ASSERT_FALSE(spotify_id_from_base62("ZZZZZZZZZZZZZZZZZZZZZZ", 22, &id));
+  TEST_ASSERT_FALSE(spotify_id_from_base62("4uLU6hMCjMI75M1A2tKUQ", 21, &id));
+  TEST_ASSERT_FALSE(spotify_id_from_base62("4uLU6hMCjMI75M1A2tKU-C", 22, &id));
+}
+
+TEST_CASE("spotify_id track table grows and iterates", "[spotify_id]")
+{
+  spotify_track_table_t table;
+  spotify_track_table_init(&table);
+
+  // A few times the initial capacity.
+  const uint32_t count = 500;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    spotify_id_t id = {};
+    memcpy(id.bytes, &i, sizeof(i));
+    TEST_ASSERT_TRUE(spotify_track_table_append(&table, &id));
+  }
+  TEST_ASSERT_EQUAL(count, table.count);
+  TEST_ASSERT_GREATER_OR_EQUAL(count, table.capacity);
+
+  spotify_track_iter_t iter = spotify_track_table_iter(&table);
+  spotify_id_t id;
+  uint32_t n = 0;
+  while (spotify_track_iter_next(&iter, &id))
+  {
+    uint32_t i;
+    memcpy(&i, id.bytes, sizeof(i));
+    TEST_ASSERT_EQUAL(n, i);
+    n++;
+  }
+  TEST_ASSERT_EQUAL(count, n);
+
+  spotify_track_table_clear(&table);
+  iter = spotify_track_table_iter(&table);
+  TEST_ASSERT_FALSE(spotify_track_iter_next(&iter, &id));
+
+  spotify_track_table_free(&table);
+  TEST_ASSERT_NULL(table.ids);
+}
@@ -0,0 +1,45 @@
+#include "unity.h"
+
+#include "spotify.h"
+#include "spotify_tls.h"
+
+#include <stdio.h>
+
+
+#define QUERIES  (4)
+
+#ifdef CONFIG_SPOTIFY_TLS_SESSIONS
+/*
+ * Needs the board on the network and utilities/tls_standin.py serving HTTPS with --close, with the
+ * Spotify URLs in menuconfig pointing at it. Every query then needs a new connection, and all but
+ * the first (or all of them, with a session stored in NVS) should resume the session.
+ */
+TEST_CASE("spotify TLS sessions resume", "[spotify][tls][network]")
+{
+  spotify_init();
+
+  const spotify_tls_stats_t before = spotify_tls_get_stats();
+  for (uint8_t i = 0; i < QUERIES; i++)
+  {
+    spotify_query();
+  }
+  const spotify_tls_stats_t after = spotify_tls_get_stats();
+
+  const uint32_t full = after.full - before.full;
+  const uint32_t resumed = after.resumed - before.resumed;
+  const uint64_t full_us = after.full_sum_us - before.full_sum_us;
+  const uint64_t resumed_us = after.resumed_sum_us - before.resumed_sum_us;
+
+  printf("%u queries: full handshakes %lu avg %llu us, resumed %lu avg %llu us, stale %lu\n",
+         QUERIES, full, full > 0 ? full_us / full : 0, resumed,
+         resumed > 0 ? resumed_us / resumed : 0, after.stale - before.stale);
+
+  TEST_ASSERT_EQUAL(QUERIES, full + resumed);
+  TEST_ASSERT_GREATER_OR_EQUAL(QUERIES - 1, resumed);
+  if (full > 0)
+  {
+    // The abbreviated handshake is a round trip shorter and skips the key exchange.
+    TEST_ASSERT_LESS_THAN(full_us / full, resumed_us / resumed);
+  }
+}
+#endif
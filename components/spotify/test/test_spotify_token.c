@@ -0,0 +1,91 @@
+#include "unity.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#include "spotify.h"
+
+#include <stdio.h>
+
+
+#define WAITERS  (4)
+
+typedef struct waiters_t
+{
+  SemaphoreHandle_t done;
+  portMUX_TYPE lock;
+  uint32_t fresh;
+} waiters_t;
+
+static void waiter_task(void* pvParameters)
+{
+  waiters_t* waiters = (waiters_t*)pvParameters;
+
+  if (spotify_wait_access_token(10000))
+  {
+    portENTER_CRITICAL(&waiters->lock);
+    waiters->fresh++;
+    portEXIT_CRITICAL(&waiters->lock);
+  }
+  (void)xSemaphoreGive(waiters->done);
+  vTaskDelete(NULL);
+}
+
+/*
+ * Needs the board on the network and utilities/tls_standin.py, like the async test. The stand-in's
+ * --delay makes the refresh slow enough for all the waiters to come while it's in progress.
+ */
+TEST_CASE("spotify token refresh is shared by the waiters", "[spotify][token][network]")
+{
+  esp_err_t err = nvs_flash_init();
+  if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND)
+  {
+    TEST_ASSERT_EQUAL(ESP_OK, nvs_flash_erase());
+    err = nvs_flash_init();
+  }
+  TEST_ASSERT_EQUAL(ESP_OK, err);
+
+  // No stored token, the first wait needs a refresh.
+  nvs_handle_t nvs;
+  if (nvs_open("spotify", NVS_READWRITE, &nvs) == ESP_OK)
+  {
+    (void)nvs_erase_key(nvs, "token");
+    (void)nvs_commit(nvs);
+    nvs_close(nvs);
+  }
+
+  spotify_init();
+
+  waiters_t waiters = {
+    .done = xSemaphoreCreateCounting(WAITERS, 0),
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+  };
+  TEST_ASSERT_NOT_NULL(waiters.done);
+
+  // The waiters come before the manager even starts.
+  for (uint8_t i = 0; i < WAITERS; i++)
+  {
+    TEST_ASSERT_EQUAL(pdPASS, xTaskCreate(waiter_task, "token_waiter",
+                                          4 * 1024 / 4, // Stack size in words, not bytes.
+                                          &waiters, 5, NULL));
+  }
+  spotify_token_start();
+
+  for (uint8_t i = 0; i < WAITERS; i++)
+  {
+    TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(waiters.done, pdMS_TO_TICKS(15000)));
+  }
+  vSemaphoreDelete(waiters.done);
+
+  const spotify_token_stats_t stats = spotify_get_token_stats();
+  printf("%u waiters: refreshes %lu, failed %lu, waited %lu, expires in %lld s\n",
+         WAITERS, stats.refreshes, stats.failures, stats.waits, stats.expires_in_s);
+
+  TEST_ASSERT_EQUAL(WAITERS, waiters.fresh);
+  TEST_ASSERT_EQUAL(WAITERS, stats.waits);
+  TEST_ASSERT_EQUAL(1, stats.refreshes);
+  TEST_ASSERT_TRUE(spotify_is_fresh_access_token());
+}
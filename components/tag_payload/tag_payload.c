@@ -0,0 +1,145 @@
+#include "tag_payload.h"
+
+#include "iso14443a.h"
+
+#include <string.h>
+
+#define LEGACY_PREFIX  "sp_song"
+
+// The value's length for the type, 0 for the types this version doesn't know.
+static uint8_t tag_payload_value_size(uint8_t type)
+{
+  switch (type)
+  {
+    case TAG_PAYLOAD_TRACK:
+    case TAG_PAYLOAD_ALBUM:
+    case TAG_PAYLOAD_PLAYLIST:
+      return sizeof(spotify_id_t);
+    case TAG_PAYLOAD_ACTION:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+size_t tag_payload_encode(const tag_payload_t* payload, uint8_t* buffer, size_t size)
+{
+  const uint8_t value_size = tag_payload_value_size(payload->type);
+  const size_t payload_size = TAG_PAYLOAD_HEADER_SIZE + value_size + TAG_PAYLOAD_CRC_SIZE;
+
+  if (value_size == 0 || size < payload_size)
+  {
+    return 0;
+  }
+
+  buffer[0] = TAG_PAYLOAD_VERSION;
+  buffer[1] = (uint8_t)payload->type;
+  buffer[2] = value_size;
+  if (payload->type == TAG_PAYLOAD_ACTION)
+  {
+    buffer[TAG_PAYLOAD_HEADER_SIZE] = (uint8_t)payload->action;
+  }
+  else
+  {
+    memcpy(buffer + TAG_PAYLOAD_HEADER_SIZE, payload->id.bytes, value_size);
+  }
+  iso14443a_crc_a(buffer, TAG_PAYLOAD_HEADER_SIZE + value_size,
+                  buffer + TAG_PAYLOAD_HEADER_SIZE + value_size);
+
+  return payload_size;
+}
+
+/*
+ * "sp_song", the dots and the base62 ID at the end.
+ */
+static tag_decode_e tag_payload_decode_legacy(const uint8_t* data, size_t size,
+                                              tag_payload_t* payload, size_t* needed)
+{
+  if (size < TAG_PAYLOAD_LEGACY_SIZE)
+  {
+    if (needed != NULL)
+    {
+      *needed = TAG_PAYLOAD_LEGACY_SIZE;
+    }
+    return TAG_DECODE_NEED_MORE;
+  }
+
+  size_t cursor = strlen(LEGACY_PREFIX);
+  while (cursor < TAG_PAYLOAD_LEGACY_SIZE && data[cursor] == '.')
+  {
+    cursor++;
+  }
+
+  if (!spotify_id_from_base62((const char*)data + cursor, TAG_PAYLOAD_LEGACY_SIZE - cursor,
+                              &payload->id))
+  {
+    return TAG_DECODE_CORRUPTED;
+  }
+
+  payload->type = TAG_PAYLOAD_TRACK;
+  payload->legacy = true;
+  return TAG_DECODE_OK;
+}
+
+tag_decode_e tag_payload_decode(const uint8_t* data, size_t size, tag_payload_t* payload,
+                                size_t* needed)
+{
+  memset(payload, 0, sizeof(tag_payload_t));
+
+  if (size >= strlen(LEGACY_PREFIX) && memcmp(data, LEGACY_PREFIX, strlen(LEGACY_PREFIX)) == 0)
+  {
+    return tag_payload_decode_legacy(data, size, payload, needed);
+  }
+
+  if (size < TAG_PAYLOAD_HEADER_SIZE || data[0] != TAG_PAYLOAD_VERSION)
+  {
+    return TAG_DECODE_UNKNOWN;
+  }
+
+  // The length has to agree with the type, a flipped bit in either is caught before the CRC.
+  const uint8_t value_size = tag_payload_value_size(data[1]);
+  if (value_size == 0 || data[2] != value_size)
+  {
+    return TAG_DECODE_CORRUPTED;
+  }
+
+  const size_t payload_size = TAG_PAYLOAD_HEADER_SIZE + value_size + TAG_PAYLOAD_CRC_SIZE;
+  if (size < payload_size)
+  {
+    if (needed != NULL)
+    {
+      *needed = payload_size;
+    }
+    return TAG_DECODE_NEED_MORE;
+  }
+
+  if (!iso14443a_crc_a_check(data, payload_size))
+  {
+    return TAG_DECODE_CORRUPTED;
+  }
+
+  payload->type = (tag_payload_type_e)data[1];
+  if (payload->type == TAG_PAYLOAD_ACTION)
+  {
+    payload->action = (tag_action_e)data[TAG_PAYLOAD_HEADER_SIZE];
+  }
+  else
+  {
+    memcpy(payload->id.bytes, data + TAG_PAYLOAD_HEADER_SIZE, value_size);
+  }
+
+  return TAG_DECODE_OK;
+}
+
+bool tag_payload_from_base62(tag_payload_type_e type, const char* base62, size_t length,
+                             tag_payload_t* payload)
+{
+  memset(payload, 0, sizeof(tag_payload_t));
+  payload->type = type;
+  return spotify_id_from_base62(base62, length, &payload->id);
+}
+
+void tag_payload_to_base62(const tag_payload_t* payload, char base62[SPOTIFY_ID_BASE62_LENGTH + 1])
+{
+  spotify_id_to_base62(&payload->id, base62);
+}
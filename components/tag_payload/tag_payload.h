@@ -0,0 +1,89 @@
+// tag_payload.h
+//
+// What a tag stores. A binary TLV, with the Spotify IDs in their 16 byte form:
+//
+//   [0]        version, TAG_PAYLOAD_VERSION
+//   [1]        type, tag_payload_type_e
+//   [2]        length of the value
+//   [3..]      value, the ID (16 bytes) or the action (1 byte)
+//   [3 + len]  CRC_A over all of the above, LSB first
+//
+// A track takes 21 bytes. The tags written before it have "sp_song", dot padding and the base62
+// track ID aligned to the end of 32 bytes - those still decode, as tracks.
+
+#ifndef TAG_PAYLOAD_H
+#define TAG_PAYLOAD_H
+
+#include "spotify_id.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TAG_PAYLOAD_VERSION      (1U)
+#define TAG_PAYLOAD_HEADER_SIZE  (3U)
+#define TAG_PAYLOAD_CRC_SIZE     (2U)
+// The largest payload, the header, an ID and the CRC.
+#define TAG_PAYLOAD_MAX_SIZE     (21U)
+#define TAG_PAYLOAD_LEGACY_SIZE  (32U)
+
+typedef enum
+{
+  TAG_PAYLOAD_TRACK = 1,
+  TAG_PAYLOAD_ALBUM,
+  TAG_PAYLOAD_PLAYLIST,
+  TAG_PAYLOAD_ACTION,
+} tag_payload_type_e;
+
+typedef enum
+{
+  TAG_ACTION_PLAY_PAUSE = 1,
+  TAG_ACTION_NEXT,
+  TAG_ACTION_PREVIOUS,
+} tag_action_e;
+
+typedef struct tag_payload_t
+{
+  tag_payload_type_e type;
+  // The ID for the tracks, the albums and the playlists. The action for the actions.
+  spotify_id_t id;
+  tag_action_e action;
+  // Decoded from the old ASCII format.
+  bool legacy;
+} tag_payload_t;
+
+typedef enum
+{
+  TAG_DECODE_OK,
+  // The data is the beginning of a payload, the rest of it is needed.
+  TAG_DECODE_NEED_MORE,
+  // A payload which got damaged, a torn write or a bad read. Worth reading again.
+  TAG_DECODE_CORRUPTED,
+  // Not a payload at all, a blank tag for example.
+  TAG_DECODE_UNKNOWN,
+} tag_decode_e;
+
+/*
+ * Return the payload's size, 0 if the buffer is too small for it.
+ */
+size_t tag_payload_encode(const tag_payload_t* payload, uint8_t* buffer, size_t size);
+
+/*
+ * Decode the first size bytes read from the tag. With TAG_DECODE_NEED_MORE the needed is set to
+ * how many bytes it takes, the needed can be NULL.
+ */
+tag_decode_e tag_payload_decode(const uint8_t* data, size_t size, tag_payload_t* payload,
+                                size_t* needed);
+
+/*
+ * Return false if the string isn't a base62 Spotify ID.
+ */
+bool tag_payload_from_base62(tag_payload_type_e type, const char* base62, size_t length,
+                             tag_payload_t* payload);
+
+/*
+ * Write the payload's ID in base62, the 22 characters and the NUL.
+ */
+void tag_payload_to_base62(const tag_payload_t* payload, char base62[SPOTIFY_ID_BASE62_LENGTH + 1]);
+
+#endif // TAG_PAYLOAD_H
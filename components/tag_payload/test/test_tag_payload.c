@@ -0,0 +1,89 @@
+#include "unity.h"
+
+#include "tag_payload.h"
+
+#include <string.h>
+
+
+TEST_CASE("tag_payload track round trip", "[tag_payload]")
+{
+  tag_payload_t payload;
+  TEST_ASSERT_TRUE(tag_payload_from_base62(TAG_PAYLOAD_TRACK, "7LPRP2wOvP4DAMFBdf4uDZ", 22,
+                                           &payload));
+
+  uint8_t buffer[32] = {};
+  TEST_ASSERT_EQUAL(0, tag_payload_encode(&payload, buffer, TAG_PAYLOAD_MAX_SIZE - 1));
+  TEST_ASSERT_EQUAL(TAG_PAYLOAD_MAX_SIZE, tag_payload_encode(&payload, buffer, sizeof(buffer)));
+  TEST_ASSERT_EQUAL(TAG_PAYLOAD_VERSION, buffer[0]);
+  TEST_ASSERT_EQUAL(TAG_PAYLOAD_TRACK, buffer[1]);
+  TEST_ASSERT_EQUAL(16, buffer[2]);
+
+  // One READ gets 16 bytes, which isn't all of it.
+  tag_payload_t decoded;
+  size_t needed = 0;
+  TEST_ASSERT_EQUAL(TAG_DECODE_NEED_MORE, tag_payload_decode(buffer, 16, &decoded, &needed));
+  TEST_ASSERT_EQUAL(TAG_PAYLOAD_MAX_SIZE, needed);
+
+  TEST_ASSERT_EQUAL(TAG_DECODE_OK, tag_payload_decode(buffer, TAG_PAYLOAD_MAX_SIZE, &decoded, NULL));
+  TEST_ASSERT_EQUAL(TAG_PAYLOAD_TRACK, decoded.type);
+  TEST_ASSERT_FALSE(decoded.legacy);
+
+  char base62[SPOTIFY_ID_BASE62_LENGTH + 1];
+  tag_payload_to_base62(&decoded, base62);
+  TEST_ASSERT_EQUAL_STRING("7LPRP2wOvP4DAMFBdf4uDZ", base62);
+
+  tag_payload_t action = { .type = TAG_PAYLOAD_ACTION, .action = TAG_ACTION_NEXT };
+  TEST_ASSERT_EQUAL(6, tag_payload_encode(&action, buffer, sizeof(buffer)));
+  TEST_ASSERT_EQUAL(TAG_DECODE_OK, tag_payload_decode(buffer, 16, &decoded, NULL));
+  TEST_ASSERT_EQUAL(TAG_PAYLOAD_ACTION, decoded.type);
+  TEST_ASSERT_EQUAL(TAG_ACTION_NEXT, decoded.action);
+}
+
+TEST_CASE("tag_payload detects corruption", "[tag_payload]")
+{
+  tag_payload_t payload;
+  TEST_ASSERT_TRUE(tag_payload_from_base62(TAG_PAYLOAD_PLAYLIST, "37i9dQZF1DXcBWIGoYBM5M", 22,
+                                           &payload));
+  uint8_t buffer[32] = {};
+  const size_t size = tag_payload_encode(&payload, buffer, sizeof(buffer));
+
+  // Every single bit flip.
+  tag_payload_t decoded;
+  for (size_t bit = 0; bit < size * 8; bit++)
+  {
+    uint8_t flipped[32];
+    memcpy(flipped, buffer, sizeof(flipped));
+    flipped[bit / 8] ^= 1U << (bit % 8);
+
+    const tag_decode_e result = tag_payload_decode(flipped, size, &decoded, NULL);
+    TEST_ASSERT_NOT_EQUAL(TAG_DECODE_OK, result);
+  }
+
+  // Blank tags.
+  memset(buffer, 0, sizeof(buffer));
+  TEST_ASSERT_EQUAL(TAG_DECODE_UNKNOWN, tag_payload_decode(buffer, 16, &decoded, NULL));
+  memset(buffer, 0xFF, sizeof(buffer));
+  TEST_ASSERT_EQUAL(TAG_DECODE_UNKNOWN, tag_payload_decode(buffer, 16, &decoded, NULL));
+}
+
+TEST_CASE("tag_payload decodes the legacy format", "[tag_payload]")
+{
+  const uint8_t legacy[32] = "sp_song...7LPRP2wOvP4DAMFBdf4uDZ";
+  tag_payload_t decoded;
+  size_t needed = 0;
+
+  TEST_ASSERT_EQUAL(TAG_DECODE_NEED_MORE, tag_payload_decode(legacy, 16, &decoded, &needed));
+  TEST_ASSERT_EQUAL(TAG_PAYLOAD_LEGACY_SIZE, needed);
+
+  TEST_ASSERT_EQUAL(TAG_DECODE_OK, tag_payload_decode(legacy, sizeof(legacy), &decoded, NULL));
+  TEST_ASSERT_EQUAL(TAG_PAYLOAD_TRACK, decoded.type);
+  TEST_ASSERT_TRUE(decoded.legacy);
+
+  char base62[SPOTIFY_ID_BASE62_LENGTH + 1];
+  tag_payload_to_base62(&decoded, base62);
+  TEST_ASSERT_EQUAL_STRING("7LPRP2wOvP4DAMFBdf4uDZ", base62);
+
+  // A torn legacy write.
+  const uint8_t torn[32] = "sp_song...7LPRP2wOvP4D\0\0\0\0\0\0\0\0\0\0";
+  TEST_ASSERT_EQUAL(TAG_DECODE_CORRUPTED, tag_payload_decode(torn, sizeof(torn), &decoded, NULL));
+}
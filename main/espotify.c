@@ -8,17 +8,24 @@
 #include "esp_http_server.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_netif_sntp.h"
 #include "nvs_flash.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
 
 #include "spotify.h"
+#include "spotify_index.h"
 #include "periph.h"
 #include "tasks.h"
 #ifdef CONFIG_RFID_READER
 #include "rfid_reader.h"
+#include "readers.h"
+#include "tag_map.h"
 #endif // CONFIG_RFID_READER
+#ifdef CONFIG_RC522
+#include "rc522.h"
+#endif // CONFIG_RC522
 
 #define MIN(a, b) (a <= b ? a : b)
 
@@ -131,8 +138,10 @@ get_handler(httpd_req_t *req)
     char content[128];
     size_t recv_size = MIN(req->content_len, sizeof(content));
     int ret = httpd_req_recv(req, content, recv_size);
-    (void)ret;
-    printf("%.*s", req->content_len, content);
+    // Only what was received, the body can be longer than the buffer.
+    if (ret > 0) {
+        printf("%.*s", ret, content);
+    }
 
     // Send a simple response
     const char resp[] = "ESP32 /espotify endpoint";
@@ -196,6 +205,9 @@ start_webserver(void)
         // Register URI handlers
         httpd_register_uri_handler(server, &uri_get);
         httpd_register_uri_handler(server, &uri_post);
+#ifdef CONFIG_TAG_MAP_UPLOAD
+        tag_map_register_upload(server);
+#endif // CONFIG_TAG_MAP_UPLOAD
     }
     // If server failed to start, handle will be NULL
     return server;
@@ -275,6 +287,18 @@ wifi_init_sta(void)
     vEventGroupDelete(s_wifi_event_group);
 }
 
+// The stored access token's expiry is wall clock time, it needs the clock set after the reboot.
+static void
+time_sync(void)
+{
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG("pool.ntp.org");
+    ESP_ERROR_CHECK(esp_netif_sntp_init(&config));
+
+    if (esp_netif_sntp_sync_wait(pdMS_TO_TICKS(5000)) != ESP_OK) {
+        ESP_LOGW("espotify", "The clock isn't set yet, the stored access token won't be used");
+    }
+}
+
 void
 app_main(void)
 {
@@ -293,46 +317,74 @@ app_main(void)
     ESP_ERROR_CHECK(ret);
 
     periph_init();
-    spi_device_handle_t spi = periph_get_spi_handle();
 #ifdef CONFIG_RFID_READER
     rfid_implement();
-    if (rfid_init(spi) != ESP_OK) {
-        ESP_LOGE("espotify", "Failed to init RFID reader!");
-    }
+    for (uint8_t i = 0; i < periph_get_reader_count(); i++) {
+        rfid_handle_t rfid = NULL;
+        if (rfid_init(periph_get_reader_spi_handle(i), &rfid) != ESP_OK) {
+            ESP_LOGE("espotify", "Failed to init RFID reader %u!", i);
+            continue;
+        }
+
+#if defined(CONFIG_RC522_WAIT_IRQ)
+        ESP_ERROR_CHECK(periph_attach_irq(periph_get_reader_irq_pin(i), rc522_irq_handler, rfid));
+#endif // CONFIG_RC522_WAIT_IRQ
+
+        if (!rfid_say_hello(rfid)) {
+            ESP_LOGE("espotify", "Failed to greet RFID reader %u!", i);
+        }
 
-    if (!rfid_say_hello()) {
-        ESP_LOGE("espotify", "Failed to greet RFID reader!");
+        readers_add(rfid, periph_get_reader_host(i));
     }
 #endif // CONFIG_RFID_READER
 
     wifi_init_sta();
+    time_sync();
 
     spotify_init();
+    spotify_index_init();
+    spotify_token_start();
+    // task_spotify and task_spotify_poll go through the async engine.
+    spotify_async_start();
 
     tasks_init();
     tasks_start();
 
-    spotify_refresh_access_token();
+    // Open a slot's API connection now, so the first tap doesn't wait for the handshake. The
+    // engine hands the taps' enqueues the slot which is connected already.
+    if (spotify_wait_access_token(10000)) {
+        (void)spotify_query_async(NULL, NULL);
+    }
     vTaskDelay(200);
 
+#ifdef CONFIG_TAG_MAP_UPLOAD
+    // Only the tag map uploads need it.
+    if (start_webserver() == NULL) {
+        ESP_LOGE("espotify", "Failed to start the webserver!");
+    } else {
+        ESP_LOGI("espotify", "Started the webserver!");
+    }
+#endif // CONFIG_TAG_MAP_UPLOAD
+
+#ifdef CONFIG_RFID_READER
+    uint32_t loops = 0;
+#endif // CONFIG_RFID_READER
     while (1) {
+#ifdef CONFIG_RFID_READER
+        // Every minute or so.
+        if (++loops % 6 == 0) {
+            tasks_log_stats();
+        }
+#endif // CONFIG_RFID_READER
         // spotify_query();
-        // spotify_get_playlist(4);
-        // spotify_get_playlist_song(spotify_context.playlist_id, 3);
         vTaskDelay(1000);
 
         // // NOTE(michalc): the ESP_LOGI below flushes the output I think. That's why those prinfs
         // fails
         // // without subsequent ESP_LOGI.
-        // printf("Music playing: %s\n", spotify_context.is_playing ? "YES" : "NO");
-        // printf("Artist: %s\n", spotify_context.artist);
-        // printf("Song: %s\n", spotify_context.song_title);
-        // printf("Song ID: %s\n", spotify_context.song_id);
-    }
-
-    if (start_webserver() == NULL) {
-        ESP_LOGE("espotify", "Failed to start the webserver!");
-    } else {
-        ESP_LOGI("espotify", "Started the webserver!");
+        // printf("Music playing: %s\n", state.is_playing ? "YES" : "NO");
+        // printf("Artist: %s\n", state.artist);
+        // printf("Song: %s\n", state.song_title);
+        // printf("Song ID: %s\n", state.song_id);
     }
 }
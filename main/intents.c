@@ -0,0 +1,122 @@
+#include "intents.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include <assert.h>
+#include <string.h>
+
+// A ring of pending intents guarded by s_lock. s_pending counts the intents in it.
+static intent_t s_ring[INTENTS_MAX];
+static uint8_t s_head = 0;
+static uint8_t s_size = 0;
+static intents_stats_t s_stats = {};
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t s_pending = NULL;
+
+void
+intents_init(void)
+{
+    s_pending = xSemaphoreCreateCounting(INTENTS_MAX, 0);
+    assert(s_pending != NULL);
+}
+
+intent_result_e
+intents_push(const intent_t *intent)
+{
+    intent_result_e result = INTENT_QUEUED;
+
+    portENTER_CRITICAL(&s_lock);
+    s_stats.taps++;
+
+    for (uint8_t i = 0; i < s_size; i++) {
+        const intent_t *waiting = &s_ring[(s_head + i) % INTENTS_MAX];
+        if (waiting->kind == intent->kind && strcmp(waiting->id, intent->id) == 0) {
+            result = INTENT_COALESCED;
+            break;
+        }
+    }
+
+    if (result == INTENT_QUEUED && s_size == INTENTS_MAX) {
+        result = INTENT_DROPPED;
+    }
+
+    if (result == INTENT_QUEUED) {
+        s_ring[(s_head + s_size) % INTENTS_MAX] = *intent;
+        s_size++;
+        s_stats.queued++;
+        if (s_size > s_stats.depth_max) {
+            s_stats.depth_max = s_size;
+        }
+    } else if (result == INTENT_COALESCED) {
+        s_stats.coalesced++;
+    } else {
+        s_stats.dropped++;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (result == INTENT_QUEUED) {
+        (void)xSemaphoreGive(s_pending);
+    }
+
+    return result;
+}
+
+bool
+intents_pop(intent_t *intent, TickType_t timeout)
+{
+    if (xSemaphoreTake(s_pending, timeout) != pdTRUE) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    *intent = s_ring[s_head];
+    s_head = (s_head + 1) % INTENTS_MAX;
+    s_size--;
+    s_stats.served++;
+    portEXIT_CRITICAL(&s_lock);
+
+    return true;
+}
+
+const char *
+intents_kind_name(intent_kind_e kind)
+{
+    switch (kind) {
+    case INTENT_TRACK:
+        return "track";
+    case INTENT_ALBUM:
+        return "album";
+    case INTENT_PLAYLIST:
+        return "playlist";
+    case INTENT_PLAY_PAUSE:
+        return "play/pause";
+    case INTENT_NEXT:
+        return "next";
+    case INTENT_PREVIOUS:
+        return "previous";
+    }
+    return "?";
+}
+
+intents_stats_t
+intents_get_stats(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    intents_stats_t stats = s_stats;
+    stats.depth = s_size;
+    portEXIT_CRITICAL(&s_lock);
+
+    return stats;
+}
+
+void
+intents_log_stats(void)
+{
+    const intents_stats_t s = intents_get_stats();
+
+    ESP_LOGI("intents",
+             "taps %lu: queued %lu, coalesced %lu, dropped %lu, served %lu, depth %lu (max %lu)",
+             s.taps, s.queued, s.coalesced, s.dropped, s.served, s.depth, s.depth_max);
+}
@@ -0,0 +1,72 @@
+// intents.h
+//
+// What the taps asked Spotify to do, waiting for task_spotify. The RFID side pushes the intents
+// and never waits, the Spotify side takes them one by one at whatever pace the network allows.
+//
+// The queue is bounded. A tap asking for what is already waiting in the queue (the same song, the
+// same album, the same action) coalesces with it. A tap which finds the queue full is dropped.
+
+#ifndef INTENTS_H
+#define INTENTS_H
+
+#include "freertos/FreeRTOS.h"
+
+#include "spotify.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define INTENTS_MAX 8
+
+typedef enum {
+    // Queue the track.
+    INTENT_TRACK,
+    // Play the album or the playlist from its beginning.
+    INTENT_ALBUM,
+    INTENT_PLAYLIST,
+    INTENT_PLAY_PAUSE,
+    INTENT_NEXT,
+    INTENT_PREVIOUS,
+} intent_kind_e;
+
+typedef struct intent_t {
+    uint8_t reader;
+    int64_t detected_us;
+    intent_kind_e kind;
+    // The base62 ID of the track, the album or the playlist. Empty for the actions.
+    char id[MAX_SONG_ID_LENGTH + 1];
+} intent_t;
+
+typedef enum {
+    INTENT_QUEUED,
+    INTENT_COALESCED,
+    INTENT_DROPPED,
+} intent_result_e;
+
+typedef struct intents_stats_t {
+    // Every push is a tap: taps == queued + coalesced + dropped.
+    uint32_t taps;
+    uint32_t queued;
+    uint32_t coalesced;
+    uint32_t dropped;
+    // Intents taken by intents_pop.
+    uint32_t served;
+    uint32_t depth;
+    uint32_t depth_max;
+} intents_stats_t;
+
+void intents_init(void);
+
+// Never blocks.
+intent_result_e intents_push(const intent_t *intent);
+
+// Take the oldest intent. Return false if there was none before the timeout.
+bool intents_pop(intent_t *intent, TickType_t timeout);
+
+// For the logs.
+const char *intents_kind_name(intent_kind_e kind);
+
+intents_stats_t intents_get_stats(void);
+void intents_log_stats(void);
+
+#endif // INTENTS_H
@@ -13,6 +13,13 @@
 #define PIN_NUM_CLK  18
 #define PIN_NUM_CS   5
 
+// The second bus, for the readers that don't share the VSPI one. GPIO12 would be the natural MISO
+// (IOMUX) but it's a strapping pin and a reader driving it during boot breaks the flash voltage
+// selection.
+#define HSPI_PIN_NUM_MISO 27
+#define HSPI_PIN_NUM_MOSI 13
+#define HSPI_PIN_NUM_CLK  14
+
 /*
  * ESP32 WROVER
  * 1.GPIO12 is internally pulled high in the module and is not recommended for use as a touch pin.
@@ -36,6 +43,57 @@ uint8_t _GPIO_IRQ_PIN[2] = {15U, 0U};
 static QueueHandle_t uart1_queue;
 spi_device_handle_t _spi;
 
+#ifdef CONFIG_RFID_READER
+#define READERS_COUNT CONFIG_RFID_READER_COUNT
+
+#if defined(CONFIG_RC522_WAIT_IRQ)
+#define READER_IRQ_PIN(pin) (pin)
+#else
+#define READER_IRQ_PIN(pin) (-1)
+#endif // CONFIG_RC522_WAIT_IRQ
+
+#if defined(CONFIG_RFID_READER_2_HSPI)
+#define READER_2_HOST HSPI_HOST
+#else
+#define READER_2_HOST VSPI_HOST
+#endif
+#if defined(CONFIG_RFID_READER_3_HSPI)
+#define READER_3_HOST HSPI_HOST
+#else
+#define READER_3_HOST VSPI_HOST
+#endif
+#if defined(CONFIG_RFID_READER_4_HSPI)
+#define READER_4_HOST HSPI_HOST
+#else
+#define READER_4_HOST VSPI_HOST
+#endif
+
+typedef struct reader_pins_t {
+    spi_host_device_t host;
+    int cs;
+    // -1 when the reader's IRQ pin isn't used.
+    int irq;
+} reader_pins_t;
+
+static const reader_pins_t readers[READERS_COUNT] = {
+    {VSPI_HOST, PIN_NUM_CS, READER_IRQ_PIN(CONFIG_RC522_IRQ_PIN)},
+#if CONFIG_RFID_READER_COUNT >= 2
+    {READER_2_HOST, CONFIG_RFID_READER_2_CS_PIN,
+     READER_IRQ_PIN(CONFIG_RFID_READER_2_IRQ_PIN)},
+#endif
+#if CONFIG_RFID_READER_COUNT >= 3
+    {READER_3_HOST, CONFIG_RFID_READER_3_CS_PIN,
+     READER_IRQ_PIN(CONFIG_RFID_READER_3_IRQ_PIN)},
+#endif
+#if CONFIG_RFID_READER_COUNT >= 4
+    {READER_4_HOST, CONFIG_RFID_READER_4_CS_PIN,
+     READER_IRQ_PIN(CONFIG_RFID_READER_4_IRQ_PIN)},
+#endif
+};
+
+static spi_device_handle_t readers_spi[READERS_COUNT];
+#endif // CONFIG_RFID_READER
+
 // For ESP32 the UART 2 uses pins 16 (rx) and 17 (tx).
 #define UART_PERIPH UART_NUM_2
 
@@ -124,6 +182,35 @@ periph_get_spi_handle(void)
 }
 
 #ifdef CONFIG_RFID_READER
+static void
+periph_init_spi_bus(spi_host_device_t host, const spi_bus_config_t *buscfg)
+{
+#if defined(CONFIG_RC522)
+    // Without DMA a transaction is limited to 64 bytes. A full RC522 FIFO burst is 65.
+    const spi_dma_chan_t dma = SPI_DMA_CH_AUTO;
+#else
+    // The PN532 reads send the command and receive the answer in one half duplex transaction,
+    // which the ESP32's SPI master refuses with DMA on.
+    const spi_dma_chan_t dma = SPI_DMA_DISABLED;
+#endif // CONFIG_RC522
+    esp_err_t ret = spi_bus_initialize(host, buscfg, dma);
+    switch (ret) {
+    case ESP_ERR_INVALID_ARG:
+        ESP_ERROR_CHECK(ret);
+        break;
+    case ESP_ERR_INVALID_STATE:
+        ESP_ERROR_CHECK(ret);
+        break;
+        break;
+    case ESP_ERR_NO_MEM:
+        ESP_ERROR_CHECK(ret);
+        break;
+    case ESP_OK:
+    default:
+        break;
+    }
+}
+
 void
 periph_init_spi(void)
 {
@@ -144,7 +231,8 @@ periph_init_spi(void)
         .spics_io_num = PIN_NUM_CS,         // CS pin
         .queue_size = 7,                    // transactions queue size
         .pre_cb = spi_pretransfer_callback, // pre transfer to toggle CS
-        .flags = SPI_DEVICE_HALFDUPLEX};
+        // Full duplex - burst reads need the address byte clocked out for every byte read.
+        .flags = 0};
 #elif defined(CONFIG_PN532)
     spi_device_interface_config_t devcfg = {
         .clock_speed_hz = 5 * 1000 * 1000,  // PN532 max 5MHz, RC522 max 10MHz
@@ -155,25 +243,55 @@ periph_init_spi(void)
         .flags = SPI_DEVICE_HALFDUPLEX | SPI_DEVICE_TXBIT_LSBFIRST | SPI_DEVICE_RXBIT_LSBFIRST};
 #endif
 
-    ret = spi_bus_initialize(VSPI_HOST, &buscfg, 0);
-    switch (ret) {
-    case ESP_ERR_INVALID_ARG:
-        ESP_ERROR_CHECK(ret);
-        break;
-    case ESP_ERR_INVALID_STATE:
-        ESP_ERROR_CHECK(ret);
-        break;
-        break;
-    case ESP_ERR_NO_MEM:
+    periph_init_spi_bus(VSPI_HOST, &buscfg);
+
+    bool hspi_used = false;
+    for (uint8_t i = 0; i < READERS_COUNT; i++) {
+        hspi_used |= readers[i].host == HSPI_HOST;
+    }
+
+    if (hspi_used) {
+        buscfg.miso_io_num = HSPI_PIN_NUM_MISO;
+        buscfg.mosi_io_num = HSPI_PIN_NUM_MOSI;
+        buscfg.sclk_io_num = HSPI_PIN_NUM_CLK;
+        periph_init_spi_bus(HSPI_HOST, &buscfg);
+    }
+
+    // Every reader is a separate device (chip select) on its bus.
+    for (uint8_t i = 0; i < READERS_COUNT; i++) {
+        devcfg.spics_io_num = readers[i].cs;
+        ret = spi_bus_add_device(readers[i].host, &devcfg, &readers_spi[i]);
         ESP_ERROR_CHECK(ret);
-        break;
-    case ESP_OK:
-    default:
-        break;
     }
 
-    ret = spi_bus_add_device(VSPI_HOST, &devcfg, &_spi);
-    ESP_ERROR_CHECK(ret);
+    _spi = readers_spi[0];
+}
+
+uint8_t
+periph_get_reader_count(void)
+{
+    return READERS_COUNT;
+}
+
+spi_device_handle_t
+periph_get_reader_spi_handle(uint8_t reader)
+{
+    assert(reader < READERS_COUNT);
+    return readers_spi[reader];
+}
+
+spi_host_device_t
+periph_get_reader_host(uint8_t reader)
+{
+    assert(reader < READERS_COUNT);
+    return readers[reader].host;
+}
+
+int
+periph_get_reader_irq_pin(uint8_t reader)
+{
+    assert(reader < READERS_COUNT);
+    return readers[reader].irq;
 }
 #endif // CONFIG_RFID_READER
 
@@ -222,6 +340,26 @@ periph_init_gpio(void (*gpio_cb)(void *arg), void *gpio_cb_arg)
     ESP_ERROR_CHECK(ret);
 }
 
+esp_err_t
+periph_attach_irq(gpio_num_t pin, gpio_isr_t isr, void *arg)
+{
+    // IRQ lines of the RFID readers are active low (see rc522_say_hello).
+    gpio_config_t io_conf = {
+        .intr_type = GPIO_INTR_NEGEDGE,
+        .pin_bit_mask = (1ULL << pin),
+        .mode = GPIO_MODE_INPUT,
+        .pull_down_en = 0,
+        .pull_up_en = 1,
+    };
+    esp_err_t ret = gpio_config(&io_conf);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // The ISR service is installed by periph_init_gpio.
+    return gpio_isr_handler_add(pin, isr, arg);
+}
+
 void
 periph_init()
 {
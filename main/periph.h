@@ -6,13 +6,24 @@
 #define PERIPH_H
 
 #include "driver/spi_master.h"
+#include "driver/gpio.h"
 
 void periph_init();
 
 void periph_init_spi(void);
 
+// The first reader's SPI device.
 spi_device_handle_t periph_get_spi_handle(void);
 
+uint8_t periph_get_reader_count(void);
+spi_device_handle_t periph_get_reader_spi_handle(uint8_t reader);
+spi_host_device_t periph_get_reader_host(uint8_t reader);
+// Return -1 if the reader's IRQ pin isn't used.
+int periph_get_reader_irq_pin(uint8_t reader);
+
 uint8_t periph_get_button_state(uint8_t clear);
 
+// Call isr with arg on the falling edge of pin. Meant for the IRQ lines of the RFID readers.
+esp_err_t periph_attach_irq(gpio_num_t pin, gpio_isr_t isr, void *arg);
+
 #endif // PERIPH_H
@@ -0,0 +1,159 @@
+#include "pipeline.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+struct pipeline_stage_t {
+    const char *name;
+    QueueHandle_t queue;
+    size_t item_size;
+    pipeline_work_t work;
+    pipeline_stage_t *next;
+    UBaseType_t priority;
+    uint32_t stack_size;
+    // The producers, the stage's task and the readers of the stats all touch them.
+    pipeline_stage_stats_t stats;
+    portMUX_TYPE lock;
+};
+
+pipeline_stage_t *
+pipeline_stage_create(const char *name, size_t item_size, uint8_t depth, pipeline_work_t work,
+                      UBaseType_t priority, uint32_t stack_size)
+{
+    pipeline_stage_t *stage = calloc(1, sizeof(pipeline_stage_t));
+    if (stage == NULL) {
+        return NULL;
+    }
+
+    stage->queue = xQueueCreate(depth, item_size);
+    if (stage->queue == NULL) {
+        free(stage);
+        return NULL;
+    }
+
+    stage->name = name;
+    stage->item_size = item_size;
+    stage->work = work;
+    stage->priority = priority;
+    stage->stack_size = stack_size;
+    portMUX_INITIALIZE(&stage->lock);
+
+    return stage;
+}
+
+void
+pipeline_stage_connect(pipeline_stage_t *stage, pipeline_stage_t *next)
+{
+    assert(stage->item_size == next->item_size);
+    stage->next = next;
+}
+
+static void
+pipeline_note_depth(pipeline_stage_t *stage)
+{
+    const uint32_t depth = uxQueueMessagesWaiting(stage->queue);
+    portENTER_CRITICAL(&stage->lock);
+    if (depth > stage->stats.depth_max) {
+        stage->stats.depth_max = depth;
+    }
+    portEXIT_CRITICAL(&stage->lock);
+}
+
+bool
+pipeline_push(pipeline_stage_t *stage, const void *item, TickType_t timeout)
+{
+    if (xQueueSendToBack(stage->queue, item, timeout) != pdPASS) {
+        return false;
+    }
+    pipeline_note_depth(stage);
+    return true;
+}
+
+bool
+pipeline_try_push(pipeline_stage_t *stage, const void *item)
+{
+    if (!pipeline_push(stage, item, 0)) {
+        portENTER_CRITICAL(&stage->lock);
+        stage->stats.rejected++;
+        portEXIT_CRITICAL(&stage->lock);
+        return false;
+    }
+    return true;
+}
+
+static void
+pipeline_stage_task(void *arg)
+{
+    pipeline_stage_t *stage = (pipeline_stage_t *)arg;
+    // The item lives on the stack of the task, the stack size has to account for it.
+    uint8_t item[stage->item_size];
+
+    while (1) {
+        (void)xQueueReceive(stage->queue, item, portMAX_DELAY);
+
+        const int64_t start = esp_timer_get_time();
+        const bool pass = stage->work(item);
+        const uint32_t service = esp_timer_get_time() - start;
+
+        portENTER_CRITICAL(&stage->lock);
+        stage->stats.processed++;
+        stage->stats.service_sum_us += service;
+        if (service > stage->stats.service_max_us) {
+            stage->stats.service_max_us = service;
+        }
+        portEXIT_CRITICAL(&stage->lock);
+
+        if (pass && stage->next != NULL) {
+            const int64_t blocked_start = esp_timer_get_time();
+            (void)pipeline_push(stage->next, item, portMAX_DELAY);
+            const uint32_t blocked = esp_timer_get_time() - blocked_start;
+
+            portENTER_CRITICAL(&stage->lock);
+            stage->stats.blocked_sum_us += blocked;
+            stage->stats.passed++;
+            portEXIT_CRITICAL(&stage->lock);
+        }
+    }
+}
+
+bool
+pipeline_stage_start(pipeline_stage_t *stage)
+{
+    return xTaskCreate(&pipeline_stage_task, stage->name, stage->stack_size / 4, stage,
+                       stage->priority, NULL) == pdPASS;
+}
+
+QueueHandle_t
+pipeline_stage_get_queue(pipeline_stage_t *stage)
+{
+    return stage->queue;
+}
+
+pipeline_stage_stats_t
+pipeline_stage_get_stats(pipeline_stage_t *stage)
+{
+    portENTER_CRITICAL(&stage->lock);
+    pipeline_stage_stats_t stats = stage->stats;
+    portEXIT_CRITICAL(&stage->lock);
+    stats.depth = uxQueueMessagesWaiting(stage->queue);
+    return stats;
+}
+
+void
+pipeline_stage_log_stats(pipeline_stage_t *stage)
+{
+    const pipeline_stage_stats_t s = pipeline_stage_get_stats(stage);
+    const uint32_t processed = s.processed > 0 ? s.processed : 1;
+
+    ESP_LOGI("pipeline",
+             "%-10s: depth %lu (max %lu), rejected %lu, processed %lu, passed %lu, "
+             "service avg %llu us max %lu us, blocked %llu us",
+             stage->name, s.depth, s.depth_max, s.rejected, s.processed, s.passed,
+             s.service_sum_us / processed, s.service_max_us, s.blocked_sum_us);
+}
@@ -0,0 +1,59 @@
+// pipeline.h
+//
+// Processing stages connected with bounded queues. Every stage runs in its own task: it takes an
+// item from its queue, works on it and passes it on to the next stage's queue. A full queue blocks
+// the previous stage, so a slow stage slows down the ones before it instead of piling items up.
+//
+// Items are copied in and out of the queues. All the stages of a pipeline share the item type.
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct pipeline_stage_t pipeline_stage_t;
+
+// Work on the item in place. Return true to pass it to the next stage, false to drop it.
+typedef bool (*pipeline_work_t)(void *item);
+
+typedef struct pipeline_stage_stats_t {
+    uint32_t processed;
+    uint32_t passed;
+    // Items which didn't fit in the stage's queue when pushed with pipeline_try_push.
+    uint32_t rejected;
+    // Number of items waiting in the stage's queue, now and at most.
+    uint32_t depth;
+    uint32_t depth_max;
+    uint32_t service_max_us;
+    uint64_t service_sum_us;
+    // Time spent waiting for space in the next stage's queue.
+    uint64_t blocked_sum_us;
+} pipeline_stage_stats_t;
+
+// The stage's task doesn't run until pipeline_stage_start.
+pipeline_stage_t *pipeline_stage_create(const char *name, size_t item_size, uint8_t depth,
+                                        pipeline_work_t work, UBaseType_t priority,
+                                        uint32_t stack_size);
+
+void pipeline_stage_connect(pipeline_stage_t *stage, pipeline_stage_t *next);
+
+bool pipeline_stage_start(pipeline_stage_t *stage);
+
+// Put an item in the stage's queue. Return false if there was no space in it before the timeout.
+bool pipeline_push(pipeline_stage_t *stage, const void *item, TickType_t timeout);
+
+// Like pipeline_push but doesn't wait and counts the failures as rejected.
+bool pipeline_try_push(pipeline_stage_t *stage, const void *item);
+
+// The stage's input queue, for the producers which aren't pipeline stages themselves.
+QueueHandle_t pipeline_stage_get_queue(pipeline_stage_t *stage);
+
+pipeline_stage_stats_t pipeline_stage_get_stats(pipeline_stage_t *stage);
+void pipeline_stage_log_stats(pipeline_stage_t *stage);
+
+#endif // PIPELINE_H
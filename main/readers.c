@@ -0,0 +1,243 @@
+#include "readers.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// 32 scans per second per reader.
+#define READERS_SCAN_PERIOD_MS (1000 / 32)
+
+// WiFi and the TCP/IP stack run on core 0 by default. The scanning takes the other one.
+#if defined(CONFIG_FREERTOS_UNICORE)
+#define READERS_SCAN_CORE 0
+#else
+#define READERS_SCAN_CORE 1
+#endif
+
+#define READERS_SCAN_PRIORITY 7
+
+typedef struct reader_t {
+    rfid_handle_t rfid;
+    spi_host_device_t host;
+    // How many times the reader got paused without being resumed. Guarded by s_lock.
+    uint32_t paused;
+    // Both 0 when there is nothing to compare against (right after start or a pause).
+    int64_t last_poll_us;
+    int64_t last_empty_poll_us;
+    readers_stats_t stats;
+} reader_t;
+
+static reader_t s_readers[READERS_MAX];
+static uint8_t s_count = 0;
+static readers_detect_cb_t s_on_detect = NULL;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+int
+readers_add(rfid_handle_t rfid, spi_host_device_t host)
+{
+    if (s_count >= READERS_MAX) {
+        return -1;
+    }
+
+    reader_t *r = &s_readers[s_count];
+    memset(r, 0, sizeof(*r));
+    r->rfid = rfid;
+    r->host = host;
+
+    return s_count++;
+}
+
+uint8_t
+readers_count(void)
+{
+    return s_count;
+}
+
+rfid_handle_t
+readers_get(uint8_t reader)
+{
+    assert(reader < s_count);
+    return s_readers[reader].rfid;
+}
+
+void
+readers_pause(uint8_t reader)
+{
+    assert(reader < s_count);
+    portENTER_CRITICAL(&s_lock);
+    s_readers[reader].paused++;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void
+readers_resume(uint8_t reader)
+{
+    assert(reader < s_count);
+    portENTER_CRITICAL(&s_lock);
+    if (s_readers[reader].paused > 0) {
+        s_readers[reader].paused--;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void
+readers_pause_all(void)
+{
+    for (uint8_t i = 0; i < s_count; i++) {
+        readers_pause(i);
+    }
+}
+
+void
+readers_resume_all(void)
+{
+    for (uint8_t i = 0; i < s_count; i++) {
+        readers_resume(i);
+    }
+}
+
+static bool
+readers_is_paused(uint8_t reader)
+{
+    portENTER_CRITICAL(&s_lock);
+    const bool paused = s_readers[reader].paused > 0;
+    portEXIT_CRITICAL(&s_lock);
+    return paused;
+}
+
+static void
+readers_poll(uint8_t reader)
+{
+    reader_t *r = &s_readers[reader];
+
+    if (readers_is_paused(reader)) {
+        // The time spent paused isn't a scanning delay.
+        r->last_poll_us = 0;
+        r->last_empty_poll_us = 0;
+        return;
+    }
+
+    // Someone is in the middle of a session with a PICC on this reader. Don't wait for it, the
+    // other readers on the bus would have to wait too.
+    if (!rfid_lock(r->rfid, 0)) {
+        r->stats.busy++;
+        return;
+    }
+
+    const int64_t start = esp_timer_get_time();
+    if (r->last_poll_us != 0) {
+        const uint32_t interval = start - r->last_poll_us;
+        r->stats.poll_intervals++;
+        r->stats.poll_interval_sum_us += interval;
+        if (interval > r->stats.poll_interval_max_us) {
+            r->stats.poll_interval_max_us = interval;
+        }
+    }
+    r->last_poll_us = start;
+    r->stats.polls++;
+
+    // Only the REQA, the anticollision and the rest are up to whoever handles the PICC. The PICC
+    // stays in the READY state meanwhile, nobody else talks to it while the reader is paused.
+    const bool detected = rfid_test_picc_presence(r->rfid);
+
+    rfid_unlock(r->rfid);
+
+    if (!detected) {
+        r->last_empty_poll_us = start;
+        return;
+    }
+
+    const int64_t end = esp_timer_get_time();
+    r->stats.detections++;
+    if (r->last_empty_poll_us != 0) {
+        const uint32_t latency = end - r->last_empty_poll_us;
+        r->stats.detect_latencies++;
+        r->stats.detect_latency_sum_us += latency;
+        if (latency > r->stats.detect_latency_max_us) {
+            r->stats.detect_latency_max_us = latency;
+        }
+    }
+
+    // Don't detect the same PICC again while it's being handled.
+    readers_pause(reader);
+    if (s_on_detect == NULL || !s_on_detect(reader, r->rfid)) {
+        readers_resume(reader);
+    }
+}
+
+static void
+readers_scan_task(void *arg)
+{
+    const spi_host_device_t host = (spi_host_device_t)(uintptr_t)arg;
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (1) {
+        // Every reader on the bus gets one poll per round. A poll is bounded by the REQA's frame
+        // waiting time so none of them can hog the bus.
+        for (uint8_t i = 0; i < s_count; i++) {
+            if (s_readers[i].host == host) {
+                readers_poll(i);
+            }
+        }
+
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(READERS_SCAN_PERIOD_MS));
+    }
+}
+
+void
+readers_start(readers_detect_cb_t on_detect)
+{
+    s_on_detect = on_detect;
+
+    // One task per SPI host with at least one reader on it.
+    for (uint8_t i = 0; i < s_count; i++) {
+        bool host_seen = false;
+        for (uint8_t j = 0; j < i; j++) {
+            host_seen |= s_readers[j].host == s_readers[i].host;
+        }
+        if (host_seen) {
+            continue;
+        }
+
+        char name[configMAX_TASK_NAME_LEN];
+        snprintf(name, sizeof(name), "readers_scan_%d", (int)s_readers[i].host);
+
+        BaseType_t xReturned = xTaskCreatePinnedToCore(
+            &readers_scan_task, name,
+            4 * 1024 / 4, // Stack size in words, not bytes.
+            (void *)(uintptr_t)s_readers[i].host, READERS_SCAN_PRIORITY, NULL, READERS_SCAN_CORE);
+
+        if (xReturned != pdPASS) {
+            ESP_LOGE("readers", "Failed to start scanning SPI host %d", (int)s_readers[i].host);
+        }
+    }
+}
+
+readers_stats_t
+readers_get_stats(uint8_t reader)
+{
+    assert(reader < s_count);
+    return s_readers[reader].stats;
+}
+
+void
+readers_log_stats(void)
+{
+    for (uint8_t i = 0; i < s_count; i++) {
+        const readers_stats_t *s = &s_readers[i].stats;
+        const uint32_t intervals = s->poll_intervals > 0 ? s->poll_intervals : 1;
+        const uint32_t latencies = s->detect_latencies > 0 ? s->detect_latencies : 1;
+
+        ESP_LOGI("readers",
+                 "reader %u (host %d): polls %lu, busy %lu, poll interval avg %llu us max %lu us, "
+                 "detections %lu, detect latency avg %llu us max %lu us",
+                 i, (int)s_readers[i].host, s->polls, s->busy, s->poll_interval_sum_us / intervals,
+                 s->poll_interval_max_us, s->detections, s->detect_latency_sum_us / latencies,
+                 s->detect_latency_max_us);
+    }
+}
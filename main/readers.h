@@ -0,0 +1,60 @@
+// readers.h
+//
+// The set of RFID readers attached to the ESP32 and the tasks scanning them for PICCs.
+//
+// There is one scanning task per SPI host, so readers on different hosts are scanned in parallel.
+// Readers sharing a host take turns - each one gets a single poll per scan round.
+
+#ifndef READERS_H
+#define READERS_H
+
+#include "driver/spi_master.h"
+
+#include "rfid_reader.h"
+
+#define READERS_MAX 4
+
+typedef struct readers_stats_t {
+    uint32_t polls;
+    // Polls skipped because the reader was in a session with a PICC.
+    uint32_t busy;
+    uint32_t detections;
+    // Time between the starts of two consecutive polls. A PICC waits at most that long (plus the
+    // poll itself) to be noticed.
+    uint32_t poll_intervals;
+    uint32_t poll_interval_max_us;
+    uint64_t poll_interval_sum_us;
+    // Time from the last poll which found nothing to the end of the poll which found a PICC.
+    // That's the upper bound of the tap detection latency.
+    uint32_t detect_latencies;
+    uint32_t detect_latency_max_us;
+    uint64_t detect_latency_sum_us;
+} readers_stats_t;
+
+// Called from the scanning task once a PICC answered the REQA on the reader. Keep it short, it
+// delays the scanning of the other readers on the host.
+// The reader is paused at that point, whoever handles the PICC resumes it with readers_resume.
+// If the callback returns false, nobody is going to handle the PICC and the reader gets resumed
+// right away.
+typedef bool (*readers_detect_cb_t)(uint8_t reader, rfid_handle_t rfid);
+
+// Return the reader's index or -1 if the set is full.
+int readers_add(rfid_handle_t rfid, spi_host_device_t host);
+
+uint8_t readers_count(void);
+
+rfid_handle_t readers_get(uint8_t reader);
+
+// Start the scanning tasks. Add all the readers before calling it.
+void readers_start(readers_detect_cb_t on_detect);
+
+// Pausing nests - the reader is scanned again once every pause got its resume.
+void readers_pause(uint8_t reader);
+void readers_resume(uint8_t reader);
+void readers_pause_all(void);
+void readers_resume_all(void);
+
+readers_stats_t readers_get_stats(uint8_t reader);
+void readers_log_stats(void);
+
+#endif // READERS_H
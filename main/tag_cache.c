@@ -0,0 +1,334 @@
+#include "tag_cache.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TAG_CACHE_NVS_NAMESPACE "tag_cache"
+#define TAG_CACHE_NVS_KEY       "entries"
+#define TAG_CACHE_NVS_VERSION   2
+// Anything earlier and the clock wasn't set, 2021-01-01.
+#define TAG_CACHE_VALID_TIME    (1609459200)
+
+typedef struct tag_cache_entry_t {
+    // 0 for a free entry.
+    uint8_t uid_size;
+    uint8_t uid[TAG_CACHE_UID_MAX];
+    tag_payload_t payload;
+    int64_t stored_us;
+    uint32_t read_us;
+    // The LRU clock's value at the last use.
+    uint32_t used;
+} tag_cache_entry_t;
+
+// What goes to NVS. The payload is encoded, so a damaged blob doesn't make it into the cache.
+typedef struct tag_cache_record_t {
+    uint8_t uid_size;
+    uint8_t uid[TAG_CACHE_UID_MAX];
+    uint8_t payload[TAG_PAYLOAD_MAX_SIZE];
+    uint32_t read_us;
+    // When the payload was read, in time(NULL) seconds, 0 if the clock wasn't set. Otherwise the
+    // age at the time of the store is all there is, the time spent powered off doesn't count.
+    int64_t stored_at;
+    uint32_t age_s;
+} tag_cache_record_t;
+
+typedef struct tag_cache_blob_t {
+    uint32_t version;
+    uint32_t count;
+    tag_cache_record_t records[CONFIG_TAG_CACHE_CAPACITY];
+} tag_cache_blob_t;
+
+// The entries are searched linearly, there are few of them. Guarded by s_lock.
+static tag_cache_entry_t s_entries[CONFIG_TAG_CACHE_CAPACITY];
+static uint32_t s_clock = 0;
+static tag_cache_stats_t s_stats = {};
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+#ifdef CONFIG_TAG_CACHE_NVS
+// Set by the changes the NVS doesn't have yet. Guarded by s_lock.
+static bool s_dirty = false;
+// Does the NVS writes, the tasks which change the cache only wake it up.
+static TaskHandle_t s_flush_task = NULL;
+#endif // CONFIG_TAG_CACHE_NVS
+
+static tag_cache_entry_t *
+tag_cache_find(const uint8_t *uid, uint8_t uid_size)
+{
+    for (uint32_t i = 0; i < CONFIG_TAG_CACHE_CAPACITY; i++) {
+        if (s_entries[i].uid_size == uid_size && memcmp(s_entries[i].uid, uid, uid_size) == 0) {
+            return &s_entries[i];
+        }
+    }
+    return NULL;
+}
+
+static bool
+tag_cache_expired(const tag_cache_entry_t *entry, int64_t now_us)
+{
+    return CONFIG_TAG_CACHE_TTL_S > 0 &&
+           now_us - entry->stored_us > (int64_t)CONFIG_TAG_CACHE_TTL_S * 1000000;
+}
+
+#ifdef CONFIG_TAG_CACHE_NVS
+static void
+tag_cache_store(void)
+{
+    tag_cache_blob_t *blob = (tag_cache_blob_t *)calloc(1, sizeof(tag_cache_blob_t));
+    if (blob == NULL) {
+        return;
+    }
+
+    const int64_t now_us = esp_timer_get_time();
+    const time_t now = time(NULL);
+
+    blob->version = TAG_CACHE_NVS_VERSION;
+    portENTER_CRITICAL(&s_lock);
+    // Whatever changes from here on gets stored by the next flush.
+    s_dirty = false;
+    for (uint32_t i = 0; i < CONFIG_TAG_CACHE_CAPACITY; i++) {
+        const tag_cache_entry_t *entry = &s_entries[i];
+        if (entry->uid_size == 0) {
+            continue;
+        }
+        tag_cache_record_t *record = &blob->records[blob->count++];
+        record->uid_size = entry->uid_size;
+        memcpy(record->uid, entry->uid, sizeof(record->uid));
+        (void)tag_payload_encode(&entry->payload, record->payload, sizeof(record->payload));
+        record->read_us = entry->read_us;
+        record->age_s = (uint32_t)((now_us - entry->stored_us) / 1000000);
+        record->stored_at = now >= TAG_CACHE_VALID_TIME ? now - record->age_s : 0;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(TAG_CACHE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        // Only the records in use.
+        err = nvs_set_blob(nvs, TAG_CACHE_NVS_KEY, blob,
+                           offsetof(tag_cache_blob_t, records) +
+                               blob->count * sizeof(tag_cache_record_t));
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW("tag_cache", "Failed to store the cache: %s", esp_err_to_name(err));
+    }
+
+    free(blob);
+}
+
+// Low priority, the NVS writes wait for the tag I/O and the requests. The delay lets a few taps
+// in a row go out in a single write.
+static void
+tag_cache_flush_task(void *pvParameters)
+{
+    (void)pvParameters;
+
+    while (1) {
+        (void)ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_TAG_CACHE_NVS_DELAY_MS));
+
+        portENTER_CRITICAL(&s_lock);
+        const bool dirty = s_dirty;
+        portEXIT_CRITICAL(&s_lock);
+
+        if (dirty) {
+            tag_cache_store();
+        }
+    }
+}
+
+static void
+tag_cache_flush_later(void)
+{
+    if (s_flush_task != NULL) {
+        xTaskNotifyGive(s_flush_task);
+    }
+}
+
+static void
+tag_cache_load(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(TAG_CACHE_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+
+    tag_cache_blob_t *blob = (tag_cache_blob_t *)calloc(1, sizeof(tag_cache_blob_t));
+    size_t size = sizeof(tag_cache_blob_t);
+    if (blob != NULL && nvs_get_blob(nvs, TAG_CACHE_NVS_KEY, blob, &size) == ESP_OK &&
+        blob->version == TAG_CACHE_NVS_VERSION && blob->count <= CONFIG_TAG_CACHE_CAPACITY &&
+        size == offsetof(tag_cache_blob_t, records) + blob->count * sizeof(tag_cache_record_t)) {
+        const int64_t now_us = esp_timer_get_time();
+        const time_t now = time(NULL);
+        uint32_t loaded = 0;
+
+        for (uint32_t i = 0; i < blob->count; i++) {
+            const tag_cache_record_t *record = &blob->records[i];
+            tag_cache_entry_t *entry = &s_entries[loaded];
+            if (record->uid_size == 0 || record->uid_size > TAG_CACHE_UID_MAX ||
+                tag_payload_decode(record->payload, sizeof(record->payload), &entry->payload,
+                                   NULL) != TAG_DECODE_OK) {
+                continue;
+            }
+            // The wall clock counts the time the device was off, if it was set both times.
+            int64_t age_s = record->age_s;
+            if (record->stored_at != 0 && now >= TAG_CACHE_VALID_TIME &&
+                now - record->stored_at > age_s) {
+                age_s = now - record->stored_at;
+            }
+            entry->stored_us = now_us - age_s * 1000000;
+            if (tag_cache_expired(entry, now_us)) {
+                continue;
+            }
+            entry->uid_size = record->uid_size;
+            memcpy(entry->uid, record->uid, sizeof(entry->uid));
+            entry->read_us = record->read_us;
+            entry->used = ++s_clock;
+            loaded++;
+        }
+        s_stats.entries = loaded;
+        ESP_LOGI("tag_cache", "Loaded %lu tags from NVS", loaded);
+    }
+
+    free(blob);
+    nvs_close(nvs);
+}
+#endif // CONFIG_TAG_CACHE_NVS
+
+void
+tag_cache_init(void)
+{
+#ifdef CONFIG_TAG_CACHE_NVS
+    tag_cache_load();
+
+    const BaseType_t created =
+        xTaskCreate(&tag_cache_flush_task, "tag_cache_flush", 3 * 1024 / 4, NULL, 1, &s_flush_task);
+    assert(created == pdPASS);
+    (void)created;
+#endif // CONFIG_TAG_CACHE_NVS
+}
+
+bool
+tag_cache_get(const uint8_t *uid, uint8_t uid_size, tag_payload_t *payload)
+{
+    bool hit = false;
+    const int64_t now_us = esp_timer_get_time();
+
+    portENTER_CRITICAL(&s_lock);
+    s_stats.lookups++;
+    tag_cache_entry_t *entry = tag_cache_find(uid, uid_size);
+    if (entry != NULL && tag_cache_expired(entry, now_us)) {
+        // Free it, the next read puts the fresh payload in.
+        entry->uid_size = 0;
+        s_stats.expired++;
+        s_stats.entries--;
+    } else if (entry != NULL) {
+        *payload = entry->payload;
+        entry->used = ++s_clock;
+        s_stats.hits++;
+        s_stats.saved_us += entry->read_us;
+        hit = true;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    return hit;
+}
+
+void
+tag_cache_put(const uint8_t *uid, uint8_t uid_size, const tag_payload_t *payload,
+              uint32_t read_us)
+{
+    assert(uid_size > 0 && uid_size <= TAG_CACHE_UID_MAX);
+
+    portENTER_CRITICAL(&s_lock);
+    tag_cache_entry_t *entry = tag_cache_find(uid, uid_size);
+    if (entry == NULL) {
+        // A free entry or the least recently used one.
+        entry = &s_entries[0];
+        for (uint32_t i = 0; i < CONFIG_TAG_CACHE_CAPACITY; i++) {
+            if (s_entries[i].uid_size == 0) {
+                entry = &s_entries[i];
+                break;
+            }
+            if (s_entries[i].used < entry->used) {
+                entry = &s_entries[i];
+            }
+        }
+        if (entry->uid_size == 0) {
+            s_stats.entries++;
+        } else {
+            s_stats.evictions++;
+        }
+    }
+    entry->uid_size = uid_size;
+    memset(entry->uid, 0, sizeof(entry->uid));
+    memcpy(entry->uid, uid, uid_size);
+    entry->payload = *payload;
+    entry->stored_us = esp_timer_get_time();
+    entry->read_us = read_us;
+    entry->used = ++s_clock;
+#ifdef CONFIG_TAG_CACHE_NVS
+    s_dirty = true;
+#endif // CONFIG_TAG_CACHE_NVS
+    portEXIT_CRITICAL(&s_lock);
+
+#ifdef CONFIG_TAG_CACHE_NVS
+    tag_cache_flush_later();
+#endif // CONFIG_TAG_CACHE_NVS
+}
+
+void
+tag_cache_invalidate(const uint8_t *uid, uint8_t uid_size)
+{
+    portENTER_CRITICAL(&s_lock);
+    tag_cache_entry_t *entry = tag_cache_find(uid, uid_size);
+    if (entry != NULL) {
+        entry->uid_size = 0;
+        s_stats.invalidations++;
+        s_stats.entries--;
+#ifdef CONFIG_TAG_CACHE_NVS
+        s_dirty = true;
+#endif // CONFIG_TAG_CACHE_NVS
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+#ifdef CONFIG_TAG_CACHE_NVS
+    if (entry != NULL) {
+        tag_cache_flush_later();
+    }
+#endif // CONFIG_TAG_CACHE_NVS
+}
+
+tag_cache_stats_t
+tag_cache_get_stats(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    const tag_cache_stats_t stats = s_stats;
+    portEXIT_CRITICAL(&s_lock);
+
+    return stats;
+}
+
+void
+tag_cache_log_stats(void)
+{
+    const tag_cache_stats_t s = tag_cache_get_stats();
+    const uint32_t lookups = s.lookups > 0 ? s.lookups : 1;
+
+    ESP_LOGI("tag_cache",
+             "lookups %lu: hits %lu (%lu%%), expired %lu, entries %lu/%d, evicted %lu, "
+             "invalidated %lu, saved %llu ms of tag I/O",
+             s.lookups, s.hits, 100 * s.hits / lookups, s.expired, s.entries,
+             CONFIG_TAG_CACHE_CAPACITY, s.evictions, s.invalidations, s.saved_us / 1000);
+}
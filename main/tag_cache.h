@@ -0,0 +1,48 @@
+// tag_cache.h
+//
+// The payloads of the recently tapped tags, by their UIDs. A tap on a tag which is in the cache
+// skips the authentication and the data reads, the UID from the anticollision is enough.
+//
+// The least recently tapped tag makes room for a new one. The entries older than the TTL are read
+// from the tag again. See the TAG_CACHE_* options in menuconfig.
+
+#ifndef TAG_CACHE_H
+#define TAG_CACHE_H
+
+#include "tag_payload.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TAG_CACHE_UID_MAX 10
+
+typedef struct tag_cache_stats_t {
+    // lookups == hits + misses, the expired entries count as misses.
+    uint32_t lookups;
+    uint32_t hits;
+    uint32_t expired;
+    uint32_t evictions;
+    uint32_t invalidations;
+    uint32_t entries;
+    // The tag I/O the hits didn't do, as long as it took when the tags were read.
+    uint64_t saved_us;
+} tag_cache_stats_t;
+
+// Loads the cache from NVS and starts the task which writes the changes back, with
+// CONFIG_TAG_CACHE_NVS.
+void tag_cache_init(void);
+
+// Return true if the tag's payload is cached.
+bool tag_cache_get(const uint8_t *uid, uint8_t uid_size, tag_payload_t *payload);
+
+// read_us is how long it took to read the payload from the tag.
+void tag_cache_put(const uint8_t *uid, uint8_t uid_size, const tag_payload_t *payload,
+                   uint32_t read_us);
+
+// The tag is being written, what's cached won't be true anymore.
+void tag_cache_invalidate(const uint8_t *uid, uint8_t uid_size);
+
+tag_cache_stats_t tag_cache_get_stats(void);
+void tag_cache_log_stats(void);
+
+#endif // TAG_CACHE_H
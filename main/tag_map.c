@@ -0,0 +1,331 @@
+#include "tag_map.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "spi_flash_mmap.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define TAG_MAP_PARTITION_SUBTYPE 0x40
+#define TAG_MAP_PARTITION_LABEL   "tag_map"
+// The upload goes to flash a sector at a time.
+#define TAG_MAP_UPLOAD_CHUNK      4096
+// Consecutive receive timeouts before an upload is given up on.
+#define TAG_MAP_UPLOAD_TIMEOUTS   3
+#define TAG_MAP_UPLOAD_HEADER     "X-Tag-Map-Secret"
+
+static const esp_partition_t *s_partition = NULL;
+// The mapped table, s_records is NULL while there is none. Guarded by s_lock, so an upload
+// doesn't unmap the table from under a lookup.
+static esp_partition_mmap_handle_t s_mmap = 0;
+static const tag_map_record_t *s_records = NULL;
+static tag_map_stats_t s_stats = {};
+static SemaphoreHandle_t s_lock = NULL;
+
+#ifdef CONFIG_TAG_MAP_UPLOAD
+static void
+tag_map_unmap(void)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_records != NULL) {
+        esp_partition_munmap(s_mmap);
+        s_records = NULL;
+        s_stats.count = 0;
+    }
+    xSemaphoreGive(s_lock);
+}
+#endif // CONFIG_TAG_MAP_UPLOAD
+
+// Map the table if the partition holds a valid one.
+static bool
+tag_map_map(void)
+{
+    tag_map_header_t header;
+    if (esp_partition_read(s_partition, 0, &header, sizeof(header)) != ESP_OK) {
+        return false;
+    }
+
+    if (header.magic != TAG_MAP_MAGIC || header.version != TAG_MAP_VERSION ||
+        header.record_size != sizeof(tag_map_record_t) ||
+        header.count > (s_partition->size - sizeof(header)) / sizeof(tag_map_record_t)) {
+        ESP_LOGI("tag_map", "No table in the partition");
+        return false;
+    }
+
+    // Only as much as the table takes, the data cache's address space is shared with the app.
+    const size_t size = sizeof(header) + header.count * sizeof(tag_map_record_t);
+    const void *mapped = NULL;
+    esp_partition_mmap_handle_t mmap;
+    esp_err_t err =
+        esp_partition_mmap(s_partition, 0, size, ESP_PARTITION_MMAP_DATA, &mapped, &mmap);
+    if (err != ESP_OK) {
+        ESP_LOGE("tag_map", "Failed to map %u bytes: %s", size, esp_err_to_name(err));
+        return false;
+    }
+
+    const tag_map_record_t *records =
+        (const tag_map_record_t *)((const uint8_t *)mapped + sizeof(header));
+    if (esp_rom_crc32_le(0, (const uint8_t *)records, header.count * sizeof(tag_map_record_t)) !=
+        header.crc) {
+        ESP_LOGE("tag_map", "The table's CRC doesn't match");
+        esp_partition_munmap(mmap);
+        return false;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_mmap = mmap;
+    s_records = records;
+    s_stats.count = header.count;
+    xSemaphoreGive(s_lock);
+
+    ESP_LOGI("tag_map", "Mapped %lu tags", header.count);
+    return true;
+}
+
+void
+tag_map_init(void)
+{
+    s_lock = xSemaphoreCreateMutex();
+    assert(s_lock != NULL);
+
+    s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, TAG_MAP_PARTITION_SUBTYPE,
+                                           TAG_MAP_PARTITION_LABEL);
+    if (s_partition == NULL) {
+        ESP_LOGW("tag_map", "No %s partition", TAG_MAP_PARTITION_LABEL);
+        return;
+    }
+
+    (void)tag_map_map();
+}
+
+static int
+tag_map_compare(const tag_map_record_t *record, uint8_t uid_size,
+                const uint8_t uid[TAG_MAP_UID_MAX])
+{
+    if (record->uid_size != uid_size) {
+        return record->uid_size < uid_size ? -1 : 1;
+    }
+    return memcmp(record->uid, uid, TAG_MAP_UID_MAX);
+}
+
+bool
+tag_map_lookup(const uint8_t *uid, uint8_t uid_size, tag_payload_t *payload)
+{
+    if (uid_size == 0 || uid_size > TAG_MAP_UID_MAX) {
+        return false;
+    }
+
+    uint8_t key[TAG_MAP_UID_MAX] = {};
+    memcpy(key, uid, uid_size);
+
+    const int64_t start = esp_timer_get_time();
+    const tag_map_record_t *found = NULL;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_records != NULL) {
+        uint32_t low = 0;
+        uint32_t high = s_stats.count;
+        while (low < high) {
+            const uint32_t middle = low + (high - low) / 2;
+            const int order = tag_map_compare(&s_records[middle], uid_size, key);
+            if (order == 0) {
+                found = &s_records[middle];
+                break;
+            } else if (order < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+    }
+
+    if (found != NULL) {
+        memset(payload, 0, sizeof(tag_payload_t));
+        payload->type = (tag_payload_type_e)found->type;
+        if (payload->type == TAG_PAYLOAD_ACTION) {
+            payload->action = (tag_action_e)found->value[0];
+        } else {
+            memcpy(payload->id.bytes, found->value, sizeof(payload->id.bytes));
+        }
+    }
+
+    const uint32_t elapsed = esp_timer_get_time() - start;
+    s_stats.lookups++;
+    s_stats.hits += found != NULL ? 1 : 0;
+    s_stats.lookup_sum_us += elapsed;
+    if (elapsed > s_stats.lookup_max_us) {
+        s_stats.lookup_max_us = elapsed;
+    }
+    xSemaphoreGive(s_lock);
+
+    return found != NULL;
+}
+
+#ifdef CONFIG_TAG_MAP_UPLOAD
+// Receive exactly size bytes of the body. A few timeouts in a row mean the client is gone.
+static bool
+tag_map_recv(httpd_req_t *req, uint8_t *buffer, size_t size)
+{
+    size_t received = 0;
+    uint8_t timeouts = 0;
+    while (received < size) {
+        const int ret = httpd_req_recv(req, (char *)buffer + received, size - received);
+        if (ret == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < TAG_MAP_UPLOAD_TIMEOUTS) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        timeouts = 0;
+        received += ret;
+    }
+    return true;
+}
+
+// The request has to carry CONFIG_TAG_MAP_UPLOAD_SECRET, an empty secret refuses all of them.
+static bool
+tag_map_authorized(httpd_req_t *req)
+{
+    const char *secret = CONFIG_TAG_MAP_UPLOAD_SECRET;
+    const size_t secret_size = strlen(secret);
+    char given[65] = {};
+    if (secret_size == 0 || secret_size >= sizeof(given) ||
+        httpd_req_get_hdr_value_str(req, TAG_MAP_UPLOAD_HEADER, given, sizeof(given)) != ESP_OK ||
+        strlen(given) != secret_size) {
+        return false;
+    }
+
+    // The time it takes doesn't tell how much of the secret matched.
+    uint8_t diff = 0;
+    for (size_t i = 0; i < secret_size; i++) {
+        diff |= (uint8_t)(given[i] ^ secret[i]);
+    }
+    return diff == 0;
+}
+
+// The body is the table's image. The old table stays until the new one's header checks out. The
+// records are written as they arrive and the header goes last, once their CRC matches, so a
+// broken upload leaves no table behind rather than a bad one.
+static esp_err_t
+tag_map_upload_handler(httpd_req_t *req)
+{
+    if (!tag_map_authorized(req)) {
+        ESP_LOGW("tag_map", "Refused an upload without the secret");
+        httpd_resp_send_err(req, HTTPD_403_FORBIDDEN, "Wrong or missing " TAG_MAP_UPLOAD_HEADER);
+        return ESP_OK;
+    }
+    if (s_partition == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No tag_map partition");
+        return ESP_OK;
+    }
+    if (req->content_len < sizeof(tag_map_header_t) || req->content_len > s_partition->size) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "The image doesn't fit the partition");
+        return ESP_OK;
+    }
+
+    tag_map_header_t header;
+    if (!tag_map_recv(req, (uint8_t *)&header, sizeof(header))) {
+        httpd_resp_send_err(req, HTTPD_408_REQ_TIMEOUT, "The upload stalled");
+        return ESP_FAIL;
+    }
+    if (header.magic != TAG_MAP_MAGIC || header.version != TAG_MAP_VERSION ||
+        header.record_size != sizeof(tag_map_record_t) ||
+        req->content_len != sizeof(header) + (size_t)header.count * sizeof(tag_map_record_t)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Not a valid table");
+        return ESP_OK;
+    }
+
+    uint8_t *chunk = (uint8_t *)malloc(TAG_MAP_UPLOAD_CHUNK);
+    if (chunk == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_OK;
+    }
+
+    tag_map_unmap();
+
+    const size_t erase_size =
+        (req->content_len + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+    esp_err_t err = esp_partition_erase_range(s_partition, 0, erase_size);
+
+    uint32_t crc = 0;
+    size_t offset = sizeof(header);
+    while (err == ESP_OK && offset < req->content_len) {
+        const size_t wanted = MIN(req->content_len - offset, TAG_MAP_UPLOAD_CHUNK);
+        if (!tag_map_recv(req, chunk, wanted)) {
+            free(chunk);
+            httpd_resp_send_err(req, HTTPD_408_REQ_TIMEOUT, "The upload stalled");
+            return ESP_FAIL;
+        }
+        crc = esp_rom_crc32_le(crc, chunk, wanted);
+        err = esp_partition_write(s_partition, offset, chunk, wanted);
+        offset += wanted;
+    }
+    free(chunk);
+
+    if (err != ESP_OK) {
+        ESP_LOGE("tag_map", "Failed to write the table: %s", esp_err_to_name(err));
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Flash write failed");
+        return ESP_OK;
+    }
+    if (crc != header.crc) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "The records' CRC doesn't match");
+        return ESP_OK;
+    }
+
+    err = esp_partition_write(s_partition, 0, &header, sizeof(header));
+    if (err != ESP_OK || !tag_map_map()) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to map the table");
+        return ESP_OK;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_stats.uploads++;
+    const uint32_t count = s_stats.count;
+    xSemaphoreGive(s_lock);
+
+    char response[48];
+    snprintf(response, sizeof(response), "%lu tags mapped\n", count);
+    httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+esp_err_t
+tag_map_register_upload(httpd_handle_t server)
+{
+    static const httpd_uri_t uri_upload = {
+        .uri = "/tag_map", .method = HTTP_POST, .handler = tag_map_upload_handler};
+
+    if (strlen(CONFIG_TAG_MAP_UPLOAD_SECRET) == 0) {
+        ESP_LOGW("tag_map", "No upload secret set, the uploads will be refused");
+    }
+    return httpd_register_uri_handler(server, &uri_upload);
+}
+#endif // CONFIG_TAG_MAP_UPLOAD
+
+tag_map_stats_t
+tag_map_get_stats(void)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    const tag_map_stats_t stats = s_stats;
+    xSemaphoreGive(s_lock);
+
+    return stats;
+}
+
+void
+tag_map_log_stats(void)
+{
+    const tag_map_stats_t s = tag_map_get_stats();
+    const uint32_t lookups = s.lookups > 0 ? s.lookups : 1;
+
+    ESP_LOGI("tag_map", "%lu tags, lookups %lu: hits %lu, avg %llu us max %lu us, uploads %lu",
+             s.count, s.lookups, s.hits, s.lookup_sum_us / lookups, s.lookup_max_us, s.uploads);
+}
@@ -0,0 +1,70 @@
+// tag_map.h
+//
+// A UID to payload mapping for the blank tags, so they don't need to be written. It's a table in
+// the tag_map data partition (see partitions.csv), built from a CSV by utilities/tag_map_build.py:
+//
+//   header   tag_map_header_t, 32 bytes
+//   records  tag_map_record_t, sorted by the UID's size and then by its bytes
+//
+// The table is memory mapped and binary searched in place, a lookup reads a couple dozen records
+// at most whatever the table's size, and it never touches the tag.
+
+#ifndef TAG_MAP_H
+#define TAG_MAP_H
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+#include "tag_payload.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TAG_MAP_MAGIC   0x504d5445 // "ETMP"
+#define TAG_MAP_VERSION 1
+#define TAG_MAP_UID_MAX 10
+
+typedef struct tag_map_header_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;
+    // esp_rom_crc32_le(0, ...) over the records.
+    uint32_t crc;
+    uint8_t reserved[16];
+} tag_map_header_t;
+
+// The UID is zero padded. The value is the payload's type and its ID, or the action in the ID's
+// first byte.
+typedef struct tag_map_record_t {
+    uint8_t uid_size;
+    uint8_t uid[TAG_MAP_UID_MAX];
+    uint8_t type;
+    uint8_t value[16];
+} tag_map_record_t;
+
+typedef struct tag_map_stats_t {
+    uint32_t count;
+    uint32_t lookups;
+    uint32_t hits;
+    uint64_t lookup_sum_us;
+    uint32_t lookup_max_us;
+    uint32_t uploads;
+} tag_map_stats_t;
+
+// Map the partition. Without a valid table every lookup misses.
+void tag_map_init(void);
+
+// Return true if the UID is in the table.
+bool tag_map_lookup(const uint8_t *uid, uint8_t uid_size, tag_payload_t *payload);
+
+#ifdef CONFIG_TAG_MAP_UPLOAD
+// POST /tag_map with the table's image as the body and CONFIG_TAG_MAP_UPLOAD_SECRET in the
+// X-Tag-Map-Secret header replaces the table.
+esp_err_t tag_map_register_upload(httpd_handle_t server);
+#endif // CONFIG_TAG_MAP_UPLOAD
+
+tag_map_stats_t tag_map_get_stats(void);
+void tag_map_log_stats(void);
+
+#endif // TAG_MAP_H
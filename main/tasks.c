@@ -1,19 +1,28 @@
 #include "tasks.h"
 #include "spotify.h"
+#include "spotify_index.h"
 #include "periph.h"
 #include "shared.h"
+#include "pipeline.h"
+#include "intents.h"
+#include "tag_payload.h"
+#include "tag_cache.h"
+#include "tag_map.h"
 
 #ifdef CONFIG_RFID_READER
 #include "rc522.h" // TODO(michalc): remove this when fully ported to rfid_reader
 #include "rfid_reader.h"
+#include "readers.h"
 #endif // CONFIG_RFID_READER
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_timer.h"
 
+#include <stdio.h>
 #include <string.h>
 
 // TODO(michalc): This is defined in the periph.c... shouldn't be defined in two places.
@@ -22,22 +31,66 @@
 #define RFID_OP_READ  0x0
 #define RFID_OP_WRITE 0x1
 
+// A READ gets 16 bytes: a MIFARE block or 4 NTAG pages.
+#define PICC_READ_SIZE 16
+// A damaged payload gets read once more while the PICC is still in the field. A failed READ sends
+// the PICC back to IDLE, the retry selects it again by its UID (rc522_reselect).
+#define PICC_READ_ATTEMPTS 2
+// The PICCs taken from the field at once, e.g. a stack of cards on the reader. Each gets a job.
+#define PICC_INVENTORY_MAX 4
+
 TaskHandle_t x_spotify = NULL;
 TaskHandle_t x_spotify_read_playlist = NULL;
 TaskHandle_t x_spotify_find_playlist = NULL;
-QueueHandle_t q_rfid_to_spotify = NULL;
-
+TaskHandle_t x_spotify_poll = NULL;
+
+// The playlist index answers the lookups without the network, but only knows the playlists as of
+// its last refresh. Past this age a lookup refreshes it, after answering.
+#define PLAYLIST_INDEX_MAX_AGE_US (60LL * 60 * 1000 * 1000)
+
+// How long to wait for a slot when all of the engine's are busy.
+#define SPOTIFY_SLOT_WAIT_MS 50
+
+// A request task_spotify or task_spotify_poll handed to the async engine.
+typedef struct tasks_request_t {
+    SemaphoreHandle_t done;
+    esp_err_t err;
+} tasks_request_t;
+
+static tasks_request_t s_dispatch = {};
+static tasks_request_t s_poll = {};
+
+// The current playlist's tracks, filled by task_spotify_read_playlist.
+static spotify_track_table_t s_playlist_tracks = {};
+
+// A tapped PICC on its way through the pipeline:
+//
+//   detect -> identify -> read -> decode -> (intents) -> dispatch
+//
+// The detect stage is the readers' scanning, see readers.h. The identify stage makes a job of
+// every PICC in the field. The identify and read stages hold the reader, which stays paused from
+// the detection until the read stage is done with all of the PICCs. From that point on the reader
+// scans again, so the next PICC can be detected while these are still being decoded and
+// dispatched. The decode stage turns the PICC into an intent, task_spotify dispatches the intents
+// to Spotify.
+typedef struct tag_job_t {
+    uint8_t reader;
+    uint8_t reading_or_writing;
+    int64_t detected_us;
 #ifdef CONFIG_RFID_READER
-static esp_timer_handle_t s_rfid_reader_timer;
-TaskHandle_t x_task_rfid_read_or_write = NULL;
-
-bool scanning_timer_running = false;
-uint8_t reading_or_writing = RFID_OP_READ;
+    picc_t picc;
+    // Left halted by the identify stage, the read stage has to select it again.
+    bool halted;
+#endif // CONFIG_RFID_READER
+    // Big enough for the legacy payloads too.
+    uint8_t data[TAG_PAYLOAD_LEGACY_SIZE];
+    uint8_t data_size;
+} tag_job_t;
 
-esp_err_t
-scanning_timer_resume();
-esp_err_t
-scanning_timer_pause();
+#ifdef CONFIG_RFID_READER
+static pipeline_stage_t *s_identify = NULL;
+static pipeline_stage_t *s_read = NULL;
+static pipeline_stage_t *s_decode = NULL;
 
 // The read/write switch might be something else than pressing a button.
 static inline uint8_t
@@ -46,199 +99,475 @@ read_or_write()
     return periph_get_button_state(1);
 }
 
-static void
-task_rfid_scanning(void *arg)
+// Runs in the reader's scanning task, see readers_detect_cb_t.
+static bool
+tasks_on_picc_detected(uint8_t reader, rfid_handle_t rfid)
 {
-    (void)arg;
+    (void)rfid;
 
-    const bool picc_present = rfid_test_picc_presence();
+    const tag_job_t job = {
+        .reader = reader,
+        .reading_or_writing = read_or_write() == 1 ? RFID_OP_WRITE : RFID_OP_READ,
+        .detected_us = esp_timer_get_time(),
+    };
 
-    if (picc_present) {
-        bool status = rfid_anti_collision(1);
-        (void)status;
+    ESP_LOGI("tasks", "PICC detected on reader %u.", reader);
 
-        reading_or_writing = read_or_write() == 1 ? RFID_OP_WRITE : RFID_OP_READ;
+    // Don't block the scanning of the other readers on the bus.
+    return pipeline_try_push(s_identify, &job);
+}
 
-        ESP_LOGI("tasks", "PICC detected.");
-        if (reading_or_writing == RFID_OP_READ) {
-            ESP_LOGI("tasks", "Notifying to read.");
-        } else {
-            ESP_LOGI("tasks", "Notifying to write.");
+#ifndef CONFIG_RC522
+// What the read stage needs of a PICC, the readers without the reselect don't fill it in.
+static picc_t
+tasks_picc_from(const iso14443a_picc_t *found)
+{
+    picc_t picc = {
+        .uid_full = true,
+        .uid_bits = found->uid_size * 8,
+        .type = found->sak == 0x08   ? PICC_SUPPORTED_MIFARE_1K
+                : found->sak == 0x00 ? PICC_SUPPORTED_NTAG213
+                                     : PICC_NOT_SUPPORTED,
+    };
+    memcpy(picc.uid, found->uid, found->uid_size);
+    return picc;
+}
+#endif // CONFIG_RC522
+
+// The inventory of the PICCs in the field and, for the NTAGs, GET_VERSION. Fills in job->picc for
+// the first PICC, the others go on to the read stage in jobs of their own. Each job holds the
+// reader paused until the read stage is done with it.
+static bool
+tasks_identify(void *item)
+{
+    tag_job_t *job = (tag_job_t *)item;
+    rfid_handle_t rfid = readers_get(job->reader);
+    tag_job_t jobs[PICC_INVENTORY_MAX];
+    uint8_t identified = 0;
+
+    defer(rfid_lock(rfid, portMAX_DELAY), rfid_unlock(rfid))
+    {
+        // The detection's REQA left the new PICCs READY. The ones halted before, e.g. the stack
+        // this PICC was put on, stay out of it, they were dispatched already.
+        iso14443a_picc_t piccs[PICC_INVENTORY_MAX];
+        const uint8_t count =
+            rfid_inventory(rfid, ISO14443A_INVENTORY_READY, piccs, PICC_INVENTORY_MAX);
+
+        for (uint8_t i = 0; i < count; i++) {
+            tag_job_t *picc_job = &jobs[identified];
+            *picc_job = *job;
+#ifdef CONFIG_RC522
+            // TODO(michalc): remove this when fully ported to rfid_reader
+            rc522_handle_t rc522 = (rc522_handle_t)rfid;
+            // The inventory halts them all. A single PICC stays selected for the read stage,
+            // of a stack each gets halted again once it's identified.
+            if (!rc522_reselect(rc522, piccs[i].uid, piccs[i].uid_size)) {
+                continue;
+            }
+            // The SAK only hints at the type, GET_VERSION tells it for sure.
+            if (rc522_get_last_picc(rc522).type == PICC_SUPPORTED_NTAG213) {
+                (void)rc522_picc_get_version(rc522);
+            }
+            picc_job->picc = rc522_get_last_picc(rc522);
+            picc_job->halted = count > 1;
+            if (picc_job->halted) {
+                rc522_picc_halta(rc522, PICC_CMD_HALTA);
+            }
+#else
+            picc_job->picc = tasks_picc_from(&piccs[i]);
+            picc_job->halted = true;
+#endif // CONFIG_RC522
+            identified++;
+        }
+
+        if (count > 1) {
+            ESP_LOGI("tasks", "%u PICCs on reader %u, identified %u", count, job->reader,
+                     identified);
         }
+    }
+
+    if (identified == 0) {
+        ESP_LOGW("tasks", "Failed to identify the PICC on reader %u", job->reader);
+        readers_resume(job->reader);
+        return false;
+    }
 
-        xTaskNotify(x_task_rfid_read_or_write, reading_or_writing, eSetValueWithOverwrite);
+    // Without the reader, the read stage needs it to make room in its queue.
+    for (uint8_t i = 1; i < identified; i++) {
+        readers_pause(job->reader);
+        (void)pipeline_push(s_read, &jobs[i], portMAX_DELAY);
     }
+    *job = jobs[0];
+
+    return true;
 }
 
-void
-task_rfid_read_or_write(void *pvParameters)
+#ifdef CONFIG_RC522
+// Read as much of the payload as it takes. On the NTAGs that's one FAST_READ. A MIFARE READ gets
+// a 16 byte block, so a binary payload (21 bytes) takes two of them and a legacy one (32) too.
+// Return false if the read failed or the payload is damaged.
+static bool
+tasks_read_payload(rc522_handle_t rc522, tag_job_t *job, uint32_t block_initial)
 {
-    uint8_t spotify_should_act = 0;
-    uint32_t reading_or_writing = RFID_OP_READ;
-    uint8_t msg[32] = {};
+    tag_payload_t payload;
+    // A FAST_READ can get a whole binary payload right away.
+    size_t needed =
+        job->picc.type == PICC_SUPPORTED_NTAG213 ? TAG_PAYLOAD_MAX_SIZE : PICC_READ_SIZE;
+
+    job->data_size = 0;
+
+    while (job->data_size < needed) {
+        if (job->picc.type == PICC_SUPPORTED_NTAG213) {
+            // The pages go in 4 byte steps, FAST_READ gets all of the ones needed in one command.
+            const uint8_t page = block_initial + job->data_size / 4;
+            const uint8_t pages = (needed - job->data_size + 3) / 4;
+            if (rc522_ntag_fast_read(rc522, page, page + pages - 1, job->data + job->data_size) !=
+                SUCCESS) {
+                return false;
+            }
+            job->data_size += pages * 4;
+        } else {
+            const uint8_t block = block_initial + job->data_size / PICC_READ_SIZE;
+            if (rc522_read_picc_data(rc522, block, job->data + job->data_size) != SUCCESS) {
+                return false;
+            }
+            job->data_size += PICC_READ_SIZE;
+        }
 
-    while (1) {
-        spotify_should_act = 0;
+        const tag_decode_e result =
+            tag_payload_decode(job->data, job->data_size, &payload, &needed);
+        if (result == TAG_DECODE_CORRUPTED) {
+            ESP_LOGW("tasks", "Damaged payload on the PICC from reader %u", job->reader);
+            return false;
+        }
+        if (result != TAG_DECODE_NEED_MORE || needed > sizeof(job->data)) {
+            break;
+        }
+    }
 
-        // Wait indefinitely for a notification from the scanning task. When notified
-        // to act, pause the scanning task.
-        (void)xTaskNotifyWait(0x0, ULONG_MAX, &reading_or_writing, portMAX_DELAY);
+    return true;
+}
+#endif // CONFIG_RC522
 
-#ifdef CONFIG_RFID_READER
-        defer(scanning_timer_pause(), scanning_timer_resume())
+// Read the PICC's data into job->data or write the current song to it. The last stage which needs
+// the reader.
+static bool
+tasks_read(void *item)
+{
+    tag_job_t *job = (tag_job_t *)item;
+    const uint8_t uid_size = job->picc.uid_bits / 8;
+    bool read = false;
+
+    // The UID is all it takes for a mapped tag or a tag which was read recently.
+    if (job->reading_or_writing == RFID_OP_READ) {
+        tag_payload_t payload;
+        const char *source = NULL;
+        if (tag_map_lookup(job->picc.uid, uid_size, &payload)) {
+            source = "mapped";
+        } else if (tag_cache_get(job->picc.uid, uid_size, &payload)) {
+            source = "cached";
+        }
+        if (source != NULL) {
+            job->data_size = tag_payload_encode(&payload, job->data, sizeof(job->data));
+            ESP_LOGI("tasks", "PICC from reader %u is %s", job->reader, source);
+            read = true;
+        }
+    }
+
+#ifndef CONFIG_RC522
+    // The inventory halted it, there's no reading or writing the PICCs through the PN532 yet.
+    if (!read) {
+        ESP_LOGW("tasks", "Only the mapped and the cached PICCs work with this reader");
+    }
+    readers_resume(job->reader);
+    return read;
+#else
+    // TODO(michalc): remove this when fully ported to rfid_reader
+    rc522_handle_t rc522 = (rc522_handle_t)readers_get(job->reader);
+
+    if (read) {
+        // Let it go, so it isn't detected over and over while it stays in the field.
+        defer(rc522_lock(rc522, portMAX_DELAY), (rc522_unlock(rc522), readers_resume(job->reader)))
         {
-#endif // CONFIG_RFID_READER
-            ESP_LOGI("tasks", "Reading or writing to PICC");
-
-            // MIFARE's first sector is not fully available since the first block is taken.
-            // NTAG has first 5 (or 4, confused atm) pages (4 byte chunk) taken by manufacturer
-            // data.
-            const uint8_t sector = 5;
-            const uint32_t block_initial = 4 * sector - 4;
-
-            // If we call the authentication on a PICC that doesn't conform to this type of
-            // authentication we risk sending the PICC back into the original state. That might be
-            // an IDLE state. This is dangerous because we might constantly wake the PICC up. It
-            // would behave as if we used the WUPA command.
-            if (rc522_get_last_picc().type == PICC_SUPPORTED_MIFARE_1K) {
-                const uint8_t key[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-
-                // Authenticate sector access.
-                rc522_authenticate(PICC_CMD_MIFARE_AUTH_KEY_A, block_initial, key);
-            }
+            rc522_picc_halta(rc522, PICC_CMD_HALTA);
+        }
+        return true;
+    }
 
-            // 16 bytes and 2 bytes for CRC.
-            uint8_t transfer_buffer[32] = {};
-            const char *song_id = spotify_context.song_id;
+    // Once the session with the PICC is over the reader can scan again.
+    defer(rc522_lock(rc522, portMAX_DELAY), (rc522_unlock(rc522), readers_resume(job->reader)))
+    {
+        ESP_LOGI("tasks", "Reading or writing to PICC");
+        const int64_t io_start = esp_timer_get_time();
+
+        // MIFARE's first sector is not fully available since the first block is taken.
+        // NTAG has first 5 (or 4, confused atm) pages (4 byte chunk) taken by manufacturer
+        // data.
+        const uint8_t sector = 5;
+        const uint32_t block_initial = 4 * sector - 4;
+
+        // One of a stack, the identify stage halted it.
+        const bool present = !job->halted || rc522_reselect(rc522, job->picc.uid, uid_size);
+
+        // If we call the authentication on a PICC that doesn't conform to this type of
+        // authentication we risk sending the PICC back into the original state. That might be
+        // an IDLE state. This is dangerous because we might constantly wake the PICC up. It
+        // would behave as if we used the WUPA command.
+        if (present && job->picc.type == PICC_SUPPORTED_MIFARE_1K) {
+            const uint8_t key[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+            // Authenticate sector access.
+            rc522_authenticate(rc522, PICC_CMD_MIFARE_AUTH_KEY_A, block_initial, key);
+        }
 
-            if (reading_or_writing == RFID_OP_WRITE && spotify_context.is_playing != 0xFF) {
-                // TODO(michalc): wait for refresh of the Spotify's context state.
+        // A copy, the poll can change the song while it's being written.
+        spotify_state_t state;
+        spotify_get_state(&state);
 
-                uint8_t write_buffer[32] = {};
-                memset(write_buffer, '.', 32);
-                memcpy(write_buffer, "sp_song", strlen("sp_song"));
-                // Copy the song ID aligned to the end of the buffer.
-                memcpy(write_buffer + 32 - strlen(song_id), song_id, strlen(song_id));
+        if (!present) {
+            ESP_LOGW("tasks", "The PICC on reader %u left the field", job->reader);
+        } else if (job->reading_or_writing == RFID_OP_WRITE && state.is_playing != 0xFF) {
+            // TODO(michalc): wait for refresh of the Spotify's context state.
 
-                rc522_write_picc_data(block_initial, write_buffer, 32);
-            }
-            // Value 0f 0x0 means reading.
-            else if (reading_or_writing == RFID_OP_READ) {
-                uint8_t read_buffer[32] = {};
-                // We want to send a message to the Spotify task.
-                spotify_should_act = 1;
-
-                uint32_t block_to_read = block_initial;
-
-                if (rc522_read_picc_data(block_to_read, transfer_buffer) != SUCCESS) {
-                    spotify_should_act = 0;
-                } else {
-                    memcpy(read_buffer, transfer_buffer, 16);
-                }
+            tag_cache_invalidate(job->picc.uid, uid_size);
 
-                // There is different block addressing for different PICCs.
-                if (rc522_get_last_picc().type == PICC_SUPPORTED_MIFARE_1K) {
-                    block_to_read = block_to_read + 1;
-                } else if (rc522_get_last_picc().type == PICC_SUPPORTED_NTAG213) {
-                    block_to_read = block_to_read + 4;
+            tag_payload_t payload;
+            if (tag_payload_from_base62(TAG_PAYLOAD_TRACK, state.song_id, strlen(state.song_id),
+                                        &payload)) {
+                // Zero padded to whole blocks, so nothing of the previous payload stays behind.
+                uint8_t write_buffer[32] = {};
+                (void)tag_payload_encode(&payload, write_buffer, sizeof(write_buffer));
+                rc522_write_picc_data(rc522, block_initial, write_buffer, sizeof(write_buffer));
+            } else {
+                ESP_LOGW("tasks", "Not writing the malformed song ID %s", state.song_id);
+            }
+        }
+        // Value 0f 0x0 means reading.
+        else if (job->reading_or_writing == RFID_OP_READ) {
+            bool selected = true;
+            for (uint8_t attempt = 0; attempt < PICC_READ_ATTEMPTS && !read && selected;
+                 attempt++) {
+                if (attempt > 0) {
+                    // From a known state, whether the last READ got an answer or not.
+                    rc522_picc_halta(rc522, PICC_CMD_HALTA);
+                    rc522_clear_bitmask(rc522, RC522_REG_STATUS_2, 0x08);
+                    selected = rc522_reselect(rc522, job->picc.uid, uid_size);
+                    if (selected && job->picc.type == PICC_SUPPORTED_MIFARE_1K) {
+                        const uint8_t key[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+                        rc522_authenticate(rc522, PICC_CMD_MIFARE_AUTH_KEY_A, block_initial, key);
+                    }
                 }
-
-                if (rc522_read_picc_data(block_to_read, transfer_buffer) != SUCCESS) {
-                    spotify_should_act = 0;
-                } else {
-                    memcpy(read_buffer + 16, transfer_buffer, 16);
-                    // NOTE(michalc): what's saved in the PICC is the message we send. Might change
-                    // in the future.
-                    memcpy(msg, read_buffer, 32);
+                if (selected) {
+                    read = tasks_read_payload(rc522, job, block_initial);
                 }
             }
 
-            rc522_picc_halta(PICC_CMD_HALTA);
-            // Clear the MFCrypto1On bit.
-            rc522_clear_bitmask(RC522_REG_STATUS_2, 0x08);
-#ifdef CONFIG_RFID_READER
+            tag_payload_t payload;
+            if (read && tag_payload_decode(job->data, job->data_size, &payload, NULL) ==
+                            TAG_DECODE_OK) {
+                tag_cache_put(job->picc.uid, uid_size, &payload,
+                              esp_timer_get_time() - io_start);
+            }
         }
-#endif // CONFIG_RFID_READER
 
-        if (spotify_should_act) {
-            (void)xQueueSendToBack(q_rfid_to_spotify, (const void *)msg, portMAX_DELAY);
+        rc522_picc_halta(rc522, PICC_CMD_HALTA);
+        // Clear the MFCrypto1On bit.
+        rc522_clear_bitmask(rc522, RC522_REG_STATUS_2, 0x08);
+    }
+
+    // Nothing more to do after a write.
+    return read;
+#endif // CONFIG_RC522
+}
+
+// Turn the PICC's data into an intent.
+static bool
+tasks_decode(void *item)
+{
+    tag_job_t *job = (tag_job_t *)item;
+    tag_payload_t payload;
+
+    const tag_decode_e result = tag_payload_decode(job->data, job->data_size, &payload, NULL);
+    if (result != TAG_DECODE_OK) {
+        ESP_LOGW("tasks", "No payload on the PICC from reader %u (%d)", job->reader, result);
+        return false;
+    }
+
+    intent_t intent = {
+        .reader = job->reader,
+        .detected_us = job->detected_us,
+    };
+    switch (payload.type) {
+    case TAG_PAYLOAD_TRACK:
+        intent.kind = INTENT_TRACK;
+        break;
+    case TAG_PAYLOAD_ALBUM:
+        intent.kind = INTENT_ALBUM;
+        break;
+    case TAG_PAYLOAD_PLAYLIST:
+        intent.kind = INTENT_PLAYLIST;
+        break;
+    case TAG_PAYLOAD_ACTION:
+        if (payload.action == TAG_ACTION_PLAY_PAUSE) {
+            intent.kind = INTENT_PLAY_PAUSE;
+        } else if (payload.action == TAG_ACTION_NEXT) {
+            intent.kind = INTENT_NEXT;
+        } else if (payload.action == TAG_ACTION_PREVIOUS) {
+            intent.kind = INTENT_PREVIOUS;
+        } else {
+            ESP_LOGW("tasks", "Unknown action %d from reader %u", payload.action, job->reader);
+            return false;
         }
+        break;
+    }
+    if (payload.type != TAG_PAYLOAD_ACTION) {
+        tag_payload_to_base62(&payload, intent.id);
+    }
+    ESP_LOGI("tasks", "Decoded %s %s from reader %u%s", intents_kind_name(intent.kind),
+             intent.id, job->reader, payload.legacy ? " (legacy format)" : "");
+
+    const intent_result_e pushed = intents_push(&intent);
+    if (pushed == INTENT_COALESCED) {
+        ESP_LOGI("tasks", "The same %s %s is already waiting", intents_kind_name(intent.kind),
+                 intent.id);
+    } else if (pushed == INTENT_DROPPED) {
+        ESP_LOGW("tasks", "Too many intents waiting, dropping %s %s",
+                 intents_kind_name(intent.kind), intent.id);
     }
+
+    return pushed != INTENT_DROPPED;
 }
 #endif // CONFIG_RFID_READER
 
+// The token manager refreshes the token ahead of its expiry, this only waits at the start or after
+// the refreshes failed.
+static void
+tasks_wait_access_token(void)
+{
+    while (!spotify_wait_access_token(10000)) {
+        ESP_LOGW("tasks", "Still waiting for the access token");
+    }
+}
+
+// Runs in the async engine's task.
+static void
+tasks_on_request_done(void *user_data, esp_err_t err)
+{
+    tasks_request_t *request = (tasks_request_t *)user_data;
+
+    request->err = err;
+    (void)xSemaphoreGive(request->done);
+}
+
+// Submit the intent's request. Return false when all of the engine's slots are busy.
+static bool
+tasks_submit(const intent_t *intent)
+{
+    switch (intent->kind) {
+    case INTENT_TRACK:
+        return spotify_enqueue_song_async(intent->id, strlen(intent->id), tasks_on_request_done,
+                                          &s_dispatch);
+    case INTENT_ALBUM:
+        return spotify_play_context_async("album", intent->id, tasks_on_request_done,
+                                          &s_dispatch);
+    case INTENT_PLAYLIST:
+        return spotify_play_context_async("playlist", intent->id, tasks_on_request_done,
+                                          &s_dispatch);
+    case INTENT_PLAY_PAUSE:
+        return spotify_play_pause_async(tasks_on_request_done, &s_dispatch);
+    case INTENT_NEXT:
+        return spotify_next_song_async(tasks_on_request_done, &s_dispatch);
+    case INTENT_PREVIOUS:
+        return spotify_previous_song_async(tasks_on_request_done, &s_dispatch);
+    }
+    return false;
+}
+
+// Dispatch the intents to Spotify. It doesn't hold any reader, the taps keep being detected and
+// queued while it waits for the network. The requests go through the async engine, on a slot's
+// connection, so a tap doesn't wait behind a poll or a playlist download on the API host's one.
 void
 task_spotify(void *pvParameters)
 {
-    char msg[32] = {};
-    str song_id = {};
+    (void)pvParameters;
+    intent_t intent = {};
 
     while (1) {
-        // Block forever waiting for a message.
-        const BaseType_t status = xQueueReceive(q_rfid_to_spotify, msg, portMAX_DELAY);
-        ESP_LOGI("tasks", "task_spotify got msg %.32s", msg);
+        // Block forever waiting for an intent.
+        (void)intents_pop(&intent, portMAX_DELAY);
 
-#ifdef CONFIG_RFID_READER
-        defer(scanning_timer_pause(), scanning_timer_resume())
-        {
-#endif // CONFIG_RFID_READER
-            // TODO(michalc): This can lock
-            // TODO(michalc): what if the token expires between here and enqueue song.
-            while (!spotify_is_fresh_access_token()) {
-                ESP_LOGW("tasks", "Refreshing the access token");
-                spotify_refresh_access_token();
-                vTaskDelay(200);
-            }
+        // TODO(michalc): This can lock
+        tasks_wait_access_token();
 
-            if (status == pdPASS) {
-                // spotify_query(&spotify);
-                if (memcmp(msg, "sp_song", strlen("sp_song")) == 0) {
-                    char *msg_cursor = msg;
-                    do {
-                        msg_cursor++;
-                    } while (!(*(msg_cursor - 1) == '.' && *msg_cursor != '.'));
-                    song_id.data = msg_cursor;
-                    song_id.length = MAX_SONG_ID_LENGTH;
-                    ESP_LOGI("tasks", "Enqueueing song %.*s", song_id.length, song_id.data);
-                    spotify_enqueue_song(song_id.data, song_id.length);
-                }
-            } else {
-                // TODO(michalc): I don't expect we'll get here...
-            }
-#ifdef CONFIG_RFID_READER
+        ESP_LOGI("tasks", "Dispatching %s %s", intents_kind_name(intent.kind), intent.id);
+        while (!tasks_submit(&intent)) {
+            vTaskDelay(pdMS_TO_TICKS(SPOTIFY_SLOT_WAIT_MS));
         }
-#endif // CONFIG_RFID_READER
+        // One request at a time, so they get to Spotify in the taps' order.
+        (void)xSemaphoreTake(s_dispatch.done, portMAX_DELAY);
+        spotify_poll_kick();
+
+        if (s_dispatch.err == ESP_OK) {
+            ESP_LOGI("tasks", "The %s from reader %u dispatched %lld ms after the tap",
+                     intents_kind_name(intent.kind), intent.reader,
+                     (esp_timer_get_time() - intent.detected_us) / 1000);
+        } else {
+            ESP_LOGW("tasks", "Failed to dispatch %s %s: %s", intents_kind_name(intent.kind),
+                     intent.id, esp_err_to_name(s_dispatch.err));
+        }
+    }
+}
+
+// Keep the now playing state fresh. The poller decides when to poll next, it's mostly idle. The
+// polls go through the async engine too, so they never hold the API host's connection.
+void
+task_spotify_poll(void *pvParameters)
+{
+    (void)pvParameters;
+
+    while (1) {
+        tasks_wait_access_token();
+
+        while (!spotify_poll_now_playing_async(tasks_on_request_done, &s_poll)) {
+            vTaskDelay(pdMS_TO_TICKS(SPOTIFY_SLOT_WAIT_MS));
+        }
+        (void)xSemaphoreTake(s_poll.done, portMAX_DELAY);
+
+        spotify_poll_wait(spotify_poll_next_ms());
     }
 }
 
 void
 task_spotify_read_playlist(void *pvParameters)
 {
+    spotify_state_t state;
+
     while (1) {
         vTaskSuspend(x_spotify_read_playlist);
-        if (spotify_context.playlist_id[0] == 0) {
+        spotify_get_state(&state);
+        if (state.playlist_id[0] == 0) {
             ESP_LOGW("tasks",
                      "Requested to read playlist contents but don't know the playlist's ID");
             continue;
         }
 
-#ifdef CONFIG_RFID_READER
-        defer(scanning_timer_pause(), scanning_timer_resume())
-        {
-#endif // CONFIG_RFID_READER
-            while (!spotify_is_fresh_access_token()) {
-                ESP_LOGW("tasks", "Refreshing the access token");
-                spotify_refresh_access_token();
-                vTaskDelay(200);
-            }
+        tasks_wait_access_token();
 
-            // TODO(michalc): this is just a placeholder
-            for (uint8_t i = 0; i < 8; i++) {
-                spotify_get_playlist_song(spotify_context.playlist_id, i);
-            }
-#ifdef CONFIG_RFID_READER
-        }
-#endif // CONFIG_RFID_READER
+        spotify_track_table_clear(&s_playlist_tracks);
+        (void)spotify_load_playlist_tracks(state.playlist_id, &s_playlist_tracks);
+    }
+}
+
+// Only the current playlist's tracks are kept, so only its change needs a download.
+static void
+tasks_on_playlist_changed(void *user_data, const spotify_playlist_t *playlist)
+{
+    spotify_state_t state;
+    spotify_get_state(&state);
+
+    if (strcmp(playlist->id, state.playlist_id) == 0) {
+        ESP_LOGI("tasks", "The current playlist %s changed", playlist->name);
+        vTaskResume(x_spotify_read_playlist);
     }
 }
 
@@ -246,58 +575,84 @@ void
 task_spotify_find_playlist(void *pvParameters)
 {
     const char *playlist_name = "Score";
+    char playlist_id[MAX_PLAYLIST_ID_LENGTH + 1];
+    char fresh_id[MAX_PLAYLIST_ID_LENGTH + 1];
+    // 0 until the first refresh since the boot. The index from NVS can be of any age.
+    int64_t refreshed_us = 0;
 
     while (1) {
         vTaskSuspend(x_spotify_find_playlist);
 
-#ifdef CONFIG_RFID_READER
-        defer(scanning_timer_pause(), scanning_timer_resume())
-        {
-#endif // CONFIG_RFID_READER
-            while (!spotify_is_fresh_access_token()) {
-                ESP_LOGW("tasks", "Refreshing the access token");
-                spotify_refresh_access_token();
-                vTaskDelay(200);
-            }
+        // The index answers without the network.
+        const bool found = spotify_index_find(playlist_name, playlist_id, NULL);
+        if (found) {
+            spotify_set_playlist(playlist_id, playlist_name);
+            ESP_LOGI("tasks", "Found a playlist: %s %s", playlist_name, playlist_id);
+        }
 
-            // TODO(michalc): this is just a placeholder
-            for (uint8_t i = 0; i < 8; i++) {
-                spotify_get_playlist(i);
+        // A name it doesn't know, or an index old enough to have missed a playlist made again
+        // under the same name, with a new ID.
+        if (found && refreshed_us != 0 &&
+            esp_timer_get_time() - refreshed_us < PLAYLIST_INDEX_MAX_AGE_US) {
+            continue;
+        }
 
-                if (0 ==
-                    strncmp(spotify_context.playlist_name, playlist_name, MAX_PLAYLIST_ID_LENGTH)) {
-                    ESP_LOGI("tasks", "Found a playlist: %s %s", spotify_context.playlist_name,
-                             spotify_context.playlist_id);
-                    break;
-                }
-            }
-#ifdef CONFIG_RFID_READER
+        tasks_wait_access_token();
+        if (!spotify_index_refresh(tasks_on_playlist_changed, NULL)) {
+            ESP_LOGW("tasks", "Failed to refresh the playlists");
+            continue;
+        }
+        refreshed_us = esp_timer_get_time();
+
+        if (!spotify_index_find(playlist_name, fresh_id, NULL)) {
+            ESP_LOGW("tasks", "No playlist named %s", playlist_name);
+            continue;
+        }
+        if (!found || strcmp(fresh_id, playlist_id) != 0) {
+            spotify_set_playlist(fresh_id, playlist_name);
+            ESP_LOGI("tasks", "Found a playlist: %s %s", playlist_name, fresh_id);
+        }
+        // The tracks loaded so far are the old playlist's.
+        if (found && strcmp(fresh_id, playlist_id) != 0) {
+            vTaskResume(x_spotify_read_playlist);
         }
-#endif // CONFIG_RFID_READER
     }
 }
 
 void
 tasks_init(void)
 {
-    const uint8_t queue_length = 4U;
-    const uint8_t queue_element_size = 32U;
-    q_rfid_to_spotify = xQueueCreate(queue_length, queue_element_size);
+    intents_init();
+#ifdef CONFIG_RFID_READER
+    tag_cache_init();
+    tag_map_init();
+#endif // CONFIG_RFID_READER
 
     BaseType_t xReturned;
 
+    s_dispatch.done = xSemaphoreCreateBinary();
+    s_poll.done = xSemaphoreCreateBinary();
+
 #ifdef CONFIG_RFID_READER
-    xReturned =
-        xTaskCreate(&task_rfid_read_or_write,    // Function that implements the task.
-                    "task_rfid_read_or_write",   // Text name for the task.
-                    8 * 1024 / 4,                // Stack size in words, not bytes.
-                    (void *)1,                   // Parameter passed into the task.
-                    6,                           // Priority at which the task is created.
-                    &x_task_rfid_read_or_write); // Used to pass out the created task's handle.
+    // Each queue holds a few PICCs. When one is full the stage feeding it waits, all the way back
+    // to the detection, which drops the PICC and lets the reader detect it again on a later scan.
+    // The decode stage never waits for task_spotify, the intents queue doesn't block.
+    const uint8_t queue_length = 4U;
 
-    if (xReturned == pdPASS) {
-        // success
-    }
+    // One PICC per reader at most, the reader is paused until its PICC is read.
+    s_identify = pipeline_stage_create("tag_identify", sizeof(tag_job_t), READERS_MAX,
+                                       &tasks_identify, 6, 4 * 1024);
+    s_read = pipeline_stage_create("tag_read", sizeof(tag_job_t), READERS_MAX, &tasks_read, 6,
+                                   8 * 1024);
+    s_decode = pipeline_stage_create("tag_decode", sizeof(tag_job_t), queue_length,
+                                     &tasks_decode, 5, 4 * 1024);
+
+    pipeline_stage_connect(s_identify, s_read);
+    pipeline_stage_connect(s_read, s_decode);
+
+    (void)pipeline_stage_start(s_identify);
+    (void)pipeline_stage_start(s_read);
+    (void)pipeline_stage_start(s_decode);
 #endif // CONFIG_RFID_READER
 
     xReturned = xTaskCreate(&task_spotify,  // Function that implements the task.
@@ -332,47 +687,40 @@ tasks_init(void)
     if (xReturned == pdPASS) {
         // success
     }
-}
 
-#ifdef CONFIG_RFID_READER
-esp_err_t
-scanning_timer_resume()
-{
-    // 125000 microseconds means 8Hz.
-    if (!scanning_timer_running) {
-        esp_timer_start_periodic(s_rfid_reader_timer, 125000 / 4);
-        scanning_timer_running = true;
-    }
-    return ESP_OK;
-}
+    xReturned = xTaskCreate(&task_spotify_poll, "task_spotify_poll",
+                            16 * 1024 / 4,    // Stack size in words, not bytes.
+                            (void *)1,        // Parameter passed into the task.
+                            4,                // Below the taps, the poll can wait.
+                            &x_spotify_poll); // Used to pass out the created task's handle.
 
-esp_err_t
-scanning_timer_pause()
-{
-    if (scanning_timer_running) {
-        esp_timer_stop(s_rfid_reader_timer);
-        scanning_timer_running = false;
+    if (xReturned == pdPASS) {
+        // success
     }
-    return ESP_OK;
 }
-#endif // CONFIG_RFID_READER
 
 void
 tasks_start(void)
 {
 #ifdef CONFIG_RFID_READER
-    // Start the scanning task.
-    const esp_timer_create_args_t timer_args = {
-        .callback = &task_rfid_scanning,
-        .arg = (void *)tag_handler, // rc522.c function
-        .name = "task_rfid_scanning",
-    };
-
-    // Not checking return value here because I can't imagine when this would fail (hubris?).
-    esp_timer_create(&timer_args, &s_rfid_reader_timer);
-
-    scanning_timer_resume();
+    // Start the scanning tasks.
+    readers_start(tasks_on_picc_detected);
 #endif // CONFIG_RFID_READER
     // vTaskResume(x_spotify_find_playlist);
     return;
 }
+
+void
+tasks_log_stats(void)
+{
+#ifdef CONFIG_RFID_READER
+    readers_log_stats();
+    pipeline_stage_log_stats(s_identify);
+    pipeline_stage_log_stats(s_read);
+    pipeline_stage_log_stats(s_decode);
+    tag_cache_log_stats();
+    tag_map_log_stats();
+#endif // CONFIG_RFID_READER
+    intents_log_stats();
+    spotify_log_stats();
+}
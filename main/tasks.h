@@ -3,5 +3,7 @@
 
 void tasks_init(void);
 void tasks_start(void);
+// Log the readers', the tag pipeline's, the intents' and the Spotify connections' stats.
+void tasks_log_stats(void);
 
 #endif // TASKS_H
@@ -0,0 +1,126 @@
+"""
+Builds the tag_map partition's image from a CSV of the tags' UIDs and what they play, so the blank
+tags work without being written. A line is a UID in hex, the bytes optionally separated with ':',
+and a URI:
+
+  04:a2:2b:1a:f3:5c:80,spotify:track:7LPRP2wOvP4DAMFBdf4uDZ
+  8a1b2c3d,spotify:playlist:37i9dQZF1DXcBWIGoYBM5M
+  04a22b1af35c81,action:next
+
+The albums are spotify:album:..., the actions are action:play_pause, action:next and
+action:previous. The image goes to the device over HTTP, with CONFIG_TAG_MAP_UPLOAD and its
+secret set in menuconfig, or to the partition with the parttool:
+
+  python3 tag_map_build.py tags.csv tag_map.bin
+  curl -H "X-Tag-Map-Secret: <secret>" --data-binary @tag_map.bin http://<device>/tag_map
+  parttool.py write_partition --partition-name tag_map --input tag_map.bin
+
+The layout is in main/tag_map.h.
+"""
+
+import argparse
+import csv
+import struct
+import sys
+import zlib
+
+
+MAGIC = 0x504d5445
+VERSION = 1
+UID_MAX = 10
+# The partition's size in partitions.csv.
+PARTITION_SIZE = 0x2F0000
+
+HEADER = struct.Struct("<IHHII16x")
+RECORD = struct.Struct(f"<B{UID_MAX}sB16s")
+
+TYPES = {"track": 1, "album": 2, "playlist": 3}
+ACTION = 4
+ACTIONS = {"play_pause": 1, "next": 2, "previous": 3}
+
+BASE62 = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+
+
+def parse_uid(text):
+  uid = bytes.fromhex(text.replace(":", "").strip())
+  # 4, 7 or 10 bytes, the single, double and triple size UIDs.
+  if len(uid) not in (4, 7, 10):
+    raise ValueError(f"a UID is 4, 7 or 10 bytes, not {len(uid)}")
+  return uid
+
+
+def parse_base62(text):
+  if len(text) != 22:
+    raise ValueError(f"a Spotify ID is 22 characters, not {len(text)}")
+  n = 0
+  for c in text:
+    if c not in BASE62:
+      raise ValueError(f"{c!r} isn't a base62 digit")
+    n = n * 62 + BASE62.index(c)
+  if n >= 1 << 128:
+    raise ValueError("the ID doesn't fit 128 bits")
+  return n.to_bytes(16, "big")
+
+
+def parse_uri(text):
+  parts = text.strip().split(":")
+  if len(parts) == 3 and parts[0] == "spotify" and parts[1] in TYPES:
+    return TYPES[parts[1]], parse_base62(parts[2])
+  if len(parts) == 2 and parts[0] == "action" and parts[1] in ACTIONS:
+    return ACTION, bytes([ACTIONS[parts[1]]]).ljust(16, b"\0")
+  raise ValueError(f"not a track, album, playlist or action: {text.strip()}")
+
+
+def build(rows):
+  records = {}
+  for line, (uid_text, uri_text) in rows:
+    try:
+      uid = parse_uid(uid_text)
+      value = parse_uri(uri_text)
+    except ValueError as e:
+      raise ValueError(f"line {line}: {e}")
+    if uid in records:
+      raise ValueError(f"line {line}: {uid.hex(':')} is already mapped")
+    records[uid] = value
+
+  # The device binary searches by the UID's size and then its bytes.
+  body = b"".join(
+    RECORD.pack(len(uid), uid, kind, value)
+    for uid, (kind, value) in sorted(records.items(), key=lambda r: (len(r[0]), r[0])))
+  header = HEADER.pack(MAGIC, VERSION, RECORD.size, len(records), zlib.crc32(body))
+  return header + body, len(records)
+
+
+def read_rows(path):
+  with open(path, newline="") as f:
+    for line, row in enumerate(csv.reader(f), start=1):
+      if not row or row[0].lstrip().startswith("#"):
+        continue
+      if len(row) != 2:
+        raise ValueError(f"line {line}: expected a UID and a URI")
+      yield line, row
+
+
+def main():
+  parser = argparse.ArgumentParser(description="Build the tag_map partition's image.")
+  parser.add_argument("csv", help="the UID,URI lines")
+  parser.add_argument("output", help="the image")
+  parser.add_argument("--max-size", type=lambda s: int(s, 0), default=PARTITION_SIZE,
+                      help="the partition's size, 0x%(default)x by default")
+  args = parser.parse_args()
+
+  try:
+    image, count = build(read_rows(args.csv))
+  except ValueError as e:
+    sys.exit(f"{args.csv}: {e}")
+
+  if len(image) > args.max_size:
+    sys.exit(f"{count} tags take {len(image)} bytes, the partition has {args.max_size}")
+
+  with open(args.output, "wb") as f:
+    f.write(image)
+  print(f"{count} tags, {len(image)} bytes")
+
+
+if __name__ == "__main__":
+  main()
@@ -0,0 +1,194 @@
+"""
+A local stand-in for api.spotify.com and accounts.spotify.com. Point the CONFIG_SPOTIFY_API_URL and
+CONFIG_SPOTIFY_ACCOUNTS_URL at it to see how the device uses its connections: every new connection
+is logged with its handshake and whether the TLS session got resumed.
+
+  openssl req -x509 -newkey rsa:2048 -nodes -days 365 -subj "/CN=standin" \
+    -keyout standin.key -out standin.crt
+  python3 tls_standin.py --cert standin.crt --key standin.key
+
+Without --cert it serves plain HTTP. With --delay every response is held back, like a far away
+server, which shows whether the device's requests overlap:
+
+  python3 tls_standin.py --cert standin.crt --key standin.key --delay 300
+
+With --expires-in the access tokens expire sooner than the real ones, to see the device refresh
+them ahead of time.
+
+With --close every connection is closed after its response, so every request needs a new one and
+resumes the TLS session, if the device kept it:
+
+  python3 tls_standin.py --cert standin.crt --key standin.key --close
+"""
+
+import argparse
+import http.server
+import json
+import ssl
+import threading
+import time
+import urllib.parse
+
+
+stats = {"connections": 0, "resumed": 0, "requests": 0}
+stats_lock = threading.Lock()
+delay_s = 0.0
+expires_in_s = 3600
+close_connections = False
+
+# Enough playlists for a few pages, the one tasks.c looks for is on the third.
+PLAYLISTS = [(f"{i:022d}", f"Playlist {i}") for i in range(130)]
+PLAYLISTS[117] = ("37i9dQZF1DXcBWIGoYBM5M", "Score")
+
+BASE62 = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+
+
+def base62(n):
+  digits = ""
+  for _ in range(22):
+    n, d = divmod(n, 62)
+    digits = BASE62[d] + digits
+  return digits
+
+
+# Every playlist has the same 500 tracks.
+TRACKS = [base62(0x93bc414a606747b2b612491ef83d5a3e + i) for i in range(500)]
+TRACK_MS = 180000
+START = time.monotonic()
+
+
+class StandinRequestHandler(http.server.BaseHTTPRequestHandler):
+  # Keep-alive, like the real API.
+  protocol_version = "HTTP/1.1"
+
+  def setup(self):
+    super().setup()
+    resumed = getattr(self.connection, "session_reused", False)
+    with stats_lock:
+      stats["connections"] += 1
+      stats["resumed"] += 1 if resumed else 0
+      print(f"New connection from {self.client_address}, "
+            f"TLS {getattr(self.connection, 'version', lambda: None)()}, "
+            f"resumed {resumed}, {stats}")
+
+  def reply(self, code, body=None):
+    with stats_lock:
+      stats["requests"] += 1
+    # The server is threaded, the delays of the concurrent requests overlap.
+    time.sleep(delay_s)
+    data = json.dumps(body).encode() if body is not None else b""
+    self.send_response(code)
+    self.send_header("Content-Type", "application/json")
+    self.send_header("Content-Length", str(len(data)))
+    if close_connections:
+      self.send_header("Connection", "close")
+      self.close_connection = True
+    self.end_headers()
+    self.wfile.write(data)
+
+  def do_GET(self):
+    print(f"GET {self.path}")
+    if self.path.startswith("/v1/me/player/currently-playing"):
+      # The tracks are 3 minutes long and follow one another, to see when the device polls.
+      elapsed_ms = int((time.monotonic() - START) * 1000)
+      track = TRACKS[elapsed_ms // TRACK_MS % len(TRACKS)]
+      self.reply(200, {
+        "is_playing": True,
+        "progress_ms": elapsed_ms % TRACK_MS,
+        "item": {
+          "id": track,
+          "name": f"Track {track}",
+          "duration_ms": TRACK_MS,
+          "artists": [{"name": "Stand-in artist"}],
+        },
+      })
+    elif self.path.startswith("/v1/me/player"):
+      self.reply(200, {
+        "is_playing": True,
+        "item": {
+          "id": "4uLU6hMCjMI75M1A2tKUQC",
+          "name": "Stand-in song",
+          "artists": [{"name": "Stand-in artist"}],
+        },
+      })
+    elif self.path.startswith("/v1/me/playlists"):
+      query = urllib.parse.parse_qs(urllib.parse.urlsplit(self.path).query)
+      limit = int(query.get("limit", ["20"])[0])
+      offset = int(query.get("offset", ["0"])[0])
+      end = min(offset + limit, len(PLAYLISTS))
+      self.reply(200, {
+        "href": f"https://api.spotify.com/v1/me/playlists?offset={offset}&limit={limit}",
+        "items": [{"id": i, "name": n, "snapshot_id": f"MSw{i[-8:]}", "tracks": {"total": 500}}
+                  for i, n in PLAYLISTS[offset:end]],
+        "limit": limit,
+        "next": (f"https://api.spotify.com/v1/me/playlists?offset={end}&limit={limit}"
+                 if end < len(PLAYLISTS) else None),
+        "offset": offset,
+        "total": len(PLAYLISTS),
+      })
+    elif self.path.startswith("/v1/playlists/"):
+      split = urllib.parse.urlsplit(self.path)
+      query = urllib.parse.parse_qs(split.query)
+      limit = int(query.get("limit", ["100"])[0])
+      offset = int(query.get("offset", ["0"])[0])
+      end = min(offset + limit, len(TRACKS))
+      self.reply(200, {
+        "href": f"https://api.spotify.com{split.path}?offset={offset}&limit={limit}",
+        "items": [{"track": {"id": t, "name": f"Track {t}"}} for t in TRACKS[offset:end]],
+        "next": (f"https://api.spotify.com{split.path}?offset={end}&limit={limit}"
+                 if end < len(TRACKS) else None),
+        "total": len(TRACKS),
+      })
+    else:
+      self.reply(404, {"error": {"status": 404, "message": "Not found"}})
+
+  def do_POST(self):
+    length = int(self.headers.get("Content-Length", 0))
+    body = self.rfile.read(length)
+    print(f"POST {self.path} {body}")
+    if self.path.startswith("/api/token"):
+      self.reply(200, {
+        "access_token": "standin-access-token",
+        "token_type": "Bearer",
+        "expires_in": expires_in_s,
+      })
+    elif self.path.startswith("/v1/me/player/"):
+      self.reply(204)
+    else:
+      self.reply(404, {"error": {"status": 404, "message": "Not found"}})
+
+  def do_PUT(self):
+    length = int(self.headers.get("Content-Length", 0))
+    body = self.rfile.read(length)
+    print(f"PUT {self.path} {body}")
+    if self.path.startswith("/v1/me/player/"):
+      self.reply(204)
+    else:
+      self.reply(404, {"error": {"status": 404, "message": "Not found"}})
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser()
+  parser.add_argument("--port", type=int, default=8443)
+  parser.add_argument("--cert")
+  parser.add_argument("--key")
+  parser.add_argument("--delay", type=int, default=0, help="milliseconds per response")
+  parser.add_argument("--expires-in", type=int, default=3600, help="access tokens' lifetime, s")
+  parser.add_argument("--close", action="store_true", help="close the connection after a response")
+  args = parser.parse_args()
+  delay_s = args.delay / 1000
+  expires_in_s = args.expires_in
+  close_connections = args.close
+
+  server = http.server.ThreadingHTTPServer(("", args.port), StandinRequestHandler)
+  if args.cert:
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(args.cert, args.key)
+    server.socket = context.wrap_socket(server.socket, server_side=True)
+
+  try:
+    print(f"Starting the stand-in on {args.port}")
+    server.serve_forever()
+  except KeyboardInterrupt:
+    print("Shutting down...")
+    server.shutdown()